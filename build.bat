@@ -44,9 +44,11 @@ SET COMPILER_FLAGS=^
     -D_CRT_SECURE_NO_WARNINGS=1 -Wno-gnu-anonymous-struct -Wno-missing-braces -Wno-nested-anon-types -Wno-unused-function^
     -std=c++14 -fvisibility=hidden -fvisibility-inlines-hidden^
     -D_HAS_EXCEPTIONS=0 -fno-exceptions -fno-unwind-tables^
-    -fno-rtti -mavx2^
-    -fuse-ld=lld -Wl,%TARGET_LINKER_FLAGS%,-incremental:no,-subsystem:console,-manifest:no^
-    -o "%BUILD_DIR%\%PROGRAM_NAME%.exe"
+    -fno-rtti -msse4.2 -mpopcnt^
+    -fuse-ld=lld -Wl,%TARGET_LINKER_FLAGS%,-incremental:no,-subsystem:console,-manifest:no
 
-clang %COMPILER_FLAGS% src\main.cpp
+clang %COMPILER_FLAGS% -o "%BUILD_DIR%\%PROGRAM_NAME%.exe" src\main.cpp
+clang %COMPILER_FLAGS% -o "%BUILD_DIR%\bench.exe" src\bench.cpp
+clang %COMPILER_FLAGS% -o "%BUILD_DIR%\microbench.exe" src\microbench.cpp
+clang %COMPILER_FLAGS% -shared -o "%BUILD_DIR%\%PROGRAM_NAME%.dll" src\library.cpp
 
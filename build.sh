@@ -15,12 +15,14 @@ COMPILER_FLAGS="
     -Wno-gnu-anonymous-struct -Wno-missing-braces -Wno-unused-command-line-argument -Wno-nested-anon-types -Wno-unused-function
     -std=c++14 -fvisibility=hidden -fvisibility-inlines-hidden
     -fno-exceptions -fno-unwind-tables -D_HAS_EXCEPTIONS=0
-    -fno-rtti -march=native
+    -fno-rtti -msse4.2 -mpopcnt
     -static-libgcc -static-libstdc++
     -fms-extensions
-    -lm
-    -o "$BUILD_DIR/$PROGRAM_NAME"
+    -lm -pthread
 "
 
-clang $COMPILER_FLAGS src/main.cpp
+clang $COMPILER_FLAGS -o "$BUILD_DIR/$PROGRAM_NAME" src/main.cpp
+clang $COMPILER_FLAGS -o "$BUILD_DIR/bench" src/bench.cpp
+clang $COMPILER_FLAGS -o "$BUILD_DIR/microbench" src/microbench.cpp
+clang $COMPILER_FLAGS -shared -fPIC -o "$BUILD_DIR/lib$PROGRAM_NAME.so" src/library.cpp
 
@@ -0,0 +1,123 @@
+#ifndef RAY_H
+#define RAY_H
+
+// C API of the intersection engine, built as a library from src/library.cpp.
+//
+// A device owns the threads that queries run on. Primitives are added to a
+// scene, and committing the scene builds its acceleration structure. A
+// committed scene answers batches of closest-hit and any-hit queries whose
+// rays and hits are arrays per component, allocated by the caller.
+//
+//     Ray_Device *device = ray_device_create(0, NULL);
+//     Ray_Scene  *scene  = ray_scene_create(device);
+//     ray_scene_add_primitives(scene, primitives, num_primitives);
+//     ray_scene_commit(scene);
+//     ray_intersect(scene, &rays, &hits, num_rays, RAY_QUERY_PARALLEL);
+//
+// Hits are written in the order of the rays whatever order they are traced in.
+//
+// Clients compile with -Iinclude and link against the library. The header is
+// kept out of src, whose math.h would hide the system one.
+//
+// The API is versioned by RAY_API_VERSION. Within a version, functions keep
+// their signatures and structures keep their layout.
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#   ifdef RAY_BUILD_LIBRARY
+#       define RAY_API __declspec(dllexport)
+#   else
+#       define RAY_API __declspec(dllimport)
+#   endif
+#else
+#   define RAY_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define RAY_API_VERSION 1
+
+#define RAY_NO_PRIMITIVE 0xFFFFFFFFu
+
+typedef enum Ray_Status
+{
+    RAY_OK               = 0,
+    RAY_INVALID_ARGUMENT = 1,
+    RAY_NOT_COMMITTED    = 2, // The scene changed since it was last committed
+} Ray_Status;
+
+typedef enum Ray_Primitive_Type
+{
+    RAY_PRIMITIVE_PLANE     = 0, // Through its position, parameters is the normal
+    RAY_PRIMITIVE_ELLIPSOID = 1, // Parameters are the semi-axes
+    RAY_PRIMITIVE_BOX       = 2, // Parameters are the half extents
+} Ray_Primitive_Type;
+
+typedef struct Ray_Primitive
+{
+    uint32_t type; // Ray_Primitive_Type
+    float    parameters[3];
+    float    position[3];
+    float    rotation[4]; // Unit quaternion x, y, z, w, of the object axes
+} Ray_Primitive;
+
+// A batch of rays, one array per component. Directions need not be unit
+// length, distances are then in multiples of the direction.
+typedef struct Ray_Rays
+{
+    const float *origin_x, *origin_y, *origin_z;
+    const float *direction_x, *direction_y, *direction_z;
+    const float *t_max; // Farthest distance of a hit, NULL for no limit
+} Ray_Rays;
+
+// The closest hits of a batch of rays, one array per component
+typedef struct Ray_Hits
+{
+    float    *t;         // Distance, INFINITY without a hit
+    uint32_t *primitive; // Index in the order the primitives were added, RAY_NO_PRIMITIVE without a hit
+    float    *normal_x, *normal_y, *normal_z; // Unit normal facing the ray, NULL to skip
+} Ray_Hits;
+
+typedef enum Ray_Query_Flags
+{
+    RAY_QUERY_PARALLEL = 1 << 0, // Split the batch over the threads of the device
+    // Trace the rays in the order of their origins and directions. Pays off for
+    // large incoherent batches in scenes too large for the caches.
+    RAY_QUERY_SORTED   = 1 << 1,
+} Ray_Query_Flags;
+
+typedef struct Ray_Device Ray_Device;
+typedef struct Ray_Scene  Ray_Scene;
+
+RAY_API uint32_t ray_api_version(void);
+
+// Zero threads uses one per processor. The instruction set is "sse4.2",
+// "avx2" or "avx512", NULL for avx2 where the processor supports it and
+// sse4.2 otherwise. Returns NULL if the processor does not support it.
+RAY_API Ray_Device *ray_device_create(uint32_t num_threads, const char *instruction_set);
+RAY_API void        ray_device_release(Ray_Device *device);
+
+RAY_API Ray_Scene *ray_scene_create(Ray_Device *device);
+RAY_API void       ray_scene_release(Ray_Scene *scene);
+
+// Primitives get consecutive indices in the order they are added
+RAY_API Ray_Status ray_scene_add_primitives(Ray_Scene *scene, const Ray_Primitive *primitives, uint32_t count);
+RAY_API Ray_Status ray_scene_commit(Ray_Scene *scene);
+
+// Queries only read the scene, so several threads can query it at once, but
+// not while it is changed or committed. Parallel queries on the same device
+// take turns.
+RAY_API Ray_Status ray_intersect(Ray_Scene *scene, const Ray_Rays *rays, Ray_Hits *hits, uint32_t count, uint32_t flags);
+
+// Sets occluded[i] to 1 if the ray hits anything within (0, t_max), 0 otherwise
+RAY_API Ray_Status ray_occluded(Ray_Scene *scene, const Ray_Rays *rays, uint8_t *occluded, uint32_t count, uint32_t flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
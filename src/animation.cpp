@@ -0,0 +1,276 @@
+// Rendering of a range of frames of an animated scene.
+//
+// Keyframes give the position and the rotation of the camera and of primitives
+// at some frames. In between they are interpolated, linearly for positions and
+// spherically for rotations, and outside of their range the first or the last
+// key holds. Rotations take the shorter arc, so a full turn needs at least
+// three keys. For example a quarter turn of the camera over 24 frames is
+//
+//     CAMERA_ROTATION_KEY 0  0 0 0 1
+//     CAMERA_ROTATION_KEY 24 0 0.7071 0 0.7071
+//
+// and primitives take POSITION_KEY frame x y z and ROTATION_KEY frame x y z w.
+//
+// The scene is parsed and its acceleration structure built once. For every
+// frame only the animated primitives are updated and the BVH is refit around
+// them. Frames render on all threads, and the output of a frame is written on
+// another thread while the next frame renders.
+
+const u32 FRAME_PATH_CAPACITY = 1024;
+
+// Returns the last key at or before the frame, or the first key, and the
+// interpolation parameter towards the key after it
+template <typename Key>
+u32 find_key(Array<Key> keys, f32 frame, f32 *t)
+{
+    u32 i = 0;
+    while (i + 1 < keys.size && keys[i + 1].frame <= frame) {
+        i++;
+    }
+
+    *t = 0;
+    if (i + 1 < keys.size) {
+        *t = CLAMP((frame - keys[i].frame) / (keys[i + 1].frame - keys[i].frame), 0.0f, 1.0f);
+    }
+
+    return i;
+}
+
+Vector3 evaluate_position(Array<Position_Key> keys, f32 frame)
+{
+    f32 t;
+    u32 i = find_key(keys, frame, &t);
+    if (t == 0) {
+        return keys[i].position;
+    }
+
+    return lerp(keys[i].position, keys[i + 1].position, t);
+}
+
+Quaternion evaluate_rotation(Array<Rotation_Key> keys, f32 frame)
+{
+    f32 t;
+    u32 i = find_key(keys, frame, &t);
+    if (t == 0) {
+        return keys[i].rotation;
+    }
+
+    return slerp(keys[i].rotation, keys[i + 1].rotation, t);
+}
+
+struct Animation
+{
+    // Camera axes as given in the scene, the camera rotation keys apply to them
+    Vector3 camera_right, camera_up, camera_forward;
+
+    Array<u32> animated; // Primitives with keyframes
+    BVH8_Refit refit;
+};
+
+void animation_init(Animation *animation, Scene *scene)
+{
+    *animation = {
+        .camera_right   = scene->camera.right,
+        .camera_up      = scene->camera.up,
+        .camera_forward = scene->camera.forward,
+    };
+
+    for (u32 i = 0; i < scene->primitives.size; i++) {
+        if (scene->primitives[i].track) {
+            array_push(&animation->animated, i);
+        }
+    }
+
+    bvh8_refit_init(&animation->refit, &scene->bvh, scene->primitives);
+}
+
+void animation_free(Animation *animation)
+{
+    array_free(&animation->animated);
+    bvh8_refit_free(&animation->refit);
+}
+
+// Moves the camera and the animated primitives to where they are at the frame
+void set_frame(Animation *animation, Scene *scene, f32 frame)
+{
+    Track *camera = &scene->camera_track;
+    if (camera->positions.size > 0) {
+        scene->camera.position = evaluate_position(camera->positions, frame);
+    }
+
+    if (camera->rotations.size > 0) {
+        Quaternion rotation = evaluate_rotation(camera->rotations, frame);
+        scene->camera.right   = rotate(animation->camera_right,   rotation);
+        scene->camera.up      = rotate(animation->camera_up,      rotation);
+        scene->camera.forward = rotate(animation->camera_forward, rotation);
+    }
+
+    ARRAY_ITERATE(animation->animated) {
+        Primitive *primitive = &scene->primitives[*it];
+        Track *track = &scene->tracks[primitive->track - 1];
+
+        if (track->positions.size > 0) {
+            primitive->position = evaluate_position(track->positions, frame);
+        }
+        if (track->rotations.size > 0) {
+            primitive->rotation = evaluate_rotation(track->rotations, frame);
+        }
+    }
+
+    bvh8_refit(&animation->refit, &scene->bvh, scene->primitives, animation->animated);
+
+    // What the radiance cache learned does not depend on the camera, but
+    // moving primitives change it anywhere
+    if (scene->radiance_cache && animation->animated.size > 0) {
+        radiance_cache_clear(scene->radiance_cache);
+    }
+}
+
+// The last run of # in the output path is replaced by the zero-padded frame
+// number. Without one, the number is inserted before the extension.
+void frame_output_path(char *path, const char *output_path, u32 frame)
+{
+    const char *hashes_end = strrchr(output_path, '#');
+    if (hashes_end) {
+        const char *hashes = hashes_end;
+        while (hashes > output_path && hashes[-1] == '#') {
+            hashes--;
+        }
+
+        snprintf(path, FRAME_PATH_CAPACITY, "%.*s%0*u%s", (int) (hashes - output_path), output_path,
+                 (int) (hashes_end + 1 - hashes), frame, hashes_end + 1);
+        return;
+    }
+
+    const char *extension = strrchr(output_path, '.');
+    if (!extension || strpbrk(extension, "/\\")) {
+        extension = output_path + strlen(output_path);
+    }
+
+    snprintf(path, FRAME_PATH_CAPACITY, "%.*s_%04u%s", (int) (extension - output_path), output_path, frame, extension);
+}
+
+// Writes the frames in the order they were submitted, on its own thread. The
+// frames alternate between two pixel buffers, so one can be resolved while the
+// other is written.
+struct Frame_Writer
+{
+    Thread_Pool   pool; // Of its own, PNG compresses while the next frame renders
+    Os_Mutex     *mutex;
+    Os_Condition *changed;
+
+    u32  width, height;
+    u8  *pixels[2];
+    char paths[2][FRAME_PATH_CAPACITY];
+
+    u32  num_submitted;
+    u32  num_written;
+    bool done; // No more frames will be submitted
+};
+
+void frame_writer_thread(void *data)
+{
+    Frame_Writer *writer = (Frame_Writer *) data;
+    memory_set_tag(MEMORY_OUTPUT);
+
+    os_lock(writer->mutex);
+    for (;;) {
+        while (writer->num_written == writer->num_submitted && !writer->done) {
+            os_wait(writer->changed, writer->mutex);
+        }
+
+        if (writer->num_written == writer->num_submitted) {
+            break;
+        }
+
+        u32 buffer = writer->num_written % 2;
+        os_unlock(writer->mutex);
+        write_image(&writer->pool, writer->paths[buffer], writer->width, writer->height, writer->pixels[buffer]);
+        os_lock(writer->mutex);
+
+        writer->num_written++;
+        os_wake_all(writer->changed);
+    }
+    os_unlock(writer->mutex);
+}
+
+// Renders the frames first to last, inclusive. Every frame uses the same
+// random sequence, so the noise on static parts of the image does not flicker.
+int render_animation(Options *options, Scene *scene, u64 seed)
+{
+    u64 start = os_time_ns();
+
+    Animation animation;
+    animation_init(&animation, scene);
+
+    Thread_Pool pool;
+    thread_pool_init(&pool, options->num_threads);
+
+    u64 num_pixels = (u64) scene->width * scene->height;
+    Vector3 *accumulation = (Vector3 *) memory_allocate(MEMORY_FRAMEBUFFERS, num_pixels * sizeof(Vector3));
+
+    Frame_Writer writer = {
+        .mutex   = os_create_mutex(),
+        .changed = os_create_condition(),
+        .width   = scene->width,
+        .height  = scene->height,
+        .pixels  = {
+            (u8 *) memory_allocate(MEMORY_FRAMEBUFFERS, 3 * num_pixels),
+            (u8 *) memory_allocate(MEMORY_FRAMEBUFFERS, 3 * num_pixels),
+        },
+    };
+
+    thread_pool_init(&writer.pool, options->num_threads);
+
+    Os_Thread *writer_thread = os_start_thread(frame_writer_thread, &writer);
+    if (!writer_thread) {
+        printf("Could not start the output thread.\n");
+        return 1;
+    }
+
+    for (u32 frame = options->first_frame; frame <= options->last_frame; frame++) {
+        u64 frame_start = os_time_ns();
+
+        set_frame(&animation, scene, (f32) frame);
+        render_parallel(&pool, scene, seed, accumulation);
+
+        // Wait for the buffer of the frame before the last one to be written
+        os_lock(writer.mutex);
+        while (writer.num_submitted - writer.num_written == 2) {
+            os_wait(writer.changed, writer.mutex);
+        }
+        os_unlock(writer.mutex);
+
+        u32 buffer = writer.num_submitted % 2;
+        resolve_pixels(scene, accumulation, scene->samples, writer.pixels[buffer]);
+        frame_output_path(writer.paths[buffer], options->output_path, frame);
+
+        os_lock(writer.mutex);
+        writer.num_submitted++;
+        os_wake_all(writer.changed);
+        os_unlock(writer.mutex);
+
+        printf("Frame %u: %.3f s\n", frame, (os_time_ns() - frame_start) / 1E9);
+        fflush(stdout);
+    }
+
+    os_lock(writer.mutex);
+    writer.done = true;
+    os_wake_all(writer.changed);
+    os_unlock(writer.mutex);
+    os_join_thread(writer_thread);
+
+    printf("Rendered %u frames in %.3f s.\n", options->last_frame - options->first_frame + 1, (os_time_ns() - start) / 1E9);
+
+    os_free(writer.pixels[0], 3 * num_pixels);
+    os_free(writer.pixels[1], 3 * num_pixels);
+    os_destroy_condition(writer.changed);
+    os_destroy_mutex(writer.mutex);
+    thread_pool_free(&writer.pool);
+
+    os_free(accumulation, num_pixels * sizeof(Vector3));
+    thread_pool_free(&pool);
+    animation_free(&animation);
+
+    return 0;
+}
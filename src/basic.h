@@ -42,6 +42,10 @@ inline u64 array_size(T (&array)[N])
 #define ALIGN_POW2(x, a) (((x) + (a) - 1) & ~((a) - 1))
 #define DIV_UP(a, b) (((a) + (b) - 1) / (b))
 
+#define STRINGIFY(x) #x
+
+#define FORCE_INLINE inline __attribute__((always_inline))
+
 // Combine two 32-bit ints into a 64-bit int
 #define MAKE_U64(l, h) (((u64(h)) << 32) + (l))
 
@@ -148,7 +152,7 @@ inline void array_maybe_expand(Array<T> *array, u32 to_add)
     }
 
     if (array->data) {
-        array->data = (T *) os_reallocate(array->data, array->capacity, minimal_capacity * sizeof(T));
+        array->data = (T *) os_reallocate(array->data, array->capacity * sizeof(T), minimal_capacity * sizeof(T));
     } else {
         array->data = (T *) os_allocate(minimal_capacity * sizeof(T));
     }
@@ -217,7 +221,7 @@ inline T array_delete(Array<T> *array, u32 index)
 template <typename T>
 inline void array_free(Array<T> *array)
 {
-    os_free(array->data, array->capacity);
+    os_free(array->data, array->capacity * sizeof(T));
     *array = {};
 }
 
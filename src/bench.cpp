@@ -0,0 +1,1480 @@
+// Benchmarks for the renderer internals, built from the same unity build as the
+// renderer itself.
+//
+// Usage: bench [benchmark_name [arguments...]]
+// Without arguments every benchmark runs with its default arguments.
+//
+// The helpers are shared with microbench.cpp, which defines RAY_NO_BENCH_MAIN.
+// The library is part of the build, so that its C API is benchmarked too.
+
+#include "library.cpp"
+
+PRIVATE_NAMESPACE_BEGIN
+
+Quaternion random_rotation(Xoroshiro128 *xoroshiro)
+{
+    Quaternion q;
+    f32 norm;
+    do {
+        q = {
+            2 * xoroshiro_next_f32(xoroshiro) - 1,
+            2 * xoroshiro_next_f32(xoroshiro) - 1,
+            2 * xoroshiro_next_f32(xoroshiro) - 1,
+            2 * xoroshiro_next_f32(xoroshiro) - 1,
+        };
+        norm = sqrtf(q.x * q.x + q.y * q.y + q.z * q.z + q.w * q.w);
+    } while (norm < 1E-3f || norm > 1.0f);
+
+    return {q.x / norm, q.y / norm, q.z / norm, q.w / norm};
+}
+
+// Random boxes and ellipsoids in a cube of side 100, sized so that the density
+// does not depend on the number of primitives
+void make_random_scene(Scene *scene, u32 num_primitives, u64 seed)
+{
+    Xoroshiro128 xoroshiro;
+    xoroshiro_set_seed(&xoroshiro, seed);
+
+    f32 scale = 30.0f / cbrtf((f32) num_primitives);
+    for (u32 i = 0; i < num_primitives; i++) {
+        Primitive primitive;
+        primitive.type = xoroshiro_next_u32(&xoroshiro, 1) ? PRIMITIVE_BOX : PRIMITIVE_ELLIPSOID;
+        primitive.parameters = scale * Vector3{
+            0.2f + xoroshiro_next_f32(&xoroshiro),
+            0.2f + xoroshiro_next_f32(&xoroshiro),
+            0.2f + xoroshiro_next_f32(&xoroshiro),
+        };
+        primitive.position = {
+            100 * xoroshiro_next_f32(&xoroshiro) - 50,
+            100 * xoroshiro_next_f32(&xoroshiro) - 50,
+            100 * xoroshiro_next_f32(&xoroshiro) - 50,
+        };
+        primitive.rotation = random_rotation(&xoroshiro);
+        primitive.color = {0.5f, 0.5f, 0.5f};
+        array_push(&scene->primitives, primitive);
+    }
+}
+
+Array<Ray> make_random_rays(u32 num_rays, u64 seed)
+{
+    Xoroshiro128 xoroshiro;
+    xoroshiro_set_seed(&xoroshiro, seed);
+
+    Array<Ray> rays = {};
+    for (u32 i = 0; i < num_rays; i++) {
+        Ray ray = {
+            .origin = {
+                100 * xoroshiro_next_f32(&xoroshiro) - 50,
+                100 * xoroshiro_next_f32(&xoroshiro) - 50,
+                100 * xoroshiro_next_f32(&xoroshiro) - 50,
+            },
+            .direction = uniform_unit_sphere(&xoroshiro),
+        };
+        array_push(&rays, ray);
+    }
+
+    return rays;
+}
+
+// Sum of hit distances, which keeps the traversal from being optimized away
+// and lets different structures be checked against each other
+template <typename F>
+f64 time_rays(const char *name, Array<Ray> rays, f32 *hits, F intersect_function)
+{
+    u64 start = os_time_ns();
+    for (u32 i = 0; i < rays.size; i++) {
+        Primitive *closest;
+        hits[i] = intersect_function(rays[i], &closest).t;
+    }
+    u64 elapsed = os_time_ns() - start;
+
+    f64 ns_per_ray = (f64) elapsed / rays.size;
+    printf("    %-8s %10.1f ns/ray %10.2f Mrays/s\n", name, ns_per_ray, 1E3 / ns_per_ray);
+
+    return ns_per_ray;
+}
+
+u32 count_mismatches(f32 *a, f32 *b, u32 count)
+{
+    u32 mismatches = 0;
+    for (u32 i = 0; i < count; i++) {
+        if (a[i] != b[i] && ABS(a[i] - b[i]) > 1E-4f * MAX(ABS(a[i]), 1.0f)) {
+            mismatches++;
+        }
+    }
+
+    return mismatches;
+}
+
+// Runs body(num_primitives) for every scene size given on the command line, or
+// for the default ones without any
+template <u32 N, typename F>
+void for_each_size(u32 argc, char **argv, const u32 (&default_sizes)[N], F body)
+{
+    u32 num_sizes = argc > 0 ? argc : N;
+    for (u32 s = 0; s < num_sizes; s++) {
+        body(argc > 0 ? (u32) atoi(argv[s]) : default_sizes[s]);
+    }
+}
+
+// bench bvh [num_primitives...]
+// Memory per primitive and closest-hit traversal speed of the 8-wide quantized
+// BVH against the plain binary layout it is collapsed from.
+void benchmark_bvh(u32 argc, char **argv)
+{
+    u32 default_sizes[] = {100, 1000, 10000, 100000};
+
+    const u32 NUM_RAYS = 200000;
+    Array<Ray> rays = make_random_rays(NUM_RAYS, 1);
+    defer {
+        array_free(&rays);
+    };
+
+    f32 *hits_binary = (f32 *) os_allocate(NUM_RAYS * sizeof(f32));
+    f32 *hits_wide   = (f32 *) os_allocate(NUM_RAYS * sizeof(f32));
+    f32 *hits_linear = (f32 *) os_allocate(NUM_RAYS * sizeof(f32));
+    defer {
+        os_free(hits_binary, NUM_RAYS * sizeof(f32));
+        os_free(hits_wide,   NUM_RAYS * sizeof(f32));
+        os_free(hits_linear, NUM_RAYS * sizeof(f32));
+    };
+
+    for_each_size(argc, argv, default_sizes, [&] (u32 num_primitives) {
+        Scene scene = {};
+        make_random_scene(&scene, num_primitives, 2);
+
+        BVH2 bvh2 = {};
+        u64 build_start = os_time_ns();
+        bvh2_build(&bvh2, scene.primitives);
+        u64 binary_build_time = os_time_ns() - build_start;
+        bvh8_build(&scene.bvh, &bvh2, scene.primitives);
+        u64 wide_build_time = os_time_ns() - build_start - binary_build_time;
+
+        // The chunks copy what the tests read of the primitives, which the
+        // binary layout reads from the primitives themselves, so they are
+        // counted apart from the nodes
+        f64 binary_bytes = bvh2.nodes.size * sizeof(BVH2_Node) + bvh2.primitive_indices.size * sizeof(u32);
+        f64 wide_bytes = scene.bvh.nodes.size * sizeof(BVH8_Node) + scene.bvh.primitive_indices.size * sizeof(u32) +
+            scene.bvh.leaf_slot_bits.size;
+        f64 chunk_bytes = (scene.bvh.leaf_chunks.size + scene.bvh.plane_chunks.size) * sizeof(Primitive_Chunk);
+
+        u32 used_lanes = 0;
+        ARRAY_ITERATE(scene.bvh.primitive_indices) {
+            used_lanes += *it != U32_MAX;
+        }
+
+        printf("%u primitives:\n", num_primitives);
+        printf("    binary   %6u nodes %8.1f bytes/primitive, built in %.2f ms\n",
+            bvh2.nodes.size, binary_bytes / num_primitives, binary_build_time / 1E6);
+        printf("    wide     %6u nodes %8.1f bytes/primitive, collapsed in %.2f ms\n",
+            scene.bvh.nodes.size, wide_bytes / num_primitives, wide_build_time / 1E6);
+        printf("    chunks   %6u lanes %8.1f bytes/primitive, %.1f%% of the lanes used\n",
+            scene.bvh.primitive_indices.size, chunk_bytes / num_primitives,
+            100.0 * used_lanes / MAX(scene.bvh.primitive_indices.size, 1));
+
+        f64 binary_time = time_rays("binary", rays, hits_binary, [&] (Ray ray, Primitive **closest) {
+            return bvh2_intersect(&bvh2, scene.primitives, ray, closest);
+        });
+        f64 wide_time = time_rays("wide", rays, hits_wide, [&] (Ray ray, Primitive **closest) {
+            return bvh8_intersect(&scene.bvh, scene.primitives, ray, closest);
+        });
+        printf("    speedup  %10.2fx\n", binary_time / wide_time);
+
+        u32 mismatches = count_mismatches(hits_binary, hits_wide, NUM_RAYS);
+        if (num_primitives <= 1000) {
+            Array<Ray> linear_rays = rays;
+            linear_rays.size = MIN(rays.size, 20000);
+            time_rays("linear", linear_rays, hits_linear, [&] (Ray ray, Primitive **closest) {
+                Intersection out = {.t = INFINITY};
+                *closest = nullptr;
+                ARRAY_ITERATE(scene.primitives) {
+                    Intersection current = intersect_once(it, ray);
+                    if (current.t > 0 && current.t < out.t) {
+                        out = current;
+                        *closest = it;
+                    }
+                }
+                return out;
+            });
+            mismatches += count_mismatches(hits_linear, hits_wide, linear_rays.size);
+        }
+
+        if (mismatches) {
+            printf("    WARNING: %u rays disagree between layouts\n", mismatches);
+        }
+
+        bvh2_free(&bvh2);
+        bvh8_free(&scene.bvh);
+        array_free(&scene.primitives);
+    });
+}
+
+void make_random_render_scene(Scene *scene, u32 num_primitives, u32 size, u32 samples)
+{
+    make_random_scene(scene, num_primitives, 3);
+    scene->width  = size;
+    scene->height = size;
+    scene->samples = samples;
+    scene->ray_depth = 4;
+    scene->background_color = {1, 1, 1};
+    scene->camera = {
+        .position = {0, 0, -90},
+        .right    = {1, 0, 0},
+        .up       = {0, 1, 0},
+        .forward  = {0, 0, 1},
+        .fov_x_radians = 1.0f,
+    };
+    xoroshiro_set_seed(&scene->xoroshiro, 4);
+    build_acceleration_structure(scene);
+    select_kernels(scene);
+}
+
+// bench sorting [num_primitives...]
+// Path-by-path rendering against batched rendering with secondary rays sorted
+// by origin and direction, for several batch sizes. Sorting only pays off once
+// the batch is large enough to group similar rays and the scene is too large
+// for the traversal to stay in cache.
+void benchmark_sorting(u32 argc, char **argv)
+{
+    u32 default_sizes[] = {1000, 100000, 1000000};
+    u32 batch_sizes[] = {1 << 12, 1 << 16, 1 << 18};
+
+    for_each_size(argc, argv, default_sizes, [&] (u32 num_primitives) {
+        Scene scene = {};
+        make_random_render_scene(&scene, num_primitives, 128, 8);
+
+        u64 accumulation_size = (u64) scene.width * scene.height * sizeof(Vector3);
+        Vector3 *accumulation = (Vector3 *) os_allocate(accumulation_size);
+        u8 *pixels = (u8 *) os_allocate(3 * scene.width * scene.height);
+
+        f64 num_paths = (f64) scene.width * scene.height * scene.samples;
+        printf("%u primitives, %.0f paths:\n", num_primitives, num_paths);
+
+        // Best of a few runs, the renders are short enough to be noisy
+        const u32 RUNS = 3;
+
+        f64 unsorted_time = INFINITY;
+        for (u32 run = 0; run < RUNS; run++) {
+            u64 start = os_time_ns();
+            fill_pixels(&scene, pixels);
+            unsorted_time = MIN(unsorted_time, (os_time_ns() - start) / 1E9);
+        }
+        printf("    path by path      %8.3f s %8.1f ns/path\n", unsorted_time, unsorted_time * 1E9 / num_paths);
+
+        for (u32 b = 0; b < array_size(batch_sizes); b++) {
+            f64 sorted_time = INFINITY;
+            f64 sort_time = 0;
+            for (u32 run = 0; run < RUNS; run++) {
+                Sorted_Renderer renderer;
+                sorted_renderer_init(&renderer, batch_sizes[b]);
+                memset(accumulation, 0, accumulation_size);
+
+                u64 start = os_time_ns();
+                fill_accumulation_sorted(&renderer, &scene, accumulation);
+                f64 time = (os_time_ns() - start) / 1E9;
+                if (time < sorted_time) {
+                    sorted_time = time;
+                    sort_time = renderer.sort_time_ns / 1E9;
+                }
+
+                sorted_renderer_free(&renderer);
+            }
+
+            printf("    sorted, batch %-6u %6.3f s %8.1f ns/path, %4.1f%% sorting, %5.2fx\n",
+                batch_sizes[b], sorted_time, sorted_time * 1E9 / num_paths,
+                100.0 * sort_time / sorted_time, unsorted_time / sorted_time);
+        }
+
+        os_free(accumulation, accumulation_size);
+        os_free(pixels, 3 * scene.width * scene.height);
+        bvh8_free(&scene.bvh);
+        array_free(&scene.primitives);
+    });
+}
+
+// bench occlusion [num_primitives...]
+// Shadow-ray workloads through the closest-hit query against the any-hit
+// occlusion query. The random workload connects random pairs of points, the
+// coherent one connects a small patch to a single point, so that most rays are
+// blocked by the same primitive and the occluder cache applies.
+void benchmark_occlusion(u32 argc, char **argv)
+{
+    u32 default_sizes[] = {1000, 100000};
+
+    const u32 NUM_RAYS = 200000;
+    Ray *rays = (Ray *) os_allocate(NUM_RAYS * sizeof(Ray));
+    f32 *t_max = (f32 *) os_allocate(NUM_RAYS * sizeof(f32));
+    defer {
+        os_free(rays, NUM_RAYS * sizeof(Ray));
+        os_free(t_max, NUM_RAYS * sizeof(f32));
+    };
+
+    auto random_point = [] (Xoroshiro128 *xoroshiro, f32 size) -> Vector3 {
+        return {
+            size * (xoroshiro_next_f32(xoroshiro) - 0.5f),
+            size * (xoroshiro_next_f32(xoroshiro) - 0.5f),
+            size * (xoroshiro_next_f32(xoroshiro) - 0.5f),
+        };
+    };
+
+    for_each_size(argc, argv, default_sizes, [&] (u32 num_primitives) {
+        Scene scene = {};
+        make_random_scene(&scene, num_primitives, 2);
+        build_acceleration_structure(&scene);
+        printf("%u primitives:\n", num_primitives);
+
+        for (u32 workload = 0; workload < 2; workload++) {
+            Xoroshiro128 xoroshiro;
+            xoroshiro_set_seed(&xoroshiro, 5);
+
+            Vector3 target = random_point(&xoroshiro, 100);
+            Vector3 patch_center = random_point(&xoroshiro, 100);
+            for (u32 i = 0; i < NUM_RAYS; i++) {
+                Vector3 from, to;
+                if (workload == 0) {
+                    from = random_point(&xoroshiro, 100);
+                    to   = random_point(&xoroshiro, 100);
+                } else {
+                    from = patch_center + random_point(&xoroshiro, 1);
+                    to   = target;
+                }
+
+                rays[i] = {.origin = from, .direction = normalize(to - from)};
+                t_max[i] = length(to - from);
+            }
+
+            u64 start = os_time_ns();
+            u32 blocked_closest = 0;
+            for (u32 i = 0; i < NUM_RAYS; i++) {
+                Primitive *closest;
+                intersect(&scene, rays[i], &closest, t_max[i]);
+                blocked_closest += closest != nullptr;
+            }
+            f64 closest_time = (f64) (os_time_ns() - start) / NUM_RAYS;
+
+            last_occluder = U32_MAX;
+            start = os_time_ns();
+            u32 blocked_any = 0;
+            for (u32 i = 0; i < NUM_RAYS; i++) {
+                blocked_any += occluded(&scene, rays[i], t_max[i]);
+            }
+            f64 any_time = (f64) (os_time_ns() - start) / NUM_RAYS;
+
+            printf("    %-8s %4.1f%% blocked, intersect %8.1f ns/ray, occluded %8.1f ns/ray, %5.2fx\n",
+                workload == 0 ? "random" : "coherent", 100.0 * blocked_any / NUM_RAYS,
+                closest_time, any_time, closest_time / any_time);
+            if (blocked_any != blocked_closest) {
+                printf("    WARNING: %u rays disagree between queries\n", ABS((s32) blocked_any - (s32) blocked_closest));
+            }
+        }
+
+        bvh8_free(&scene.bvh);
+        array_free(&scene.primitives);
+    });
+}
+
+// bench queries [num_primitives...]
+// Closest-hit and any-hit queries through the C API of the library: one ray per
+// call, whole batches on the calling thread in the given order and sorted, and
+// sorted batches split over the threads of the device.
+void benchmark_queries(u32 argc, char **argv)
+{
+    u32 default_sizes[] = {1000, 100000};
+
+    const u32 NUM_RAYS = 200000;
+    const u32 NUM_ARRAYS = 11; // Origin, direction, t_max, hit t and normal
+    const u32 RUNS = 5;
+
+    Array<Ray> rays = make_random_rays(NUM_RAYS, 1);
+    f32 *arrays = (f32 *) os_allocate(NUM_ARRAYS * NUM_RAYS * sizeof(f32));
+    u32 *primitives[2] = {(u32 *) os_allocate(NUM_RAYS * sizeof(u32)), (u32 *) os_allocate(NUM_RAYS * sizeof(u32))};
+    u8  *occluded[2]   = {(u8 *) os_allocate(NUM_RAYS), (u8 *) os_allocate(NUM_RAYS)};
+    f32 *hits_t_reference = (f32 *) os_allocate(NUM_RAYS * sizeof(f32));
+    defer {
+        array_free(&rays);
+        os_free(arrays, NUM_ARRAYS * NUM_RAYS * sizeof(f32));
+        for (u32 i = 0; i < 2; i++) {
+            os_free(primitives[i], NUM_RAYS * sizeof(u32));
+            os_free(occluded[i], NUM_RAYS);
+        }
+        os_free(hits_t_reference, NUM_RAYS * sizeof(f32));
+    };
+
+    f32 *array[NUM_ARRAYS];
+    for (u32 i = 0; i < NUM_ARRAYS; i++) {
+        array[i] = &arrays[i * NUM_RAYS];
+    }
+    for (u32 i = 0; i < NUM_RAYS; i++) {
+        array[0][i] = rays[i].origin.x;
+        array[1][i] = rays[i].origin.y;
+        array[2][i] = rays[i].origin.z;
+        array[3][i] = rays[i].direction.x;
+        array[4][i] = rays[i].direction.y;
+        array[5][i] = rays[i].direction.z;
+        array[6][i] = 50;
+    }
+
+    Ray_Device *device = ray_device_create(0, INSTRUCTION_SET_NAMES[instruction_set]);
+    ASSERT(device);
+    defer {
+        ray_device_release(device);
+    };
+
+    // The arrays of the rays and hits from the given ray on
+    auto rays_at = [&] (u32 first) -> Ray_Rays {
+        return {array[0] + first, array[1] + first, array[2] + first, array[3] + first, array[4] + first, array[5] + first, array[6] + first};
+    };
+    auto hits_at = [&] (u32 first, u32 *hit_primitives) -> Ray_Hits {
+        return {array[7] + first, hit_primitives + first, array[8] + first, array[9] + first, array[10] + first};
+    };
+
+    for_each_size(argc, argv, default_sizes, [&] (u32 num_primitives) {
+        Scene random_scene = {};
+        make_random_scene(&random_scene, num_primitives, 2);
+
+        Ray_Scene *scene = ray_scene_create(device);
+        ARRAY_ITERATE(random_scene.primitives) {
+            Ray_Primitive primitive = {
+                .type       = it->type,
+                .parameters = {it->parameters.x, it->parameters.y, it->parameters.z},
+                .position   = {it->position.x, it->position.y, it->position.z},
+                .rotation   = {it->rotation.x, it->rotation.y, it->rotation.z, it->rotation.w},
+            };
+            ray_scene_add_primitives(scene, &primitive, 1);
+        }
+        array_free(&random_scene.primitives);
+
+        u64 start = os_time_ns();
+        ray_scene_commit(scene);
+        printf("%u primitives, committed in %.2f ms:\n", num_primitives, (os_time_ns() - start) / 1E6);
+
+        const char *modes[] = {"single", "batch", "sorted", "parallel"};
+        const u32 mode_flags[] = {0, 0, RAY_QUERY_SORTED, RAY_QUERY_PARALLEL | RAY_QUERY_SORTED};
+        for (u32 query = 0; query < 2; query++) {
+            f64 single_time = 0;
+            for (u32 mode = 0; mode < array_size(modes); mode++) {
+                u32 *hit_primitives = primitives[mode == 0 ? 0 : 1];
+                u8  *blocked        = occluded[mode == 0 ? 0 : 1];
+
+                f64 ns_per_ray = INFINITY;
+                for (u32 run = 0; run < RUNS; run++) {
+                    last_occluder = U32_MAX;
+
+                    start = os_time_ns();
+                    if (mode == 0) {
+                        for (u32 i = 0; i < NUM_RAYS; i++) {
+                            Ray_Rays ray = rays_at(i);
+                            if (query == 0) {
+                                Ray_Hits hit = hits_at(i, hit_primitives);
+                                ray_intersect(scene, &ray, &hit, 1, 0);
+                            } else {
+                                ray_occluded(scene, &ray, blocked + i, 1, 0);
+                            }
+                        }
+                    } else {
+                        Ray_Rays batch = rays_at(0);
+                        if (query == 0) {
+                            Ray_Hits hits = hits_at(0, hit_primitives);
+                            ray_intersect(scene, &batch, &hits, NUM_RAYS, mode_flags[mode]);
+                        } else {
+                            ray_occluded(scene, &batch, blocked, NUM_RAYS, mode_flags[mode]);
+                        }
+                    }
+                    ns_per_ray = MIN(ns_per_ray, (f64) (os_time_ns() - start) / NUM_RAYS);
+                }
+
+                if (mode == 0) {
+                    single_time = ns_per_ray;
+                    memcpy(hits_t_reference, array[7], NUM_RAYS * sizeof(f32));
+                }
+                printf("    %-9s %-8s %8.1f ns/ray %8.2f Mrays/s %6.2fx\n", query == 0 ? "intersect" : "occluded",
+                    modes[mode], ns_per_ray, 1E3 / ns_per_ray, single_time / ns_per_ray);
+
+                u32 mismatches = 0;
+                for (u32 i = 0; i < NUM_RAYS && mode > 0; i++) {
+                    if (query == 0) {
+                        mismatches += primitives[0][i] != primitives[1][i] || hits_t_reference[i] != array[7][i];
+                    } else {
+                        mismatches += occluded[0][i] != occluded[1][i];
+                    }
+                }
+                if (mismatches) {
+                    printf("    WARNING: %u rays disagree with the single queries\n", mismatches);
+                }
+            }
+        }
+
+        ray_scene_release(scene);
+    });
+}
+
+// bench incremental [num_primitives...]
+// Watch-mode turnaround: a full tiled render against incremental updates after
+// editing a single primitive, either its color or its position.
+void benchmark_incremental(u32 argc, char **argv)
+{
+    u32 default_sizes[] = {1000, 100000};
+
+    const u32 EDITS = 8;
+
+    for_each_size(argc, argv, default_sizes, [&] (u32 num_primitives) {
+        Scene scene = {};
+        make_random_render_scene(&scene, num_primitives, 256, 8);
+        printf("%u primitives:\n", num_primitives);
+
+        Incremental_Renderer renderer = {};
+        u64 start = os_time_ns();
+        u32 num_tiles = render_incremental(&renderer, nullptr, &scene);
+        f64 full_time = (os_time_ns() - start) / 1E9;
+        printf("    full render      %8.3f s\n", full_time);
+
+        Xoroshiro128 xoroshiro;
+        xoroshiro_set_seed(&xoroshiro, 6);
+
+        for (u32 kind = 0; kind < 2; kind++) {
+            f64 time = 0;
+            u32 num_rendered = 0;
+
+            for (u32 e = 0; e < EDITS; e++) {
+                Scene edited = scene;
+                edited.primitives = {};
+                edited.sampled_lights = {};
+                edited.bvh = {};
+                ARRAY_ITERATE(scene.primitives) {
+                    array_push(&edited.primitives, *it);
+                }
+
+                Primitive *primitive = &edited.primitives[xoroshiro_next_u32(&xoroshiro, num_primitives - 1)];
+                if (kind == 0) {
+                    primitive->color = {0.9f, 0.1f, 0.1f};
+                } else {
+                    primitive->position += 0.2f * primitive->parameters;
+                }
+                build_acceleration_structure(&edited);
+
+                start = os_time_ns();
+                num_rendered += render_incremental(&renderer, &scene, &edited);
+                time += (os_time_ns() - start) / 1E9;
+
+                free_scene(&scene);
+                scene = edited;
+            }
+
+            printf("    %-16s %8.3f s %5.1f%% of %u tiles, %5.2fx\n", kind == 0 ? "recolor one" : "move one",
+                time / EDITS, 100.0 * num_rendered / (EDITS * num_tiles), num_tiles, full_time * EDITS / time);
+        }
+
+        incremental_renderer_free(&renderer);
+        free_scene(&scene);
+    });
+}
+
+// bench refit [num_primitives...]
+// Per-frame BVH update of an animation: refitting after a fraction of the
+// primitives moved against rebuilding, and the traversal speed of the refit
+// tree against the rebuilt one, which degrades as more primitives move.
+void benchmark_refit(u32 argc, char **argv)
+{
+    u32 default_sizes[] = {10000, 200000};
+
+    f32 moved_fractions[] = {0.001f, 0.01f, 0.1f, 1.0f};
+
+    const u32 NUM_RAYS = 200000;
+    Array<Ray> rays = make_random_rays(NUM_RAYS, 3);
+    f32 *refit_hits   = (f32 *) os_allocate(NUM_RAYS * sizeof(f32));
+    f32 *rebuilt_hits = (f32 *) os_allocate(NUM_RAYS * sizeof(f32));
+    defer {
+        array_free(&rays);
+        os_free(refit_hits,   NUM_RAYS * sizeof(f32));
+        os_free(rebuilt_hits, NUM_RAYS * sizeof(f32));
+    };
+
+    for_each_size(argc, argv, default_sizes, [&] (u32 num_primitives) {
+        printf("%u primitives:\n", num_primitives);
+
+        for (u32 f = 0; f < array_size(moved_fractions); f++) {
+            Scene scene = {};
+            make_random_scene(&scene, num_primitives, 2);
+            build_acceleration_structure(&scene);
+
+            BVH8_Refit refit;
+            bvh8_refit_init(&refit, &scene.bvh, scene.primitives);
+
+            Xoroshiro128 xoroshiro;
+            xoroshiro_set_seed(&xoroshiro, 7);
+
+            Array<u32> moved = {};
+            u32 num_moved = MAX((u32) (moved_fractions[f] * num_primitives), 1u);
+            for (u32 i = 0; i < num_moved; i++) {
+                u32 index = num_moved == num_primitives ? i : xoroshiro_next_u32(&xoroshiro, num_primitives - 1);
+                array_push(&moved, index);
+            }
+
+            // Like a few frames of motion, by about the size of a primitive
+            f64 refit_time = 0;
+            const u32 FRAMES = 4;
+            for (u32 frame = 0; frame < FRAMES; frame++) {
+                ARRAY_ITERATE(moved) {
+                    Primitive *primitive = &scene.primitives[*it];
+                    primitive->position += 0.5f * primitive->parameters.x * uniform_unit_sphere(&xoroshiro);
+                }
+
+                u64 start = os_time_ns();
+                bvh8_refit(&refit, &scene.bvh, scene.primitives, moved);
+                refit_time += (os_time_ns() - start) / 1E6;
+            }
+            refit_time /= FRAMES;
+
+            Scene rebuilt = scene;
+            rebuilt.bvh = {};
+            u64 start = os_time_ns();
+            build_acceleration_structure(&rebuilt);
+            f64 rebuild_time = (os_time_ns() - start) / 1E6;
+
+            printf("  %5.1f%% moved: refit %8.3f ms, rebuild %8.3f ms, %7.1fx\n", 100.0f * moved_fractions[f],
+                refit_time, rebuild_time, rebuild_time / refit_time);
+            f64 refit_ns = time_rays("refit", rays, refit_hits, [&] (Ray ray, Primitive **closest) {
+                return bvh8_intersect(&scene.bvh, scene.primitives, ray, closest);
+            });
+            f64 rebuilt_ns = time_rays("rebuilt", rays, rebuilt_hits, [&] (Ray ray, Primitive **closest) {
+                return bvh8_intersect(&rebuilt.bvh, rebuilt.primitives, ray, closest);
+            });
+            printf("    refit traversal %.2fx the cost of rebuilt\n", refit_ns / rebuilt_ns);
+
+            u32 mismatches = count_mismatches(refit_hits, rebuilt_hits, NUM_RAYS);
+            if (mismatches > 0) {
+                printf("    WARNING: %u rays disagree between the trees\n", mismatches);
+            }
+
+            array_free(&moved);
+            bvh8_refit_free(&refit);
+            bvh8_free(&rebuilt.bvh);
+            free_scene(&scene);
+        }
+    });
+}
+
+// bench kernels [num_primitives...]
+// Rendering with the kernels selected for the features of the scene against
+// the general ones compiled for every feature. The homogeneous scenes hold only
+// ellipsoids or only boxes, all diffuse, and a few of them are lights.
+void benchmark_kernels(u32 argc, char **argv)
+{
+    u32 default_sizes[] = {1000, 100000};
+
+    const char *workloads[] = {"ellipsoids", "boxes", "mixed"};
+    const u32 RUNS = 3;
+
+    for_each_size(argc, argv, default_sizes, [&] (u32 num_primitives) {
+        printf("%u primitives:\n", num_primitives);
+
+        for (u32 w = 0; w < array_size(workloads); w++) {
+            Scene scene = {};
+            make_random_render_scene(&scene, num_primitives, 128, 4);
+            bvh8_free(&scene.bvh);
+
+            for (u32 i = 0; i < num_primitives; i++) {
+                Primitive *primitive = &scene.primitives[i];
+                if (w == 0) {
+                    primitive->type = PRIMITIVE_ELLIPSOID;
+                } else if (w == 1) {
+                    primitive->type = PRIMITIVE_BOX;
+                }
+
+                if (i % 64 == 0) {
+                    primitive->emission = {4, 4, 4};
+                }
+            }
+            prepare_scene(&scene);
+
+            const Scene_Kernels *selected = scene.kernels;
+            const Scene_Kernels *general  = &ISA_KERNELS[instruction_set][array_size(SCENE_KERNELS) - 1];
+
+            u32 num_paths = scene.width * scene.height * scene.samples;
+            auto time_render = [&] (const Scene_Kernels *kernels) -> f64 {
+                scene.kernels = kernels;
+                xoroshiro_set_seed(&scene.xoroshiro, 4);
+
+                u64 start = os_time_ns();
+                Vector3 sum = {};
+                for (u32 y = 0; y < scene.height; y++) {
+                    for (u32 x = 0; x < scene.width; x++) {
+                        for (u32 i = 0; i < scene.samples; i++) {
+                            sum += ray_trace(&scene, camera_ray(&scene, x, y), 1);
+                        }
+                    }
+                }
+                f64 ns_per_path = (f64) (os_time_ns() - start) / num_paths;
+
+                // Keeps the paths from being optimized away
+                if (!(sum.x >= 0)) {
+                    printf("    WARNING: invalid radiance\n");
+                }
+
+                return ns_per_path;
+            };
+
+            // Alternated and the fastest of several runs, to be fair to both under noise
+            f64 selected_time = INFINITY, general_time = INFINITY;
+            for (u32 run = 0; run < RUNS; run++) {
+                selected_time = MIN(selected_time, time_render(selected));
+                general_time  = MIN(general_time,  time_render(general));
+            }
+
+            printf("    %-10s features 0x%02x: selected %8.1f ns/path, general %8.1f ns/path, %5.2fx\n", workloads[w],
+                selected->features, selected_time, general_time, general_time / selected_time);
+
+            free_scene(&scene);
+        }
+    });
+}
+
+// bench isa [num_primitives...]
+// The same kernels compiled for every instruction set that the processor
+// supports: rendering of a mixed scene with sampled lights, and tonemapping.
+void benchmark_isa(u32 argc, char **argv)
+{
+    u32 default_sizes[] = {1000, 100000};
+
+    const u32 RUNS = 3;
+    u32 supported = supported_instruction_sets();
+
+    for_each_size(argc, argv, default_sizes, [&] (u32 num_primitives) {
+        printf("%u primitives:\n", num_primitives);
+
+        Scene scene = {};
+        make_random_render_scene(&scene, num_primitives, 128, 4);
+        bvh8_free(&scene.bvh);
+        for (u32 i = 0; i < num_primitives; i += 64) {
+            scene.primitives[i].emission = {4, 4, 4};
+        }
+        prepare_scene(&scene);
+
+        u32 kernel_index = scene.kernels - ISA_KERNELS[instruction_set];
+        u32 num_paths = scene.width * scene.height * scene.samples;
+
+        // Tonemapping runs over an image of its own
+        Scene image = {.width = 1024, .height = 1024};
+        u32 num_pixels = image.width * image.height;
+        Vector3 *accumulation = (Vector3 *) os_allocate(num_pixels * sizeof(Vector3));
+        u8 *pixels = (u8 *) os_allocate(3 * num_pixels);
+        Xoroshiro128 xoroshiro;
+        xoroshiro_set_seed(&xoroshiro, 5);
+        for (u32 i = 0; i < num_pixels; i++) {
+            accumulation[i] = 4.0f * Vector3{xoroshiro_next_f32(&xoroshiro), xoroshiro_next_f32(&xoroshiro), xoroshiro_next_f32(&xoroshiro)};
+        }
+
+        for (u32 isa = 0; isa < ISA_COUNT; isa++) {
+            if (!(supported & (1 << isa))) {
+                printf("    %-7s not supported\n", INSTRUCTION_SET_NAMES[isa]);
+                continue;
+            }
+
+            const Scene_Kernels *kernels = &ISA_KERNELS[isa][kernel_index];
+            scene.kernels = kernels;
+
+            f64 render_time = INFINITY, resolve_time = INFINITY;
+            for (u32 run = 0; run < RUNS; run++) {
+                xoroshiro_set_seed(&scene.xoroshiro, 4);
+
+                u64 start = os_time_ns();
+                Vector3 sum = {};
+                for (u32 y = 0; y < scene.height; y++) {
+                    for (u32 x = 0; x < scene.width; x++) {
+                        for (u32 i = 0; i < scene.samples; i++) {
+                            sum += ray_trace(&scene, camera_ray(&scene, x, y), 1);
+                        }
+                    }
+                }
+                render_time = MIN(render_time, (f64) (os_time_ns() - start) / num_paths);
+
+                // Keeps the paths from being optimized away
+                if (!(sum.x >= 0)) {
+                    printf("    WARNING: invalid radiance\n");
+                }
+
+                start = os_time_ns();
+                kernels->resolve_pixels(&image, accumulation, 1, pixels);
+                resolve_time = MIN(resolve_time, (f64) (os_time_ns() - start) / num_pixels);
+            }
+
+            printf("    %-7s render %8.1f ns/path, tonemap %6.2f ns/pixel\n", INSTRUCTION_SET_NAMES[isa], render_time, resolve_time);
+        }
+
+        os_free(accumulation, num_pixels * sizeof(Vector3));
+        os_free(pixels, 3 * num_pixels);
+        free_scene(&scene);
+    });
+}
+
+// bench samplers
+// Checks that the batched samplers of every instruction set that the
+// processor supports follow the distributions of the scalar ones: the moments
+// of the cosine around the normal, the shares of the box faces and sides, and
+// the moments of the points on the ellipsoid mapped back onto the unit sphere.
+// Every sample must also be of unit length or on the surface. Moments and
+// shares are allowed five standard errors.
+void benchmark_samplers(u32 argc, char **argv)
+{
+    const u32 BATCHES = 1 << 16;
+    const f64 NUM_SAMPLES = (f64) BATCHES * SAMPLE_BATCH;
+    const f32 MAX_SURFACE_ERROR = 1E-5f;
+
+    f32 s = sinf(0.5f), c = cosf(0.5f);
+    Primitive box = {};
+    box.type       = PRIMITIVE_BOX;
+    box.parameters = {0.5f, 1, 2};
+    box.position   = {1, 2, 3};
+    box.rotation   = Quaternion(0, 0.6f * s, 0.8f * s, c);
+    Primitive ellipsoid = box;
+    ellipsoid.type = PRIMITIVE_ELLIPSOID;
+
+    // Within five standard errors of a mean of samples with the given deviation
+    u32 mismatches = 0;
+    auto check_mean = [&] (const char *what, f64 mean, f64 expected, f64 deviation) {
+        if (ABS(mean - expected) > 5 * deviation / sqrt(NUM_SAMPLES)) {
+            printf("    WARNING: %s is %.5f, expected %.5f\n", what, mean, expected);
+            mismatches++;
+        }
+    };
+    auto check_error = [&] (const char *what, f32 error) {
+        if (!(error <= MAX_SURFACE_ERROR)) {
+            printf("    WARNING: %s error %.2e exceeds %.0e\n", what, error, MAX_SURFACE_ERROR);
+            mismatches++;
+        }
+    };
+
+    Sample_Randoms randoms;
+    Vector3_Batch  normals, samples;
+
+    u32 supported = supported_instruction_sets();
+    for (u32 isa = 0; isa < ISA_COUNT; isa++) {
+        if (!(supported & (1 << isa))) {
+            printf("%s: not supported\n", INSTRUCTION_SET_NAMES[isa]);
+            continue;
+        }
+        printf("%s:\n", INSTRUCTION_SET_NAMES[isa]);
+
+        const Sample_Kernels *kernels = ISA_SAMPLE_KERNELS[isa];
+        Xoroshiro128 xoroshiro;
+        xoroshiro_set_seed(&xoroshiro, 7);
+
+        // The cosine of a cosine-weighted direction has moments 2/3 and 1/2
+        f64 cosine_sum = 0, cosine_sq_sum = 0;
+        f32 length_error = 0, min_cosine = 1;
+        for (u32 b = 0; b < BATCHES; b++) {
+            for (u32 i = 0; i < SAMPLE_BATCH; i++) {
+                Vector3 normal = uniform_unit_sphere(&xoroshiro);
+                normals.x[i] = normal.x;
+                normals.y[i] = normal.y;
+                normals.z[i] = normal.z;
+            }
+            draw_sample_randoms(&xoroshiro, &randoms);
+            kernels->cosine_weighted(&randoms, &normals, &samples);
+
+            for (u32 i = 0; i < SAMPLE_BATCH; i++) {
+                Vector3 direction = {samples.x[i], samples.y[i], samples.z[i]};
+                f32 cosine = dot(direction, Vector3{normals.x[i], normals.y[i], normals.z[i]});
+                cosine_sum    += cosine;
+                cosine_sq_sum += cosine * cosine;
+                min_cosine   = MIN(min_cosine, cosine);
+                length_error = MAX(length_error, ABS(length(direction) - 1));
+            }
+        }
+        printf("    cosine_weighted       mean cosine %.5f, mean squared %.5f, length error %.1e\n",
+            cosine_sum / NUM_SAMPLES, cosine_sq_sum / NUM_SAMPLES, length_error);
+        check_mean("mean cosine", cosine_sum / NUM_SAMPLES, 2.0 / 3, sqrt(1.0 / 18));
+        check_mean("mean squared cosine", cosine_sq_sum / NUM_SAMPLES, 0.5, sqrt(1.0 / 12));
+        check_error("cosine_weighted length", length_error);
+        if (min_cosine < -MAX_SURFACE_ERROR) {
+            printf("    WARNING: a direction points below the surface, cosine %.2e\n", min_cosine);
+            mismatches++;
+        }
+
+        // A face is chosen by its area, and either side of it half the time
+        Vector3 dimensions = box.parameters;
+        f64 areas[3] = {dimensions.y * dimensions.z, dimensions.x * dimensions.z, dimensions.x * dimensions.y};
+        f64 face_counts[3] = {}, positive_counts[3] = {};
+        f32 box_error = 0;
+        for (u32 b = 0; b < BATCHES; b++) {
+            draw_sample_randoms(&xoroshiro, &randoms);
+            kernels->uniform_box(&randoms, &box, &samples);
+
+            for (u32 i = 0; i < SAMPLE_BATCH; i++) {
+                Vector3 p = rotate(Vector3{samples.x[i], samples.y[i], samples.z[i]} - box.position, conj(box.rotation)) / dimensions;
+                u32 axis = ABS(p.x) > ABS(p.y) ? 0 : 1;
+                axis = ABS(p.z) > ABS(p[axis]) ? 2 : axis;
+
+                face_counts[axis]++;
+                positive_counts[axis] += p[axis] > 0;
+                box_error = MAX(box_error, ABS(ABS(p[axis]) - 1));
+            }
+        }
+        printf("    uniform_box           face shares %.4f %.4f %.4f, surface error %.1e\n",
+            face_counts[0] / NUM_SAMPLES, face_counts[1] / NUM_SAMPLES, face_counts[2] / NUM_SAMPLES, box_error);
+        for (u32 axis = 0; axis < 3; axis++) {
+            f64 share = areas[axis] / (areas[0] + areas[1] + areas[2]);
+            check_mean("face share", face_counts[axis] / NUM_SAMPLES, share, sqrt(share * (1 - share)));
+            check_mean("positive side share", positive_counts[axis] / NUM_SAMPLES, 0.5 * share, sqrt(0.5 * share * (1 - 0.5 * share)));
+        }
+        check_error("uniform_box surface", box_error);
+
+        // Mapped back onto the unit sphere, the points are uniform: every
+        // coordinate has mean 0 and mean square 1/3
+        f64 sums[3] = {}, square_sums[3] = {};
+        f32 ellipsoid_error = 0;
+        for (u32 b = 0; b < BATCHES; b++) {
+            draw_sample_randoms(&xoroshiro, &randoms);
+            kernels->nonuniform_ellipsoid(&randoms, &ellipsoid, &samples);
+
+            for (u32 i = 0; i < SAMPLE_BATCH; i++) {
+                Vector3 unit = rotate(Vector3{samples.x[i], samples.y[i], samples.z[i]} - ellipsoid.position, conj(ellipsoid.rotation)) / ellipsoid.parameters;
+                for (u32 axis = 0; axis < 3; axis++) {
+                    sums[axis]        += unit[axis];
+                    square_sums[axis] += unit[axis] * unit[axis];
+                }
+                ellipsoid_error = MAX(ellipsoid_error, ABS(length(unit) - 1));
+            }
+        }
+        printf("    nonuniform_ellipsoid  mean squares %.4f %.4f %.4f, surface error %.1e\n",
+            square_sums[0] / NUM_SAMPLES, square_sums[1] / NUM_SAMPLES, square_sums[2] / NUM_SAMPLES, ellipsoid_error);
+        for (u32 axis = 0; axis < 3; axis++) {
+            check_mean("mean coordinate", sums[axis] / NUM_SAMPLES, 0, sqrt(1.0 / 3));
+            check_mean("mean squared coordinate", square_sums[axis] / NUM_SAMPLES, 1.0 / 3, sqrt(4.0 / 45));
+        }
+        check_error("nonuniform_ellipsoid surface", ellipsoid_error);
+    }
+
+    if (mismatches) {
+        printf("WARNING: %u sampler checks failed\n", mismatches);
+    }
+}
+
+// Error metrics of an image against a reference, both averaged radiance
+struct Image_Error
+{
+    f64 rmse;
+    f64 relmse; // Squared error over the squared reference, offset so that dark pixels do not dominate
+    f64 flip;   // In [0, 1], see flip_color_error
+};
+
+// CIE L*a*b* of a linear sRGB color, with a D65 white
+Vector3 linear_to_lab(Vector3 rgb)
+{
+    Vector3 xyz = {
+        (0.4124f * rgb.r + 0.3576f * rgb.g + 0.1805f * rgb.b) / 0.9505f,
+        (0.2126f * rgb.r + 0.7152f * rgb.g + 0.0722f * rgb.b),
+        (0.0193f * rgb.r + 0.1192f * rgb.g + 0.9505f * rgb.b) / 1.0890f,
+    };
+
+    Vector3 f;
+    for (u32 i = 0; i < 3; i++) {
+        f[i] = xyz[i] > 0.008856f ? cbrtf(xyz[i]) : 7.787f * xyz[i] + 16.0f / 116.0f;
+    }
+
+    return {116.0f * f.y - 16.0f, 500.0f * (f.x - f.y), 200.0f * (f.y - f.z)};
+}
+
+f32 hyab_distance(Vector3 lab_a, Vector3 lab_b)
+{
+    return ABS(lab_a.x - lab_b.x) + sqrtf(SQUARE(lab_a.y - lab_b.y) + SQUARE(lab_a.z - lab_b.z));
+}
+
+// L*a*b* of the image as displayed: tonemapped, back to linear, and smoothed
+// by a 3x3 binomial filter, which stands in for the contrast sensitivity
+// filters of FLIP
+void display_lab(Vector3 *image, u32 width, u32 height, Vector3 *displayed, Vector3 *lab)
+{
+    for (u32 i = 0; i < width * height; i++) {
+        displayed[i] = pow(aces_tonemap(image[i]), 2.2f);
+    }
+
+    for (u32 y = 0; y < height; y++) {
+        for (u32 x = 0; x < width; x++) {
+            Vector3 sum = {};
+            f32 weight_sum = 0.0f;
+            for (s32 dy = -1; dy <= 1; dy++) {
+                for (s32 dx = -1; dx <= 1; dx++) {
+                    s32 sx = (s32) x + dx;
+                    s32 sy = (s32) y + dy;
+                    if (sx < 0 || sy < 0 || sx >= (s32) width || sy >= (s32) height) {
+                        continue;
+                    }
+
+                    f32 weight = (dx == 0 ? 2.0f : 1.0f) * (dy == 0 ? 2.0f : 1.0f);
+                    sum += weight * displayed[sx + sy * width];
+                    weight_sum += weight;
+                }
+            }
+
+            lab[x + y * width] = linear_to_lab(sum / weight_sum);
+        }
+    }
+}
+
+// The color pipeline of FLIP (Andersson et al. 2020) without its feature
+// term for edges and points: the HyAB distance of the displayed images,
+// compressed and mapped to [0, 1] the same way, and averaged over the pixels
+f64 flip_color_error(Vector3 *image, Vector3 *reference, u32 width, u32 height)
+{
+    const f32 EXPONENT  = 0.7f;
+    const f32 KNEE      = 0.4f;  // Of the largest error
+    const f32 KNEE_EXIT = 0.95f; // Error in [0, 1] at the knee
+
+    u64 num_pixels = (u64) width * height;
+    Vector3 *displayed = (Vector3 *) os_allocate(num_pixels * sizeof(Vector3));
+    Vector3 *lab       = (Vector3 *) os_allocate(num_pixels * sizeof(Vector3));
+    Vector3 *lab_reference = (Vector3 *) os_allocate(num_pixels * sizeof(Vector3));
+    display_lab(image,     width, height, displayed, lab);
+    display_lab(reference, width, height, displayed, lab_reference);
+
+    // The largest error is the one between green and blue
+    f32 max_error = powf(hyab_distance(linear_to_lab({0, 1, 0}), linear_to_lab({0, 0, 1})), EXPONENT);
+
+    f64 sum = 0.0;
+    for (u64 i = 0; i < num_pixels; i++) {
+        f32 error = powf(hyab_distance(lab[i], lab_reference[i]), EXPONENT);
+        if (error < KNEE * max_error) {
+            error = KNEE_EXIT * error / (KNEE * max_error);
+        } else {
+            error = KNEE_EXIT + (1.0f - KNEE_EXIT) * (error - KNEE * max_error) / (max_error - KNEE * max_error);
+        }
+
+        sum += MIN(error, 1.0f);
+    }
+
+    os_free(displayed,     num_pixels * sizeof(Vector3));
+    os_free(lab,           num_pixels * sizeof(Vector3));
+    os_free(lab_reference, num_pixels * sizeof(Vector3));
+
+    return sum / num_pixels;
+}
+
+Image_Error image_error(Vector3 *image, Vector3 *reference, u32 width, u32 height)
+{
+    u64 num_pixels = (u64) width * height;
+
+    f64 squared_sum = 0.0, relative_sum = 0.0;
+    for (u64 i = 0; i < num_pixels; i++) {
+        for (u32 c = 0; c < 3; c++) {
+            f64 squared = SQUARE((f64) image[i][c] - reference[i][c]);
+            squared_sum  += squared;
+            relative_sum += squared / (SQUARE((f64) reference[i][c]) + 1E-2);
+        }
+    }
+
+    return {
+        .rmse   = sqrt(squared_sum / (3 * num_pixels)),
+        .relmse = relative_sum / (3 * num_pixels),
+        .flip   = flip_color_error(image, reference, width, height),
+    };
+}
+
+// Progressive rendering on all threads in passes of one sample per pixel.
+// Only the passes are timed.
+struct Quality_Renderer
+{
+    Thread_Pool *pool;
+    Scene       *scene;
+    u64          seed;
+
+    Vector3 *sum;
+    Vector3 *pass;
+    Vector3 *average;
+    u32      num_passes;
+    u64      time_ns;
+
+    Guide    *guide;    // Updated after 1, 2, 4... passes if not null
+    Caustics *caustics; // Traces a photon map for every pass if not null
+};
+
+void quality_renderer_init(Quality_Renderer *renderer, Thread_Pool *pool, Scene *scene, u64 seed)
+{
+    u64 size = (u64) scene->width * scene->height * sizeof(Vector3);
+    *renderer = {
+        .pool    = pool,
+        .scene   = scene,
+        .seed    = seed,
+        .sum     = (Vector3 *) os_allocate(size),
+        .pass    = (Vector3 *) os_allocate(size),
+        .average = (Vector3 *) os_allocate(size),
+    };
+}
+
+void quality_renderer_free(Quality_Renderer *renderer)
+{
+    u64 size = (u64) renderer->scene->width * renderer->scene->height * sizeof(Vector3);
+    os_free(renderer->sum,     size);
+    os_free(renderer->pass,    size);
+    os_free(renderer->average, size);
+}
+
+// Renders passes until the rendering time reaches the given one, at least one
+void quality_render_until(Quality_Renderer *renderer, u64 time_ns)
+{
+    Scene pass_scene = *renderer->scene;
+    pass_scene.samples = 1;
+    pass_scene.guide   = renderer->guide;
+    pass_scene.photon_map = renderer->caustics ? &renderer->caustics->map : nullptr;
+    u64 num_pixels = (u64) pass_scene.width * pass_scene.height;
+
+    do {
+        u64 start = os_time_ns();
+        if (renderer->caustics) {
+            caustics_pass(renderer->caustics, renderer->pool, renderer->scene, ~renderer->seed + renderer->num_passes * 0xD1B54A32D192ED03ull);
+        }
+        render_parallel(renderer->pool, &pass_scene, renderer->seed + renderer->num_passes * 0xD1B54A32D192ED03ull, renderer->pass);
+        for (u64 i = 0; i < num_pixels; i++) {
+            renderer->sum[i] += renderer->pass[i];
+        }
+        renderer->num_passes++;
+
+        if (renderer->guide && (renderer->num_passes & (renderer->num_passes - 1)) == 0) {
+            guide_update(renderer->guide);
+        }
+        renderer->time_ns += os_time_ns() - start;
+    } while (renderer->time_ns < time_ns);
+
+    for (u64 i = 0; i < num_pixels; i++) {
+        renderer->average[i] = renderer->sum[i] / (f32) renderer->num_passes;
+    }
+}
+
+// Stored reference: the header, then the average radiance of every pixel
+struct Reference_Header
+{
+    u32 magic;
+    u32 version;
+    u32 width, height;
+    u32 samples;
+    u64 scene_hash;
+    u64 time_ns; // Spent rendering it
+};
+
+const u32 REFERENCE_MAGIC   = 0x46455252; // RREF
+const u32 REFERENCE_VERSION = 2; // Bump when the renderer converges to a different image
+
+// Only a reference of the same scene and renderer that was rendered for at
+// least the given time is reused, otherwise it is rendered again
+bool load_reference(const char *path, Scene *scene, u64 scene_hash, u64 min_time_ns, Vector3 *reference, u32 *samples, u64 *time_ns)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+
+    Reference_Header header;
+    u64 num_pixels = (u64) scene->width * scene->height;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && header.magic == REFERENCE_MAGIC &&
+        header.version == REFERENCE_VERSION && header.width == scene->width && header.height == scene->height &&
+        header.scene_hash == scene_hash && header.time_ns >= min_time_ns &&
+        fread(reference, sizeof(Vector3), num_pixels, file) == num_pixels;
+    fclose(file);
+
+    *samples = header.samples;
+    *time_ns = header.time_ns;
+    return valid;
+}
+
+void store_reference(const char *path, Scene *scene, u64 scene_hash, Vector3 *reference, u32 samples, u64 time_ns)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("    Could not open `%s` for writing.\n", path);
+        return;
+    }
+
+    Reference_Header header = {REFERENCE_MAGIC, REFERENCE_VERSION, scene->width, scene->height, samples, scene_hash, time_ns};
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(reference, sizeof(Vector3), (u64) scene->width * scene->height, file);
+    fclose(file);
+}
+
+// Writes the string as a JSON string literal
+void json_string(FILE *file, const char *string)
+{
+    fputc('"', file);
+    for (const char *c = string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*c, file);
+    }
+    fputc('"', file);
+}
+
+// bench quality [--budgets seconds,...] [--reference-time seconds] [--json path] [--guide] [--caustics]
+//               [scene_path...]
+// Image quality at equal rendering time. Every scene is rendered for each of
+// the budgets on all threads and compared with a reference that renders the
+// same way for longer, by default 32 times the largest budget. References of
+// scene files are stored next to them as scene_path.reference and reused
+// while the file and the renderer are unchanged, unless the reference rendered
+// for less than the reference time. Without scene paths a random scene is used,
+// with a reference kept in memory. The results go to a JSON file, quality.json
+// by default, with efficiency as 1 / (relMSE * time). With --guide the budgets
+// render with path guiding, learning as they go, and the references without.
+// With --caustics the budgets trace a caustic photon map for every pass, of
+// CAUSTIC_PHOTONS photons or DEFAULT_QUALITY_PHOTONS where the scene sets
+// none, and the references path trace the caustics. Scenes with a radiance
+// cache render the budgets with it and the references without.
+//
+// The error of the reference adds to the measured error, so the reference
+// should take much longer than the budgets. Only the rendering is timed, the
+// scene preparation is not.
+void benchmark_quality(u32 argc, char **argv)
+{
+    const u32 MAX_BUDGETS = 16;
+    const u32 REFERENCE_TIME_FACTOR = 32;
+    const u32 DEFAULT_QUALITY_PHOTONS = 1 << 16;
+
+    f64 budgets[MAX_BUDGETS] = {0.1, 0.2, 0.4};
+    u32 num_budgets = 3;
+    f64 reference_time = 0;
+    const char *json_path = "quality.json";
+    bool guided = false;
+    bool caustics = false;
+
+    u32 first_scene = 0;
+    while (first_scene < argc && argv[first_scene][0] == '-') {
+        char *arg = argv[first_scene];
+        if (strcmp(arg, "--guide") == 0) {
+            guided = true;
+            first_scene++;
+            continue;
+        }
+        if (strcmp(arg, "--caustics") == 0) {
+            caustics = true;
+            first_scene++;
+            continue;
+        }
+        if (first_scene + 1 >= argc) {
+            break;
+        }
+
+        char *value = argv[first_scene + 1];
+        if (strcmp(arg, "--budgets") == 0) {
+            num_budgets = 0;
+            for (char *c = value; *c && num_budgets < MAX_BUDGETS;) {
+                budgets[num_budgets++] = strtod(c, &c);
+                if (*c == ',') {
+                    c++;
+                } else if (*c) {
+                    break;
+                }
+            }
+        } else if (strcmp(arg, "--reference-time") == 0) {
+            reference_time = atof(value);
+        } else if (strcmp(arg, "--json") == 0) {
+            json_path = value;
+        } else {
+            break;
+        }
+        first_scene += 2;
+    }
+
+    qsort(budgets, num_budgets, sizeof(f64), [] (const void *a, const void *b) {
+        f64 difference = *(f64 *) a - *(f64 *) b;
+        return difference < 0 ? -1 : (difference > 0 ? 1 : 0);
+    });
+    if (num_budgets == 0 || budgets[0] <= 0) {
+        printf("Invalid budgets.\n");
+        return;
+    }
+    if (reference_time <= 0) {
+        reference_time = REFERENCE_TIME_FACTOR * budgets[num_budgets - 1];
+    }
+
+    FILE *json = fopen(json_path, "w");
+    if (!json) {
+        printf("Could not open `%s` for writing.\n", json_path);
+        return;
+    }
+    fprintf(json, "{\n  \"reference_time\": %g,\n  \"guided\": %s,\n  \"caustics\": %s,\n  \"scenes\": [",
+        reference_time, guided ? "true" : "false", caustics ? "true" : "false");
+
+    Thread_Pool pool;
+    thread_pool_init(&pool, 0);
+
+    u32 num_scenes = MAX(argc - first_scene, 1);
+    u32 num_written = 0;
+    for (u32 s = 0; s < num_scenes; s++) {
+        const char *scene_path = first_scene < argc ? argv[first_scene + s] : nullptr;
+
+        Scene scene = {};
+        u64 scene_hash = 0;
+        if (scene_path) {
+            File file = {.name = (char *) scene_path};
+            if (!os_read_file(&file)) {
+                printf("%s: could not be read\n", scene_path);
+                continue;
+            }
+            scene_hash = poly31_hash(file.data, file.size);
+
+            Parser parser = {.buffer = (char *) file.data, .length = file.size};
+            parse(&parser, &scene);
+            os_free(file.data, file.size);
+            prepare_scene(&scene);
+        } else {
+            make_random_render_scene(&scene, 1000, 128, 1);
+            bvh8_free(&scene.bvh);
+            for (u32 i = 0; i < scene.primitives.size; i += 64) {
+                scene.primitives[i].emission = {4, 4, 4};
+            }
+            prepare_scene(&scene);
+        }
+
+        const char *name = scene_path ? scene_path : "random";
+        printf("%s:\n", name);
+
+        u64 num_pixels = (u64) scene.width * scene.height;
+        Vector3 *reference = (Vector3 *) os_allocate(num_pixels * sizeof(Vector3));
+
+        char reference_path[1024] = {};
+        u32 reference_samples = 0;
+        u64 reference_time_ns = 0;
+        if (scene_path) {
+            snprintf(reference_path, sizeof(reference_path), "%s.reference", scene_path);
+        }
+
+        if (scene_path && load_reference(reference_path, &scene, scene_hash, (u64) (reference_time * 1E9), reference, &reference_samples, &reference_time_ns)) {
+            printf("    reference %6u samples per pixel in %.1f s, from %s\n", reference_samples, reference_time_ns / 1E9, reference_path);
+        } else {
+            Scene reference_scene = scene;
+            reference_scene.radiance_cache = nullptr;
+
+            Quality_Renderer renderer;
+            quality_renderer_init(&renderer, &pool, &reference_scene, 1);
+            quality_render_until(&renderer, (u64) (reference_time * 1E9));
+            memcpy(reference, renderer.average, num_pixels * sizeof(Vector3));
+            reference_samples = renderer.num_passes;
+            reference_time_ns = renderer.time_ns;
+            quality_renderer_free(&renderer);
+
+            printf("    reference %6u samples per pixel in %.1f s\n", reference_samples, reference_time_ns / 1E9);
+            if (scene_path) {
+                store_reference(reference_path, &scene, scene_hash, reference, reference_samples, reference_time_ns);
+            }
+        }
+
+        fprintf(json, "%s\n    {\n      \"name\": ", num_written++ > 0 ? "," : "");
+        json_string(json, name);
+        fprintf(json, ",\n      \"width\": %u,\n      \"height\": %u,\n      \"reference_samples\": %u,\n      \"results\": [",
+            scene.width, scene.height, reference_samples);
+
+        // Every budget continues the rendering of the one before it
+        Guide guide;
+        Caustics scene_caustics;
+        Quality_Renderer renderer;
+        quality_renderer_init(&renderer, &pool, &scene, 2);
+        if (guided) {
+            guide_init(&guide, &scene);
+            renderer.guide = &guide;
+        }
+        if (caustics) {
+            if (!scene.caustic_photons) {
+                scene.caustic_photons = DEFAULT_QUALITY_PHOTONS;
+            }
+            caustics_init(&scene_caustics, &scene);
+            renderer.caustics = &scene_caustics;
+        }
+
+        for (u32 b = 0; b < num_budgets; b++) {
+            quality_render_until(&renderer, (u64) (budgets[b] * 1E9));
+
+            f64 time = renderer.time_ns / 1E9;
+            Image_Error error = image_error(renderer.average, reference, scene.width, scene.height);
+            f64 efficiency = 1.0 / (error.relmse * time);
+
+            printf("    %6.2f s: %5u samples, RMSE %.4e, relMSE %.4e, FLIP %.4f, efficiency %8.1f\n",
+                time, renderer.num_passes, error.rmse, error.relmse, error.flip, efficiency);
+            fprintf(json, "%s\n        {\"budget\": %g, \"time\": %.4f, \"samples\": %u, \"rmse\": %.6e, \"relmse\": %.6e, \"flip\": %.6f, \"efficiency\": %.6e}",
+                b > 0 ? "," : "", budgets[b], time, renderer.num_passes, error.rmse, error.relmse, error.flip, efficiency);
+        }
+        quality_renderer_free(&renderer);
+        if (guided) {
+            guide_free(&guide);
+        }
+        if (caustics) {
+            caustics_free(&scene_caustics);
+        }
+
+        fprintf(json, "\n      ]\n    }");
+
+        os_free(reference, num_pixels * sizeof(Vector3));
+        free_scene(&scene);
+    }
+
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+    thread_pool_free(&pool);
+
+    printf("Results written to %s.\n", json_path);
+}
+
+struct Benchmark
+{
+    const char *name;
+    void (*run)(u32 argc, char **argv);
+};
+
+#ifndef RAY_NO_BENCH_MAIN
+Benchmark benchmarks[] = {
+    {"bvh",         benchmark_bvh},
+    {"sorting",     benchmark_sorting},
+    {"occlusion",   benchmark_occlusion},
+    {"queries",     benchmark_queries},
+    {"incremental", benchmark_incremental},
+    {"refit",       benchmark_refit},
+    {"kernels",     benchmark_kernels},
+    {"isa",         benchmark_isa},
+    {"samplers",    benchmark_samplers},
+    {"quality",     benchmark_quality},
+};
+
+#endif
+
+PRIVATE_NAMESPACE_END
+
+#ifndef RAY_NO_BENCH_MAIN
+extern "C"
+{
+
+int main(int argc, char **argv)
+{
+    using namespace ray;
+
+    // bench [--isa name] [benchmark [arguments...]]
+    const char *isa = nullptr;
+    if (argc >= 3 && strcmp(argv[1], "--isa") == 0) {
+        isa = argv[2];
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (!select_instruction_set(isa)) {
+        return 1;
+    }
+
+    bool found = argc < 2;
+    for (u32 i = 0; i < array_size(benchmarks); i++) {
+        if (argc < 2) {
+            printf("== %s ==\n", benchmarks[i].name);
+            benchmarks[i].run(0, nullptr);
+        } else if (strcmp(argv[1], benchmarks[i].name) == 0) {
+            benchmarks[i].run(argc - 2, argv + 2);
+            found = true;
+        }
+    }
+
+    if (!found) {
+        printf("Unknown benchmark `%s`.\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
+
+}
+#endif
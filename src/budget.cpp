@@ -0,0 +1,130 @@
+// Rendering within a time budget instead of a fixed number of samples.
+//
+// Samples are taken in passes of one sample per pixel, until the budget is
+// nearly used. Within a pass the rows are visited in an interleaved order, so
+// when the budget runs out in the middle of a pass the extra samples are spread
+// evenly over the image. The clock is read once per row, and a row is only
+// started if it, the resolve and the output are predicted to finish before the
+// deadline.
+
+const u32 BUDGET_ROW_STRIDE = 8;
+
+struct Budget_Renderer
+{
+    u64 deadline;
+    u64 reserve;      // Predicted time of everything that follows the last row
+    u64 max_row_time; // Of the rows rendered so far
+
+    Vector3 *accumulation;
+    u32     *row_samples;
+};
+
+// Renders one sample for every pixel of the row unless it could make the
+// output late. Returns false if the row was not rendered.
+bool render_budget_row(Budget_Renderer *renderer, Scene *scene, u32 y)
+{
+    u64 now = os_time_ns();
+    if (now + renderer->max_row_time + renderer->reserve > renderer->deadline) {
+        return false;
+    }
+
+    for (u32 x = 0; x < scene->width; x++) {
+        renderer->accumulation[x + y * scene->width] += ray_trace(scene, camera_ray(scene, x, y), 1);
+    }
+    renderer->row_samples[y]++;
+
+    renderer->max_row_time = MAX(renderer->max_row_time, os_time_ns() - now);
+
+    return true;
+}
+
+// Like resolve_pixels, with the number of samples given per row. Rows without
+// any samples, if the budget did not allow for a whole pass, repeat the
+// nearest row that has some.
+void resolve_budget_pixels(Scene *scene, Vector3 *accumulation, u32 *row_samples, u8 *pixels)
+{
+    for (u32 y = 0; y < scene->height; y++) {
+        u32 source = y;
+        for (u32 d = 1; row_samples[source] == 0 && d < scene->height; d++) {
+            if (y >= d && row_samples[y - d] > 0) {
+                source = y - d;
+            } else if (y + d < scene->height && row_samples[y + d] > 0) {
+                source = y + d;
+            }
+        }
+
+        for (u32 x = 0; x < scene->width; x++) {
+            Vector3 out_color = {};
+            if (row_samples[source] > 0) {
+                out_color = aces_tonemap(accumulation[x + source * scene->width] / row_samples[source]);
+            }
+
+            pixels[3 * (x + y * scene->width) + 0] = ROUND_COLOR(out_color.r);
+            pixels[3 * (x + y * scene->width) + 1] = ROUND_COLOR(out_color.g);
+            pixels[3 * (x + y * scene->width) + 2] = ROUND_COLOR(out_color.b);
+        }
+    }
+}
+
+// Renders until shortly before start + budget and resolves into pixels, which
+// are then written to output_path with the pool. Returns the average number of
+// samples per pixel.
+f64 render_budget(Scene *scene, f64 budget_seconds, Thread_Pool *pool, const char *output_path, u8 *pixels, u64 start)
+{
+    u64 accumulation_size = (u64) scene->width * scene->height * sizeof(Vector3);
+    u64 row_samples_size  = scene->height * sizeof(u32);
+
+    Budget_Renderer renderer = {
+        .deadline     = start + (u64) (budget_seconds * 1E9),
+        .accumulation = (Vector3 *) memory_allocate(MEMORY_FRAMEBUFFERS, accumulation_size),
+        .row_samples  = (u32 *)     memory_allocate(MEMORY_FRAMEBUFFERS, row_samples_size),
+    };
+
+    // Time the resolve on the empty buffer to know how much to leave for it,
+    // with a sample in every row so that it tonemaps every pixel
+    for (u32 y = 0; y < scene->height; y++) {
+        renderer.row_samples[y] = 1;
+    }
+    u64 resolve_start = os_time_ns();
+    resolve_budget_pixels(scene, renderer.accumulation, renderer.row_samples, pixels);
+    u64 resolve_time = os_time_ns() - resolve_start;
+    memset(renderer.row_samples, 0, row_samples_size);
+
+    // And the output on a strip of 1 / BUDGET_ROW_STRIDE of the rows, scaled to
+    // the whole image. An empty image encodes several times faster than a
+    // rendered one, so the strip is filled with noise, which compresses worst.
+    // The final resolve overwrites it, and the final write the file. Noise
+    // already bounds the output from above, so only the resolve gets a margin.
+    u32 sample_rows = DIV_UP(scene->height, BUDGET_ROW_STRIDE);
+    Xoroshiro128 noise;
+    xoroshiro_set_seed(&noise, 1);
+    for (u64 i = 0; i < 3 * (u64) scene->width * sample_rows; i++) {
+        pixels[i] = (u8) xoroshiro_next_u64(&noise);
+    }
+    u64 output_start = os_time_ns();
+    write_image(pool, output_path, scene->width, sample_rows, pixels);
+    u64 output_time = (os_time_ns() - output_start) * scene->height / MAX(sample_rows, 1);
+
+    renderer.reserve = 2 * resolve_time + output_time + 1000000;
+
+    bool in_time = scene->width > 0 && scene->height > 0;
+    while (in_time) {
+        for (u32 phase = 0; phase < BUDGET_ROW_STRIDE && in_time; phase++) {
+            for (u32 y = phase; y < scene->height && in_time; y += BUDGET_ROW_STRIDE) {
+                in_time = render_budget_row(&renderer, scene, y);
+            }
+        }
+    }
+
+    resolve_budget_pixels(scene, renderer.accumulation, renderer.row_samples, pixels);
+
+    u64 total_samples = 0;
+    for (u32 y = 0; y < scene->height; y++) {
+        total_samples += (u64) renderer.row_samples[y] * scene->width;
+    }
+
+    os_free(renderer.accumulation, accumulation_size);
+    os_free(renderer.row_samples,  row_samples_size);
+
+    return (f64) total_samples / ((u64) scene->width * scene->height);
+}
@@ -0,0 +1,727 @@
+// Construction of the bounding volume hierarchies declared in bvh.h, refitting
+// and traversal of the binary BVH. The BVH8 traversal is a render kernel (see
+// kernels.cpp).
+
+AABB primitive_bounds(Primitive *primitive)
+{
+    ASSERT(primitive->type != PRIMITIVE_PLANE);
+
+    // Columns of the rotation matrix
+    Vector3 axis_x = rotate({1, 0, 0}, primitive->rotation);
+    Vector3 axis_y = rotate({0, 1, 0}, primitive->rotation);
+    Vector3 axis_z = rotate({0, 0, 1}, primitive->rotation);
+
+    Vector3 p = primitive->parameters;
+    Vector3 extent;
+    if (primitive->type == PRIMITIVE_BOX) {
+        for (u32 i = 0; i < 3; i++) {
+            extent[i] = ABS(axis_x[i]) * p.x + ABS(axis_y[i]) * p.y + ABS(axis_z[i]) * p.z;
+        }
+    } else {
+        for (u32 i = 0; i < 3; i++) {
+            extent[i] = sqrtf(SQUARE(axis_x[i] * p.x) + SQUARE(axis_y[i] * p.y) + SQUARE(axis_z[i] * p.z));
+        }
+    }
+
+    return {primitive->position - extent, primitive->position + extent};
+}
+
+// Binary BVH:
+struct BVH_Build_Item
+{
+    AABB    bounds;
+    Vector3 centroid;
+    u32     index;
+};
+
+// Partially sorts the items so that the one at `middle` has the median centroid along the axis
+void bvh_select_median(BVH_Build_Item *items, u32 count, u32 middle, u32 axis)
+{
+    s32 left = 0;
+    s32 right = count - 1;
+    while (left < right) {
+        f32 pivot = items[(left + right) / 2].centroid[axis];
+        s32 i = left;
+        s32 j = right;
+        while (i <= j) {
+            while (items[i].centroid[axis] < pivot) {
+                i++;
+            }
+            while (items[j].centroid[axis] > pivot) {
+                j--;
+            }
+            if (i <= j) {
+                BVH_Build_Item tmp = items[i];
+                items[i] = items[j];
+                items[j] = tmp;
+                i++;
+                j--;
+            }
+        }
+
+        if ((s32) middle <= j) {
+            right = j;
+        } else if ((s32) middle >= i) {
+            left = i;
+        } else {
+            break;
+        }
+    }
+}
+
+u32 bvh2_build_recursive(BVH2 *bvh, BVH_Build_Item *items, u32 count, u32 depth)
+{
+    u32 node_index = bvh->nodes.size;
+    array_push(&bvh->nodes, {});
+
+    AABB bounds = empty_aabb();
+    AABB centroid_bounds = empty_aabb();
+    for (u32 i = 0; i < count; i++) {
+        bounds = merge(bounds, items[i].bounds);
+        centroid_bounds = merge(centroid_bounds, items[i].centroid);
+    }
+
+    auto make_leaf = [&] () -> u32
+    {
+        BVH2_Node *node = &bvh->nodes[node_index];
+        node->bounds = bounds;
+        node->offset = bvh->primitive_indices.size;
+        node->count  = count;
+        for (u32 i = 0; i < count; i++) {
+            array_push(&bvh->primitive_indices, items[i].index);
+        }
+
+        return node_index;
+    };
+
+    if (count == 1) {
+        return make_leaf();
+    }
+
+    Vector3 centroid_extent = centroid_bounds.max - centroid_bounds.min;
+    u32 axis = 0;
+    for (u32 i = 1; i < 3; i++) {
+        if (centroid_extent[i] > centroid_extent[axis]) {
+            axis = i;
+        }
+    }
+
+    u32 middle = count / 2;
+    if (centroid_extent[axis] <= 0) {
+        // All centroids coincide, so no binning plane separates them
+        if (count <= BVH_MAX_LEAF_SIZE) {
+            return make_leaf();
+        }
+    } else if (depth >= BVH_MEDIAN_SPLIT_DEPTH) {
+        bvh_select_median(items, count, middle, axis);
+    } else {
+        struct Bin
+        {
+            AABB bounds = empty_aabb();
+            u32  count  = 0;
+        };
+
+        Bin bins[BVH_SAH_BINS] = {};
+        f32 bin_scale = BVH_SAH_BINS / centroid_extent[axis];
+        auto bin_of = [&] (BVH_Build_Item *item) -> u32 {
+            u32 b = (u32) ((item->centroid[axis] - centroid_bounds.min[axis]) * bin_scale);
+            return MIN(b, BVH_SAH_BINS - 1);
+        };
+
+        for (u32 i = 0; i < count; i++) {
+            Bin *bin = &bins[bin_of(&items[i])];
+            bin->bounds = merge(bin->bounds, items[i].bounds);
+            bin->count += 1;
+        }
+
+        // Sweep from the right to get the cost of every right-hand side
+        f32 right_areas[BVH_SAH_BINS];
+        u32 right_counts[BVH_SAH_BINS];
+        AABB right_bounds = empty_aabb();
+        u32 right_count = 0;
+        for (u32 i = BVH_SAH_BINS - 1; i > 0; i--) {
+            right_bounds = merge(right_bounds, bins[i].bounds);
+            right_count += bins[i].count;
+            right_areas[i]  = surface_area(right_bounds);
+            right_counts[i] = right_count;
+        }
+
+        f32 best_cost = INFINITY;
+        u32 best_split = 0;
+        AABB left_bounds = empty_aabb();
+        u32 left_count = 0;
+        for (u32 i = 0; i < BVH_SAH_BINS - 1; i++) {
+            left_bounds = merge(left_bounds, bins[i].bounds);
+            left_count += bins[i].count;
+            if (left_count == 0 || right_counts[i + 1] == 0) {
+                continue;
+            }
+
+            f32 cost = surface_area(left_bounds) * left_count + right_areas[i + 1] * right_counts[i + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = i;
+            }
+        }
+
+        // Cost of a leaf relative to splitting, with unit traversal and intersection costs
+        f32 leaf_cost = surface_area(bounds) * count;
+        if (count <= BVH_MAX_LEAF_SIZE && leaf_cost <= surface_area(bounds) + best_cost) {
+            return make_leaf();
+        }
+
+        // Partition the items around the chosen plane
+        u32 left = 0;
+        u32 right = count;
+        while (left < right) {
+            if (bin_of(&items[left]) <= best_split) {
+                left++;
+            } else {
+                right--;
+                BVH_Build_Item tmp = items[left];
+                items[left] = items[right];
+                items[right] = tmp;
+            }
+        }
+        middle = left;
+    }
+
+    bvh2_build_recursive(bvh, items, middle, depth + 1);
+    u32 second = bvh2_build_recursive(bvh, items + middle, count - middle, depth + 1);
+
+    BVH2_Node *node = &bvh->nodes[node_index];
+    node->bounds = bounds;
+    node->offset = second;
+    node->count  = 0;
+    node->axis   = axis;
+
+    return node_index;
+}
+
+void bvh2_build(BVH2 *bvh, Array<Primitive> primitives)
+{
+    Array<BVH_Build_Item> items = {};
+    defer {
+        array_free(&items);
+    };
+
+    for (u32 i = 0; i < primitives.size; i++) {
+        if (primitives[i].type == PRIMITIVE_PLANE) {
+            array_push(&bvh->unbounded, i);
+            continue;
+        }
+
+        AABB bounds = primitive_bounds(&primitives[i]);
+        array_push(&items, {bounds, center(bounds), i});
+    }
+
+    bvh->bounds = empty_aabb();
+    if (items.size > 0) {
+        bvh2_build_recursive(bvh, items.data, items.size, 0);
+        bvh->bounds = bvh->nodes[0].bounds;
+    }
+}
+
+void bvh2_free(BVH2 *bvh)
+{
+    array_free(&bvh->nodes);
+    array_free(&bvh->primitive_indices);
+    array_free(&bvh->unbounded);
+}
+
+// Slab test, returns the entry distance or INFINITY on a miss
+inline f32 intersect_aabb(AABB box, Vector3 origin, Vector3 inverse_direction, f32 t_max)
+{
+    Vector3 t1 = (box.min - origin) * inverse_direction;
+    Vector3 t2 = (box.max - origin) * inverse_direction;
+
+    f32 t_near = MAX(max(min(t1, t2)), 0.0f);
+    f32 t_far  = MIN(min(max(t1, t2)), t_max);
+
+    return t_near <= t_far ? t_near : INFINITY;
+}
+
+Intersection bvh2_intersect(BVH2 *bvh, Array<Primitive> primitives, Ray world_ray, Primitive **closest, f32 t_max = INFINITY)
+{
+    Intersection out = {.t = t_max};
+    *closest = nullptr;
+
+    auto test = [&] (u32 index) {
+        Intersection current = intersect_once(&primitives[index], world_ray);
+        if (current.t > 0 && current.t < out.t) {
+            out = current;
+            *closest = &primitives[index];
+        }
+    };
+
+    ARRAY_ITERATE(bvh->unbounded) {
+        test(*it);
+    }
+
+    if (bvh->nodes.size == 0) {
+        return out;
+    }
+
+    Vector3 inverse = inverse_direction(world_ray.direction);
+    bool negative[3] = {inverse.x < 0, inverse.y < 0, inverse.z < 0};
+
+    u32 stack[64];
+    u32 stack_size = 0;
+    u32 node_index = 0;
+    while (true) {
+        BVH2_Node *node = &bvh->nodes[node_index];
+        if (intersect_aabb(node->bounds, world_ray.origin, inverse, out.t) != INFINITY) {
+            if (node->count > 0) {
+                for (u32 i = 0; i < node->count; i++) {
+                    test(bvh->primitive_indices[node->offset + i]);
+                }
+            } else {
+                // Visit the child on the near side of the split first
+                ASSERT(stack_size < array_size(stack));
+                if (negative[node->axis]) {
+                    stack[stack_size++] = node_index + 1;
+                    node_index = node->offset;
+                } else {
+                    stack[stack_size++] = node->offset;
+                    node_index = node_index + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0) {
+            break;
+        }
+        node_index = stack[--stack_size];
+    }
+
+    if (!*closest) {
+        out.t = INFINITY;
+    }
+
+    return out;
+}
+
+// 8-wide BVH:
+void bvh8_clear_slot(BVH8_Node *node, u32 slot)
+{
+    u8 *lo[3] = {node->lo_x, node->lo_y, node->lo_z};
+    u8 *hi[3] = {node->hi_x, node->hi_y, node->hi_z};
+
+    for (u32 axis = 0; axis < 3; axis++) {
+        lo[axis][slot] = 255;
+        hi[axis][slot] = 0;
+    }
+}
+
+// Quantizes the bounds of a slot within the frame of its node, rounding
+// outwards. Returns the dequantized bounds, which are the frame of the child.
+AABB bvh8_quantize_slot(BVH8_Node *node, u32 slot, AABB frame, AABB bounds)
+{
+    u8 *lo[3] = {node->lo_x, node->lo_y, node->lo_z};
+    u8 *hi[3] = {node->hi_x, node->hi_y, node->hi_z};
+
+    AABB child_frame;
+    for (u32 axis = 0; axis < 3; axis++) {
+        f32 step = bvh8_quantization_step(frame.max[axis] - frame.min[axis]);
+        f32 frame_min = frame.min[axis];
+        f32 child_min = bounds.min[axis];
+        f32 child_max = bounds.max[axis];
+
+        s32 q_lo = (s32) floorf((child_min - frame_min) / step);
+        q_lo = CLAMP(q_lo, 0, 255);
+        while (q_lo > 0 && bvh8_dequantize(frame_min, step, q_lo) > child_min) {
+            q_lo--;
+        }
+
+        s32 q_hi = (s32) ceilf((child_max - frame_min) / step);
+        q_hi = CLAMP(q_hi, q_lo, 255);
+        while (q_hi < 255 && bvh8_dequantize(frame_min, step, q_hi) < child_max) {
+            q_hi++;
+        }
+        ASSERT(bvh8_dequantize(frame_min, step, q_hi) >= child_max);
+
+        lo[axis][slot] = q_lo;
+        hi[axis][slot] = q_hi;
+        child_frame.min[axis] = bvh8_dequantize(frame_min, step, q_lo);
+        child_frame.max[axis] = bvh8_dequantize(frame_min, step, q_hi);
+    }
+
+    return child_frame;
+}
+
+struct BVH8_Builder
+{
+    BVH8 *bvh;
+    BVH2 *bvh2;
+    Array<Primitive> primitives;
+};
+
+void bvh8_collapse(BVH8_Builder *builder, u32 binary_index, u32 node_index, AABB frame)
+{
+    BVH2 *bvh2 = builder->bvh2;
+    BVH8 *bvh = builder->bvh;
+
+    // Open up the child with the largest surface area until the node is full
+    u32 children[BVH8_WIDTH];
+    u32 num_children = 0;
+    if (bvh2->nodes[binary_index].count > 0) {
+        children[num_children++] = binary_index;
+    } else {
+        children[num_children++] = binary_index + 1;
+        children[num_children++] = bvh2->nodes[binary_index].offset;
+    }
+
+    while (num_children < BVH8_WIDTH) {
+        s32 best = -1;
+        f32 best_area = -1.0f;
+        for (u32 i = 0; i < num_children; i++) {
+            BVH2_Node *child = &bvh2->nodes[children[i]];
+            if (child->count == 0 && surface_area(child->bounds) > best_area) {
+                best = i;
+                best_area = surface_area(child->bounds);
+            }
+        }
+
+        if (best < 0) {
+            break;
+        }
+
+        u32 opened = children[best];
+        children[best] = opened + 1;
+        children[num_children++] = bvh2->nodes[opened].offset;
+    }
+
+    // Greedily assign children to slots by how far they lie towards each slot corner
+    Vector3 frame_center = center(frame);
+    s32 slots[BVH8_WIDTH];
+    bool child_assigned[BVH8_WIDTH] = {};
+    for (u32 s = 0; s < BVH8_WIDTH; s++) {
+        slots[s] = -1;
+    }
+
+    for (u32 n = 0; n < num_children; n++) {
+        f32 best_score = -INFINITY;
+        u32 best_child = 0, best_slot = 0;
+        for (u32 c = 0; c < num_children; c++) {
+            if (child_assigned[c]) {
+                continue;
+            }
+
+            Vector3 offset = center(bvh2->nodes[children[c]].bounds) - frame_center;
+            for (u32 s = 0; s < BVH8_WIDTH; s++) {
+                if (slots[s] >= 0) {
+                    continue;
+                }
+
+                Vector3 corner = {(s & 1) ? 1.0f : -1.0f, (s & 2) ? 1.0f : -1.0f, (s & 4) ? 1.0f : -1.0f};
+                f32 score = dot(offset, corner);
+                if (score > best_score) {
+                    best_score = score;
+                    best_child = c;
+                    best_slot = s;
+                }
+            }
+        }
+
+        slots[best_slot] = best_child;
+        child_assigned[best_child] = true;
+    }
+
+    // Reserve the inner children contiguously, then quantize every slot
+    u32 inner_mask = 0;
+    u32 num_inner = 0;
+    for (u32 s = 0; s < BVH8_WIDTH; s++) {
+        if (slots[s] >= 0 && bvh2->nodes[children[slots[s]]].count == 0) {
+            inner_mask |= 1u << s;
+            num_inner++;
+        }
+    }
+
+    u32 child_base = bvh->nodes.size;
+    array_resize(&bvh->nodes, bvh->nodes.size + num_inner);
+
+    BVH8_Node node = {};
+    node.child_base = child_base;
+    node.meta = inner_mask;
+
+    AABB child_frames[BVH8_WIDTH];
+    for (u32 s = 0; s < BVH8_WIDTH; s++) {
+        if (slots[s] < 0) {
+            // Empty slots have inverted bounds and never pass the slab test
+            bvh8_clear_slot(&node, s);
+            continue;
+        }
+
+        BVH2_Node *child = &bvh2->nodes[children[slots[s]]];
+        child_frames[s] = bvh8_quantize_slot(&node, s, frame, child->bounds);
+
+        if (child->count > 0) {
+            ASSERT(child->count <= BVH8_MAX_LEAF_SIZE);
+            node.meta |= (u32) child->count << (8 + 3 * s);
+        }
+    }
+
+    // The leaf primitives of all slots, grouped by type into chunks of lanes
+    node.primitive_base = bvh->primitive_indices.size;
+
+    Primitive_Type chunk_types[2] = {PRIMITIVE_ELLIPSOID, PRIMITIVE_BOX};
+    for (u32 t = 0; t < 2; t++) {
+        for (u32 s = 0; s < BVH8_WIDTH; s++) {
+            if (slots[s] < 0 || (inner_mask & (1u << s))) {
+                continue;
+            }
+
+            BVH2_Node *child = &bvh2->nodes[children[slots[s]]];
+            for (u32 i = 0; i < child->count; i++) {
+                u32 index = bvh2->primitive_indices[child->offset + i];
+                if (builder->primitives[index].type == chunk_types[t]) {
+                    array_push(&bvh->primitive_indices, index);
+                    array_push(&bvh->leaf_slot_bits, (u8) (1u << s));
+                }
+            }
+        }
+
+        if (t == 0) {
+            node.ellipsoid_lanes = (u8) (bvh->primitive_indices.size - node.primitive_base);
+        }
+    }
+
+    while (bvh->primitive_indices.size % PRIMITIVE_LANES != 0) {
+        array_push(&bvh->primitive_indices, U32_MAX);
+        array_push(&bvh->leaf_slot_bits, (u8) 0);
+    }
+    node.leaf_chunks = (u8) ((bvh->primitive_indices.size - node.primitive_base) / PRIMITIVE_LANES);
+
+    bvh->nodes[node_index] = node;
+
+    u32 inner_index = child_base;
+    for (u32 s = 0; s < BVH8_WIDTH; s++) {
+        if (inner_mask & (1u << s)) {
+            bvh8_collapse(builder, children[slots[s]], inner_index++, child_frames[s]);
+        }
+    }
+}
+
+void primitive_chunk_set(Array<Primitive_Chunk> chunks, u32 lane, Primitive *primitive)
+{
+    Primitive_Chunk *chunk = &chunks[lane / PRIMITIVE_LANES];
+    lane %= PRIMITIVE_LANES;
+
+    Quaternion inverse_rotation = conj(primitive->rotation);
+    for (u32 i = 0; i < 3; i++) {
+        chunk->position[i][lane]   = primitive->position[i];
+        chunk->parameters[i][lane] = primitive->parameters[i];
+        if (primitive->type == PRIMITIVE_ELLIPSOID) {
+            chunk->parameters[i][lane] = 1.0f / primitive->parameters[i];
+        }
+    }
+    chunk->inverse_rotation[0][lane] = inverse_rotation.x;
+    chunk->inverse_rotation[1][lane] = inverse_rotation.y;
+    chunk->inverse_rotation[2][lane] = inverse_rotation.z;
+    chunk->inverse_rotation[3][lane] = inverse_rotation.w;
+}
+
+// Tests load up to 8 lanes, so one chunk of padding follows the last one
+void primitive_chunks_init(Array<Primitive_Chunk> *chunks, u32 num_lanes)
+{
+    array_resize(chunks, DIV_UP(num_lanes, PRIMITIVE_LANES) + 1);
+    memset(chunks->data, 0, chunks->size * sizeof(Primitive_Chunk));
+}
+
+void bvh8_build(BVH8 *bvh, BVH2 *bvh2, Array<Primitive> primitives)
+{
+    array_resize(&bvh->unbounded, bvh2->unbounded.size);
+    memcpy(bvh->unbounded.data, bvh2->unbounded.data, bvh2->unbounded.size * sizeof(u32));
+
+    primitive_chunks_init(&bvh->plane_chunks, bvh->unbounded.size);
+    for (u32 i = 0; i < bvh->unbounded.size; i++) {
+        primitive_chunk_set(bvh->plane_chunks, i, &primitives[bvh->unbounded[i]]);
+    }
+
+    bvh->bounds = bvh2->bounds;
+    if (bvh2->nodes.size == 0) {
+        return;
+    }
+
+    BVH8_Builder builder = {.bvh = bvh, .bvh2 = bvh2, .primitives = primitives};
+    array_resize(&bvh->nodes, 1);
+    bvh8_collapse(&builder, 0, 0, bvh->bounds);
+
+    primitive_chunks_init(&bvh->leaf_chunks, bvh->primitive_indices.size);
+    for (u32 i = 0; i < bvh->primitive_indices.size; i++) {
+        if (bvh->primitive_indices[i] != U32_MAX) {
+            primitive_chunk_set(bvh->leaf_chunks, i, &primitives[bvh->primitive_indices[i]]);
+        }
+    }
+
+    for (u32 i = 0; i < 8; i++) {
+        array_push(&bvh->leaf_slot_bits, (u8) 0);
+    }
+}
+
+void bvh8_free(BVH8 *bvh)
+{
+    array_free(&bvh->nodes);
+    array_free(&bvh->primitive_indices);
+    array_free(&bvh->unbounded);
+    array_free(&bvh->leaf_chunks);
+    array_free(&bvh->leaf_slot_bits);
+    array_free(&bvh->plane_chunks);
+}
+
+// Recomputes the exact slot bounds of the dirty nodes of the subtree, returns its bounds
+AABB bvh8_refit_bounds(BVH8_Refit *refit, BVH8 *bvh, Array<Primitive> primitives, u32 node_index)
+{
+    BVH8_Node *node = &bvh->nodes[node_index];
+    AABB *slot_bounds = &refit->slot_bounds[node_index * BVH8_WIDTH];
+
+    u32 inner_index = node->child_base;
+    for (u32 slot = 0; slot < BVH8_WIDTH; slot++) {
+        if (node->meta & (1u << slot)) {
+            u32 child = inner_index++;
+            if (refit->dirty[child]) {
+                slot_bounds[slot] = bvh8_refit_bounds(refit, bvh, primitives, child);
+            }
+        } else {
+            slot_bounds[slot] = empty_aabb();
+        }
+    }
+
+    for (u32 lane = node->primitive_base; lane < node->primitive_base + bvh8_leaf_lane_count(node); lane++) {
+        u32 index = bvh->primitive_indices[lane];
+        if (index != U32_MAX) {
+            AABB *bounds = &slot_bounds[__builtin_ctz(bvh->leaf_slot_bits[lane])];
+            *bounds = merge(*bounds, primitive_bounds(&primitives[index]));
+        }
+    }
+
+    AABB bounds = empty_aabb();
+    for (u32 slot = 0; slot < BVH8_WIDTH; slot++) {
+        bounds = merge(bounds, slot_bounds[slot]);
+    }
+
+    return bounds;
+}
+
+void bvh8_requantize(BVH8_Refit *refit, BVH8 *bvh, u32 node_index, AABB frame)
+{
+    AABB *old_frame = &refit->frames[node_index];
+    if (!refit->dirty[node_index] && memcmp(old_frame, &frame, sizeof(AABB)) == 0) {
+        return;
+    }
+    *old_frame = frame;
+    refit->dirty[node_index] = false;
+
+    BVH8_Node *node = &bvh->nodes[node_index];
+    AABB *slot_bounds = &refit->slot_bounds[node_index * BVH8_WIDTH];
+
+    u32 inner_index = node->child_base;
+    for (u32 slot = 0; slot < BVH8_WIDTH; slot++) {
+        bool inner = node->meta & (1u << slot);
+        if (!inner && bvh8_leaf_count(node->meta, slot) == 0) {
+            continue;
+        }
+
+        AABB child_frame = bvh8_quantize_slot(node, slot, frame, slot_bounds[slot]);
+        if (inner) {
+            bvh8_requantize(refit, bvh, inner_index++, child_frame);
+        }
+    }
+}
+
+// Updates the bounds of the BVH after the given primitives have moved
+void bvh8_refit(BVH8_Refit *refit, BVH8 *bvh, Array<Primitive> primitives, Array<u32> moved)
+{
+    ARRAY_ITERATE(moved) {
+        u32 node = refit->primitive_nodes[*it];
+        if (node == BVH8_NO_NODE) {
+            primitive_chunk_set(bvh->plane_chunks, refit->primitive_lanes[*it], &primitives[*it]);
+            continue;
+        }
+
+        primitive_chunk_set(bvh->leaf_chunks, refit->primitive_lanes[*it], &primitives[*it]);
+
+        while (!refit->dirty[node]) {
+            refit->dirty[node] = true;
+            node = refit->parents[node];
+        }
+    }
+
+    if (bvh->nodes.size == 0 || !refit->dirty[0]) {
+        return;
+    }
+
+    bvh->bounds = bvh8_refit_bounds(refit, bvh, primitives, 0);
+    bvh8_requantize(refit, bvh, 0, bvh->bounds);
+}
+
+void bvh8_refit_init(BVH8_Refit *refit, BVH8 *bvh, Array<Primitive> primitives)
+{
+    Memory_Tag tag = memory_set_tag(MEMORY_ACCEL);
+
+    *refit = {};
+    array_resize(&refit->slot_bounds, bvh->nodes.size * BVH8_WIDTH);
+    array_resize(&refit->frames,      bvh->nodes.size);
+    array_resize(&refit->parents,     bvh->nodes.size);
+    array_resize(&refit->dirty,       bvh->nodes.size);
+    array_resize(&refit->primitive_nodes, primitives.size);
+    array_resize(&refit->primitive_lanes, primitives.size);
+
+    for (u32 i = 0; i < primitives.size; i++) {
+        refit->primitive_nodes[i] = BVH8_NO_NODE;
+    }
+    for (u32 i = 0; i < bvh->unbounded.size; i++) {
+        refit->primitive_lanes[bvh->unbounded[i]] = i;
+    }
+
+    for (u32 n = 0; n < bvh->nodes.size; n++) {
+        BVH8_Node *node = &bvh->nodes[n];
+        refit->dirty[n] = true;
+
+        u32 inner_index = node->child_base;
+        for (u32 slot = 0; slot < BVH8_WIDTH; slot++) {
+            if (node->meta & (1u << slot)) {
+                refit->parents[inner_index++] = n;
+            }
+        }
+
+        for (u32 lane = node->primitive_base; lane < node->primitive_base + bvh8_leaf_lane_count(node); lane++) {
+            u32 index = bvh->primitive_indices[lane];
+            if (index != U32_MAX) {
+                refit->primitive_nodes[index] = n;
+                refit->primitive_lanes[index] = lane;
+            }
+        }
+    }
+
+    if (bvh->nodes.size > 0) {
+        refit->parents[0] = 0;
+        bvh->bounds = bvh8_refit_bounds(refit, bvh, primitives, 0);
+        bvh8_requantize(refit, bvh, 0, bvh->bounds);
+    }
+
+    memory_set_tag(tag);
+}
+
+void bvh8_refit_free(BVH8_Refit *refit)
+{
+    array_free(&refit->slot_bounds);
+    array_free(&refit->frames);
+    array_free(&refit->parents);
+    array_free(&refit->primitive_nodes);
+    array_free(&refit->primitive_lanes);
+    array_free(&refit->dirty);
+}
+
+void build_acceleration_structure(Scene *scene)
+{
+    Memory_Tag tag = memory_set_tag(MEMORY_ACCEL);
+
+    BVH2 bvh2 = {};
+    bvh2_build(&bvh2, scene->primitives);
+    bvh8_build(&scene->bvh, &bvh2, scene->primitives);
+    bvh2_free(&bvh2);
+
+    memory_set_tag(tag);
+}
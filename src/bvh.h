@@ -0,0 +1,201 @@
+#pragma once
+
+#include "math.h"
+
+// Bounding volume hierarchies over the bounded primitives of a scene.
+//
+// The scene is first built into a binary BVH (SAH binning), which is then
+// collapsed into an 8-wide BVH whose child bounds are quantized to 8 bits.
+// Planes are unbounded and are kept in a separate list that is tested linearly.
+
+struct AABB
+{
+    Vector3 min, max;
+};
+
+inline AABB empty_aabb()
+{
+    return {{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+}
+
+inline AABB merge(AABB a, AABB b)
+{
+    return {min(a.min, b.min), max(a.max, b.max)};
+}
+
+inline AABB merge(AABB a, Vector3 p)
+{
+    return {min(a.min, p), max(a.max, p)};
+}
+
+inline Vector3 center(AABB a)
+{
+    return 0.5f * (a.min + a.max);
+}
+
+inline f32 surface_area(AABB a)
+{
+    Vector3 d = a.max - a.min;
+    if (d.x < 0 || d.y < 0 || d.z < 0) {
+        return 0.0f;
+    }
+
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Safe reciprocal of the ray direction: zero components are replaced by a tiny
+// value of the same sign so that slab tests never produce NaNs.
+inline Vector3 inverse_direction(Vector3 direction)
+{
+    __m128 tiny = _mm_cmplt_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), direction.m), _mm_set1_ps(1E-20f));
+    __m128 sign = _mm_and_ps(_mm_cmplt_ps(direction.m, _mm_setzero_ps()), _mm_set1_ps(-0.0f));
+    __m128 d = _mm_blendv_ps(direction.m, _mm_or_ps(sign, _mm_set1_ps(1E-20f)), tiny);
+
+    return vector3(clear_pad(_mm_div_ps(_mm_set1_ps(1.0f), d)));
+}
+
+// Binary BVH:
+const u32 BVH_MAX_LEAF_SIZE      = 4;
+const u32 BVH_SAH_BINS           = 12;
+const u32 BVH_MEDIAN_SPLIT_DEPTH = 40; // Deeper nodes are split at the object median, which bounds the tree depth
+
+struct BVH2_Node
+{
+    AABB bounds;
+    u32  offset; // First primitive index for leaves, index of the second child for inner nodes
+    u16  count;  // Zero for inner nodes
+    u16  axis;   // Split axis, used to order traversal by the ray direction sign
+};
+
+struct BVH2
+{
+    Array<BVH2_Node> nodes; // Depth-first, the first child of an inner node immediately follows it
+    Array<u32>       primitive_indices;
+    Array<u32>       unbounded; // Planes
+
+    AABB bounds;
+};
+
+// 8-wide BVH:
+//
+// Child bounds are quantized to 8 bits relative to the frame of their parent,
+// which is the parent's own dequantized box (the root frame is stored in the
+// BVH). The quantization step of a frame is a power of two derived from its
+// extent, so dequantization is exact and the builder can guarantee that the
+// dequantized bounds are conservative. This keeps a node in one cache line.
+//
+// The children of a node are stored contiguously (inner nodes starting at
+// child_base, leaf primitives starting at primitive_base), and each subtree
+// follows its parent's block, giving a depth-first layout. The primitives of
+// all leaves of a node are grouped by type, first the ellipsoids and then the
+// boxes, which share the chunk where the ellipsoids end, and the lanes of a
+// node are padded to whole chunks of PRIMITIVE_LANES. A ray is tested against
+// all leaves of a node a few lanes of one type at a time.
+//
+// Slots are assigned so that slot s holds the child that lies the furthest
+// towards the corner whose signs are given by the bits of s (set bit means
+// positive), so a ray with direction sign octant o visits slots in the order
+// k ^ ~o for k = 0..7, nearest first.
+const u32 BVH8_WIDTH         = 8;
+const u32 BVH8_STACK_SIZE    = 512; // 7 * (BVH_MEDIAN_SPLIT_DEPTH + 32) rounded up
+const u32 BVH8_MAX_LEAF_SIZE = 7;   // Leaf sizes are packed into three bits per slot
+const u32 PRIMITIVE_LANES    = 4;   // Of a Primitive_Chunk
+
+struct alignas(64) BVH8_Node
+{
+    u8 lo_x[BVH8_WIDTH], lo_y[BVH8_WIDTH], lo_z[BVH8_WIDTH];
+    u8 hi_x[BVH8_WIDTH], hi_y[BVH8_WIDTH], hi_z[BVH8_WIDTH];
+
+    u32 child_base;
+    u32 primitive_base; // First leaf lane, a multiple of PRIMITIVE_LANES
+    u32 meta; // Bits 0-7 are the inner node mask, bits 8-31 hold the 3-bit primitive count of every leaf slot
+
+    u8 ellipsoid_lanes; // The box lanes follow them
+    u8 leaf_chunks;
+};
+
+static_assert(sizeof(BVH8_Node) == 64, "BVH8_Node must occupy exactly one cache line.");
+static_assert(BVH_MAX_LEAF_SIZE <= BVH8_MAX_LEAF_SIZE, "Binary leaves must fit into 8-wide leaf slots.");
+
+inline u32 bvh8_leaf_count(u32 meta, u32 slot)
+{
+    return (meta >> (8 + 3 * slot)) & 7;
+}
+
+inline u32 bvh8_leaf_lane_count(BVH8_Node *node)
+{
+    return node->leaf_chunks * PRIMITIVE_LANES;
+}
+
+// Power-of-two quantization step for a frame: the smallest 2^e with
+// 128 * 2^e >= extent, so that 255 steps cover the extent with a margin.
+inline f32 bvh8_quantization_step(f32 extent)
+{
+    u32 bits;
+    memcpy(&bits, &extent, sizeof(bits));
+
+    s32 exponent = (s32) ((bits >> 23) & 0xFF) - 127 + ((bits & 0x7FFFFF) != 0) - 7;
+    exponent = CLAMP(exponent, -126, 127);
+
+    bits = (u32) (exponent + 127) << 23;
+    f32 step;
+    memcpy(&step, &bits, sizeof(step));
+
+    return step;
+}
+
+inline f32 bvh8_dequantize(f32 frame_min, f32 step, u8 q)
+{
+    // q * step is exact, so this rounds exactly once with or without FMA
+    return frame_min + (f32) q * step;
+}
+
+// What intersection tests read of PRIMITIVE_LANES primitives, split from the
+// shading data and stored as structure of arrays, so that a ray is tested
+// against the lanes of one or more consecutive chunks at once and the colors
+// and materials are only read for the closest hit. Padding lanes are zero.
+struct alignas(16) Primitive_Chunk
+{
+    f32 position[3][PRIMITIVE_LANES];
+    f32 inverse_rotation[4][PRIMITIVE_LANES]; // x, y, z, w
+    f32 parameters[3][PRIMITIVE_LANES];       // With the reciprocals of the semi-axes of ellipsoids
+};
+
+struct BVH8
+{
+    Array<BVH8_Node> nodes; // Allocated in whole pages, so every node is cache-line aligned
+    Array<u32>       primitive_indices; // Of every leaf lane, U32_MAX for padding
+    Array<u32>       unbounded; // Planes
+
+    // Lanes in the order of primitive_indices and of unbounded. Both end with
+    // padding, so a test can load past the last chunk and slot bits.
+    Array<Primitive_Chunk> leaf_chunks;
+    Array<u8>              leaf_slot_bits; // Bit of the leaf slot of every lane in its node, zero for padding
+    Array<Primitive_Chunk> plane_chunks;
+
+    AABB bounds; // Frame of the root node
+};
+
+// Refitting keeps the topology of a BVH8 and updates its bounds after
+// primitives have moved. The exact bounds of every slot are kept between
+// refits, so only the nodes on the paths from the root to the moved primitives
+// are recomputed, and the other nodes are requantized only if the frame their
+// parent gives them has changed.
+struct BVH8_Refit
+{
+    Array<AABB> slot_bounds;     // BVH8_WIDTH per node
+    Array<AABB> frames;          // The frame every node is quantized in
+    Array<u32>  parents;         // Of every node, the root is its own parent
+    Array<u32>  primitive_nodes; // Node whose leaf holds the primitive, BVH8_NO_NODE for planes
+    Array<u32>  primitive_lanes; // Lane of every primitive in the leaf chunks, or in the plane chunks for planes
+    Array<u8>   dirty;           // Per node, set on the paths to moved primitives
+};
+
+const u32 BVH8_NO_NODE = 0xFFFFFFFF;
+
+struct BVH8_Stack_Entry
+{
+    u32  node;
+    f32  t_near;
+    AABB frame;
+};
@@ -0,0 +1,221 @@
+// Path guiding, after Müller et al., "Practical Path Guiding for Efficient
+// Light-Transport Simulation".
+//
+// The scene bounds are split by a binary tree, in the middle and along the
+// axes in turn, and every leaf holds two quadtrees over directions. Diffuse
+// bounces sample the one learned on the passes before and record the radiance
+// that reaches the camera through them into the other (see guide_train in
+// kernels.cpp). After a pass the recorded quadtree takes over, leaves that
+// recorded many vertices are split, and the quadtrees to record into next are
+// refined where the learned radiance is concentrated.
+//
+// Every leaf mixes the BRDF and its quadtree with a weight that follows the
+// gradient of the KL divergence from the mixture to the recorded radiance
+// times the BRDF, as in "Path Guiding in Production". Leaves that have not
+// learned anything sample the BRDF alone.
+
+const f32 GUIDE_SPATIAL_THRESHOLD    = 4000;  // Vertices per pass above which a leaf is split, times sqrt(2^updates)
+const f32 GUIDE_SUBDIVISION_FRACTION = 0.01f; // Of the radiance of a quadtree above which a cell is subdivided
+const u32 GUIDE_MAX_QUADTREE_DEPTH   = 20;
+const f32 GUIDE_LEARNING_RATE        = 2.0f;  // Of the logit of the BRDF fraction
+const f32 GUIDE_MAX_LOGIT            = 3.0f;  // Keeps the BRDF fraction within 5% to 95%
+
+const u32 QUADTREE_NO_NODE = U32_MAX;
+
+// Surfaces facing different ways see different halves of the sphere, so the
+// spatial trees are separate for the six directions along the axes, the first
+// nodes in guide->nodes. Walls and the floor along them learn apart.
+const u32 GUIDE_NORMAL_DIRECTIONS = 6;
+
+// A root with four empty leaves
+void quadtree_reset(Quadtree *tree)
+{
+    array_resize(&tree->nodes, 1);
+    tree->nodes[0] = {};
+    tree->total = 0;
+}
+
+Quadtree quadtree_copy(Quadtree *tree)
+{
+    Quadtree copy = {.total = tree->total};
+    array_resize(&copy.nodes, tree->nodes.size);
+    memcpy(copy.nodes.data, tree->nodes.data, tree->nodes.size * sizeof(Quadtree_Node));
+
+    return copy;
+}
+
+// Recording only adds to the cells of leaves, this sums up the nodes above them
+void quadtree_sum(Quadtree *tree)
+{
+    for (u32 i = tree->nodes.size; i-- > 0;) {
+        Quadtree_Node *node = &tree->nodes[i];
+        for (u32 c = 0; c < 4; c++) {
+            if (node->children[c]) {
+                Quadtree_Node *child = &tree->nodes[node->children[c]];
+                node->sums[c] = child->sums[0] + child->sums[1] + child->sums[2] + child->sums[3];
+            }
+        }
+    }
+
+    Quadtree_Node *root = &tree->nodes[0];
+    tree->total = root->sums[0] + root->sums[1] + root->sums[2] + root->sums[3];
+}
+
+// Subdivides the cells of to_node whose share of the radiance of the learned
+// tree is above the threshold. Cells the learned tree did not subdivide
+// spread their radiance evenly over their children.
+void quadtree_refine_node(Quadtree *from, u32 from_node, f32 node_sum, Quadtree *to, u32 to_node, u32 depth)
+{
+    for (u32 c = 0; c < 4; c++) {
+        f32 sum = node_sum / 4;
+        u32 from_child = QUADTREE_NO_NODE;
+        if (from_node != QUADTREE_NO_NODE) {
+            sum = from->nodes[from_node].sums[c];
+            if (from->nodes[from_node].children[c]) {
+                from_child = from->nodes[from_node].children[c];
+            }
+        }
+
+        if (depth < GUIDE_MAX_QUADTREE_DEPTH && sum > GUIDE_SUBDIVISION_FRACTION * from->total && to->nodes.size < U16_MAX) {
+            u32 child = to->nodes.size;
+            array_push(&to->nodes, {});
+            to->nodes[to_node].children[c] = (u16) child;
+
+            quadtree_refine_node(from, from_child, sum, to, child, depth + 1);
+        }
+    }
+}
+
+// Empties the tree to record into, with the structure the learned one calls for
+void quadtree_refine(Quadtree *from, Quadtree *to)
+{
+    quadtree_reset(to);
+    quadtree_refine_node(from, 0, from->total, to, 0, 1);
+}
+
+void guide_init(Guide *guide, Scene *scene)
+{
+    // Planes are not in the BVH, the camera keeps a scene of planes bounded
+    AABB bounds = merge(scene->bvh.bounds, scene->camera.position);
+    Vector3 margin = 0.01f * (bounds.max - bounds.min) + Vector3{1E-3f, 1E-3f, 1E-3f};
+
+    *guide = {.bounds = {bounds.min - margin, bounds.max + margin}};
+    for (u32 i = 0; i < GUIDE_NORMAL_DIRECTIONS; i++) {
+        array_push(&guide->nodes, {.leaf = i});
+
+        Guide_Leaf leaf = {.bsdf_fraction = 0.5f};
+        quadtree_reset(&leaf.building);
+        array_push(&guide->leaves, leaf);
+    }
+}
+
+void guide_free(Guide *guide)
+{
+    ARRAY_ITERATE(guide->leaves) {
+        array_free(&it->sampling.nodes);
+        array_free(&it->building.nodes);
+    }
+    array_free(&guide->leaves);
+    array_free(&guide->nodes);
+}
+
+// Learns from the pass that just ended, and prepares the next one
+void guide_update(Guide *guide)
+{
+    guide->num_updates++;
+
+    ARRAY_ITERATE(guide->leaves) {
+        // The recorded tree becomes the one to sample
+        quadtree_sum(&it->building);
+        Quadtree learned = it->building;
+        it->building = it->sampling;
+        it->sampling = learned;
+
+        // Gradient descent on the logit of the BRDF fraction
+        if (it->weight_sum > 0) {
+            f32 fraction = it->bsdf_fraction;
+            f32 gradient = -it->gradient_sum / it->weight_sum * fraction * (1 - fraction);
+            it->bsdf_logit = CLAMP(it->bsdf_logit - GUIDE_LEARNING_RATE * gradient, -GUIDE_MAX_LOGIT, GUIDE_MAX_LOGIT);
+            it->bsdf_fraction = 1.0f / (1.0f + expf(-it->bsdf_logit));
+        }
+        it->gradient_sum = 0;
+        it->weight_sum = 0;
+    }
+
+    // Split the leaves that saw many vertices, assuming they halve. Children
+    // are appended and split in turn by the same loop.
+    f32 threshold = GUIDE_SPATIAL_THRESHOLD * sqrtf((f32) (1u << MIN(guide->num_updates, 30)));
+    for (u32 i = 0; i < guide->nodes.size; i++) {
+        if (guide->nodes[i].children || guide->leaves[guide->nodes[i].leaf].num_samples <= threshold) {
+            continue;
+        }
+
+        u32 leaf_index = guide->nodes[i].leaf;
+        u32 axis = guide->nodes[i].axis;
+        Guide_Leaf *leaf = &guide->leaves[leaf_index];
+        leaf->num_samples /= 2;
+
+        Guide_Leaf other = *leaf;
+        other.sampling = quadtree_copy(&leaf->sampling);
+        other.building = {};
+
+        guide->nodes[i].children = guide->nodes.size;
+        array_push(&guide->nodes, {.leaf = leaf_index,          .axis = (axis + 1) % 3});
+        array_push(&guide->nodes, {.leaf = guide->leaves.size, .axis = (axis + 1) % 3});
+        array_push(&guide->leaves, other);
+    }
+
+    ARRAY_ITERATE(guide->leaves) {
+        quadtree_refine(&it->sampling, &it->building);
+        it->num_samples = 0;
+    }
+}
+
+// Renders scene->samples paths per pixel into the accumulation buffer, in
+// passes of 1, 2, 4... samples and a last one of the rest, and updates the
+// guide after every pass but the last. All passes are summed, each is an
+// unbiased estimate on its own. Scenes with caustic photons trace a photon map
+// for every pass.
+void render_guided(Thread_Pool *pool, Scene *scene, u64 seed, Vector3 *accumulation)
+{
+    Guide guide;
+    guide_init(&guide, scene);
+
+    Caustics caustics;
+    caustics_init(&caustics, scene);
+
+    u64 num_pixels = (u64) scene->width * scene->height;
+    Vector3 *pass = (Vector3 *) memory_allocate(MEMORY_FRAMEBUFFERS, num_pixels * sizeof(Vector3));
+    memset(accumulation, 0, num_pixels * sizeof(Vector3));
+
+    Scene pass_scene = *scene;
+    pass_scene.guide = &guide;
+    pass_scene.photon_map = scene->caustic_photons ? &caustics.map : nullptr;
+
+    u32 remaining = scene->samples;
+    for (u32 p = 0; remaining > 0; p++) {
+        // The pass after a short last one would not learn much more
+        u32 samples = MIN(1u << MIN(p, 30), remaining);
+        if (remaining - samples < 2 * samples) {
+            samples = remaining;
+        }
+        remaining -= samples;
+
+        pass_scene.samples = samples;
+        if (pass_scene.photon_map) {
+            caustics_pass(&caustics, pool, scene, ~seed + p * 0xD1B54A32D192ED03ull);
+        }
+        render_parallel(pool, &pass_scene, seed + p * 0xD1B54A32D192ED03ull, pass);
+        for (u64 i = 0; i < num_pixels; i++) {
+            accumulation[i] += pass[i];
+        }
+
+        if (remaining > 0) {
+            guide_update(&guide);
+        }
+    }
+
+    os_free(pass, num_pixels * sizeof(Vector3));
+    guide_free(&guide);
+    caustics_free(&caustics);
+}
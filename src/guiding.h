@@ -0,0 +1,95 @@
+#pragma once
+
+#include "math.h"
+
+// Path guiding (see guiding.cpp): a binary tree over space whose leaves hold
+// learned distributions of the incident radiance over directions. Those are
+// quadtrees over the unit square, which the cylindrical mapping takes to the
+// sphere of directions with a constant Jacobian of 4 pi.
+
+const u32 GUIDE_MAX_VERTICES = 16; // Diffuse vertices per path that train the guide
+
+// Child i covers x >= 0.5 if i & 1 and y >= 0.5 if i & 2 of the node's square.
+// Children that are not nodes themselves are leaves of the quadtree.
+struct Quadtree_Node
+{
+    f32 sums[4];     // Recorded radiance of every child
+    u16 children[4]; // Index of the child node, zero for leaves
+};
+
+struct Quadtree
+{
+    Array<Quadtree_Node> nodes; // The root first, children after their parents
+    f32 total;                  // Of the root sums, zero while nothing is learned
+};
+
+struct Guide_Leaf
+{
+    Quadtree sampling; // Learned on the passes before, read-only during a pass
+    Quadtree building; // Recorded into during a pass, atomically
+    u32 num_samples;   // Vertices recorded in the current pass
+
+    // Probability of sampling the BRDF instead of the quadtree, the logistic
+    // function of bsdf_logit. The gradient of the KL divergence from the
+    // mixture to the recorded radiance times the BRDF is summed during a pass
+    // and steps the logit at its end.
+    f32 bsdf_logit;
+    f32 bsdf_fraction;
+    f32 gradient_sum;
+    f32 weight_sum;
+};
+
+struct Guide_Node
+{
+    u32 children; // Index of the first of two children, zero for leaves
+    u32 leaf;     // Index into guide->leaves for leaves
+    u32 axis;     // The node is split in the middle of its bounds along this axis
+};
+
+struct Guide
+{
+    AABB bounds;
+    Array<Guide_Node> nodes; // The root first
+    Array<Guide_Leaf> leaves;
+    u32 num_updates;
+};
+
+// A diffuse vertex of a guided path, which trains its leaf once the radiance
+// that reached the camera through it is known
+struct Guide_Vertex
+{
+    Guide_Leaf *leaf;
+    f32 x, y;                 // Point of the unit square of the sampled direction
+    Vector3 throughput;       // Of the path before the vertex
+    Vector3 next_throughput;  // After it, in the sampled direction
+    Vector3 radiance;         // Of the path up to the vertex, with its next-event estimation
+    f32 pdf, bsdf_pdf, guide_pdf;
+};
+
+struct Guide_Path
+{
+    Guide_Vertex vertices[GUIDE_MAX_VERTICES];
+    u32 num_vertices;
+};
+
+inline f32 luminance(Vector3 color)
+{
+    return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
+inline void atomic_add_f32(f32 *address, f32 value)
+{
+    u32 *bits = (u32 *) address;
+    u32 expected = __atomic_load_n(bits, __ATOMIC_RELAXED);
+    for (;;) {
+        f32 sum;
+        memcpy(&sum, &expected, sizeof(f32));
+        sum += value;
+
+        u32 desired;
+        memcpy(&desired, &sum, sizeof(f32));
+        if (__atomic_compare_exchange_n(bits, &expected, desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,134 @@
+// Per pixel costs of a render, enabled by --heatmap.
+//
+// The scene runs kernels compiled with FEATURE_COSTS, which count the work of
+// every path into path_costs, and the pixel loop adds the counts and the TSC
+// cycles of every pixel to the heatmap. Without --heatmap those kernels are
+// never selected, so the render kernels do not count anything.
+//
+// Every cost is written as a false colour PPM, scaled to its 99th percentile
+// so that a few outliers do not leave the rest black, and as a greyscale PFM of
+// the raw floats.
+
+enum Heatmap_Channel
+{
+    HEATMAP_CYCLES,
+    HEATMAP_PRIMITIVE_TESTS,
+    HEATMAP_BOUNCES,
+    HEATMAP_LIGHT_PDFS,
+
+    HEATMAP_CHANNEL_COUNT
+};
+
+const char *HEATMAP_CHANNEL_NAMES[HEATMAP_CHANNEL_COUNT] = {"cycles", "tests", "bounces", "light_pdfs"};
+
+struct Heatmap
+{
+    u32 width, height;
+    f32 *channels[HEATMAP_CHANNEL_COUNT]; // Totals over the samples of every pixel
+};
+
+void heatmap_init(Heatmap *heatmap, u32 width, u32 height)
+{
+    *heatmap = {.width = width, .height = height};
+    for (u32 c = 0; c < HEATMAP_CHANNEL_COUNT; c++) {
+        heatmap->channels[c] = (f32 *) memory_allocate(MEMORY_FRAMEBUFFERS, (u64) width * height * sizeof(f32));
+    }
+
+    path_costs = {};
+}
+
+void heatmap_free(Heatmap *heatmap)
+{
+    for (u32 c = 0; c < HEATMAP_CHANNEL_COUNT; c++) {
+        os_free(heatmap->channels[c], (u64) heatmap->width * heatmap->height * sizeof(f32));
+    }
+}
+
+// The kernels of the scene with the same code as those select_kernels picks,
+// plus the counting
+void select_cost_kernels(Scene *scene)
+{
+    scene->kernels = ISA_COST_KERNELS[instruction_set];
+}
+
+// Takes the costs that the paths of the pixel counted on this thread
+void heatmap_record(Heatmap *heatmap, u32 pixel, u64 cycles)
+{
+    heatmap->channels[HEATMAP_CYCLES][pixel]          = (f32) cycles;
+    heatmap->channels[HEATMAP_PRIMITIVE_TESTS][pixel] = (f32) path_costs.primitive_tests;
+    heatmap->channels[HEATMAP_BOUNCES][pixel]         = (f32) path_costs.bounces;
+    heatmap->channels[HEATMAP_LIGHT_PDFS][pixel]      = (f32) path_costs.light_pdfs;
+
+    path_costs = {};
+}
+
+// Black through blue, red and yellow to white
+Vector3 heat_color(f32 t)
+{
+    const Vector3 STOPS[] = {{0, 0, 0}, {0, 0, 1}, {1, 0, 0}, {1, 1, 0}, {1, 1, 1}};
+
+    f32 x = CLAMP(t, 0.0f, 1.0f) * (array_size(STOPS) - 1);
+    u32 i = MIN((u32) x, array_size(STOPS) - 2);
+
+    return lerp(STOPS[i], STOPS[i + 1], x - i);
+}
+
+// Greyscale PFM, whose rows go from the bottom up
+void write_pfm(const char *file_name, u32 width, u32 height, f32 *values)
+{
+    FILE *file = fopen(file_name, "wb");
+    if (!file) {
+        printf("Could not open file `%s` for writing.", file_name);
+        return;
+    }
+
+    fprintf(file, "Pf\n%u %u\n-1.0\n", width, height); // A negative scale for little endian
+    for (u32 y = height; y-- > 0;) {
+        fwrite(&values[(u64) y * width], sizeof(f32), width, file);
+    }
+
+    fclose(file);
+}
+
+void write_heatmap(Heatmap *heatmap, const char *name)
+{
+    u64 num_pixels = (u64) heatmap->width * heatmap->height;
+    f32 *sorted = (f32 *) os_allocate(num_pixels * sizeof(f32));
+    u8 *pixels = (u8 *) os_allocate(3 * num_pixels);
+
+    for (u32 c = 0; c < HEATMAP_CHANNEL_COUNT; c++) {
+        f32 *values = heatmap->channels[c];
+
+        f64 sum = 0;
+        for (u64 i = 0; i < num_pixels; i++) {
+            sum += values[i];
+        }
+
+        memcpy(sorted, values, num_pixels * sizeof(f32));
+        qsort(sorted, num_pixels, sizeof(f32), [] (const void *a, const void *b) {
+            f32 difference = *(f32 *) a - *(f32 *) b;
+            return difference < 0 ? -1 : (difference > 0 ? 1 : 0);
+        });
+        f32 percentile = sorted[(num_pixels - 1) * 99 / 100];
+        f32 scale = percentile > 0 ? percentile : MAX(sorted[num_pixels - 1], 1.0f);
+
+        for (u64 i = 0; i < num_pixels; i++) {
+            Vector3 color = heat_color(values[i] / scale);
+            pixels[3 * i + 0] = ROUND_COLOR(color.r);
+            pixels[3 * i + 1] = ROUND_COLOR(color.g);
+            pixels[3 * i + 2] = ROUND_COLOR(color.b);
+        }
+
+        char file_name[1024];
+        snprintf(file_name, sizeof(file_name), "%s_%s.ppm", name, HEATMAP_CHANNEL_NAMES[c]);
+        write_ppm(file_name, heatmap->width, heatmap->height, pixels);
+        snprintf(file_name, sizeof(file_name), "%s_%s.pfm", name, HEATMAP_CHANNEL_NAMES[c]);
+        write_pfm(file_name, heatmap->width, heatmap->height, values);
+
+        printf("Heatmap %-10s mean %12.1f, 99th percentile %12.1f, max %12.1f per pixel.\n",
+            HEATMAP_CHANNEL_NAMES[c], sum / num_pixels, percentile, sorted[num_pixels - 1]);
+    }
+
+    os_free(sorted, num_pixels * sizeof(f32));
+    os_free(pixels, 3 * num_pixels);
+}
@@ -0,0 +1,842 @@
+// Image output in the format of the extension of the path: PNG, QOI or PPM.
+//
+// PNG is split into bands of rows that are filtered and deflated on their own,
+// on all threads of a pool. Every band ends byte aligned with an empty stored
+// block, a sync flush, so the bands concatenate into one zlib stream, and every
+// band is an IDAT chunk with its own CRC. The Adler-32 of the stream is combined
+// from those of the bands and written as a last IDAT chunk of four bytes.
+// Matches do not reach into the band before, which costs little for bands of
+// a megabyte.
+//
+// QOI is sequential but an order of magnitude faster than deflate. Both encoders
+// read the pixels straight from the framebuffer.
+
+const u32 PNG_BAND_BYTES = 1 << 20; // Filtered bytes per band, at least one row
+
+const u32 DEFLATE_WINDOW       = 1 << 15;
+const u32 DEFLATE_HASH_BITS    = 15;
+const u32 DEFLATE_MAX_CHAIN    = 16;      // Candidates tried per match
+const u32 DEFLATE_BLOCK_TOKENS = 1 << 15; // Literals and matches per Huffman block
+const u32 DEFLATE_MIN_MATCH    = 3;
+const u32 DEFLATE_MAX_MATCH    = 258;
+const u32 DEFLATE_NO_POSITION  = U32_MAX;
+
+const u16 DEFLATE_LENGTH_BASE[29]    = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const u8  DEFLATE_LENGTH_EXTRA[29]   = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const u16 DEFLATE_DISTANCE_BASE[30]  = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const u8  DEFLATE_DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+const u8  DEFLATE_CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Lookup tables, filled once before the first PNG
+struct Png_Tables
+{
+    bool initialized;
+    u32  crc[256];
+    u8   length_codes[DEFLATE_MAX_MATCH + 1]; // Index into DEFLATE_LENGTH_BASE by match length
+    u8   distance_codes[512];                 // By distance - 1 below 256, and 256 + (distance - 1) / 128 above
+};
+
+Png_Tables png_tables;
+
+void png_init_tables()
+{
+    if (png_tables.initialized) {
+        return;
+    }
+
+    for (u32 i = 0; i < 256; i++) {
+        u32 c = i;
+        for (u32 k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        png_tables.crc[i] = c;
+    }
+
+    for (u32 code = 0; code < 29; code++) {
+        u32 end = code + 1 < 29 ? DEFLATE_LENGTH_BASE[code + 1] : DEFLATE_MAX_MATCH + 1;
+        for (u32 length = DEFLATE_LENGTH_BASE[code]; length < end; length++) {
+            png_tables.length_codes[length] = (u8) code;
+        }
+    }
+    png_tables.length_codes[DEFLATE_MAX_MATCH] = 28;
+
+    for (u32 code = 0; code < 30; code++) {
+        for (u32 d = DEFLATE_DISTANCE_BASE[code] - 1; d < DEFLATE_DISTANCE_BASE[code] - 1 + (1u << DEFLATE_DISTANCE_EXTRA[code]); d++) {
+            if (d < 256) {
+                png_tables.distance_codes[d] = (u8) code;
+            } else {
+                png_tables.distance_codes[256 + (d >> 7)] = (u8) code;
+            }
+        }
+    }
+
+    png_tables.initialized = true;
+}
+
+u32 crc32_update(u32 crc, u8 *data, u64 size)
+{
+    for (u64 i = 0; i < size; i++) {
+        crc = png_tables.crc[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+const u32 ADLER_MODULUS = 65521;
+
+u32 adler32_update(u32 adler, u8 *data, u64 size)
+{
+    u32 a = adler & 0xFFFF;
+    u32 b = adler >> 16;
+    while (size > 0) {
+        // The largest run whose sums cannot overflow before the modulo
+        u32 run = (u32) MIN(size, 5552);
+        for (u32 i = 0; i < run; i++) {
+            a += data[i];
+            b += a;
+        }
+
+        a %= ADLER_MODULUS;
+        b %= ADLER_MODULUS;
+        data += run;
+        size -= run;
+    }
+
+    return a | (b << 16);
+}
+
+// Adler-32 of two concatenated buffers, from the checksums of both and the size of the second
+u32 adler32_combine(u32 first, u32 second, u64 second_size)
+{
+    u64 remainder = second_size % ADLER_MODULUS;
+    u64 a = (first & 0xFFFF) + (second & 0xFFFF) + ADLER_MODULUS - 1;
+    u64 b = remainder * (first & 0xFFFF) % ADLER_MODULUS + (first >> 16) + (second >> 16) + ADLER_MODULUS - remainder;
+
+    return (u32) (a % ADLER_MODULUS) | (u32) (b % ADLER_MODULUS) << 16;
+}
+
+void store_be32(u8 *out, u32 value)
+{
+    out[0] = (u8) (value >> 24);
+    out[1] = (u8) (value >> 16);
+    out[2] = (u8) (value >> 8);
+    out[3] = (u8) value;
+}
+
+// Least significant bit first, as deflate wants it
+struct Bit_Writer
+{
+    u8 *out;
+    u64 bits;
+    u32 count;
+};
+
+FORCE_INLINE void put_bits(Bit_Writer *writer, u32 value, u32 count)
+{
+    writer->bits |= (u64) value << writer->count;
+    writer->count += count;
+    if (writer->count >= 32) {
+        u32 low = (u32) writer->bits;
+        memcpy(writer->out, &low, 4);
+        writer->out   += 4;
+        writer->bits >>= 32;
+        writer->count -= 32;
+    }
+}
+
+// Pads to a byte boundary and writes out the bits
+void flush_bits(Bit_Writer *writer)
+{
+    while (writer->count > 0) {
+        *writer->out++ = (u8) writer->bits;
+        writer->bits >>= 8;
+        writer->count = writer->count > 8 ? writer->count - 8 : 0;
+    }
+    writer->bits = 0;
+}
+
+// Code lengths of a Huffman code for the frequencies, none longer than
+// max_length. Frequencies are halved until the tree is shallow enough.
+void huffman_lengths(u32 *frequencies, u32 count, u32 max_length, u8 *lengths)
+{
+    u32 symbols[288];
+    u32 weights[2 * 288];
+    u32 parents[2 * 288];
+    u32 depths[2 * 288];
+
+    u32 n = 0;
+    for (u32 s = 0; s < count; s++) {
+        lengths[s] = 0;
+        if (frequencies[s] > 0) {
+            symbols[n++] = s;
+        }
+    }
+
+    // Deflate decoders want complete codes, so one symbol gets a sibling
+    if (n < 2) {
+        lengths[n == 1 && symbols[0] == 0 ? 1 : 0] = 1;
+        lengths[n == 1 ? symbols[0] : 1] = 1;
+        return;
+    }
+
+    // Insertion sort by frequency, there are few symbols
+    for (u32 i = 1; i < n; i++) {
+        u32 symbol = symbols[i];
+        u32 j = i;
+        while (j > 0 && frequencies[symbols[j - 1]] > frequencies[symbol]) {
+            symbols[j] = symbols[j - 1];
+            j--;
+        }
+        symbols[j] = symbol;
+    }
+
+    for (u32 i = 0; i < n; i++) {
+        weights[i] = frequencies[symbols[i]];
+    }
+
+    for (;;) {
+        // Leaves are sorted and internal nodes are made in increasing order,
+        // so the two lightest nodes are always at the front of either queue
+        u32 leaf = 0, internal = n;
+        for (u32 next = n; next < 2 * n - 1; next++) {
+            u32 children[2];
+            for (u32 k = 0; k < 2; k++) {
+                if (leaf < n && (internal >= next || weights[leaf] <= weights[internal])) {
+                    children[k] = leaf++;
+                } else {
+                    children[k] = internal++;
+                }
+            }
+
+            weights[next] = weights[children[0]] + weights[children[1]];
+            parents[children[0]] = next;
+            parents[children[1]] = next;
+        }
+
+        u32 deepest = 0;
+        depths[2 * n - 2] = 0;
+        for (s32 i = 2 * n - 3; i >= 0; i--) {
+            depths[i] = depths[parents[i]] + 1;
+            deepest = MAX(deepest, depths[i]);
+        }
+
+        if (deepest <= max_length) {
+            break;
+        }
+
+        // Halving keeps the leaves sorted
+        for (u32 i = 0; i < n; i++) {
+            weights[i] = (weights[i] >> 1) | 1;
+        }
+    }
+
+    for (u32 i = 0; i < n; i++) {
+        lengths[symbols[i]] = (u8) depths[i];
+    }
+}
+
+// Canonical codes for the lengths, bit reversed for the bit writer
+void huffman_codes(u8 *lengths, u32 count, u16 *codes)
+{
+    u32 length_counts[16] = {};
+    for (u32 s = 0; s < count; s++) {
+        length_counts[lengths[s]]++;
+    }
+    length_counts[0] = 0;
+
+    u32 next_code[16];
+    u32 code = 0;
+    for (u32 bits = 1; bits < 16; bits++) {
+        code = (code + length_counts[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+
+    for (u32 s = 0; s < count; s++) {
+        u32 length = lengths[s];
+        if (length == 0) {
+            continue;
+        }
+
+        u32 c = next_code[length]++;
+        u32 reversed = 0;
+        for (u32 i = 0; i < length; i++) {
+            reversed = (reversed << 1) | ((c >> i) & 1);
+        }
+        codes[s] = (u16) reversed;
+    }
+}
+
+// A literal when distance is zero
+struct Deflate_Token
+{
+    u16 value; // Literal byte or match length
+    u16 distance;
+};
+
+// Per thread state of the PNG encoder
+struct Png_Scratch
+{
+    u8 *filtered; // Filter bytes and filtered rows of the band
+    u32 *head;    // Last position of each hash
+    u32 *chain;   // Position before with the same hash, by position in the window
+    Deflate_Token *tokens;
+};
+
+// Writes one dynamic Huffman block of the tokens, or stored blocks of the raw
+// bytes they cover if those are smaller
+void deflate_block(Bit_Writer *writer, Deflate_Token *tokens, u32 num_tokens, u8 *raw, u32 raw_size, bool final)
+{
+    u32 literal_frequencies[286] = {};
+    u32 distance_frequencies[30] = {};
+    for (u32 i = 0; i < num_tokens; i++) {
+        Deflate_Token token = tokens[i];
+        if (token.distance == 0) {
+            literal_frequencies[token.value]++;
+        } else {
+            literal_frequencies[257 + png_tables.length_codes[token.value]]++;
+            u32 d = token.distance - 1;
+            distance_frequencies[d < 256 ? png_tables.distance_codes[d] : png_tables.distance_codes[256 + (d >> 7)]]++;
+        }
+    }
+    literal_frequencies[256] = 1;
+
+    u8 literal_lengths[286], distance_lengths[30];
+    huffman_lengths(literal_frequencies, 286, 15, literal_lengths);
+    huffman_lengths(distance_frequencies, 30, 15, distance_lengths);
+
+    u32 num_literal_codes = 286;
+    while (num_literal_codes > 257 && literal_lengths[num_literal_codes - 1] == 0) {
+        num_literal_codes--;
+    }
+    u32 num_distance_codes = 30;
+    while (num_distance_codes > 1 && distance_lengths[num_distance_codes - 1] == 0) {
+        num_distance_codes--;
+    }
+
+    // Run length code the concatenated code lengths into symbols 0-18 with their extra bits
+    u8 all_lengths[286 + 30];
+    memcpy(all_lengths, literal_lengths, num_literal_codes);
+    memcpy(all_lengths + num_literal_codes, distance_lengths, num_distance_codes);
+    u32 num_lengths = num_literal_codes + num_distance_codes;
+
+    u8  runs[286 + 30], run_extras[286 + 30];
+    u32 num_runs = 0;
+    u32 length_frequencies[19] = {};
+    for (u32 i = 0; i < num_lengths;) {
+        u8  length = all_lengths[i];
+        u32 repeat = 1;
+        while (i + repeat < num_lengths && all_lengths[i + repeat] == length) {
+            repeat++;
+        }
+
+        u32 used = 1;
+        u8  symbol = length, extra = 0;
+        if (length == 0 && repeat >= 11) {
+            used = MIN(repeat, 138);
+            symbol = 18;
+            extra = (u8) (used - 11);
+        } else if (length == 0 && repeat >= 3) {
+            used = repeat;
+            symbol = 17;
+            extra = (u8) (used - 3);
+        } else if (length != 0 && i > 0 && all_lengths[i - 1] == length && repeat >= 3) {
+            used = MIN(repeat, 6);
+            symbol = 16;
+            extra = (u8) (used - 3);
+        }
+
+        runs[num_runs] = symbol;
+        run_extras[num_runs] = extra;
+        num_runs++;
+        length_frequencies[symbol]++;
+        i += used;
+    }
+
+    u8  length_lengths[19];
+    u16 length_codes[19];
+    huffman_lengths(length_frequencies, 19, 7, length_lengths);
+    huffman_codes(length_lengths, 19, length_codes);
+
+    u32 num_length_codes = 19;
+    while (num_length_codes > 4 && length_lengths[DEFLATE_CODE_LENGTH_ORDER[num_length_codes - 1]] == 0) {
+        num_length_codes--;
+    }
+
+    u64 dynamic_bits = 3 + 14 + 3 * num_length_codes;
+    for (u32 i = 0; i < num_runs; i++) {
+        u8 symbol = runs[i];
+        dynamic_bits += length_lengths[symbol] + (symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0);
+    }
+    for (u32 s = 0; s < 286; s++) {
+        dynamic_bits += (u64) literal_frequencies[s] * (literal_lengths[s] + (s > 256 ? DEFLATE_LENGTH_EXTRA[s - 257] : 0));
+    }
+    for (u32 s = 0; s < 30; s++) {
+        dynamic_bits += (u64) distance_frequencies[s] * (distance_lengths[s] + DEFLATE_DISTANCE_EXTRA[s]);
+    }
+
+    u64 stored_bits = 8 * (raw_size + 5 * (u64) DIV_UP(MAX(raw_size, 1), 65535)) + 7;
+    if (stored_bits < dynamic_bits) {
+        u32 offset = 0;
+        do {
+            u32 size = MIN(raw_size - offset, 65535);
+            bool last = offset + size == raw_size;
+
+            put_bits(writer, last && final, 3);
+            flush_bits(writer);
+            writer->out[0] = (u8) size;
+            writer->out[1] = (u8) (size >> 8);
+            writer->out[2] = (u8) ~size;
+            writer->out[3] = (u8) (~size >> 8);
+            memcpy(writer->out + 4, raw + offset, size);
+            writer->out += 4 + size;
+
+            offset += size;
+        } while (offset < raw_size);
+        return;
+    }
+
+    u16 literal_codes[286], distance_codes[30];
+    huffman_codes(literal_lengths, 286, literal_codes);
+    huffman_codes(distance_lengths, 30, distance_codes);
+
+    put_bits(writer, final | (2 << 1), 3);
+    put_bits(writer, num_literal_codes - 257, 5);
+    put_bits(writer, num_distance_codes - 1, 5);
+    put_bits(writer, num_length_codes - 4, 4);
+    for (u32 i = 0; i < num_length_codes; i++) {
+        put_bits(writer, length_lengths[DEFLATE_CODE_LENGTH_ORDER[i]], 3);
+    }
+    for (u32 i = 0; i < num_runs; i++) {
+        u8 symbol = runs[i];
+        put_bits(writer, length_codes[symbol], length_lengths[symbol]);
+        if (symbol >= 16) {
+            put_bits(writer, run_extras[i], symbol == 16 ? 2 : symbol == 17 ? 3 : 7);
+        }
+    }
+
+    for (u32 i = 0; i < num_tokens; i++) {
+        Deflate_Token token = tokens[i];
+        if (token.distance == 0) {
+            put_bits(writer, literal_codes[token.value], literal_lengths[token.value]);
+            continue;
+        }
+
+        u32 length_code = png_tables.length_codes[token.value];
+        put_bits(writer, literal_codes[257 + length_code], literal_lengths[257 + length_code]);
+        put_bits(writer, token.value - DEFLATE_LENGTH_BASE[length_code], DEFLATE_LENGTH_EXTRA[length_code]);
+
+        u32 d = token.distance - 1;
+        u32 distance_code = d < 256 ? png_tables.distance_codes[d] : png_tables.distance_codes[256 + (d >> 7)];
+        put_bits(writer, distance_codes[distance_code], distance_lengths[distance_code]);
+        put_bits(writer, token.distance - DEFLATE_DISTANCE_BASE[distance_code], DEFLATE_DISTANCE_EXTRA[distance_code]);
+    }
+    put_bits(writer, literal_codes[256], literal_lengths[256]);
+}
+
+FORCE_INLINE u32 deflate_hash(u8 *data)
+{
+    u32 bytes = data[0] | (data[1] << 8) | (data[2] << 16);
+    return (bytes * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+FORCE_INLINE u32 match_length(u8 *a, u8 *b, u32 max_length)
+{
+    u32 length = 0;
+    while (length + 8 <= max_length) {
+        u64 x, y;
+        memcpy(&x, a + length, 8);
+        memcpy(&y, b + length, 8);
+        if (x != y) {
+            return length + __builtin_ctzll(x ^ y) / 8;
+        }
+        length += 8;
+    }
+
+    while (length < max_length && a[length] == b[length]) {
+        length++;
+    }
+
+    return length;
+}
+
+// Compresses the data into deflate blocks with greedy hash chain matching,
+// ending with the final block or with a sync flush
+void deflate(Png_Scratch *scratch, u8 *data, u32 size, bool final, Bit_Writer *writer)
+{
+    for (u32 i = 0; i < (1u << DEFLATE_HASH_BITS); i++) {
+        scratch->head[i] = DEFLATE_NO_POSITION;
+    }
+
+    u32 num_tokens = 0;
+    u32 block_start = 0;
+    u32 position = 0;
+    while (position < size) {
+        u32 best_length = 0, best_distance = 0;
+        if (position + DEFLATE_MIN_MATCH <= size) {
+            u32 hash = deflate_hash(data + position);
+            u32 candidate = scratch->head[hash];
+            scratch->head[hash] = position;
+            scratch->chain[position % DEFLATE_WINDOW] = candidate;
+
+            u32 max_length = MIN(size - position, DEFLATE_MAX_MATCH);
+            for (u32 tries = 0; tries < DEFLATE_MAX_CHAIN && candidate != DEFLATE_NO_POSITION; tries++) {
+                u32 distance = position - candidate;
+                if (distance >= DEFLATE_WINDOW) {
+                    break;
+                }
+
+                if (data[candidate + best_length] == data[position + best_length]) {
+                    u32 length = match_length(data + candidate, data + position, max_length);
+                    if (length > best_length) {
+                        best_length   = length;
+                        best_distance = distance;
+                        if (length == max_length) {
+                            break;
+                        }
+                    }
+                }
+
+                candidate = scratch->chain[candidate % DEFLATE_WINDOW];
+            }
+        }
+
+        if (best_length >= DEFLATE_MIN_MATCH) {
+            scratch->tokens[num_tokens++] = {(u16) best_length, (u16) best_distance};
+
+            // Skipped positions still go into the chains
+            u32 end = position + best_length;
+            for (position++; position < end; position++) {
+                if (position + DEFLATE_MIN_MATCH <= size) {
+                    u32 hash = deflate_hash(data + position);
+                    scratch->chain[position % DEFLATE_WINDOW] = scratch->head[hash];
+                    scratch->head[hash] = position;
+                }
+            }
+        } else {
+            scratch->tokens[num_tokens++] = {data[position], 0};
+            position++;
+        }
+
+        if (num_tokens == DEFLATE_BLOCK_TOKENS) {
+            deflate_block(writer, scratch->tokens, num_tokens, data + block_start, position - block_start, final && position == size);
+            num_tokens = 0;
+            block_start = position;
+        }
+    }
+
+    if (num_tokens > 0 || block_start == 0) {
+        deflate_block(writer, scratch->tokens, num_tokens, data + block_start, position - block_start, final);
+    }
+
+    if (!final) {
+        // Sync flush: an empty stored block
+        put_bits(writer, 0, 3);
+        flush_bits(writer);
+        memcpy(writer->out, "\x00\x00\xFF\xFF", 4);
+        writer->out += 4;
+    } else {
+        flush_bits(writer);
+    }
+}
+
+FORCE_INLINE u8 paeth(u8 a, u8 b, u8 c)
+{
+    s32 p  = a + b - c;
+    s32 pa = abs(p - a);
+    s32 pb = abs(p - b);
+    s32 pc = abs(p - c);
+
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Filters a row with the filter that gives the smallest sum of absolute
+// residuals, the usual heuristic. Above is null for the first row.
+void png_filter_row(u8 *row, u8 *above, u32 size, u8 *out)
+{
+    u32 sums[5] = {};
+    for (u32 i = 0; i < size; i++) {
+        u8 x = row[i];
+        u8 a = i >= 3 ? row[i - 3] : 0;
+        u8 b = above ? above[i] : 0;
+        u8 c = above && i >= 3 ? above[i - 3] : 0;
+
+        sums[0] += abs((s8) x);
+        sums[1] += abs((s8) (x - a));
+        sums[2] += abs((s8) (x - b));
+        sums[3] += abs((s8) (x - ((a + b) >> 1)));
+        sums[4] += abs((s8) (x - paeth(a, b, c)));
+    }
+
+    u32 filter = 0;
+    for (u32 f = 1; f < 5; f++) {
+        if (sums[f] < sums[filter]) {
+            filter = f;
+        }
+    }
+
+    out[0] = (u8) filter;
+    out++;
+    for (u32 i = 0; i < size; i++) {
+        u8 x = row[i];
+        u8 a = i >= 3 ? row[i - 3] : 0;
+        u8 b = above ? above[i] : 0;
+        u8 c = above && i >= 3 ? above[i - 3] : 0;
+
+        u8 prediction = 0;
+        switch (filter) {
+            case 1: prediction = a;                   break;
+            case 2: prediction = b;                   break;
+            case 3: prediction = (u8) ((a + b) >> 1); break;
+            case 4: prediction = paeth(a, b, c);      break;
+        }
+        out[i] = (u8) (x - prediction);
+    }
+}
+
+struct Png_Band
+{
+    u8 *chunk; // Length, type, data and CRC of the IDAT chunk
+    u32 chunk_size;
+    u32 capacity;
+    u32 adler;
+    u32 filtered_size;
+};
+
+void write_png(Thread_Pool *pool, const char *file_name, u32 width, u32 height, u8 *pixels)
+{
+    FILE *file = fopen(file_name, "wb");
+    if (!file) {
+        printf("Could not open file `%s` for writing.", file_name);
+        return;
+    }
+
+    png_init_tables();
+
+    u32 row_size = 3 * width;
+    u32 rows_per_band = MAX(PNG_BAND_BYTES / (row_size + 1), 1);
+    u32 num_bands = DIV_UP(height, rows_per_band);
+
+    u32 band_capacity = rows_per_band * (row_size + 1);
+    Png_Scratch *scratch = (Png_Scratch *) os_allocate(pool->num_threads * sizeof(Png_Scratch));
+    for (u32 t = 0; t < pool->num_threads; t++) {
+        scratch[t] = {
+            .filtered = (u8 *)  os_allocate(band_capacity),
+            .head     = (u32 *) os_allocate((1u << DEFLATE_HASH_BITS) * sizeof(u32)),
+            .chain    = (u32 *) os_allocate(DEFLATE_WINDOW * sizeof(u32)),
+            .tokens   = (Deflate_Token *) os_allocate(DEFLATE_BLOCK_TOKENS * sizeof(Deflate_Token)),
+        };
+    }
+
+    // Stored blocks bound the compressed size: 5 bytes per 64 KiB, a block of
+    // at least one byte per DEFLATE_BLOCK_TOKENS tokens, and the flush
+    Png_Band *bands = (Png_Band *) os_allocate(num_bands * sizeof(Png_Band));
+    for (u32 i = 0; i < num_bands; i++) {
+        bands[i].capacity = band_capacity + band_capacity / 1024 + 64;
+        bands[i].chunk = (u8 *) os_allocate(bands[i].capacity);
+    }
+
+    parallel_for(pool, num_bands, [&] (u32 band_index, u32 thread_index) {
+        Png_Scratch *s = &scratch[thread_index];
+        Png_Band *band = &bands[band_index];
+
+        u32 y_min = band_index * rows_per_band;
+        u32 y_max = MIN(y_min + rows_per_band, height);
+        for (u32 y = y_min; y < y_max; y++) {
+            u8 *row = pixels + (u64) y * row_size;
+            png_filter_row(row, y > 0 ? row - row_size : nullptr, row_size, s->filtered + (y - y_min) * (row_size + 1));
+        }
+
+        band->filtered_size = (y_max - y_min) * (row_size + 1);
+        band->adler = adler32_update(1, s->filtered, band->filtered_size);
+
+        Bit_Writer writer = {.out = band->chunk + 8};
+        if (band_index == 0) {
+            // zlib header: deflate with a 32 KiB window, no dictionary
+            writer.out[0] = 0x78;
+            writer.out[1] = 0x01;
+            writer.out += 2;
+        }
+        deflate(s, s->filtered, band->filtered_size, band_index + 1 == num_bands, &writer);
+
+        u32 data_size = (u32) (writer.out - band->chunk) - 8;
+        ASSERT(data_size + 12 <= band->capacity);
+        store_be32(band->chunk, data_size);
+        memcpy(band->chunk + 4, "IDAT", 4);
+        store_be32(band->chunk + 8 + data_size, crc32_update(U32_MAX, band->chunk + 4, data_size + 4) ^ U32_MAX);
+        band->chunk_size = data_size + 12;
+    });
+
+    u8 header[8 + 25] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    u8 *ihdr = header + 8;
+    store_be32(ihdr, 13);
+    memcpy(ihdr + 4, "IHDR", 4);
+    store_be32(ihdr + 8, width);
+    store_be32(ihdr + 12, height);
+    ihdr[16] = 8; // Bits per channel
+    ihdr[17] = 2; // RGB
+    ihdr[18] = 0; // Deflate
+    ihdr[19] = 0; // Adaptive filters
+    ihdr[20] = 0; // Not interlaced
+    store_be32(ihdr + 21, crc32_update(U32_MAX, ihdr + 4, 17) ^ U32_MAX);
+    fwrite(header, 1, sizeof(header), file);
+
+    u32 adler = 1;
+    for (u32 i = 0; i < num_bands; i++) {
+        fwrite(bands[i].chunk, 1, bands[i].chunk_size, file);
+        adler = i == 0 ? bands[i].adler : adler32_combine(adler, bands[i].adler, bands[i].filtered_size);
+        os_free(bands[i].chunk, bands[i].capacity);
+    }
+
+    u8 trailer[16 + 12];
+    store_be32(trailer, 4);
+    memcpy(trailer + 4, "IDAT", 4);
+    store_be32(trailer + 8, adler);
+    store_be32(trailer + 12, crc32_update(U32_MAX, trailer + 4, 8) ^ U32_MAX);
+    store_be32(trailer + 16, 0);
+    memcpy(trailer + 20, "IEND", 4);
+    store_be32(trailer + 24, crc32_update(U32_MAX, trailer + 20, 4) ^ U32_MAX);
+    fwrite(trailer, 1, sizeof(trailer), file);
+
+    fclose(file);
+
+    os_free(bands, num_bands * sizeof(Png_Band));
+    for (u32 t = 0; t < pool->num_threads; t++) {
+        os_free(scratch[t].filtered, band_capacity);
+        os_free(scratch[t].head,     (1u << DEFLATE_HASH_BITS) * sizeof(u32));
+        os_free(scratch[t].chain,    DEFLATE_WINDOW * sizeof(u32));
+        os_free(scratch[t].tokens,   DEFLATE_BLOCK_TOKENS * sizeof(Deflate_Token));
+    }
+    os_free(scratch, pool->num_threads * sizeof(Png_Scratch));
+}
+
+const u32 QOI_BUFFER_SIZE = 1 << 16;
+
+// https://qoiformat.org/qoi-specification.pdf, written through a small buffer
+void write_qoi(const char *file_name, u32 width, u32 height, u8 *pixels)
+{
+    FILE *file = fopen(file_name, "wb");
+    if (!file) {
+        printf("Could not open file `%s` for writing.", file_name);
+        return;
+    }
+
+    u8 buffer[QOI_BUFFER_SIZE];
+    u8 *out = buffer;
+
+    memcpy(out, "qoif", 4);
+    store_be32(out + 4, width);
+    store_be32(out + 8, height);
+    out[12] = 3; // RGB
+    out[13] = 0; // sRGB
+    out += 14;
+
+    u8  index[64][3] = {};
+    u8  previous[3] = {0, 0, 0};
+    u32 run = 0;
+
+    u64 num_pixels = (u64) width * height;
+    for (u64 i = 0; i < num_pixels; i++) {
+        // The longest op is 4 bytes
+        if (out > buffer + QOI_BUFFER_SIZE - 4) {
+            fwrite(buffer, 1, out - buffer, file);
+            out = buffer;
+        }
+
+        u8 *pixel = pixels + 3 * i;
+        u8 r = pixel[0], g = pixel[1], b = pixel[2];
+
+        if (r == previous[0] && g == previous[1] && b == previous[2]) {
+            run++;
+            if (run == 62 || i + 1 == num_pixels) {
+                *out++ = (u8) (0xC0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0) {
+            *out++ = (u8) (0xC0 | (run - 1));
+            run = 0;
+        }
+
+        // Alpha is always 255
+        u32 hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+        if (index[hash][0] == r && index[hash][1] == g && index[hash][2] == b) {
+            *out++ = (u8) hash;
+        } else {
+            index[hash][0] = r;
+            index[hash][1] = g;
+            index[hash][2] = b;
+
+            s8 dr = (s8) (r - previous[0]);
+            s8 dg = (s8) (g - previous[1]);
+            s8 db = (s8) (b - previous[2]);
+            s8 dr_dg = (s8) (dr - dg);
+            s8 db_dg = (s8) (db - dg);
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                *out++ = (u8) (0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dr_dg >= -8 && dr_dg <= 7 && dg >= -32 && dg <= 31 && db_dg >= -8 && db_dg <= 7) {
+                *out++ = (u8) (0x80 | (dg + 32));
+                *out++ = (u8) ((dr_dg + 8) << 4 | (db_dg + 8));
+            } else {
+                out[0] = 0xFE;
+                out[1] = r;
+                out[2] = g;
+                out[3] = b;
+                out += 4;
+            }
+        }
+
+        previous[0] = r;
+        previous[1] = g;
+        previous[2] = b;
+    }
+
+    fwrite(buffer, 1, out - buffer, file);
+    fwrite("\0\0\0\0\0\0\0\1", 1, 8, file);
+
+    fclose(file);
+}
+
+bool has_extension(const char *file_name, const char *extension)
+{
+    const char *dot = strrchr(file_name, '.');
+    if (!dot || strpbrk(dot, "/\\")) {
+        return false;
+    }
+
+    for (u32 i = 0;; i++) {
+        char c = dot[i + 1];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        if (c != extension[i]) {
+            return false;
+        }
+        if (c == '\0') {
+            return true;
+        }
+    }
+}
+
+// Writes the pixels as PNG or QOI by the extension of the file, PPM for any
+// other. PNG compresses on the threads of the pool, or of a pool of its own
+// without one.
+void write_image(Thread_Pool *pool, const char *file_name, u32 width, u32 height, u8 *pixels)
+{
+    if (has_extension(file_name, "png")) {
+        if (pool) {
+            write_png(pool, file_name, width, height, pixels);
+        } else {
+            Thread_Pool own_pool;
+            thread_pool_init(&own_pool, 0);
+            write_png(&own_pool, file_name, width, height, pixels);
+            thread_pool_free(&own_pool);
+        }
+    } else if (has_extension(file_name, "qoi")) {
+        write_qoi(file_name, width, height, pixels);
+    } else {
+        write_ppm(file_name, width, height, pixels);
+    }
+}
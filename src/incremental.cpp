@@ -0,0 +1,609 @@
+// Incremental re-rendering of a scene file that is being edited (watch mode).
+//
+// The image is rendered in tiles into a float accumulation buffer. While a tile
+// is rendered, every primitive that its paths hit, every light they sample and
+// every occluder of their shadow rays is recorded, together with a coarse grid
+// of the scene cells that their segments pass through.
+//
+// When the scene file changes, the new scene is diffed against the previous
+// one by primitive contents. A tile is rendered again if it touched a primitive
+// that is gone (removed or modified), or if its segments pass through a cell
+// overlapped by a primitive that is new (added or modified), since such a
+// primitive could now intercept its paths. All other tiles keep their
+// accumulated samples. Changes to the camera, the dimensions, the background,
+// the sampling settings, the set of sampled lights or to any plane invalidate
+// the whole image.
+
+const u32 TILE_SIZE         = 16;
+const u32 TOUCH_GRID_SIZE   = 16; // Cells per axis
+const u32 TOUCH_GRID_WORDS  = TOUCH_GRID_SIZE * TOUCH_GRID_SIZE * TOUCH_GRID_SIZE / 64;
+const u32 WATCH_INTERVAL_MS = 200;
+
+struct Touch_Grid
+{
+    u64 cells[TOUCH_GRID_WORDS]; // One bit per cell, see touch_grid_mark
+};
+
+struct Touch_Record
+{
+    Array<u32> primitives; // Touched by the current tile, every index once
+    u64       *marked;     // Bit set over the scene primitives, set for the indices in primitives
+    Touch_Grid grid;
+
+    AABB    grid_bounds;
+    Vector3 grid_scale;     // Cells per unit of length
+    Vector3 grid_cell_size;
+};
+
+struct Tile
+{
+    u32        first_touched; // Range in Incremental_Renderer::touched
+    u32        num_touched;
+    Touch_Grid grid;
+};
+
+struct Incremental_Renderer
+{
+    u32   width, height;
+    u32   tiles_x, tiles_y;
+    Tile *tiles;
+
+    Array<u32> touched; // Touched primitives of all tiles, in ranges referenced by the tiles
+
+    Vector3 *accumulation;
+    u8      *pixels;
+
+    Touch_Record record;
+};
+
+// Primitive of one of the scenes that are being diffed
+struct Diff_Item
+{
+    u64 hash;
+    u32 index;
+};
+
+struct Scene_Diff
+{
+    bool full; // The whole image has to be rendered again
+
+    u64       *removed;    // Bit set over the old primitives that have no equal in the new scene
+    u32       *old_to_new; // Index in the new scene of every old primitive that has an equal, U32_MAX otherwise
+    Touch_Grid added;      // Cells overlapped by the new primitives whose geometry is new
+};
+
+inline void touch_grid_mark(Touch_Grid *grid, s32 x, s32 y, s32 z)
+{
+    u32 bit = x + TOUCH_GRID_SIZE * (y + TOUCH_GRID_SIZE * z);
+    grid->cells[bit / 64] |= 1ull << (bit % 64);
+}
+
+inline u32 bit_set_size(u32 count)
+{
+    return (count + 63) / 64 * sizeof(u64);
+}
+
+void record_touch(u32 primitive_index)
+{
+    Touch_Record *record = touch_record;
+
+    u64 bit = 1ull << (primitive_index % 64);
+    if (!(record->marked[primitive_index / 64] & bit)) {
+        record->marked[primitive_index / 64] |= bit;
+        array_push(&record->primitives, primitive_index);
+    }
+}
+
+// Marks the grid cells that the segment of the ray up to t_max passes through
+void record_segment(Ray ray, f32 t_max)
+{
+    Touch_Record *record = touch_record;
+    AABB bounds = record->grid_bounds;
+
+    Vector3 inverse = inverse_direction(ray.direction);
+    Vector3 t1 = (bounds.min - ray.origin) * inverse;
+    Vector3 t2 = (bounds.max - ray.origin) * inverse;
+
+    f32 t_enter = MAX(max(min(t1, t2)), 0.0f);
+    f32 t_exit  = MIN(min(max(t1, t2)), t_max);
+    if (!(t_enter <= t_exit)) {
+        return;
+    }
+
+    // Walk the cells along the clipped segment (Amanatides and Woo)
+    Vector3 p = (ray.origin + t_enter * ray.direction - bounds.min) * record->grid_scale;
+    Vector3 size = record->grid_cell_size;
+
+    s32 x = CLAMP((s32) p.x, 0, (s32) TOUCH_GRID_SIZE - 1);
+    s32 y = CLAMP((s32) p.y, 0, (s32) TOUCH_GRID_SIZE - 1);
+    s32 z = CLAMP((s32) p.z, 0, (s32) TOUCH_GRID_SIZE - 1);
+
+    s32 step_x = ray.direction.x < 0 ? -1 : 1;
+    s32 step_y = ray.direction.y < 0 ? -1 : 1;
+    s32 step_z = ray.direction.z < 0 ? -1 : 1;
+
+    f32 t_next_x = (bounds.min.x + (x + (step_x > 0)) * size.x - ray.origin.x) * inverse.x;
+    f32 t_next_y = (bounds.min.y + (y + (step_y > 0)) * size.y - ray.origin.y) * inverse.y;
+    f32 t_next_z = (bounds.min.z + (z + (step_z > 0)) * size.z - ray.origin.z) * inverse.z;
+
+    f32 t_delta_x = size.x * ABS(inverse.x);
+    f32 t_delta_y = size.y * ABS(inverse.y);
+    f32 t_delta_z = size.z * ABS(inverse.z);
+
+    // The clamped start cell may be off by one at the border, so leaving the grid ends the walk as well
+    for (;;) {
+        touch_grid_mark(&record->grid, x, y, z);
+
+        if (t_next_x < t_next_y && t_next_x < t_next_z) {
+            if (t_next_x > t_exit) break;
+            x += step_x;
+            if ((u32) x >= TOUCH_GRID_SIZE) break;
+            t_next_x += t_delta_x;
+        } else if (t_next_y < t_next_z) {
+            if (t_next_y > t_exit) break;
+            y += step_y;
+            if ((u32) y >= TOUCH_GRID_SIZE) break;
+            t_next_y += t_delta_y;
+        } else {
+            if (t_next_z > t_exit) break;
+            z += step_z;
+            if ((u32) z >= TOUCH_GRID_SIZE) break;
+            t_next_z += t_delta_z;
+        }
+    }
+}
+
+// Cells that the box overlaps, returns false if it reaches outside of the grid
+bool touch_grid_overlapping(Touch_Record *record, AABB box, Touch_Grid *grid)
+{
+    AABB bounds = record->grid_bounds;
+    for (u32 axis = 0; axis < 3; axis++) {
+        if (box.min[axis] < bounds.min[axis] || box.max[axis] > bounds.max[axis]) {
+            return false;
+        }
+    }
+
+    Vector3 lo = (box.min - bounds.min) * record->grid_scale;
+    Vector3 hi = (box.max - bounds.min) * record->grid_scale;
+
+    s32 first[3], last[3];
+    for (u32 axis = 0; axis < 3; axis++) {
+        first[axis] = CLAMP((s32) lo[axis], 0, (s32) TOUCH_GRID_SIZE - 1);
+        last[axis]  = CLAMP((s32) hi[axis], 0, (s32) TOUCH_GRID_SIZE - 1);
+    }
+
+    for (s32 z = first[2]; z <= last[2]; z++) {
+        for (s32 y = first[1]; y <= last[1]; y++) {
+            for (s32 x = first[0]; x <= last[0]; x++) {
+                touch_grid_mark(grid, x, y, z);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool touch_grids_overlap(Touch_Grid *a, Touch_Grid *b)
+{
+    u64 overlap = 0;
+    for (u32 i = 0; i < TOUCH_GRID_WORDS; i++) {
+        overlap |= a->cells[i] & b->cells[i];
+    }
+
+    return overlap != 0;
+}
+
+// The grid covers the bounded primitives and the camera, it stays the same
+// until the next full invalidation so that the grids of all tiles agree
+void set_touch_grid_bounds(Touch_Record *record, Scene *scene)
+{
+    AABB bounds = merge(scene->bvh.bounds, scene->camera.position);
+
+    Vector3 extent = bounds.max - bounds.min;
+    f32 padding = 0.01f * MAX(max(extent), 0.0f) + 1E-3f;
+    bounds.min -= {padding, padding, padding};
+    bounds.max += {padding, padding, padding};
+
+    record->grid_bounds = bounds;
+    record->grid_cell_size = (bounds.max - bounds.min) / (f32) TOUCH_GRID_SIZE;
+    record->grid_scale     = Vector3{1, 1, 1} / record->grid_cell_size;
+}
+
+void incremental_renderer_free(Incremental_Renderer *renderer)
+{
+    u32 num_tiles = renderer->tiles_x * renderer->tiles_y;
+    os_free(renderer->tiles,        num_tiles * sizeof(Tile));
+    os_free(renderer->accumulation, (u64) renderer->width * renderer->height * sizeof(Vector3));
+    os_free(renderer->pixels,       3 * renderer->width * renderer->height);
+
+    array_free(&renderer->touched);
+    array_free(&renderer->record.primitives);
+}
+
+void incremental_renderer_resize(Incremental_Renderer *renderer, Scene *scene)
+{
+    if (renderer->tiles) {
+        incremental_renderer_free(renderer);
+    }
+
+    *renderer = {
+        .width   = scene->width,
+        .height  = scene->height,
+        .tiles_x = (scene->width  + TILE_SIZE - 1) / TILE_SIZE,
+        .tiles_y = (scene->height + TILE_SIZE - 1) / TILE_SIZE,
+    };
+
+    renderer->tiles        = (Tile *)    os_allocate(renderer->tiles_x * renderer->tiles_y * sizeof(Tile));
+    renderer->accumulation = (Vector3 *) memory_allocate(MEMORY_FRAMEBUFFERS, (u64) scene->width * scene->height * sizeof(Vector3));
+    renderer->pixels       = (u8 *)      memory_allocate(MEMORY_FRAMEBUFFERS, 3 * scene->width * scene->height);
+}
+
+void render_tile(Incremental_Renderer *renderer, Scene *scene, u32 tile_index)
+{
+    u32 x_min = (tile_index % renderer->tiles_x) * TILE_SIZE;
+    u32 y_min = (tile_index / renderer->tiles_x) * TILE_SIZE;
+    u32 x_max = MIN(x_min + TILE_SIZE, scene->width);
+    u32 y_max = MIN(y_min + TILE_SIZE, scene->height);
+
+    for (u32 y = y_min; y < y_max; y++) {
+        for (u32 x = x_min; x < x_max; x++) {
+            Vector3 sum = {};
+            for (u32 i = 0; i < scene->samples; i++) {
+                sum += ray_trace(scene, camera_ray(scene, x, y), 1);
+            }
+
+            renderer->accumulation[x + y * scene->width] = sum;
+        }
+    }
+}
+
+// Renders the tiles flagged in invalid, or all tiles if it is null. The touched
+// primitives of the kept tiles are renumbered with old_to_new.
+// Returns the number of rendered tiles.
+u32 render_tiles(Incremental_Renderer *renderer, Scene *scene, bool *invalid, u32 *old_to_new)
+{
+    Touch_Record *record = &renderer->record;
+    u32 marked_size = bit_set_size(scene->primitives.size);
+    record->marked = (u64 *) os_allocate(marked_size);
+
+    Array<u32> touched = {};
+    u32 num_rendered = 0;
+
+    touch_record = record;
+    for (u32 t = 0; t < renderer->tiles_x * renderer->tiles_y; t++) {
+        Tile *tile = &renderer->tiles[t];
+        u32 first = touched.size;
+
+        if (!invalid || invalid[t]) {
+            record->primitives.size = 0;
+            record->grid = {};
+
+            render_tile(renderer, scene, t);
+
+            array_resize(&touched, first + record->primitives.size);
+            ARRAY_ITERATE(record->primitives) {
+                touched.data[first++] = *it;
+                record->marked[*it / 64] = 0;
+            }
+
+            *tile = {
+                .first_touched = touched.size - record->primitives.size,
+                .num_touched   = record->primitives.size,
+                .grid          = record->grid,
+            };
+            num_rendered++;
+        } else {
+            array_resize(&touched, first + tile->num_touched);
+            for (u32 i = 0; i < tile->num_touched; i++) {
+                touched.data[first + i] = old_to_new[renderer->touched[tile->first_touched + i]];
+            }
+
+            tile->first_touched = first;
+        }
+    }
+    touch_record = nullptr;
+
+    array_free(&renderer->touched);
+    renderer->touched = touched;
+    os_free(record->marked, marked_size);
+
+    return num_rendered;
+}
+
+// The fields of a primitive that the diff compares, copied one by one, as a
+// Primitive has padding that may hold anything. Fields the diff ignores are zero.
+struct Diff_Key
+{
+    u32 type, surface_type, track;
+    f32 ior;
+    f32 parameters[3], position[3], rotation[4], color[3], emission[3];
+};
+
+static_assert(sizeof(Diff_Key) == 20 * sizeof(u32), "Diff_Key must not have padding, it is hashed bytewise.");
+
+Diff_Key diff_key(Primitive *primitive, bool geometry_only)
+{
+    Diff_Key key = {};
+    key.type  = primitive->type;
+    key.track = primitive->track;
+    for (u32 i = 0; i < 3; i++) {
+        key.parameters[i] = primitive->parameters[i];
+        key.position[i]   = primitive->position[i];
+    }
+    key.rotation[0] = primitive->rotation.x;
+    key.rotation[1] = primitive->rotation.y;
+    key.rotation[2] = primitive->rotation.z;
+    key.rotation[3] = primitive->rotation.w;
+
+    if (!geometry_only) {
+        key.surface_type = primitive->surface_type;
+        if (primitive->surface_type == SURFACE_DIELECTRIC) {
+            key.ior = primitive->ior;
+        }
+        for (u32 i = 0; i < 3; i++) {
+            key.color[i]    = primitive->color[i];
+            key.emission[i] = primitive->emission[i];
+        }
+    }
+
+    return key;
+}
+
+bool diff_keys_equal(Diff_Key *a, Diff_Key *b)
+{
+    bool equal = a->type == b->type && a->surface_type == b->surface_type && a->track == b->track && a->ior == b->ior;
+    for (u32 i = 0; i < 3; i++) {
+        equal = equal && a->parameters[i] == b->parameters[i] && a->position[i] == b->position[i] &&
+            a->color[i] == b->color[i] && a->emission[i] == b->emission[i];
+    }
+    for (u32 i = 0; i < 4; i++) {
+        equal = equal && a->rotation[i] == b->rotation[i];
+    }
+
+    return equal;
+}
+
+// Pairs up the unpaired primitives of the old and the new scene whose keys are
+// equal: both sides are sorted by the hash of the key, and equal keys
+// are searched for within runs of equal hashes
+void pair_primitives(Array<Primitive> old_primitives, Array<Primitive> new_primitives, bool geometry_only, u32 *old_to_new, bool *new_paired)
+{
+    auto sorted_items = [geometry_only] (Array<Primitive> primitives, u32 *count, auto is_paired) -> Diff_Item *
+    {
+        Diff_Item *items = (Diff_Item *) os_allocate(primitives.size * sizeof(Diff_Item) + 1);
+        *count = 0;
+        for (u32 i = 0; i < primitives.size; i++) {
+            if (!is_paired(i)) {
+                Diff_Key key = diff_key(&primitives[i], geometry_only);
+                items[(*count)++] = {poly31_hash((u8 *) &key, sizeof(key)), i};
+            }
+        }
+
+        auto compare_items = [] (const void *a, const void *b) -> int
+        {
+            const Diff_Item *i1 = (Diff_Item *) a;
+            const Diff_Item *i2 = (Diff_Item *) b;
+
+            if (i1->hash != i2->hash) {
+                return i1->hash < i2->hash ? -1 : 1;
+            }
+
+            return (i1->index > i2->index) - (i1->index < i2->index);
+        };
+        qsort(items, *count, sizeof(Diff_Item), compare_items);
+
+        return items;
+    };
+
+    u32 num_old, num_new;
+    Diff_Item *old_items = sorted_items(old_primitives, &num_old, [old_to_new] (u32 i) { return old_to_new[i] != U32_MAX; });
+    Diff_Item *new_items = sorted_items(new_primitives, &num_new, [new_paired] (u32 i) { return new_paired[i]; });
+    defer {
+        os_free(old_items, old_primitives.size * sizeof(Diff_Item) + 1);
+        os_free(new_items, new_primitives.size * sizeof(Diff_Item) + 1);
+    };
+
+    u32 o = 0, n = 0;
+    while (o < num_old && n < num_new) {
+        if (old_items[o].hash < new_items[n].hash) {
+            o++;
+        } else if (old_items[o].hash > new_items[n].hash) {
+            n++;
+        } else {
+            u64 hash = old_items[o].hash;
+            u32 o_end = o, n_end = n;
+            while (o_end < num_old && old_items[o_end].hash == hash) o_end++;
+            while (n_end < num_new && new_items[n_end].hash == hash) n_end++;
+
+            for (; o < o_end; o++) {
+                Diff_Key old_key = diff_key(&old_primitives[old_items[o].index], geometry_only);
+                for (u32 k = n; k < n_end; k++) {
+                    u32 new_index = new_items[k].index;
+                    Diff_Key new_key = diff_key(&new_primitives[new_index], geometry_only);
+                    if (!new_paired[new_index] && diff_keys_equal(&old_key, &new_key)) {
+                        new_paired[new_index] = true;
+                        old_to_new[old_items[o].index] = new_index;
+                        break;
+                    }
+                }
+            }
+
+            n = n_end;
+        }
+    }
+}
+
+void diff_free(Scene_Diff *diff, Scene *old_scene)
+{
+    os_free(diff->removed,    bit_set_size(old_scene->primitives.size));
+    os_free(diff->old_to_new, old_scene->primitives.size * sizeof(u32) + 1);
+}
+
+void diff_scenes(Touch_Record *record, Scene *old_scene, Scene *new_scene, Scene_Diff *diff)
+{
+    u32 num_old = old_scene->primitives.size;
+    u32 num_new = new_scene->primitives.size;
+
+    *diff = {};
+    diff->removed    = (u64 *) os_allocate(bit_set_size(num_old));
+    diff->old_to_new = (u32 *) os_allocate(num_old * sizeof(u32) + 1);
+
+    diff->full =
+        old_scene->width  != new_scene->width  ||
+        old_scene->height != new_scene->height ||
+        old_scene->background_color != new_scene->background_color ||
+        old_scene->camera.position != new_scene->camera.position ||
+        old_scene->camera.right    != new_scene->camera.right    ||
+        old_scene->camera.up       != new_scene->camera.up       ||
+        old_scene->camera.forward  != new_scene->camera.forward  ||
+        old_scene->camera.fov_x_radians != new_scene->camera.fov_x_radians ||
+        old_scene->ray_depth != new_scene->ray_depth ||
+        old_scene->samples   != new_scene->samples   ||
+        old_scene->sampled_lights.size != new_scene->sampled_lights.size; // Changes the light selection density everywhere
+
+    u32  *old_to_geometry = (u32 *)  os_allocate(num_old * sizeof(u32) + 1);
+    bool *new_paired      = (bool *) os_allocate(num_new + 1);
+    defer {
+        os_free(old_to_geometry, num_old * sizeof(u32) + 1);
+        os_free(new_paired,      num_new + 1);
+    };
+
+    for (u32 i = 0; i < num_old; i++) {
+        diff->old_to_new[i] = U32_MAX;
+    }
+
+    // Unchanged primitives
+    pair_primitives(old_scene->primitives, new_scene->primitives, false, diff->old_to_new, new_paired);
+
+    // Tiles whose paths touched a primitive that changed or was removed are
+    // affected, the recorded paths cover whatever it did to them
+    for (u32 i = 0; i < num_old; i++) {
+        if (diff->old_to_new[i] == U32_MAX) {
+            diff->removed[i / 64] |= 1ull << (i % 64);
+        }
+    }
+
+    // Primitives whose material changed, but whose geometry did not, can not
+    // intercept any paths that they did not intercept before
+    memcpy(old_to_geometry, diff->old_to_new, num_old * sizeof(u32));
+    pair_primitives(old_scene->primitives, new_scene->primitives, true, old_to_geometry, new_paired);
+
+    // Other new primitives may intercept any path through the cells they overlap.
+    // Planes are not bounded, so any path may be affected.
+    for (u32 i = 0; i < num_new; i++) {
+        if (!new_paired[i]) {
+            Primitive *primitive = &new_scene->primitives[i];
+            if (primitive->type == PRIMITIVE_PLANE || !touch_grid_overlapping(record, primitive_bounds(primitive), &diff->added)) {
+                diff->full = true;
+            }
+        }
+    }
+}
+
+// Renders the new scene, keeping the tiles of the previous render that the
+// changes can not have affected. Returns the number of rendered tiles.
+u32 render_incremental(Incremental_Renderer *renderer, Scene *old_scene, Scene *new_scene)
+{
+    if (!old_scene) {
+        incremental_renderer_resize(renderer, new_scene);
+        set_touch_grid_bounds(&renderer->record, new_scene);
+
+        return render_tiles(renderer, new_scene, nullptr, nullptr);
+    }
+
+    Scene_Diff diff;
+    diff_scenes(&renderer->record, old_scene, new_scene, &diff);
+    defer {
+        diff_free(&diff, old_scene);
+    };
+
+    if (diff.full) {
+        if (new_scene->width != renderer->width || new_scene->height != renderer->height) {
+            incremental_renderer_resize(renderer, new_scene);
+        }
+        set_touch_grid_bounds(&renderer->record, new_scene);
+
+        return render_tiles(renderer, new_scene, nullptr, nullptr);
+    }
+
+    u32 num_tiles = renderer->tiles_x * renderer->tiles_y;
+    bool *invalid = (bool *) os_allocate(num_tiles);
+    defer {
+        os_free(invalid, num_tiles);
+    };
+
+    for (u32 t = 0; t < num_tiles; t++) {
+        Tile *tile = &renderer->tiles[t];
+
+        invalid[t] = touch_grids_overlap(&tile->grid, &diff.added);
+        for (u32 i = 0; i < tile->num_touched && !invalid[t]; i++) {
+            u32 index = renderer->touched[tile->first_touched + i];
+            invalid[t] = (diff.removed[index / 64] >> (index % 64)) & 1;
+        }
+    }
+
+    return render_tiles(renderer, new_scene, invalid, diff.old_to_new);
+}
+
+void write_incremental(Incremental_Renderer *renderer, Scene *scene, const char *output_path, u32 num_rendered, u64 start)
+{
+    f64 time = (os_time_ns() - start) / 1E9;
+
+    resolve_pixels(scene, renderer->accumulation, scene->samples, renderer->pixels);
+    memory_set_tag(MEMORY_OUTPUT);
+    write_image(nullptr, output_path, scene->width, scene->height, renderer->pixels);
+
+    printf("Rendered %u of %u tiles in %.2f s.\n", num_rendered, renderer->tiles_x * renderer->tiles_y, time);
+    memory_report();
+    fflush(stdout);
+}
+
+// Renders the scene into the output again whenever the scene file changes.
+// Runs until the process is interrupted.
+int watch(Options *options, Scene *scene, u64 scene_hash)
+{
+    Incremental_Renderer renderer = {};
+
+    u64 start = os_time_ns();
+    memory_set_tag(MEMORY_RENDER);
+    u32 num_rendered = render_incremental(&renderer, nullptr, scene);
+    write_incremental(&renderer, scene, options->output_path, num_rendered, start);
+
+    for (;;) {
+        os_sleep_ms(WATCH_INTERVAL_MS);
+
+        memory_set_tag(MEMORY_PARSER);
+        File file = {.name = (char *) options->scene_path};
+        if (!os_read_file(&file)) {
+            continue;
+        }
+
+        u64 hash = poly31_hash(file.data, file.size);
+        if (hash == scene_hash) {
+            os_free(file.data, file.size);
+            continue;
+        }
+        scene_hash = hash;
+
+        // Keep the random sequence going, so that the new samples are independent of the kept ones
+        Scene new_scene = {.xoroshiro = scene->xoroshiro};
+
+        start = os_time_ns();
+
+        memory_set_tag(MEMORY_SCENE);
+        Parser parser = {.buffer = (char *) file.data, .length = file.size};
+        parse(&parser, &new_scene);
+        os_free(file.data, file.size);
+
+        prepare_scene(&new_scene);
+
+        memory_set_tag(MEMORY_RENDER);
+        num_rendered = render_incremental(&renderer, scene, &new_scene);
+        write_incremental(&renderer, &new_scene, options->output_path, num_rendered, start);
+
+        free_scene(scene);
+        *scene = new_scene;
+    }
+
+    return 0;
+}
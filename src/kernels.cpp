@@ -0,0 +1,2022 @@
+// The render kernels: intersection, BVH8 traversal, light sampling, scattering
+// and tonemapping.
+//
+// This file is included once per instruction set, each time into its own
+// namespace and with KERNELS_ISA set, and the one to run is chosen at startup
+// (see select_instruction_set). Everything here is compiled for that
+// instruction set, including the math it inlines, so it must not be included
+// anywhere else.
+
+Intersection intersect_plane(Primitive *plane, Ray ray)
+{
+    Vector3 object_normal = plane->parameters;
+
+    Intersection intersection = {
+        .t = -dot(ray.origin, object_normal) / dot(ray.direction, object_normal),
+        .normal = normalize(rotate(object_normal, plane->rotation)),
+    };
+
+    if (dot(object_normal, ray.direction) > 0) {
+        intersection.normal = -intersection.normal;
+        intersection.inner = true;
+    }
+
+    return intersection;
+}
+
+// Ray parameters of both intersections with the ellipsoid, returns false on a miss.
+// Shared by the closest-hit and occlusion queries so that they always agree.
+bool ellipsoid_interval(Vector3 semi_axes, Ray ray, f32 *t_min, f32 *t_max)
+{
+    f32 a = dot(ray.direction / semi_axes, ray.direction / semi_axes);
+    f32 b = 2.0f * dot(ray.origin / semi_axes, ray.direction / semi_axes);
+    f32 c = dot(ray.origin / semi_axes, ray.origin / semi_axes) - 1.0f;
+
+    f32 discriminant = b * b - 4.0f * a * c;
+    if (discriminant < 0) {
+        return false;
+    }
+
+    *t_min = (-b - sqrtf(discriminant)) / (2 * a);
+    *t_max = (-b + sqrtf(discriminant)) / (2 * a);
+
+    return true;
+}
+
+// Ray parameters of the entry and exit points of the box, returns false on a miss
+bool box_interval(Vector3 dimensions, Ray ray, f32 *interval_min, f32 *interval_max)
+{
+    Vector3 t1 = (-dimensions - ray.origin) / ray.direction;
+    Vector3 t2 = ( dimensions - ray.origin) / ray.direction;
+
+    Vector3 t_min = min(t1, t2);
+    Vector3 t_max = max(t1, t2);
+
+    *interval_min = max(t_min);
+    *interval_max = min(t_max);
+
+    return *interval_min <= *interval_max;
+}
+
+Intersection intersect_ellipsoid(Primitive *ellipsoid, Ray ray)
+{
+    Vector3 semi_axes = ellipsoid->parameters;
+
+    f32 t_min, t_max;
+    if (!ellipsoid_interval(semi_axes, ray, &t_min, &t_max)) {
+        return {.t = -1};
+    }
+
+    f32 t = -1;
+    f32 t_other = -1;
+    if (t_min > 0) {
+        t = t_min;
+        t_other = t_max;
+    } else if (t_max > 0) {
+        t = t_max;
+    } else {
+        return {.t = -1};
+    }
+
+    Vector3 object_normal = (ray.origin + t * ray.direction) / semi_axes / semi_axes;
+
+    Intersection intersection = {
+        .t = t,
+        .normal = normalize(rotate(object_normal, ellipsoid->rotation)),
+    };
+
+    if (t_other > 0) {
+        intersection.t_other = t_other;
+
+        Vector3 object_normal_other = (ray.origin + t_other * ray.direction) / semi_axes / semi_axes;
+        intersection.normal_other = normalize(rotate(object_normal_other, ellipsoid->rotation));
+    }
+
+    if (dot(object_normal, ray.direction) > 0) {
+        intersection.normal = -intersection.normal;
+        intersection.inner = true;
+    }
+
+    return intersection;
+}
+
+Intersection intersect_box(Primitive *box, Ray ray)
+{
+    Vector3 dimensions = box->parameters;
+
+    f32 interval_min, interval_max;
+    if (!box_interval(dimensions, ray, &interval_min, &interval_max)) {
+        return {.t = -1};
+    }
+
+    f32 t = -1.0f;
+    f32 t_other = -1.0f;
+    if (interval_min > 0) {
+        t = interval_min;
+        t_other = interval_max;
+    } else if (interval_max > 0) {
+        t = interval_max;
+    } else {
+        return {.t = -1};
+    }
+
+    Vector3 object_normal = (ray.origin + t * ray.direction) / dimensions;
+    u32 max_index = 0;
+    for (u32 i = 1; i < 3; i++) {
+        if (ABS(object_normal[i]) > ABS(object_normal[max_index])) {
+            max_index = i;
+        }
+    }
+
+    object_normal = keep_axis(object_normal, max_index);
+
+    Intersection intersection = {
+        .t = t,
+        .normal = normalize(rotate(object_normal, box->rotation)),
+    };
+
+    if (t_other > 0) {
+        intersection.t_other = t_other;
+
+        Vector3 object_normal_other = (ray.origin + t_other * ray.direction) / dimensions;
+        u32 max_index = 0;
+        for (u32 i = 1; i < 3; i++) {
+            if (ABS(object_normal_other[i]) > ABS(object_normal_other[max_index])) {
+                max_index = i;
+            }
+        }
+
+        object_normal_other = keep_axis(object_normal_other, max_index);
+
+        intersection.normal_other = normalize(rotate(object_normal_other, box->rotation));
+    }
+
+    if (dot(ray.direction, object_normal) > 0) {
+        intersection.normal = -intersection.normal;
+        intersection.inner = true;
+    }
+
+    return intersection;
+}
+
+template <u32 FEATURES = FEATURES_ALL>
+Intersection intersect_once(Primitive *primitive, Ray world_ray)
+{
+    if (FEATURES & FEATURE_COSTS) {
+        path_costs.primitive_tests++;
+    }
+
+    Quaternion inverse_rotation = conj(primitive->rotation);
+    Ray ray = {
+        .origin = rotate(world_ray.origin - primitive->position, inverse_rotation),
+        .direction = rotate(world_ray.direction, inverse_rotation),
+    };
+
+    switch (primitive_type<FEATURES>(primitive)) {
+    case PRIMITIVE_PLANE:
+        if (FEATURES & FEATURE_PLANES) {
+            return intersect_plane(primitive, ray);
+        }
+        break;
+    case PRIMITIVE_ELLIPSOID:
+        if (FEATURES & FEATURE_ELLIPSOIDS) {
+            return intersect_ellipsoid(primitive, ray);
+        }
+        break;
+    case PRIMITIVE_BOX:
+        if (FEATURES & FEATURE_BOXES) {
+            return intersect_box(primitive, ray);
+        }
+        break;
+    }
+
+    return {.t = -1};
+}
+
+// Distance-only versions of the intersection functions for occlusion queries.
+// They return the same t, but skip the normals.
+f32 plane_distance(Primitive *plane, Ray ray)
+{
+    Vector3 object_normal = plane->parameters;
+
+    return -dot(ray.origin, object_normal) / dot(ray.direction, object_normal);
+}
+
+f32 ellipsoid_distance(Primitive *ellipsoid, Ray ray)
+{
+    f32 t_min, t_max;
+    if (!ellipsoid_interval(ellipsoid->parameters, ray, &t_min, &t_max)) {
+        return -1;
+    }
+
+    return t_min > 0 ? t_min : t_max;
+}
+
+f32 box_distance(Primitive *box, Ray ray)
+{
+    f32 interval_min, interval_max;
+    if (!box_interval(box->parameters, ray, &interval_min, &interval_max)) {
+        return -1;
+    }
+
+    return interval_min > 0 ? interval_min : interval_max;
+}
+
+template <u32 FEATURES = FEATURES_ALL>
+f32 intersect_once_distance(Primitive *primitive, Ray world_ray)
+{
+    if (FEATURES & FEATURE_COSTS) {
+        path_costs.primitive_tests++;
+    }
+
+    Quaternion inverse_rotation = conj(primitive->rotation);
+    Ray ray = {
+        .origin = rotate(world_ray.origin - primitive->position, inverse_rotation),
+        .direction = rotate(world_ray.direction, inverse_rotation),
+    };
+
+    switch (primitive_type<FEATURES>(primitive)) {
+    case PRIMITIVE_PLANE:
+        if (FEATURES & FEATURE_PLANES) {
+            return plane_distance(primitive, ray);
+        }
+        break;
+    case PRIMITIVE_ELLIPSOID:
+        if (FEATURES & FEATURE_ELLIPSOIDS) {
+            return ellipsoid_distance(primitive, ray);
+        }
+        break;
+    case PRIMITIVE_BOX:
+        if (FEATURES & FEATURE_BOXES) {
+            return box_distance(primitive, ray);
+        }
+        break;
+    }
+
+    return -1;
+}
+
+// Ray tests against the primitives of chunks:
+//
+// The lanes are one AVX register, which holds two consecutive chunks, or one
+// SSE register below AVX2, which holds one. Divisions are replaced by
+// reciprocals, so the distances can differ from the scalar ones in the last
+// bits. The closest hit is intersected again by the scalar code, which the
+// shading uses.
+#if KERNELS_ISA >= KERNELS_AVX2
+const u32 KERNEL_LANES = 8;
+
+struct Lanes
+{
+    __m256 v;
+};
+
+FORCE_INLINE Lanes lanes_set(f32 a)
+{
+    return {_mm256_set1_ps(a)};
+}
+
+// A field of the chunk of p and of the chunk after it
+FORCE_INLINE Lanes lanes_load(const f32 *p)
+{
+    const f32 *next = p + sizeof(Primitive_Chunk) / sizeof(f32);
+
+    return {_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(p)), _mm_load_ps(next), 1)};
+}
+
+// Consecutive floats of a batch, aligned to the lanes
+FORCE_INLINE Lanes lanes_load_batch(const f32 *p)
+{
+    return {_mm256_load_ps(p)};
+}
+
+FORCE_INLINE void lanes_store_batch(f32 *p, Lanes a)
+{
+    _mm256_store_ps(p, a.v);
+}
+
+FORCE_INLINE Lanes operator+(Lanes a, Lanes b) { return {_mm256_add_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator-(Lanes a, Lanes b) { return {_mm256_sub_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator*(Lanes a, Lanes b) { return {_mm256_mul_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator/(Lanes a, Lanes b) { return {_mm256_div_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator-(Lanes a)          { return {_mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f))}; }
+
+// Comparisons give masks with all bits of the lanes where they hold set
+FORCE_INLINE Lanes operator<(Lanes a, Lanes b)  { return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)}; }
+FORCE_INLINE Lanes operator<=(Lanes a, Lanes b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)}; }
+FORCE_INLINE Lanes operator>(Lanes a, Lanes b)  { return {_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)}; }
+FORCE_INLINE Lanes operator==(Lanes a, Lanes b) { return {_mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ)}; }
+FORCE_INLINE Lanes operator&(Lanes a, Lanes b)  { return {_mm256_and_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator|(Lanes a, Lanes b)  { return {_mm256_or_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator^(Lanes a, Lanes b)  { return {_mm256_xor_ps(a.v, b.v)}; }
+
+FORCE_INLINE Lanes lanes_sqrt(Lanes a)
+{
+    return {_mm256_sqrt_ps(a.v)};
+}
+
+// Same results as MIN and MAX, including for NaNs
+FORCE_INLINE Lanes lanes_min(Lanes a, Lanes b)
+{
+    return {_mm256_min_ps(a.v, b.v)};
+}
+
+FORCE_INLINE Lanes lanes_max(Lanes a, Lanes b)
+{
+    return {_mm256_max_ps(b.v, a.v)};
+}
+
+// a where the mask is set, b elsewhere
+FORCE_INLINE Lanes lanes_select(Lanes mask, Lanes a, Lanes b)
+{
+    return {_mm256_blendv_ps(b.v, a.v, mask.v)};
+}
+
+FORCE_INLINE u32 lanes_bits(Lanes mask)
+{
+    return _mm256_movemask_ps(mask.v);
+}
+
+FORCE_INLINE Lanes lanes_from_bits(u32 bits)
+{
+    __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i selected  = _mm256_and_si256(_mm256_set1_epi32(bits), lane_bits);
+
+    return {_mm256_castsi256_ps(_mm256_cmpeq_epi32(selected, lane_bits))};
+}
+
+// The lanes whose slot bits are in the mask
+FORCE_INLINE u32 lanes_in_slots(const u8 *slot_bits, u32 slot_mask)
+{
+    __m128i bits = _mm_and_si128(_mm_loadl_epi64((__m128i *) slot_bits), _mm_set1_epi8((char) slot_mask));
+
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) & 0xFF;
+}
+
+// The minimum of all lanes
+FORCE_INLINE f32 lanes_min_all(Lanes a)
+{
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtss_f32(m);
+}
+#else
+const u32 KERNEL_LANES = 4;
+
+struct Lanes
+{
+    __m128 v;
+};
+
+FORCE_INLINE Lanes lanes_set(f32 a)
+{
+    return {_mm_set1_ps(a)};
+}
+
+FORCE_INLINE Lanes lanes_load(const f32 *p)
+{
+    return {_mm_load_ps(p)};
+}
+
+FORCE_INLINE Lanes lanes_load_batch(const f32 *p)
+{
+    return {_mm_load_ps(p)};
+}
+
+FORCE_INLINE void lanes_store_batch(f32 *p, Lanes a)
+{
+    _mm_store_ps(p, a.v);
+}
+
+FORCE_INLINE Lanes operator+(Lanes a, Lanes b) { return {_mm_add_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator-(Lanes a, Lanes b) { return {_mm_sub_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator*(Lanes a, Lanes b) { return {_mm_mul_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator/(Lanes a, Lanes b) { return {_mm_div_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator-(Lanes a)          { return {_mm_xor_ps(a.v, _mm_set1_ps(-0.0f))}; }
+
+// Comparisons give masks with all bits of the lanes where they hold set
+FORCE_INLINE Lanes operator<(Lanes a, Lanes b)  { return {_mm_cmplt_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator<=(Lanes a, Lanes b) { return {_mm_cmple_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator>(Lanes a, Lanes b)  { return {_mm_cmpgt_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator==(Lanes a, Lanes b) { return {_mm_cmpeq_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator&(Lanes a, Lanes b)  { return {_mm_and_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator|(Lanes a, Lanes b)  { return {_mm_or_ps(a.v, b.v)}; }
+FORCE_INLINE Lanes operator^(Lanes a, Lanes b)  { return {_mm_xor_ps(a.v, b.v)}; }
+
+FORCE_INLINE Lanes lanes_sqrt(Lanes a)
+{
+    return {_mm_sqrt_ps(a.v)};
+}
+
+// Same results as MIN and MAX, including for NaNs
+FORCE_INLINE Lanes lanes_min(Lanes a, Lanes b)
+{
+    return {_mm_min_ps(a.v, b.v)};
+}
+
+FORCE_INLINE Lanes lanes_max(Lanes a, Lanes b)
+{
+    return {_mm_max_ps(b.v, a.v)};
+}
+
+// a where the mask is set, b elsewhere
+FORCE_INLINE Lanes lanes_select(Lanes mask, Lanes a, Lanes b)
+{
+    return {_mm_blendv_ps(b.v, a.v, mask.v)};
+}
+
+FORCE_INLINE u32 lanes_bits(Lanes mask)
+{
+    return _mm_movemask_ps(mask.v);
+}
+
+FORCE_INLINE Lanes lanes_from_bits(u32 bits)
+{
+    __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+    __m128i selected  = _mm_and_si128(_mm_set1_epi32(bits), lane_bits);
+
+    return {_mm_castsi128_ps(_mm_cmpeq_epi32(selected, lane_bits))};
+}
+
+// The lanes whose slot bits are in the mask
+FORCE_INLINE u32 lanes_in_slots(const u8 *slot_bits, u32 slot_mask)
+{
+    s32 four_bits;
+    memcpy(&four_bits, slot_bits, sizeof(four_bits));
+    __m128i bits = _mm_and_si128(_mm_cvtsi32_si128(four_bits), _mm_set1_epi8((char) slot_mask));
+
+    return ~_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) & 0xF;
+}
+
+// The minimum of all lanes
+FORCE_INLINE f32 lanes_min_all(Lanes a)
+{
+    __m128 m = _mm_min_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    return _mm_cvtss_f32(m);
+}
+#endif
+
+FORCE_INLINE Lanes lanes_abs(Lanes a)
+{
+    return a ^ (a & lanes_set(-0.0f));
+}
+
+struct Vector3_Lanes
+{
+    Lanes x, y, z;
+};
+
+FORCE_INLINE Vector3_Lanes operator+(Vector3_Lanes u, Vector3_Lanes v) { return {u.x + v.x, u.y + v.y, u.z + v.z}; }
+FORCE_INLINE Vector3_Lanes operator-(Vector3_Lanes u, Vector3_Lanes v) { return {u.x - v.x, u.y - v.y, u.z - v.z}; }
+FORCE_INLINE Vector3_Lanes operator/(Lanes a, Vector3_Lanes v)         { return {a / v.x, a / v.y, a / v.z}; }
+FORCE_INLINE Vector3_Lanes operator*(Vector3_Lanes u, Vector3_Lanes v) { return {u.x * v.x, u.y * v.y, u.z * v.z}; }
+FORCE_INLINE Vector3_Lanes operator*(Lanes a, Vector3_Lanes v)         { return {a * v.x, a * v.y, a * v.z}; }
+FORCE_INLINE Vector3_Lanes operator-(Vector3_Lanes v)                  { return {-v.x, -v.y, -v.z}; }
+
+FORCE_INLINE Lanes lanes_dot(Vector3_Lanes u, Vector3_Lanes v)
+{
+    return u.x * v.x + u.y * v.y + u.z * v.z;
+}
+
+FORCE_INLINE Vector3_Lanes lanes_cross(Vector3_Lanes u, Vector3_Lanes v)
+{
+    return {
+        u.y * v.z - u.z * v.y,
+        u.z * v.x - u.x * v.z,
+        u.x * v.y - u.y * v.x,
+    };
+}
+
+FORCE_INLINE Vector3_Lanes vector3_lanes(Vector3 v)
+{
+    return {lanes_set(v.x), lanes_set(v.y), lanes_set(v.z)};
+}
+
+FORCE_INLINE Vector3_Lanes vector3_lanes(const f32 (*fields)[PRIMITIVE_LANES])
+{
+    return {lanes_load(fields[0]), lanes_load(fields[1]), lanes_load(fields[2])};
+}
+
+// The world ray, the same in all lanes, or moved into the object space of the
+// primitives of the lanes
+struct Ray_Lanes
+{
+    Vector3_Lanes origin, direction;
+};
+
+// rotate() in every lane
+FORCE_INLINE Vector3_Lanes lanes_rotate(Vector3_Lanes v, Vector3_Lanes rotation_v, Lanes rotation_w)
+{
+    Vector3_Lanes t = lanes_set(2.0f) * lanes_cross(rotation_v, v);
+
+    return v + rotation_w * t + lanes_cross(rotation_v, t);
+}
+
+FORCE_INLINE Ray_Lanes object_ray_lanes(Primitive_Chunk *chunk, Ray_Lanes world_ray)
+{
+    Vector3_Lanes rotation_v = vector3_lanes(chunk->inverse_rotation);
+    Lanes         rotation_w = lanes_load(chunk->inverse_rotation[3]);
+
+    return {
+        .origin    = lanes_rotate(world_ray.origin - vector3_lanes(chunk->position), rotation_v, rotation_w),
+        .direction = lanes_rotate(world_ray.direction, rotation_v, rotation_w),
+    };
+}
+
+FORCE_INLINE Lanes plane_distance_lanes(Primitive_Chunk *chunk, Ray_Lanes ray)
+{
+    Vector3_Lanes object_normal = vector3_lanes(chunk->parameters);
+
+    return -lanes_dot(ray.origin, object_normal) / lanes_dot(ray.direction, object_normal);
+}
+
+// The ellipsoid lanes hold the reciprocals of the semi-axes
+FORCE_INLINE Lanes ellipsoid_distance_lanes(Primitive_Chunk *chunk, Ray_Lanes ray)
+{
+    Vector3_Lanes inverse_semi_axes = vector3_lanes(chunk->parameters);
+    Vector3_Lanes origin    = inverse_semi_axes * ray.origin;
+    Vector3_Lanes direction = inverse_semi_axes * ray.direction;
+
+    Lanes a = lanes_dot(direction, direction);
+    Lanes b = lanes_set(2.0f) * lanes_dot(origin, direction);
+    Lanes c = lanes_dot(origin, origin) - lanes_set(1.0f);
+
+    // A miss has a negative discriminant, which makes both roots NaN
+    Lanes root = lanes_sqrt(b * b - lanes_set(4.0f) * a * c);
+    Lanes inverse_2a = lanes_set(0.5f) / a;
+    Lanes t_min = (-b - root) * inverse_2a;
+    Lanes t_max = (-b + root) * inverse_2a;
+
+    return lanes_select(t_min > lanes_set(0.0f), t_min, t_max);
+}
+
+FORCE_INLINE Lanes box_distance_lanes(Primitive_Chunk *chunk, Ray_Lanes ray)
+{
+    Vector3_Lanes dimensions = vector3_lanes(chunk->parameters);
+    Vector3_Lanes inverse    = lanes_set(1.0f) / ray.direction;
+    Vector3_Lanes t1 = inverse * (-dimensions - ray.origin);
+    Vector3_Lanes t2 = inverse * ( dimensions - ray.origin);
+
+    Lanes interval_min = lanes_max(lanes_max(lanes_min(t1.x, t2.x), lanes_min(t1.y, t2.y)), lanes_min(t1.z, t2.z));
+    Lanes interval_max = lanes_min(lanes_min(lanes_max(t1.x, t2.x), lanes_max(t1.y, t2.y)), lanes_max(t1.z, t2.z));
+
+    Lanes t = lanes_select(interval_min > lanes_set(0.0f), interval_min, interval_max);
+    return lanes_select(interval_min <= interval_max, t, lanes_set(-1.0f));
+}
+
+// Distances to the primitives of a chunk of leaf lanes, which are all
+// ellipsoids or all boxes. Lanes that miss have a distance that is not
+// positive or NaN.
+template <u32 FEATURES>
+FORCE_INLINE Lanes leaf_distance_lanes(Primitive_Chunk *chunk, bool ellipsoids, Ray_Lanes world_ray)
+{
+    Ray_Lanes ray = object_ray_lanes(chunk, world_ray);
+
+    if (!(FEATURES & FEATURE_BOXES) || ((FEATURES & FEATURE_ELLIPSOIDS) && ellipsoids)) {
+        return ellipsoid_distance_lanes(chunk, ray);
+    }
+
+    return box_distance_lanes(chunk, ray);
+}
+
+// Of the KERNEL_LANES lanes from first, those within [range_first, range_end)
+FORCE_INLINE u32 range_lanes(u32 first, u32 range_first, u32 range_end)
+{
+    u32 skip = first < range_first ? range_first - first : 0;
+
+    return ((1u << MIN(range_end - first, KERNEL_LANES)) - 1) & (~0u << skip);
+}
+
+// The lanes with a distance in (0, t_max)
+FORCE_INLINE Lanes hit_lanes(Lanes t, u32 active, f32 t_max)
+{
+    return lanes_from_bits(active) & (t > lanes_set(0.0f)) & (t < lanes_set(t_max));
+}
+
+// Of the hit lanes, the one with the smallest distance, the first one on ties
+FORCE_INLINE u32 nearest_lane(Lanes t, Lanes hits, f32 *t_nearest)
+{
+    *t_nearest = lanes_min_all(lanes_select(hits, t, lanes_set(INFINITY)));
+
+    return __builtin_ctz(lanes_bits(hits & (t == lanes_set(*t_nearest))));
+}
+
+// Slab test of a ray against the eight children of a node. Returns the hit
+// mask in slot order and writes the entry distances and dequantized bounds.
+inline u32 bvh8_intersect_children(BVH8_Node *node, AABB frame, Vector3 origin, Vector3 inverse, f32 t_max,
+                                   f32 *t_near_out, f32 (*lo_out)[BVH8_WIDTH], f32 (*hi_out)[BVH8_WIDTH])
+{
+    u8 *lo[3] = {node->lo_x, node->lo_y, node->lo_z};
+    u8 *hi[3] = {node->hi_x, node->hi_y, node->hi_z};
+
+#if KERNELS_ISA >= KERNELS_AVX2
+    __m256 t_near = _mm256_setzero_ps();
+    __m256 t_far  = _mm256_set1_ps(t_max);
+    for (u32 axis = 0; axis < 3; axis++) {
+        f32 step = bvh8_quantization_step(frame.max[axis] - frame.min[axis]);
+        __m256 frame_min = _mm256_set1_ps(frame.min[axis]);
+        __m256 step_8    = _mm256_set1_ps(step);
+
+        __m256 q_lo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) lo[axis])));
+        __m256 q_hi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *) hi[axis])));
+        __m256 box_lo = _mm256_add_ps(frame_min, _mm256_mul_ps(q_lo, step_8));
+        __m256 box_hi = _mm256_add_ps(frame_min, _mm256_mul_ps(q_hi, step_8));
+        _mm256_storeu_ps(lo_out[axis], box_lo);
+        _mm256_storeu_ps(hi_out[axis], box_hi);
+
+        __m256 o = _mm256_set1_ps(origin[axis]);
+        __m256 inv = _mm256_set1_ps(inverse[axis]);
+        __m256 near_plane = inverse[axis] < 0 ? box_hi : box_lo;
+        __m256 far_plane  = inverse[axis] < 0 ? box_lo : box_hi;
+        t_near = _mm256_max_ps(t_near, _mm256_mul_ps(_mm256_sub_ps(near_plane, o), inv));
+        t_far  = _mm256_min_ps(t_far,  _mm256_mul_ps(_mm256_sub_ps(far_plane,  o), inv));
+    }
+
+    _mm256_storeu_ps(t_near_out, t_near);
+#if KERNELS_ISA >= KERNELS_AVX512
+    return _mm256_cmp_ps_mask(t_near, t_far, _CMP_LE_OQ);
+#else
+    return _mm256_movemask_ps(_mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ));
+#endif
+#else
+    __m128 t_near[2] = {_mm_setzero_ps(), _mm_setzero_ps()};
+    __m128 t_far[2]  = {_mm_set1_ps(t_max), _mm_set1_ps(t_max)};
+    for (u32 axis = 0; axis < 3; axis++) {
+        f32 step = bvh8_quantization_step(frame.max[axis] - frame.min[axis]);
+        __m128 frame_min = _mm_set1_ps(frame.min[axis]);
+        __m128 step_4    = _mm_set1_ps(step);
+        __m128 o   = _mm_set1_ps(origin[axis]);
+        __m128 inv = _mm_set1_ps(inverse[axis]);
+
+        for (u32 half = 0; half < 2; half++) {
+            s32 lo_four, hi_four;
+            memcpy(&lo_four, lo[axis] + 4 * half, sizeof(lo_four));
+            memcpy(&hi_four, hi[axis] + 4 * half, sizeof(hi_four));
+            __m128i lo_bytes = _mm_cvtsi32_si128(lo_four);
+            __m128i hi_bytes = _mm_cvtsi32_si128(hi_four);
+            __m128 box_lo = _mm_add_ps(frame_min, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(lo_bytes)), step_4));
+            __m128 box_hi = _mm_add_ps(frame_min, _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(hi_bytes)), step_4));
+            _mm_storeu_ps(lo_out[axis] + 4 * half, box_lo);
+            _mm_storeu_ps(hi_out[axis] + 4 * half, box_hi);
+
+            __m128 near_plane = inverse[axis] < 0 ? box_hi : box_lo;
+            __m128 far_plane  = inverse[axis] < 0 ? box_lo : box_hi;
+            t_near[half] = _mm_max_ps(t_near[half], _mm_mul_ps(_mm_sub_ps(near_plane, o), inv));
+            t_far[half]  = _mm_min_ps(t_far[half],  _mm_mul_ps(_mm_sub_ps(far_plane,  o), inv));
+        }
+    }
+
+    _mm_storeu_ps(t_near_out + 0, t_near[0]);
+    _mm_storeu_ps(t_near_out + 4, t_near[1]);
+    return _mm_movemask_ps(_mm_cmple_ps(t_near[0], t_far[0])) | (_mm_movemask_ps(_mm_cmple_ps(t_near[1], t_far[1])) << 4);
+#endif
+}
+
+// Leaves only hold bounded primitives and the unbounded list only planes, so
+// each is intersected by a kernel specialized for its types. Only distances
+// are computed while searching, the intersection with the normals and the
+// primitive record are read once for the closest hit.
+template <u32 FEATURES = FEATURES_ALL>
+Intersection bvh8_intersect(BVH8 *bvh, Array<Primitive> primitives, Ray world_ray, Primitive **closest, f32 t_max = INFINITY)
+{
+    f32 t_closest = t_max;
+    u32 closest_index = U32_MAX;
+
+    Ray_Lanes world_lanes = {vector3_lanes(world_ray.origin), vector3_lanes(world_ray.direction)};
+
+    if (FEATURES & FEATURE_PLANES) {
+        for (u32 first = 0; first < bvh->unbounded.size; first += KERNEL_LANES) {
+            Primitive_Chunk *chunk = &bvh->plane_chunks.data[first / PRIMITIVE_LANES];
+            u32 active = (1u << MIN(bvh->unbounded.size - first, KERNEL_LANES)) - 1;
+            if (FEATURES & FEATURE_COSTS) {
+                path_costs.primitive_tests += __builtin_popcount(active);
+            }
+
+            Ray_Lanes ray = object_ray_lanes(chunk, world_lanes);
+            Lanes t = plane_distance_lanes(chunk, ray);
+
+            Lanes hits = hit_lanes(t, active, t_closest);
+            if (lanes_bits(hits)) {
+                closest_index = bvh->unbounded[first + nearest_lane(t, hits, &t_closest)];
+            }
+        }
+    }
+
+    if ((FEATURES & (FEATURE_ELLIPSOIDS | FEATURE_BOXES)) && bvh->nodes.size > 0) {
+        Vector3 inverse = inverse_direction(world_ray.direction);
+        u32 octant = (inverse.x < 0 ? 0 : 1) | (inverse.y < 0 ? 0 : 2) | (inverse.z < 0 ? 0 : 4);
+        // Slot corners are named by their positive axes, so the near corner is the complement of the octant
+        u32 near_slot = ~octant & 7;
+
+        BVH8_Stack_Entry stack[BVH8_STACK_SIZE];
+        u32 stack_size = 0;
+        stack[stack_size++] = {.node = 0, .t_near = 0.0f, .frame = bvh->bounds};
+
+        while (stack_size > 0) {
+            BVH8_Stack_Entry entry = stack[--stack_size];
+            if (entry.t_near >= t_closest) {
+                continue;
+            }
+
+            BVH8_Node *node = &bvh->nodes[entry.node];
+
+            alignas(32) f32 t_near[BVH8_WIDTH];
+            alignas(32) f32 lo[3][BVH8_WIDTH];
+            alignas(32) f32 hi[3][BVH8_WIDTH];
+            u32 hit_mask = bvh8_intersect_children(node, entry.frame, world_ray.origin, inverse, t_closest, t_near, lo, hi);
+            if (!hit_mask) {
+                continue;
+            }
+
+            u32 inner_mask = node->meta & 0xFF;
+
+            // The hit leaves are intersected right away, up to KERNEL_LANES primitives of one type at a time
+            u32 leaf_hits = hit_mask & ~inner_mask;
+            if (leaf_hits) {
+                // The ellipsoids, then the boxes from the chunk where the ellipsoids end
+                u32 ranges[3] = {
+                    node->primitive_base,
+                    node->primitive_base + node->ellipsoid_lanes,
+                    node->primitive_base + bvh8_leaf_lane_count(node),
+                };
+                for (u32 type = 0; type < 2; type++) {
+                    bool ellipsoids = type == 0;
+                    for (u32 first = ranges[type] & ~(PRIMITIVE_LANES - 1); first < ranges[type + 1]; first += KERNEL_LANES) {
+                        u32 active = lanes_in_slots(&bvh->leaf_slot_bits.data[first], leaf_hits) & range_lanes(first, ranges[type], ranges[type + 1]);
+
+                        if (FEATURES & FEATURE_COSTS) {
+                            path_costs.primitive_tests += __builtin_popcount(active);
+                        }
+
+                        if (active) {
+                            Primitive_Chunk *chunk = &bvh->leaf_chunks.data[first / PRIMITIVE_LANES];
+                            Lanes t = leaf_distance_lanes<FEATURES>(chunk, ellipsoids, world_lanes);
+
+                            Lanes hits = hit_lanes(t, active, t_closest);
+                            if (lanes_bits(hits)) {
+                                closest_index = bvh->primitive_indices[first + nearest_lane(t, hits, &t_closest)];
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Inner nodes are pushed farthest first, so the nearest one is popped next
+            u32 inner_hits = hit_mask & inner_mask;
+            for (s32 k = BVH8_WIDTH - 1; inner_hits && k >= 0; k--) {
+                u32 slot = k ^ near_slot;
+                if (!(inner_hits & (1u << slot))) {
+                    continue;
+                }
+                inner_hits &= ~(1u << slot);
+
+                ASSERT(stack_size < BVH8_STACK_SIZE);
+                BVH8_Stack_Entry *child = &stack[stack_size++];
+                child->node   = node->child_base + __builtin_popcount(inner_mask & ((1u << slot) - 1));
+                child->t_near = t_near[slot];
+                child->frame  = {
+                    {lo[0][slot], lo[1][slot], lo[2][slot]},
+                    {hi[0][slot], hi[1][slot], hi[2][slot]},
+                };
+            }
+        }
+    }
+
+    if (closest_index == U32_MAX) {
+        *closest = nullptr;
+        return {.t = INFINITY};
+    }
+
+    *closest = &primitives[closest_index];
+    return intersect_once<FEATURES>(*closest, world_ray);
+}
+
+// Any-hit query: returns the first primitive found within (0, t_max), not necessarily the closest one
+template <u32 FEATURES = FEATURES_ALL>
+Primitive *bvh8_occluded(BVH8 *bvh, Array<Primitive> primitives, Ray world_ray, f32 t_max)
+{
+    Ray_Lanes world_lanes = {vector3_lanes(world_ray.origin), vector3_lanes(world_ray.direction)};
+
+    if (FEATURES & FEATURE_PLANES) {
+        for (u32 first = 0; first < bvh->unbounded.size; first += KERNEL_LANES) {
+            Primitive_Chunk *chunk = &bvh->plane_chunks.data[first / PRIMITIVE_LANES];
+            u32 active = (1u << MIN(bvh->unbounded.size - first, KERNEL_LANES)) - 1;
+            if (FEATURES & FEATURE_COSTS) {
+                path_costs.primitive_tests += __builtin_popcount(active);
+            }
+
+            Ray_Lanes ray = object_ray_lanes(chunk, world_lanes);
+            u32 hits = lanes_bits(hit_lanes(plane_distance_lanes(chunk, ray), active, t_max));
+            if (hits) {
+                return &primitives[bvh->unbounded[first + __builtin_ctz(hits)]];
+            }
+        }
+    }
+
+    if (!(FEATURES & (FEATURE_ELLIPSOIDS | FEATURE_BOXES)) || bvh->nodes.size == 0) {
+        return nullptr;
+    }
+
+    Vector3 inverse = inverse_direction(world_ray.direction);
+    u32 octant = (inverse.x < 0 ? 0 : 1) | (inverse.y < 0 ? 0 : 2) | (inverse.z < 0 ? 0 : 4);
+    u32 near_slot = ~octant & 7;
+
+    BVH8_Stack_Entry stack[BVH8_STACK_SIZE];
+    u32 stack_size = 0;
+    stack[stack_size++] = {.node = 0, .t_near = 0.0f, .frame = bvh->bounds};
+
+    while (stack_size > 0) {
+        BVH8_Stack_Entry entry = stack[--stack_size];
+        BVH8_Node *node = &bvh->nodes[entry.node];
+
+        alignas(32) f32 t_near[BVH8_WIDTH];
+        alignas(32) f32 lo[3][BVH8_WIDTH];
+        alignas(32) f32 hi[3][BVH8_WIDTH];
+        u32 hit_mask = bvh8_intersect_children(node, entry.frame, world_ray.origin, inverse, t_max, t_near, lo, hi);
+        if (!hit_mask) {
+            continue;
+        }
+
+        u32 inner_mask = node->meta & 0xFF;
+
+        u32 leaf_hits = hit_mask & ~inner_mask;
+        if (leaf_hits) {
+            // The ellipsoids, then the boxes from the chunk where the ellipsoids end
+            u32 ranges[3] = {
+                node->primitive_base,
+                node->primitive_base + node->ellipsoid_lanes,
+                node->primitive_base + bvh8_leaf_lane_count(node),
+            };
+            for (u32 type = 0; type < 2; type++) {
+                bool ellipsoids = type == 0;
+                for (u32 first = ranges[type] & ~(PRIMITIVE_LANES - 1); first < ranges[type + 1]; first += KERNEL_LANES) {
+                    u32 active = lanes_in_slots(&bvh->leaf_slot_bits.data[first], leaf_hits) & range_lanes(first, ranges[type], ranges[type + 1]);
+
+                    if (FEATURES & FEATURE_COSTS) {
+                        path_costs.primitive_tests += __builtin_popcount(active);
+                    }
+
+                    if (active) {
+                        Primitive_Chunk *chunk = &bvh->leaf_chunks.data[first / PRIMITIVE_LANES];
+                        Lanes t = leaf_distance_lanes<FEATURES>(chunk, ellipsoids, world_lanes);
+
+                        u32 hits = lanes_bits(hit_lanes(t, active, t_max));
+                        if (hits) {
+                            return &primitives[bvh->primitive_indices[first + __builtin_ctz(hits)]];
+                        }
+                    }
+                }
+            }
+        }
+
+        // Any hit ends the query, so the order only matters for how soon one is found
+        u32 inner_hits = hit_mask & inner_mask;
+        for (s32 k = BVH8_WIDTH - 1; inner_hits && k >= 0; k--) {
+            u32 slot = k ^ near_slot;
+            if (!(inner_hits & (1u << slot))) {
+                continue;
+            }
+            inner_hits &= ~(1u << slot);
+
+            ASSERT(stack_size < BVH8_STACK_SIZE);
+            BVH8_Stack_Entry *child = &stack[stack_size++];
+            child->node   = node->child_base + __builtin_popcount(inner_mask & ((1u << slot) - 1));
+            child->t_near = t_near[slot];
+            child->frame  = {
+                {lo[0][slot], lo[1][slot], lo[2][slot]},
+                {hi[0][slot], hi[1][slot], hi[2][slot]},
+            };
+        }
+    }
+
+    return nullptr;
+}
+
+template <u32 FEATURES = FEATURES_ALL>
+Intersection intersect(Scene *scene, Ray world_ray, Primitive **closest, f32 t_max = INFINITY)
+{
+    return bvh8_intersect<FEATURES>(&scene->bvh, scene->primitives, world_ray, closest, t_max);
+}
+
+// Returns whether anything is hit within (0, t_max), stopping at the first hit
+template <u32 FEATURES = FEATURES_ALL>
+bool occluded(Scene *scene, Ray world_ray, f32 t_max)
+{
+    if (last_occluder < scene->primitives.size) {
+        f32 t = intersect_once_distance<FEATURES>(&scene->primitives[last_occluder], world_ray);
+        if (t > 0 && t < t_max) {
+            return true;
+        }
+    }
+
+    Primitive *occluder = bvh8_occluded<FEATURES>(&scene->bvh, scene->primitives, world_ray, t_max);
+    if (occluder) {
+        last_occluder = occluder - scene->primitives.data;
+        return true;
+    }
+
+    return false;
+}
+
+Vector3 uniform_unit_sphere(Xoroshiro128 *xoroshiro)
+{
+    f32 theta = 2.0f * PI * xoroshiro_next_f32(xoroshiro);
+    f32 z = 2.0f * xoroshiro_next_f32(xoroshiro) - 1.0f;
+    f32 h = sqrtf(1.0f - z * z);
+
+    return {h * cosf(theta), h * sinf(theta), z};
+}
+
+Vector3 cosine_weighted(Xoroshiro128 *xoroshiro, Vector3 normal)
+{
+    Vector3 v;
+    do {
+        v = uniform_unit_sphere(xoroshiro);
+    } while (v == -normal);
+
+    return normalize(v + normal);
+}
+
+f32 cosine_pdf(Vector3 w, Vector3 normal)
+{
+    return MAX(0.0f, dot(w, normal) / PI);
+}
+
+// Tangent and bitangent of a unit normal, without a branch on its direction
+// (Duff et al., "Building an Orthonormal Basis, Revisited")
+void orthonormal_basis(Vector3 normal, Vector3 *tangent, Vector3 *bitangent)
+{
+    f32 sign = copysignf(1.0f, normal.z);
+    f32 a = -1.0f / (sign + normal.z);
+    f32 b = normal.x * normal.y * a;
+
+    *tangent   = {1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x};
+    *bitangent = {b, sign + normal.y * normal.y * a, -normal.y};
+}
+
+// Uniform direction within the cone around the axis. The cone is given by one
+// minus the cosine of its half angle, which keeps narrow cones precise.
+Vector3 uniform_cone(Xoroshiro128 *xoroshiro, Vector3 axis, f32 one_minus_cos)
+{
+    f32 x = one_minus_cos * xoroshiro_next_f32(xoroshiro);
+    f32 cos_theta = 1.0f - x;
+    f32 sin_theta = sqrtf(x * (2.0f - x));
+    f32 phi = 2.0f * PI * xoroshiro_next_f32(xoroshiro);
+
+    Vector3 tangent, bitangent;
+    orthonormal_basis(axis, &tangent, &bitangent);
+
+    return sin_theta * cosf(phi) * tangent + sin_theta * sinf(phi) * bitangent + cos_theta * axis;
+}
+
+f32 cone_pdf(f32 one_minus_cos)
+{
+    return 1.0f / (2.0f * PI * one_minus_cos);
+}
+
+Vector3 uniform_box(Xoroshiro128 *xoroshiro, Primitive *box)
+{
+    Vector3 dimensions = box->parameters;
+
+    Vector3 weights = {
+        4 * dimensions.y * dimensions.z,
+        4 * dimensions.x * dimensions.z,
+        4 * dimensions.x * dimensions.y
+    };
+    f32 w = weights.x + weights.y + weights.z;
+
+    f32 random_u = 2 * xoroshiro_next_f32(xoroshiro) - 1;
+    f32 random_v = 2 * xoroshiro_next_f32(xoroshiro) - 1;
+
+    f32 sign = 2.0f * xoroshiro_next_u32(xoroshiro, 1) - 1.0f;
+
+    Vector3 point;
+    f32 random_number = w * xoroshiro_next_f32(xoroshiro);
+    if (random_number < weights.x) {
+        point = {sign, random_u, random_v};
+    } else if (random_number >= weights.x && random_number < weights.x + weights.y) {
+        point = {random_u, sign, random_v};
+    } else {
+        point = {random_u, random_v, sign};
+    }
+
+    return box->position + rotate(dimensions * point, box->rotation);
+}
+
+f32 box_pdf(Primitive *box)
+{
+    Vector3 dimensions = box->parameters;
+
+    return 1.0f / (8.0f * (dimensions.y * dimensions.z + dimensions.x * dimensions.z + dimensions.x * dimensions.y));
+}
+
+Vector3 nonuniform_ellipsoid(Xoroshiro128 *xoroshiro, Primitive *ellipsoid)
+{
+    return ellipsoid->position + rotate(uniform_unit_sphere(xoroshiro) * ellipsoid->parameters, ellipsoid->rotation);
+}
+
+f32 ellipsoid_pdf(Vector3 p, Primitive *ellipsoid)
+{
+    Vector3 r = ellipsoid->parameters;
+    Vector3 n = rotate(p - ellipsoid->position, conj(ellipsoid->rotation)) / r;
+
+    return 1.0f / (4 * PI * sqrtf(n.x*n.x*r.y*r.y*r.z*r.z + r.x*r.x*n.y*n.y*r.z*r.z + r.x*r.x*r.y*r.y*n.z*n.z));
+}
+
+// Batched samplers: SAMPLE_BATCH samples per call, drawn from random numbers
+// generated ahead, without branches or loops that depend on the samples, so
+// every step runs on all lanes at once. They follow the distributions of the
+// scalar samplers above, though not the same samples for the same numbers.
+
+void draw_sample_randoms(Xoroshiro128 *xoroshiro, Sample_Randoms *randoms)
+{
+    for (u32 i = 0; i < SAMPLE_BATCH; i++) {
+        randoms->u[i] = xoroshiro_next_f32(xoroshiro);
+        randoms->v[i] = xoroshiro_next_f32(xoroshiro);
+        randoms->w[i] = xoroshiro_next_f32(xoroshiro);
+    }
+}
+
+FORCE_INLINE Vector3_Lanes vector3_lanes(Vector3_Batch *batch, u32 first)
+{
+    return {lanes_load_batch(&batch->x[first]), lanes_load_batch(&batch->y[first]), lanes_load_batch(&batch->z[first])};
+}
+
+FORCE_INLINE void store_vector3_lanes(Vector3_Batch *batch, u32 first, Vector3_Lanes v)
+{
+    lanes_store_batch(&batch->x[first], v.x);
+    lanes_store_batch(&batch->y[first], v.y);
+    lanes_store_batch(&batch->z[first], v.z);
+}
+
+// Shirley and Chiu's concentric mapping of the square to the unit disk, which
+// keeps areas. Its angle stays within a quarter of pi of an axis, where short
+// Taylor series give the sine and the cosine to within 1E-7.
+FORCE_INLINE void concentric_disk_lanes(Lanes u, Lanes v, Lanes *x, Lanes *y)
+{
+    Lanes a = lanes_set(2.0f) * u - lanes_set(1.0f);
+    Lanes b = lanes_set(2.0f) * v - lanes_set(1.0f);
+
+    Lanes along_a = lanes_abs(a) > lanes_abs(b);
+    Lanes radius  = lanes_select(along_a, a, b);
+    Lanes ratio   = lanes_select(along_a, b, a) / radius;
+    ratio = lanes_select(radius == lanes_set(0.0f), lanes_set(0.0f), ratio);
+
+    Lanes phi = lanes_set(0.25f * PI) * ratio;
+    Lanes phi2 = phi * phi;
+    Lanes sin_phi = phi * (lanes_set(1.0f) + phi2 * (lanes_set(-1.0f / 6) + phi2 * (lanes_set(1.0f / 120) +
+                    phi2 * (lanes_set(-1.0f / 5040) + phi2 * lanes_set(1.0f / 362880)))));
+    Lanes cos_phi = lanes_set(1.0f) + phi2 * (lanes_set(-1.0f / 2) + phi2 * (lanes_set(1.0f / 24) +
+                    phi2 * (lanes_set(-1.0f / 720) + phi2 * lanes_set(1.0f / 40320))));
+
+    // Beyond the diagonals the angle is measured from the other axis
+    *x = radius * lanes_select(along_a, cos_phi, sin_phi);
+    *y = radius * lanes_select(along_a, sin_phi, cos_phi);
+}
+
+// Malley's method: a uniform point of the disk lifted onto the hemisphere
+void cosine_weighted_batch(Sample_Randoms *randoms, Vector3_Batch *normals, Vector3_Batch *directions)
+{
+    for (u32 i = 0; i < SAMPLE_BATCH; i += KERNEL_LANES) {
+        Lanes x, y;
+        concentric_disk_lanes(lanes_load_batch(&randoms->u[i]), lanes_load_batch(&randoms->v[i]), &x, &y);
+        Lanes z = lanes_sqrt(lanes_max(lanes_set(0.0f), lanes_set(1.0f) - x * x - y * y));
+
+        // orthonormal_basis() in every lane
+        Vector3_Lanes normal = vector3_lanes(normals, i);
+        Lanes sign = lanes_set(1.0f) | (normal.z & lanes_set(-0.0f));
+        Lanes a = lanes_set(-1.0f) / (sign + normal.z);
+        Lanes b = normal.x * normal.y * a;
+        Vector3_Lanes tangent   = {lanes_set(1.0f) + sign * normal.x * normal.x * a, sign * b, -(sign * normal.x)};
+        Vector3_Lanes bitangent = {b, sign + normal.y * normal.y * a, -normal.y};
+
+        store_vector3_lanes(directions, i, x * tangent + y * bitangent + z * normal);
+    }
+}
+
+// The face is chosen by where w falls among the areas, and the side by which
+// half of the face's share it falls in
+void uniform_box_batch(Sample_Randoms *randoms, Primitive *box, Vector3_Batch *points)
+{
+    Vector3 dimensions = box->parameters;
+    f32 weight_x = 4 * dimensions.y * dimensions.z;
+    f32 weight_y = 4 * dimensions.x * dimensions.z;
+    f32 weight_z = 4 * dimensions.x * dimensions.y;
+    f32 weight_xy = weight_x + weight_y;
+
+    Vector3_Lanes position   = vector3_lanes(box->position);
+    Vector3_Lanes rotation_v = vector3_lanes(Vector3{box->rotation.x, box->rotation.y, box->rotation.z});
+    Lanes         rotation_w = lanes_set(box->rotation.w);
+
+    for (u32 i = 0; i < SAMPLE_BATCH; i += KERNEL_LANES) {
+        Lanes u = lanes_set(2.0f) * lanes_load_batch(&randoms->u[i]) - lanes_set(1.0f);
+        Lanes v = lanes_set(2.0f) * lanes_load_batch(&randoms->v[i]) - lanes_set(1.0f);
+        Lanes random_number = lanes_set(weight_xy + weight_z) * lanes_load_batch(&randoms->w[i]);
+
+        Lanes on_x  = random_number < lanes_set(weight_x);
+        Lanes on_xy = random_number < lanes_set(weight_xy);
+        Lanes start = lanes_select(on_x, lanes_set(0.0f), lanes_select(on_xy, lanes_set(weight_x), lanes_set(weight_xy)));
+        Lanes width = lanes_select(on_x, lanes_set(weight_x), lanes_select(on_xy, lanes_set(weight_y), lanes_set(weight_z)));
+        Lanes sign  = lanes_select(random_number - start < lanes_set(0.5f) * width, lanes_set(-1.0f), lanes_set(1.0f));
+
+        Vector3_Lanes point = {
+            lanes_select(on_x, sign, u),
+            lanes_select(on_x, u, lanes_select(on_xy, sign, v)),
+            lanes_select(on_xy, v, sign),
+        };
+
+        store_vector3_lanes(points, i, position + lanes_rotate(vector3_lanes(dimensions) * point, rotation_v, rotation_w));
+    }
+}
+
+// A uniform point of the disk at radius r lifted onto the unit sphere at
+// height 1 - 2r^2, which is uniform too, then stretched like
+// nonuniform_ellipsoid()
+void nonuniform_ellipsoid_batch(Sample_Randoms *randoms, Primitive *ellipsoid, Vector3_Batch *points)
+{
+    Vector3_Lanes position   = vector3_lanes(ellipsoid->position);
+    Vector3_Lanes radii      = vector3_lanes(ellipsoid->parameters);
+    Vector3_Lanes rotation_v = vector3_lanes(Vector3{ellipsoid->rotation.x, ellipsoid->rotation.y, ellipsoid->rotation.z});
+    Lanes         rotation_w = lanes_set(ellipsoid->rotation.w);
+
+    for (u32 i = 0; i < SAMPLE_BATCH; i += KERNEL_LANES) {
+        Lanes x, y;
+        concentric_disk_lanes(lanes_load_batch(&randoms->u[i]), lanes_load_batch(&randoms->v[i]), &x, &y);
+
+        Lanes radius_sq = x * x + y * y;
+        Lanes scale = lanes_set(2.0f) * lanes_sqrt(lanes_max(lanes_set(0.0f), lanes_set(1.0f) - radius_sq));
+        Vector3_Lanes unit = {x * scale, y * scale, lanes_set(1.0f) - lanes_set(2.0f) * radius_sq};
+
+        store_vector3_lanes(points, i, position + lanes_rotate(unit * radii, rotation_v, rotation_w));
+    }
+}
+
+const Sample_Kernels SAMPLE_KERNELS = {cosine_weighted_batch, uniform_box_batch, nonuniform_ellipsoid_batch};
+
+f32 area_formulation_density(f32 distance, Vector3 direction, Vector3 normal)
+{
+    return distance * distance / ABS(dot(direction, normal));
+}
+
+// Light sampling from a shading point:
+//
+// Sampling the whole surface of a light wastes the samples that land on its
+// far side. Ellipsoids that are close to spheres are sampled by the cone of
+// directions of their bounding sphere instead, which they nearly fill. Boxes
+// are sampled on the faces that face the point, chosen by their area projected
+// towards it. Elongated ellipsoids, and points inside of a bounding sphere or
+// a box, keep sampling the whole surface. The choice only depends on the light
+// and the point, so light_pdf makes the same one for MIS.
+const f32 LIGHT_CONE_MAX_ELONGATION = 1.25f; // Ratio of the longest to the shortest semi-axis
+
+// Returns false unless the ellipsoid is sampled by the cone of its bounding
+// sphere from the point, and one minus the cosine of the cone angle if it is
+bool ellipsoid_cone(Primitive *ellipsoid, Vector3 point, f32 *one_minus_cos)
+{
+    f32 radius = max(ellipsoid->parameters);
+    if (radius > LIGHT_CONE_MAX_ELONGATION * min(ellipsoid->parameters)) {
+        return false;
+    }
+
+    f32 distance_sq = length_sq(ellipsoid->position - point);
+    if (distance_sq <= radius * radius) {
+        return false;
+    }
+
+    f32 sin_sq = radius * radius / distance_sq;
+    *one_minus_cos = sin_sq / (1.0f + sqrtf(1.0f - sin_sq));
+
+    return true;
+}
+
+f32 box_face_area(Vector3 dimensions, u32 axis)
+{
+    return 4 * dimensions[(axis + 1) % 3] * dimensions[(axis + 2) % 3];
+}
+
+// The faces of a box that face a point outside of it, at most one per axis
+struct Box_Faces
+{
+    Vector3 signs;         // Of the facing face of every axis, 0 where neither face does
+    Vector3 probabilities; // Of sampling the face of every axis
+};
+
+// Returns false when the point is inside of the box and sees all faces
+bool box_faces(Primitive *box, Vector3 point, Box_Faces *faces)
+{
+    Vector3 dimensions = box->parameters;
+    Vector3 p = rotate(point - box->position, conj(box->rotation));
+
+    // All three axes at once, the pad lane never faces the point
+    __m128 sign_bits = _mm_and_ps(p.m, _mm_set1_ps(-0.0f));
+    __m128 height = _mm_sub_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), p.m), dimensions.m);
+    __m128 facing = _mm_cmpgt_ps(height, _mm_setzero_ps());
+
+    // From the center of the face of every axis the point is p with that
+    // coordinate replaced by the height, summed in the order dot() sums
+    __m128 squares = _mm_mul_ps(p.m, p.m);
+    __m128 heights = _mm_mul_ps(height, height);
+    __m128 x = _mm_blend_ps(_mm_shuffle_ps(squares, squares, _MM_SHUFFLE(0, 0, 0, 0)), heights, 0x1);
+    __m128 y = _mm_blend_ps(_mm_shuffle_ps(squares, squares, _MM_SHUFFLE(1, 1, 1, 1)), heights, 0x2);
+    __m128 z = _mm_blend_ps(_mm_shuffle_ps(squares, squares, _MM_SHUFFLE(2, 2, 2, 2)), heights, 0x4);
+    __m128 distances = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(x, y), z));
+
+    // Area times the cosine towards the center of the face, see box_face_area
+    __m128 areas = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.0f), rotate_lanes(dimensions.m)), rotate_lanes(rotate_lanes(dimensions.m)));
+    __m128 probabilities = _mm_and_ps(_mm_div_ps(_mm_mul_ps(areas, height), distances), facing);
+
+    f32 total = sum3(probabilities);
+    if (total == 0) {
+        *faces = {};
+        return false;
+    }
+
+    faces->signs = vector3(_mm_and_ps(_mm_or_ps(sign_bits, _mm_set1_ps(1.0f)), facing));
+    faces->probabilities = vector3(probabilities) / total;
+    return true;
+}
+
+// Uniform point on one of the facing faces
+Vector3 facing_box(Xoroshiro128 *xoroshiro, Primitive *box, Box_Faces *faces)
+{
+    f32 random_u = 2 * xoroshiro_next_f32(xoroshiro) - 1;
+    f32 random_v = 2 * xoroshiro_next_f32(xoroshiro) - 1;
+
+    // The last face that can be sampled catches rounding in the sum
+    f32 random_number = xoroshiro_next_f32(xoroshiro);
+    f32 cumulative = 0.0f;
+    u32 axis = 0;
+    for (u32 i = 0; i < 3; i++) {
+        if (faces->probabilities[i] > 0) {
+            axis = i;
+            cumulative += faces->probabilities[i];
+            if (random_number < cumulative) {
+                break;
+            }
+        }
+    }
+
+    f32 coordinates[3];
+    coordinates[axis] = faces->signs[axis];
+    coordinates[(axis + 1) % 3] = random_u;
+    coordinates[(axis + 2) % 3] = random_v;
+    Vector3 point = {coordinates[0], coordinates[1], coordinates[2]};
+
+    return box->position + rotate(box->parameters * point, box->rotation);
+}
+
+// Density of a point on the face of the axis, per unit area
+f32 facing_box_pdf(Primitive *box, Box_Faces *faces, u32 axis)
+{
+    return faces->probabilities[axis] / box_face_area(box->parameters, axis);
+}
+
+// Direction from the point towards a sample of the light. Where the whole
+// surface of the light is sampled, a point drawn ahead is taken if given.
+template <u32 FEATURES = FEATURES_ALL>
+Vector3 sample_light(Xoroshiro128 *xoroshiro, Primitive *light, Vector3 point, const Vector3 *surface_point = nullptr)
+{
+    if (primitive_type<FEATURES>(light) == PRIMITIVE_BOX) {
+        Box_Faces faces;
+        if (box_faces(light, point, &faces)) {
+            return normalize(facing_box(xoroshiro, light, &faces) - point);
+        }
+
+        return normalize((surface_point ? *surface_point : uniform_box(xoroshiro, light)) - point);
+    }
+
+    f32 one_minus_cos;
+    if (ellipsoid_cone(light, point, &one_minus_cos)) {
+        return uniform_cone(xoroshiro, normalize(light->position - point), one_minus_cos);
+    }
+
+    return normalize((surface_point ? *surface_point : nonuniform_ellipsoid(xoroshiro, light)) - point);
+}
+
+// Whether sample_light samples the whole surface of the light from the point
+bool samples_light_surface(Primitive *light, Vector3 point)
+{
+    if (light->type == PRIMITIVE_BOX) {
+        Box_Faces faces;
+        return !box_faces(light, point, &faces);
+    }
+
+    f32 one_minus_cos;
+    return !ellipsoid_cone(light, point, &one_minus_cos);
+}
+
+// Density of sample_light choosing the direction of the ray from its origin,
+// given the intersection of the ray with the light
+template <u32 FEATURES = FEATURES_ALL>
+f32 light_pdf(Primitive *light, Ray ray, Intersection intersection)
+{
+    if (FEATURES & FEATURE_COSTS) {
+        path_costs.light_pdfs++;
+    }
+
+    f32 pdf = 0.0f;
+    switch (primitive_type<FEATURES>(light)) {
+    case PRIMITIVE_BOX:
+        if ((FEATURES & FEATURE_BOXES) && intersection.t > 0) {
+            // Only facing faces are sampled, and the first hit is on one of them
+            Box_Faces faces;
+            if (box_faces(light, ray.origin, &faces)) {
+                Vector3 normal = rotate(intersection.normal, conj(light->rotation));
+                u32 axis = ABS(normal.x) > ABS(normal.y) ? 0 : 1;
+                axis = ABS(normal.z) > ABS(normal[axis]) ? 2 : axis;
+
+                pdf = facing_box_pdf(light, &faces, axis) * area_formulation_density(intersection.t, ray.direction, intersection.normal);
+                break;
+            }
+
+            pdf += box_pdf(light) * area_formulation_density(intersection.t, ray.direction, intersection.normal);
+            if (intersection.t_other > 0) {
+                pdf += box_pdf(light) * area_formulation_density(intersection.t_other, ray.direction, intersection.normal_other);
+            }
+        }
+        break;
+    case PRIMITIVE_ELLIPSOID:
+        if ((FEATURES & FEATURE_ELLIPSOIDS) && intersection.t > 0) {
+            f32 one_minus_cos;
+            if (ellipsoid_cone(light, ray.origin, &one_minus_cos)) {
+                pdf = cone_pdf(one_minus_cos);
+                break;
+            }
+
+            pdf += ellipsoid_pdf(ray.origin + intersection.t * ray.direction, light) * area_formulation_density(intersection.t, ray.direction, intersection.normal);
+            if (intersection.t_other > 0) {
+                pdf += ellipsoid_pdf(ray.origin + intersection.t_other * ray.direction, light) *
+                    area_formulation_density(intersection.t_other, ray.direction, intersection.normal_other);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    return pdf;
+}
+
+template <u32 FEATURES = FEATURES_ALL>
+f32 light_pdf(Primitive *light, Ray ray)
+{
+    return light_pdf<FEATURES>(light, ray, intersect_once<FEATURES>(light, ray));
+}
+
+// Cylindrical mapping of the unit square to the sphere of directions: x is
+// the cosine of the polar angle and y the azimuth, both rescaled
+Vector3 square_to_sphere(f32 x, f32 y)
+{
+    f32 z = 2.0f * x - 1.0f;
+    f32 r = sqrtf(MAX(0.0f, 1.0f - z * z));
+    f32 phi = 2.0f * PI * y;
+
+    return {r * cosf(phi), r * sinf(phi), z};
+}
+
+void sphere_to_square(Vector3 direction, f32 *x, f32 *y)
+{
+    f32 phi = atan2f(direction.y, direction.x);
+    if (phi < 0) {
+        phi += 2.0f * PI;
+    }
+
+    *x = CLAMP(0.5f * (direction.z + 1.0f), 0.0f, 1.0f);
+    *y = CLAMP(phi / (2.0f * PI), 0.0f, 1.0f);
+}
+
+// The leaf of the guide whose region holds the point, in the tree of the
+// direction closest to the normal
+Guide_Leaf *find_guide_leaf(Guide *guide, Vector3 point, Vector3 normal)
+{
+    u32 axis = ABS(normal.x) > ABS(normal.y) ? 0 : 1;
+    axis = ABS(normal.z) > ABS(normal[axis]) ? 2 : axis;
+
+    AABB bounds = guide->bounds;
+    Guide_Node *node = &guide->nodes.data[2 * axis + (normal[axis] < 0)];
+    while (node->children) {
+        u32 axis = node->axis;
+        f32 middle = 0.5f * (bounds.min[axis] + bounds.max[axis]);
+        if (point[axis] < middle) {
+            bounds.max[axis] = middle;
+            node = &guide->nodes.data[node->children];
+        } else {
+            bounds.min[axis] = middle;
+            node = &guide->nodes.data[node->children + 1];
+        }
+    }
+
+    return &guide->leaves.data[node->leaf];
+}
+
+// Point of the unit square in proportion to the radiance learned by the
+// quadtree, which must have some
+void quadtree_sample(Xoroshiro128 *xoroshiro, Quadtree *tree, f32 *x, f32 *y)
+{
+    f32 size = 1;
+    *x = 0, *y = 0;
+    Quadtree_Node *node = &tree->nodes.data[0];
+    for (;;) {
+        f32 total = node->sums[0] + node->sums[1] + node->sums[2] + node->sums[3];
+        f32 r = xoroshiro_next_f32(xoroshiro) * total;
+
+        u32 child = 0;
+        while (child < 3 && (r >= node->sums[child] || node->sums[child] == 0)) {
+            r -= node->sums[child];
+            child++;
+        }
+        // Rounding can run past the last child with radiance
+        while (node->sums[child] == 0) {
+            child--;
+        }
+
+        size *= 0.5f;
+        *x += (child & 1) * size;
+        *y += (child >> 1) * size;
+        if (!node->children[child]) {
+            break;
+        }
+        node = &tree->nodes.data[node->children[child]];
+    }
+
+    *x += size * xoroshiro_next_f32(xoroshiro);
+    *y += size * xoroshiro_next_f32(xoroshiro);
+}
+
+// Solid angle density of quadtree_sample at the direction of the point
+f32 quadtree_pdf(Quadtree *tree, f32 x, f32 y)
+{
+    if (tree->total <= 0) {
+        return 0.0f;
+    }
+
+    f32 density = 1.0f;
+    Quadtree_Node *node = &tree->nodes.data[0];
+    for (;;) {
+        u32 child = (x >= 0.5f) | ((y >= 0.5f) << 1);
+        f32 total = node->sums[0] + node->sums[1] + node->sums[2] + node->sums[3];
+
+        density *= 4.0f * node->sums[child] / total;
+        if (!node->children[child] || density == 0) {
+            break;
+        }
+
+        x = 2.0f * x - (child & 1);
+        y = 2.0f * y - (child >> 1);
+        node = &tree->nodes.data[node->children[child]];
+    }
+
+    return density / (4.0f * PI);
+}
+
+void quadtree_record(Quadtree *tree, f32 x, f32 y, f32 value)
+{
+    Quadtree_Node *node = &tree->nodes.data[0];
+    for (;;) {
+        u32 child = (x >= 0.5f) | ((y >= 0.5f) << 1);
+        if (!node->children[child]) {
+            atomic_add_f32(&node->sums[child], value);
+            return;
+        }
+
+        x = 2.0f * x - (child & 1);
+        y = 2.0f * y - (child >> 1);
+        node = &tree->nodes.data[node->children[child]];
+    }
+}
+
+// Trains the leaves of the vertices of a finished path with the radiance that
+// reached the camera through them. Every vertex records the incident radiance
+// over the density of its direction into its quadtree, and its share of the
+// gradient of the mixture weight. Colors are reduced to their luminance.
+void guide_train(Guide_Path *guide_path, Vector3 radiance)
+{
+    for (u32 i = 0; i < guide_path->num_vertices; i++) {
+        Guide_Vertex *vertex = &guide_path->vertices[i];
+        Guide_Leaf *leaf = vertex->leaf;
+
+        f32 incident = luminance(radiance - vertex->radiance);
+        f32 throughput = luminance(vertex->throughput);
+        f32 next_throughput = luminance(vertex->next_throughput);
+        if (!(throughput > 0 && next_throughput > 0)) {
+            continue;
+        }
+
+        // The incident radiance over the density, and the BRDF times the cosine
+        // times the incident radiance over the density
+        f32 value  = incident / (next_throughput * vertex->pdf);
+        f32 weight = incident / throughput;
+        if (!(value < INFINITY && weight < INFINITY)) {
+            continue;
+        }
+
+        if (value > 0) {
+            quadtree_record(&leaf->building, vertex->x, vertex->y, value);
+        }
+        __atomic_fetch_add(&leaf->num_samples, 1, __ATOMIC_RELAXED);
+
+        if (leaf->sampling.total > 0 && weight > 0) {
+            atomic_add_f32(&leaf->gradient_sum, weight * (vertex->bsdf_pdf - vertex->guide_pdf) / vertex->pdf);
+            atomic_add_f32(&leaf->weight_sum, weight);
+        }
+    }
+}
+
+// Density estimate of the caustic flux that arrives at the point from the
+// side of the normal, per unit area. Cells whose coordinates hash to a bucket
+// already visited are skipped, its photons have all been counted.
+Vector3 gather_photons(Photon_Map *map, Vector3 point, Vector3 normal)
+{
+    f32 radius_sq = map->radius * map->radius;
+
+    s32 x_min = photon_cell(map, point.x - map->radius), x_max = photon_cell(map, point.x + map->radius);
+    s32 y_min = photon_cell(map, point.y - map->radius), y_max = photon_cell(map, point.y + map->radius);
+    s32 z_min = photon_cell(map, point.z - map->radius), z_max = photon_cell(map, point.z + map->radius);
+
+    u32 visited[8];
+    u32 num_visited = 0;
+
+    Vector3 sum = {};
+    for (s32 z = z_min; z <= z_max; z++) {
+        for (s32 y = y_min; y <= y_max; y++) {
+            for (s32 x = x_min; x <= x_max; x++) {
+                u32 bucket = photon_bucket(map, x, y, z);
+
+                bool seen = false;
+                for (u32 i = 0; i < num_visited; i++) {
+                    seen |= visited[i] == bucket;
+                }
+                if (seen || num_visited == array_size(visited)) {
+                    continue;
+                }
+                visited[num_visited++] = bucket;
+
+                u32 begin = bucket > 0 ? map->bucket_ends.data[bucket - 1] : 0;
+                u32 end = map->bucket_ends.data[bucket];
+                for (u32 i = begin; i < end; i++) {
+                    Photon *photon = &map->photons.data[i];
+                    if (length_sq(photon->position - point) < radius_sq && dot(photon->direction, normal) < 0) {
+                        sum += photon->power;
+                    }
+                }
+            }
+        }
+    }
+
+    return sum * map->normalization;
+}
+
+// The entry of the key, claimed if the key has none yet. Null if the entries
+// it may be in are all taken by others.
+Cache_Entry *find_cache_entry(Radiance_Cache *cache, u64 key)
+{
+    u32 checksum = (u32) (key >> 32) | 1;
+    for (u32 probe = 0; probe < CACHE_MAX_PROBES; probe++) {
+        Cache_Entry *entry = &cache->entries[(key + probe) & cache->mask];
+
+        u32 expected = __atomic_load_n(&entry->checksum, __ATOMIC_RELAXED);
+        if (expected == 0 && __atomic_compare_exchange_n(&entry->checksum, &expected, checksum, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return entry;
+        }
+        if (expected == checksum) {
+            return entry;
+        }
+    }
+
+    return nullptr;
+}
+
+// Adds the radiance that left every vertex of a finished path, the radiance
+// that reached the camera through it over the throughput up to it, to the
+// entries of the vertices
+void cache_train(Cache_Path *cache_path, Vector3 radiance)
+{
+    for (u32 i = 0; i < cache_path->num_vertices; i++) {
+        Cache_Vertex *vertex = &cache_path->vertices[i];
+
+        Vector3 value = (radiance - vertex->radiance) / vertex->throughput;
+        if (!(value.x < INFINITY && value.y < INFINITY && value.z < INFINITY)) {
+            continue;
+        }
+
+        for (u32 c = 0; c < 3; c++) {
+            atomic_add_f32(&vertex->entry->sums[c], value[c]);
+        }
+        __atomic_fetch_add(&vertex->entry->count, 1, __ATOMIC_RELEASE);
+    }
+}
+
+Vector3 aces_tonemap(Vector3 x)
+{
+    const Vector3 A = {2.51f, 2.51f, 2.51f};
+    const Vector3 B = {0.03f, 0.03f, 0.03f};
+    const Vector3 C = {2.43f, 2.43f, 2.43f};
+    const Vector3 D = {0.59f, 0.59f, 0.59f};
+    const Vector3 E = {0.14f, 0.14f, 0.14f};
+
+    return pow(clamp((x * (A * x + B)) / (x * (C * x + D) + E), 0.0f, 1.0f), 1.0f / 2.2f);
+}
+
+// Averages and tonemaps the sums of the given number of paths per pixel
+void resolve_kernel(Scene *scene, Vector3 *accumulation, u32 samples, u8 *pixels)
+{
+    for (u32 i = 0; i < scene->width * scene->height; i++) {
+        Vector3 out_color = aces_tonemap(accumulation[i] / samples);
+
+        pixels[3 * i + 0] = ROUND_COLOR(out_color.r);
+        pixels[3 * i + 1] = ROUND_COLOR(out_color.g);
+        pixels[3 * i + 2] = ROUND_COLOR(out_color.b);
+    }
+}
+
+// Accounts for the surface hit by path->ray and scatters the path off it.
+// Returns false when the path terminates.
+template <u32 FEATURES = FEATURES_ALL>
+bool scatter(Scene *scene, Path *path, Intersection intersection, Primitive *closest)
+{
+    // Only boxes and ellipsoids can be sampled lights
+    const u32 LIGHT_FEATURES = FEATURES & (FEATURE_ELLIPSOIDS | FEATURE_BOXES | FEATURE_COSTS);
+
+    Ray ray = path->ray;
+    Vector3 intersection_point = ray.origin + intersection.t * ray.direction;
+
+    // Emission that next-event estimation at the previous vertex could have
+    // sampled as well is weighted by multiple importance sampling
+    f32 emission_weight = 1.0f;
+    if ((FEATURES & FEATURE_LIGHTS) && path->brdf_pdf > 0 && primitive_type<FEATURES>(closest) != PRIMITIVE_PLANE && length_sq(closest->emission) > 0) {
+        f32 pdf = light_pdf<LIGHT_FEATURES>(closest, ray) / scene->sampled_lights.size;
+        emission_weight = mis_weight(path->brdf_pdf, pdf);
+    }
+
+    // Emission of sampled lights seen from a diffuse vertex through specular
+    // ones alone was gathered from the photon map at that vertex
+    if ((FEATURES & FEATURE_LIGHTS) && path->gathered && path->brdf_pdf == 0 && primitive_type<FEATURES>(closest) != PRIMITIVE_PLANE) {
+        emission_weight = 0.0f;
+    }
+
+    path->radiance += path->throughput * closest->emission * emission_weight;
+    path->depth += 1;
+    path->brdf_pdf = 0.0f;
+
+    Xoroshiro128 *xoroshiro = &scene->xoroshiro;
+    switch (surface_type<FEATURES>(closest)) {
+    case SURFACE_DIFFUSE: {
+        if (!(FEATURES & FEATURE_DIFFUSE)) {
+            break;
+        }
+
+        Vector3 origin = intersection_point + 1E-4 * intersection.normal;
+        Vector3 brdf = closest->color / PI;
+
+        // Past the first diffuse vertex, a voxel of the radiance cache with
+        // enough samples ends the path with their average. The point is
+        // jittered within the voxel in the tangent plane, which turns the
+        // blocks of the voxels into noise. Voxels without enough samples yet
+        // are trained by the path.
+        Radiance_Cache *cache = scene->radiance_cache;
+        if (cache && cache_path) {
+            if (cache_path->bounced) {
+                Vector3 tangent, bitangent;
+                orthonormal_basis(intersection.normal, &tangent, &bitangent);
+
+                f32 u = xoroshiro_next_f32(xoroshiro) - 0.5f;
+                f32 v = xoroshiro_next_f32(xoroshiro) - 0.5f;
+                Vector3 point = intersection_point + cache->voxel_size * (u * tangent + v * bitangent);
+
+                Cache_Entry *entry = find_cache_entry(cache, cache_key(cache, point, intersection.normal));
+                if (entry) {
+                    u32 count = __atomic_load_n(&entry->count, __ATOMIC_ACQUIRE);
+                    if (count >= cache->min_samples) {
+                        Vector3 sums = {atomic_load_f32(&entry->sums[0]), atomic_load_f32(&entry->sums[1]), atomic_load_f32(&entry->sums[2])};
+                        path->radiance += path->throughput * sums / (f32) count;
+                        return false;
+                    }
+
+                    if (cache_path->num_vertices < CACHE_MAX_VERTICES) {
+                        cache_path->vertices[cache_path->num_vertices++] = {
+                            .entry      = entry,
+                            .throughput = path->throughput,
+                            .radiance   = path->radiance,
+                        };
+                    }
+                }
+            }
+            cache_path->bounced = true;
+        }
+
+        // With a guide, directions are sampled from a mixture of the BRDF and
+        // the radiance learned around the point, once there is some
+        Guide_Leaf *guide_leaf = nullptr;
+        f32 bsdf_fraction = 1.0f;
+        if (scene->guide) {
+            guide_leaf = find_guide_leaf(scene->guide, origin, intersection.normal);
+            if (guide_leaf->sampling.total > 0) {
+                bsdf_fraction = guide_leaf->bsdf_fraction;
+            }
+        }
+
+        // Next-event estimation: sample a direction towards one of the lights
+        // and add its direct contribution if nothing blocks the way to it.
+        // Past the last vertex whose continuation is traced, the shadow ray
+        // would be one segment more than ray_depth, and without the BRDF half
+        // of its MIS pair.
+        if ((FEATURES & FEATURE_LIGHTS) && scene->sampled_lights.size > 0 && path->depth <= scene->ray_depth) {
+            u32 light_index = path_samples ? path_samples->light_index : xoroshiro_next_u32(xoroshiro, scene->sampled_lights.size - 1);
+            Primitive *light = &scene->primitives[scene->sampled_lights[light_index]];
+
+            Ray shadow_ray = {
+                .origin = origin,
+                .direction = sample_light<LIGHT_FEATURES>(xoroshiro, light, origin, path_samples && path_samples->light_point_drawn ? &path_samples->light_point : nullptr),
+            };
+
+            f32 cosine = dot(shadow_ray.direction, intersection.normal);
+            if (cosine > 0) {
+                // What is seen in the direction is the first hit with the light,
+                // a cone direction may also miss a light that is not a sphere.
+                Intersection light_hit = intersect_once<LIGHT_FEATURES>(light, shadow_ray);
+                f32 pdf = light_pdf<LIGHT_FEATURES>(light, shadow_ray, light_hit) / scene->sampled_lights.size;
+
+                if (light_hit.t > 0 && pdf > 0) {
+                    bool blocked = occluded<FEATURES & (FEATURES_PRIMITIVES | FEATURE_COSTS)>(scene, shadow_ray, light_hit.t * (1 - 1E-4f));
+                    if (!blocked) {
+                        f32 brdf_pdf = cosine_pdf(shadow_ray.direction, intersection.normal);
+                        if (bsdf_fraction < 1) {
+                            f32 x, y;
+                            sphere_to_square(shadow_ray.direction, &x, &y);
+                            brdf_pdf = bsdf_fraction * brdf_pdf + (1 - bsdf_fraction) * quadtree_pdf(&guide_leaf->sampling, x, y);
+                        }
+
+                        f32 weight = mis_weight(pdf, brdf_pdf);
+                        path->radiance += path->throughput * light->emission * brdf * (weight * cosine / pdf);
+                    }
+
+                    if (touch_record) {
+                        record_touch(light - scene->primitives.data);
+                        record_segment(shadow_ray, light_hit.t);
+                        if (blocked) {
+                            record_touch(last_occluder);
+                        }
+                    }
+                }
+            }
+        }
+
+        // Caustics come from the photon map, which holds the light that
+        // arrives through specular surfaces
+        if (scene->photon_map) {
+            path->radiance += path->throughput * brdf * gather_photons(scene->photon_map, intersection_point, intersection.normal);
+            path->gathered = true;
+        }
+
+        // Continue the path by sampling the BRDF. If it hits a sampled light,
+        // the emission is weighted against next-event estimation at that point.
+        // Guided vertices keep the point of the unit square of the direction.
+        Ray next_ray = {
+            .origin = origin,
+        };
+        f32 x = 0, y = 0;
+        if (bsdf_fraction < 1 && xoroshiro_next_f32(xoroshiro) >= bsdf_fraction) {
+            quadtree_sample(xoroshiro, &guide_leaf->sampling, &x, &y);
+            next_ray.direction = square_to_sphere(x, y);
+        } else {
+            next_ray.direction = path_samples ? path_samples->bounce_direction : cosine_weighted(xoroshiro, intersection.normal);
+            if (guide_leaf) {
+                sphere_to_square(next_ray.direction, &x, &y);
+            }
+        }
+
+        // Ignore rays that are obstructed by the primitive itself.
+        // Diffuse BRDF guarantees that they do not affect the resulting color.
+        f32 cosine = dot(next_ray.direction, intersection.normal);
+        if (cosine <= 0) {
+            return false;
+        }
+
+        f32 bsdf_pdf  = cosine_pdf(next_ray.direction, intersection.normal);
+        f32 guide_pdf = bsdf_fraction < 1 ? quadtree_pdf(&guide_leaf->sampling, x, y) : 0.0f;
+        f32 pdf = bsdf_fraction < 1 ? bsdf_fraction * bsdf_pdf + (1 - bsdf_fraction) * guide_pdf : bsdf_pdf;
+
+        Vector3 throughput = path->throughput;
+        path->throughput *= brdf * (cosine / pdf);
+        path->ray = next_ray;
+        path->brdf_pdf = pdf;
+
+        if (guide_leaf && guide_path && guide_path->num_vertices < GUIDE_MAX_VERTICES) {
+            guide_path->vertices[guide_path->num_vertices++] = {
+                .leaf            = guide_leaf,
+                .x               = x,
+                .y               = y,
+                .throughput      = throughput,
+                .next_throughput = path->throughput,
+                .radiance        = path->radiance,
+                .pdf             = pdf,
+                .bsdf_pdf        = bsdf_pdf,
+                .guide_pdf       = guide_pdf,
+            };
+        }
+    } break;
+    case SURFACE_METALLIC: {
+        if (!(FEATURES & FEATURE_METALLIC)) {
+            break;
+        }
+
+        Ray reflected_ray = {
+            .origin = intersection_point + 1E-4 * intersection.normal,
+            .direction = reflect(-ray.direction, intersection.normal),
+        };
+
+        path->throughput *= closest->color;
+        path->ray = reflected_ray;
+    } break;
+    case SURFACE_DIELECTRIC: {
+        if (!(FEATURES & FEATURE_DIELECTRIC)) {
+            break;
+        }
+
+        Ray reflected_ray = {
+            .origin = intersection_point + 1E-4 * intersection.normal,
+            .direction = reflect(-ray.direction, intersection.normal),
+        };
+        path->ray = reflected_ray;
+
+        f32 ior_quotient = intersection.inner ? closest->ior : (1 / closest->ior);
+        f32 cos_1 = dot(intersection.normal, -ray.direction);
+        f32 sin_2 = ior_quotient * sqrtf(1 - cos_1 * cos_1);
+        if (sin_2 <= 1) {
+            f32 reflection_coefficient = SQUARE((ior_quotient - 1) / (ior_quotient + 1));
+            f32 r = reflection_coefficient + (1 - reflection_coefficient) * powf(1 - cos_1, 5.0f);
+            f32 random_number_in_unit_inverval = xoroshiro_next_f32(xoroshiro);
+            if (random_number_in_unit_inverval >= r) {
+                f32 cos_2 = sqrtf(1 - sin_2 * sin_2);
+                Ray refracted_ray = {
+                    .origin = intersection_point - 1E-4 * intersection.normal,
+                    .direction = normalize(ior_quotient * ray.direction + (ior_quotient * cos_1 - cos_2) * intersection.normal),
+                };
+
+                if (!intersection.inner) {
+                    path->throughput *= closest->color;
+                }
+
+                path->ray = refracted_ray;
+            }
+        }
+    } break;
+    }
+
+    return true;
+}
+
+template <u32 FEATURES>
+Vector3 ray_trace_kernel(Scene *scene, Ray ray, u32 depth)
+{
+    Path path = {
+        .ray = ray,
+        .throughput = {1, 1, 1},
+        .depth = depth,
+    };
+
+    Guide_Path guided;
+    if (scene->guide) {
+        guided.num_vertices = 0;
+        guide_path = &guided;
+    }
+
+    Cache_Path cached;
+    if (scene->radiance_cache) {
+        cached.num_vertices = 0;
+        cached.bounced = false;
+        cache_path = &cached;
+    }
+
+    while (path.depth <= scene->ray_depth) {
+        if (FEATURES & FEATURE_COSTS) {
+            path_costs.bounces++;
+        }
+
+        Primitive *closest = nullptr;
+        Intersection intersection = intersect<FEATURES & (FEATURES_PRIMITIVES | FEATURE_COSTS)>(scene, path.ray, &closest);
+
+        if (touch_record) {
+            record_segment(path.ray, closest ? intersection.t : INFINITY);
+            if (closest) {
+                record_touch(closest - scene->primitives.data);
+            }
+        }
+
+        if (!closest) {
+            path.radiance += path.throughput * scene->background_color;
+            break;
+        }
+
+        if (!scatter<FEATURES>(scene, &path, intersection, closest)) {
+            break;
+        }
+    }
+
+    if (scene->guide) {
+        guide_train(&guided, path.radiance);
+    }
+    guide_path = nullptr;
+
+    if (scene->radiance_cache) {
+        cache_train(&cached, path.radiance);
+    }
+    cache_path = nullptr;
+
+    return path.radiance;
+}
+
+template <u32 FEATURES>
+Intersection intersect_kernel(Scene *scene, Ray world_ray, Primitive **closest, f32 t_max)
+{
+    return intersect<FEATURES & (FEATURES_PRIMITIVES | FEATURE_COSTS)>(scene, world_ray, closest, t_max);
+}
+
+FORCE_INLINE Ray stream_ray(Ray_Stream rays, u32 i)
+{
+    return {
+        .origin    = {rays.origin[0][i], rays.origin[1][i], rays.origin[2][i]},
+        .direction = {rays.direction[0][i], rays.direction[1][i], rays.direction[2][i]},
+    };
+}
+
+// Batched queries of the library. They are compiled once per set of primitive
+// types, so the type dispatch and the unused types are out of the loop.
+template <u32 FEATURES>
+void intersect_stream(Scene *scene, Ray_Stream rays, Hit_Stream hits, const u32 *order, u32 first, u32 end)
+{
+    for (u32 k = first; k < end; k++) {
+        u32 i = order ? order[k] : k;
+
+        Primitive *closest;
+        Intersection intersection = intersect<FEATURES>(scene, stream_ray(rays, i), &closest, rays.t_max ? rays.t_max[i] : INFINITY);
+
+        if (!closest) {
+            hits.t[i] = INFINITY;
+            hits.primitive[i] = U32_MAX;
+            if (hits.normal[0]) {
+                hits.normal[0][i] = hits.normal[1][i] = hits.normal[2][i] = 0;
+            }
+            continue;
+        }
+
+        hits.t[i] = intersection.t;
+        hits.primitive[i] = (u32) (closest - scene->primitives.data);
+        if (hits.normal[0]) {
+            hits.normal[0][i] = intersection.normal.x;
+            hits.normal[1][i] = intersection.normal.y;
+            hits.normal[2][i] = intersection.normal.z;
+        }
+    }
+}
+
+// Consecutive rays of a batch tend to be blocked by the same primitive, which
+// occluded tries first
+template <u32 FEATURES>
+void occluded_stream(Scene *scene, Ray_Stream rays, u8 *occluded_rays, const u32 *order, u32 first, u32 end)
+{
+    for (u32 k = first; k < end; k++) {
+        u32 i = order ? order[k] : k;
+        occluded_rays[i] = occluded<FEATURES>(scene, stream_ray(rays, i), rays.t_max ? rays.t_max[i] : INFINITY);
+    }
+}
+
+template <u32 FEATURES>
+constexpr Scene_Kernels make_kernels()
+{
+    return {
+        FEATURES, ray_trace_kernel<FEATURES>, intersect_kernel<FEATURES>, scatter<FEATURES>, resolve_kernel,
+        intersect_stream<FEATURES & FEATURES_PRIMITIVES>, occluded_stream<FEATURES & FEATURES_PRIMITIVES>,
+    };
+}
+
+// Every combination of primitive types with planes, and of the common surface
+// sets, with and without sampled lights. Anything else runs FEATURES_ALL.
+#define SCENE_KERNELS_FOR_SURFACES(features)                                                        \
+    make_kernels<(features) | FEATURE_DIFFUSE>(),                                                   \
+    make_kernels<(features) | FEATURE_DIFFUSE | FEATURE_METALLIC>(),                                \
+    make_kernels<(features) | FEATURE_DIFFUSE | FEATURE_DIELECTRIC>(),                              \
+    make_kernels<(features) | FEATURE_DIFFUSE | FEATURE_METALLIC | FEATURE_DIELECTRIC>()
+#define SCENE_KERNELS_FOR_LIGHTS(features)                                                          \
+    SCENE_KERNELS_FOR_SURFACES(features),                                                           \
+    SCENE_KERNELS_FOR_SURFACES((features) | FEATURE_LIGHTS)
+
+const Scene_Kernels SCENE_KERNELS[] = {
+    SCENE_KERNELS_FOR_LIGHTS(FEATURE_ELLIPSOIDS),
+    SCENE_KERNELS_FOR_LIGHTS(FEATURE_BOXES),
+    SCENE_KERNELS_FOR_LIGHTS(FEATURE_ELLIPSOIDS | FEATURE_BOXES),
+    SCENE_KERNELS_FOR_LIGHTS(FEATURE_PLANES | FEATURE_ELLIPSOIDS),
+    SCENE_KERNELS_FOR_LIGHTS(FEATURE_PLANES | FEATURE_BOXES),
+    SCENE_KERNELS_FOR_LIGHTS(FEATURE_PLANES | FEATURE_ELLIPSOIDS | FEATURE_BOXES),
+    make_kernels<FEATURES_ALL>(),
+};
+
+#undef SCENE_KERNELS_FOR_SURFACES
+#undef SCENE_KERNELS_FOR_LIGHTS
+
+// Any scene, counting the work of its paths for the heatmap
+const Scene_Kernels COST_KERNELS = make_kernels<FEATURES_ALL | FEATURE_COSTS>();
@@ -0,0 +1,292 @@
+// The intersection engine as a shared library, with the C API of
+// include/ray.h.
+//
+// Built from the same unity build as the renderer, without its main. A query
+// runs the stream kernels of the scene (see intersect_stream in kernels.cpp),
+// which are compiled for the primitive types of the scene and the instruction
+// set of the device, in chunks of rays spread over the threads of the device,
+// optionally sorted for coherence first as the sorted renderer sorts its paths.
+
+#define RAY_BUILD_LIBRARY
+#ifndef RAY_NO_MAIN
+#define RAY_NO_MAIN
+#endif
+#include "main.cpp"
+#include "../include/ray.h"
+
+PRIVATE_NAMESPACE_BEGIN
+
+const u32 QUERY_CHUNK_SIZE = 1024; // Rays per task of a parallel query
+
+// What the opaque handles of the API point to
+struct Library_Device
+{
+    Instruction_Set isa;
+    Thread_Pool     pool;
+    Os_Mutex       *mutex; // Parallel queries take turns on the pool
+};
+
+struct Library_Scene
+{
+    Library_Device *device;
+    Scene           scene;
+    bool            committed;
+};
+
+Ray_Stream to_ray_stream(const Ray_Rays *rays)
+{
+    return {
+        .origin    = {rays->origin_x, rays->origin_y, rays->origin_z},
+        .direction = {rays->direction_x, rays->direction_y, rays->direction_z},
+        .t_max     = rays->t_max,
+    };
+}
+
+bool valid_rays(const Ray_Rays *rays)
+{
+    return rays && rays->origin_x && rays->origin_y && rays->origin_z && rays->direction_x && rays->direction_y && rays->direction_z;
+}
+
+// The indices of the rays sorted by direction octant and the Morton code of
+// their origin, as sort_paths orders paths
+u32 *sort_rays(Scene *scene, Ray_Stream rays, u32 count)
+{
+    AABB bounds = scene->bvh.bounds;
+    Vector3 extent = bounds.max - bounds.min;
+    Vector3 scale = {};
+    for (u32 axis = 0; axis < 3; axis++) {
+        if (extent[axis] > 0) {
+            scale[axis] = ((1 << SORT_MORTON_BITS) - 1) / extent[axis];
+        }
+    }
+
+    u64 *keys    = (u64 *) os_allocate(2 * (u64) count * sizeof(u64));
+    u64 *scratch = keys + count;
+    for (u32 i = 0; i < count; i++) {
+        Ray ray = {
+            .origin    = {rays.origin[0][i], rays.origin[1][i], rays.origin[2][i]},
+            .direction = {rays.direction[0][i], rays.direction[1][i], rays.direction[2][i]},
+        };
+        keys[i] = ((u64) ray_sort_key(ray, bounds.min, scale) << 32) | i;
+    }
+
+    u64 *sorted = radix_sort_keys(keys, scratch, count);
+    u32 *order = (u32 *) os_allocate(count * sizeof(u32));
+    for (u32 i = 0; i < count; i++) {
+        order[i] = (u32) sorted[i];
+    }
+    os_free(keys, 2 * (u64) count * sizeof(u64));
+
+    return order;
+}
+
+// Runs query(order, first, end) over the rays of a batch, in chunks on the
+// threads of the device when asked to and the batch has more than one chunk
+template <typename F>
+void run_query(Library_Device *device, Scene *scene, Ray_Stream rays, u32 count, u32 flags, F query)
+{
+    u32 *order = nullptr;
+    if ((flags & RAY_QUERY_SORTED) && count > 1) {
+        order = sort_rays(scene, rays, count);
+    }
+
+    u32 num_chunks = (count + QUERY_CHUNK_SIZE - 1) / QUERY_CHUNK_SIZE;
+    if (!(flags & RAY_QUERY_PARALLEL) || num_chunks <= 1 || device->pool.num_threads <= 1) {
+        query(order, 0, count);
+    } else {
+        os_lock(device->mutex);
+        parallel_for(&device->pool, num_chunks, [&] (u32 chunk, u32 thread_index) {
+            u32 first = chunk * QUERY_CHUNK_SIZE;
+            query(order, first, MIN(first + QUERY_CHUNK_SIZE, count));
+        });
+        os_unlock(device->mutex);
+    }
+
+    if (order) {
+        os_free(order, count * sizeof(u32));
+    }
+}
+
+PRIVATE_NAMESPACE_END
+
+extern "C"
+{
+
+uint32_t ray_api_version(void)
+{
+    return RAY_API_VERSION;
+}
+
+Ray_Device *ray_device_create(uint32_t num_threads, const char *instruction_set)
+{
+    using namespace ray;
+
+    Instruction_Set isa;
+    if (!find_instruction_set(instruction_set, supported_instruction_sets(), &isa)) {
+        return nullptr;
+    }
+
+    Library_Device *device = (Library_Device *) os_allocate(sizeof(Library_Device));
+    if (!device) {
+        return nullptr;
+    }
+
+    device->isa   = isa;
+    device->mutex = os_create_mutex();
+    thread_pool_init(&device->pool, num_threads);
+
+    return (Ray_Device *) device;
+}
+
+void ray_device_release(Ray_Device *handle)
+{
+    using namespace ray;
+
+    Library_Device *device = (Library_Device *) handle;
+    if (!device) {
+        return;
+    }
+
+    thread_pool_free(&device->pool);
+    os_destroy_mutex(device->mutex);
+    os_free(device, sizeof(Library_Device));
+}
+
+Ray_Scene *ray_scene_create(Ray_Device *device)
+{
+    using namespace ray;
+
+    if (!device) {
+        return nullptr;
+    }
+
+    Library_Scene *scene = (Library_Scene *) os_allocate(sizeof(Library_Scene));
+    if (!scene) {
+        return nullptr;
+    }
+
+    scene->device    = (Library_Device *) device;
+    scene->scene     = {};
+    scene->committed = false;
+
+    return (Ray_Scene *) scene;
+}
+
+void ray_scene_release(Ray_Scene *handle)
+{
+    using namespace ray;
+
+    Library_Scene *scene = (Library_Scene *) handle;
+    if (!scene) {
+        return;
+    }
+
+    free_scene(&scene->scene);
+    os_free(scene, sizeof(Library_Scene));
+}
+
+Ray_Status ray_scene_add_primitives(Ray_Scene *handle, const Ray_Primitive *primitives, uint32_t count)
+{
+    using namespace ray;
+
+    Library_Scene *scene = (Library_Scene *) handle;
+    if (!scene || (!primitives && count > 0)) {
+        return RAY_INVALID_ARGUMENT;
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        if (primitives[i].type > RAY_PRIMITIVE_BOX) {
+            return RAY_INVALID_ARGUMENT;
+        }
+    }
+
+    u32 first = scene->scene.primitives.size;
+    array_resize(&scene->scene.primitives, first + count);
+
+    for (u32 i = 0; i < count; i++) {
+        const Ray_Primitive *it = &primitives[i];
+
+        Primitive primitive;
+        primitive.type       = (Primitive_Type) it->type;
+        primitive.parameters = {it->parameters[0], it->parameters[1], it->parameters[2]};
+        primitive.position   = {it->position[0], it->position[1], it->position[2]};
+        primitive.rotation   = {it->rotation[0], it->rotation[1], it->rotation[2], it->rotation[3]};
+        scene->scene.primitives[first + i] = primitive;
+    }
+    scene->committed = false;
+
+    return RAY_OK;
+}
+
+// Unlike prepare_scene, keeps the primitives in the order they were added, as
+// the hits refer to them by index
+Ray_Status ray_scene_commit(Ray_Scene *handle)
+{
+    using namespace ray;
+
+    Library_Scene *scene = (Library_Scene *) handle;
+    if (!scene) {
+        return RAY_INVALID_ARGUMENT;
+    }
+
+    bvh8_free(&scene->scene.bvh);
+    build_acceleration_structure(&scene->scene);
+    select_kernels(&scene->scene, scene->device->isa);
+    scene->committed = true;
+
+    return RAY_OK;
+}
+
+Ray_Status ray_intersect(Ray_Scene *handle, const Ray_Rays *rays, Ray_Hits *hits, uint32_t count, uint32_t flags)
+{
+    using namespace ray;
+
+    Library_Scene *scene = (Library_Scene *) handle;
+    if (!scene || !valid_rays(rays) || !hits || !hits->t || !hits->primitive) {
+        return RAY_INVALID_ARGUMENT;
+    }
+    if ((hits->normal_x || hits->normal_y || hits->normal_z) && !(hits->normal_x && hits->normal_y && hits->normal_z)) {
+        return RAY_INVALID_ARGUMENT;
+    }
+    if (!scene->committed) {
+        return RAY_NOT_COMMITTED;
+    }
+
+    Scene *query_scene = &scene->scene;
+    Ray_Stream ray_stream = to_ray_stream(rays);
+    Hit_Stream hit_stream = {
+        .t         = hits->t,
+        .primitive = hits->primitive,
+        .normal    = {hits->normal_x, hits->normal_y, hits->normal_z},
+    };
+
+    run_query(scene->device, query_scene, ray_stream, count, flags, [&] (const u32 *order, u32 first, u32 end) {
+        query_scene->kernels->intersect_stream(query_scene, ray_stream, hit_stream, order, first, end);
+    });
+
+    return RAY_OK;
+}
+
+Ray_Status ray_occluded(Ray_Scene *handle, const Ray_Rays *rays, uint8_t *occluded, uint32_t count, uint32_t flags)
+{
+    using namespace ray;
+
+    Library_Scene *scene = (Library_Scene *) handle;
+    if (!scene || !valid_rays(rays) || !occluded) {
+        return RAY_INVALID_ARGUMENT;
+    }
+    if (!scene->committed) {
+        return RAY_NOT_COMMITTED;
+    }
+
+    Scene *query_scene = &scene->scene;
+    Ray_Stream ray_stream = to_ray_stream(rays);
+
+    run_query(scene->device, query_scene, ray_stream, count, flags, [&] (const u32 *order, u32 first, u32 end) {
+        query_scene->kernels->occluded_stream(query_scene, ray_stream, occluded, order, first, end);
+    });
+
+    return RAY_OK;
+}
+
+}
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <float.h>
 #include <time.h>
+#include <immintrin.h>
 
 #define PRIVATE_NAMESPACE_NAME  ray
 #define PRIVATE_NAMESPACE_BEGIN namespace PRIVATE_NAMESPACE_NAME { namespace {
@@ -16,6 +17,11 @@ PRIVATE_NAMESPACE_BEGIN
 #include "basic.h"
 #include "math.h"
 #include "xoroshiro.h"
+#include "bvh.h"
+#include "guiding.h"
+#include "photons.h"
+#include "radiance_cache.h"
+#include "memory.h"
 
 #ifdef _WIN32
 #include "os/win32/win32.cpp"
@@ -37,6 +43,29 @@ enum Surface_Type
     SURFACE_DIELECTRIC = 2,
 };
 
+// What a scene contains. The render kernels are compiled for several sets of
+// features, and a scene is rendered by the smallest set that covers its own
+// (see select_kernels), so branches on absent types are compiled out.
+enum Scene_Feature : u32
+{
+    FEATURE_PLANES     = 1 << PRIMITIVE_PLANE,
+    FEATURE_ELLIPSOIDS = 1 << PRIMITIVE_ELLIPSOID,
+    FEATURE_BOXES      = 1 << PRIMITIVE_BOX,
+
+    FEATURE_DIFFUSE    = 8 << SURFACE_DIFFUSE,
+    FEATURE_METALLIC   = 8 << SURFACE_METALLIC,
+    FEATURE_DIELECTRIC = 8 << SURFACE_DIELECTRIC,
+
+    FEATURE_LIGHTS     = 1 << 6, // Lights that next-event estimation samples
+
+    FEATURES_PRIMITIVES = FEATURE_PLANES | FEATURE_ELLIPSOIDS | FEATURE_BOXES,
+    FEATURES_ALL        = (1 << 7) - 1,
+
+    // Not of the scene: the kernels count the work of every path into
+    // path_costs, for the heatmap (see heatmap.cpp)
+    FEATURE_COSTS = 1 << 7,
+};
+
 struct Primitive
 {
     Vector3 parameters;
@@ -48,6 +77,113 @@ struct Primitive
     Quaternion rotation = {0, 0, 0, 1};
     Vector3    color    = {0, 0, 0};
     Vector3    emission = {0, 0, 0};
+
+    u32 track = 0; // One plus the index of its keyframes in scene->tracks, zero if it does not move
+};
+
+// The type of the primitive, a constant if the features allow only one
+template <u32 FEATURES>
+inline Primitive_Type primitive_type(Primitive *primitive)
+{
+    switch (FEATURES & FEATURES_PRIMITIVES) {
+    case FEATURE_PLANES:     return PRIMITIVE_PLANE;
+    case FEATURE_ELLIPSOIDS: return PRIMITIVE_ELLIPSOID;
+    case FEATURE_BOXES:      return PRIMITIVE_BOX;
+    default:                 return primitive->type;
+    }
+}
+
+template <u32 FEATURES>
+inline Surface_Type surface_type(Primitive *primitive)
+{
+    switch (FEATURES & (FEATURE_DIFFUSE | FEATURE_METALLIC | FEATURE_DIELECTRIC)) {
+    case FEATURE_DIFFUSE:    return SURFACE_DIFFUSE;
+    case FEATURE_METALLIC:   return SURFACE_METALLIC;
+    case FEATURE_DIELECTRIC: return SURFACE_DIELECTRIC;
+    default:                 return primitive->surface_type;
+    }
+}
+
+// Keyframes, kept sorted by frame (see animation.cpp)
+struct Position_Key
+{
+    f32     frame;
+    Vector3 position;
+};
+
+struct Rotation_Key
+{
+    f32        frame;
+    Quaternion rotation;
+};
+
+struct Track
+{
+    Array<Position_Key> positions;
+    Array<Rotation_Key> rotations;
+};
+
+struct Scene;
+struct Path;
+struct Ray;
+struct Intersection;
+
+// Rays of the batched queries of the library, one array per component, owned
+// by its caller (see library.cpp)
+struct Ray_Stream
+{
+    const f32 *origin[3];
+    const f32 *direction[3];
+    const f32 *t_max; // Null for no limit
+};
+
+struct Hit_Stream
+{
+    f32 *t;         // INFINITY without a hit
+    u32 *primitive; // U32_MAX without a hit
+    f32 *normal[3]; // Null to skip the normals
+};
+
+// Entry points of the render kernels compiled for one set of features
+struct Scene_Kernels
+{
+    u32 features;
+
+    Vector3      (*ray_trace)(Scene *scene, Ray ray, u32 depth);
+    Intersection (*intersect)(Scene *scene, Ray world_ray, Primitive **closest, f32 t_max);
+    bool         (*scatter)(Scene *scene, Path *path, Intersection intersection, Primitive *closest);
+    void         (*resolve_pixels)(Scene *scene, Vector3 *accumulation, u32 samples, u8 *pixels);
+
+    // The queries of the rays order[first, end) of a stream, [first, end) without an order
+    void (*intersect_stream)(Scene *scene, Ray_Stream rays, Hit_Stream hits, const u32 *order, u32 first, u32 end);
+    void (*occluded_stream)(Scene *scene, Ray_Stream rays, u8 *occluded, const u32 *order, u32 first, u32 end);
+};
+
+const u32 SAMPLE_BATCH = 16; // Samples per call of the batched samplers, a multiple of the widest lanes
+
+// Uniform random numbers in [0, 1) for a batch of samples, drawn ahead so the
+// samplers do not wait on the generator
+struct alignas(64) Sample_Randoms
+{
+    f32 u[SAMPLE_BATCH];
+    f32 v[SAMPLE_BATCH];
+    f32 w[SAMPLE_BATCH];
+};
+
+// The vectors of a batch, one array per coordinate
+struct alignas(64) Vector3_Batch
+{
+    f32 x[SAMPLE_BATCH];
+    f32 y[SAMPLE_BATCH];
+    f32 z[SAMPLE_BATCH];
+};
+
+// Batched samplers for paths that advance together (see kernels.cpp)
+struct Sample_Kernels
+{
+    void (*cosine_weighted)(Sample_Randoms *randoms, Vector3_Batch *normals, Vector3_Batch *directions);
+    void (*uniform_box)(Sample_Randoms *randoms, Primitive *box, Vector3_Batch *points);
+    void (*nonuniform_ellipsoid)(Sample_Randoms *randoms, Primitive *ellipsoid, Vector3_Batch *points);
 };
 
 struct Scene
@@ -66,6 +202,10 @@ struct Scene
     } camera;
 
     Array<Primitive> primitives;
+    BVH8             bvh;
+
+    Track        camera_track; // Rotations apply to the camera axes given in the scene
+    Array<Track> tracks;
 
     u32 ray_depth;
     u32 samples;
@@ -73,6 +213,20 @@ struct Scene
     Xoroshiro128 xoroshiro;
 
     u32 num_lights = 0;
+    Array<u32> sampled_lights; // Lights that next-event estimation samples, planes can not be sampled
+
+    const Scene_Kernels *kernels = nullptr; // Set by select_kernels
+
+    Guide *guide = nullptr; // Learned incident radiance that diffuse bounces sample, see guiding.cpp
+
+    u32 caustic_photons = 0;          // Emitted per pass of the caustic photon map, zero renders without one
+    f32 caustic_radius  = 0;          // Of the first pass, zero for a fraction of the scene bounds
+    Photon_Map *photon_map = nullptr; // Caustics that diffuse vertices gather, see photons.cpp
+
+    f32 cache_voxel_size  = 0;  // Of the radiance cache, zero renders without one
+    u32 cache_min_samples = 32; // Before a voxel ends paths, fewer trade noise for bias
+    u32 cache_entries     = 1 << 20;
+    Radiance_Cache *radiance_cache = nullptr; // Created by prepare_scene, see radiance_cache.cpp
 };
 
 struct Ray
@@ -125,10 +279,186 @@ bool advance_if_starts_with(Parser *parser, const char *c_string)
     return true;
 }
 
-#define SCAN_VECTOR3(parser, v) sscanf(current(parser), "%f %f %f", &(v).x, &(v).y, &(v).z)
-Primitive parse_primitive(Parser *parser)
+// Copies the next token of the current line into a null-terminated buffer.
+// Scanning the parser buffer with sscanf directly would measure all of the
+// remaining file on every call, which makes parsing quadratic in its size.
+bool next_token(Parser *parser, char *token, u32 capacity)
+{
+    while (parser->cursor < parser->length && (*current(parser) == ' ' || *current(parser) == '\t')) {
+        parser->cursor += 1;
+    }
+
+    u32 length = 0;
+    while (parser->cursor < parser->length && length + 1 < capacity) {
+        char c = *current(parser);
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            break;
+        }
+
+        token[length++] = c;
+        parser->cursor += 1;
+    }
+    token[length] = '\0';
+
+    return length > 0;
+}
+
+// Parses plain decimal numbers like 12, -0.5 or 1.5e3, which is what scene
+// files consist of, several times faster than strtof. Returns false for
+// anything else, which is then left to strtof.
+bool parse_decimal(char *token, f32 *value)
+{
+    char *c = token;
+
+    bool negative = *c == '-';
+    if (*c == '-' || *c == '+') {
+        c++;
+    }
+
+    u64 mantissa = 0;
+    s32 exponent = 0;
+    u32 num_digits = 0;
+    for (; *c >= '0' && *c <= '9'; c++, num_digits++) {
+        mantissa = 10 * mantissa + (*c - '0');
+    }
+
+    if (*c == '.') {
+        for (c++; *c >= '0' && *c <= '9'; c++, num_digits++) {
+            mantissa = 10 * mantissa + (*c - '0');
+            exponent--;
+        }
+    }
+
+    // The mantissa has to be exact
+    if (num_digits == 0 || num_digits > 18) {
+        return false;
+    }
+
+    if (*c == 'e' || *c == 'E') {
+        c++;
+        bool negative_exponent = *c == '-';
+        if (*c == '-' || *c == '+') {
+            c++;
+        }
+
+        s32 e = 0;
+        if (*c < '0' || *c > '9') {
+            return false;
+        }
+        for (; *c >= '0' && *c <= '9' && e < 1000; c++) {
+            e = 10 * e + (*c - '0');
+        }
+        exponent += negative_exponent ? -e : e;
+    }
+
+    if (*c != '\0' || exponent < -22 || exponent > 22) {
+        return false;
+    }
+
+    // Both the mantissa and the power of ten are exact doubles, so this is
+    // rounded once to double and then to float
+    const f64 POWERS_OF_TEN[] = {
+        1E0,  1E1,  1E2,  1E3,  1E4,  1E5,  1E6,  1E7,  1E8,  1E9,  1E10, 1E11,
+        1E12, 1E13, 1E14, 1E15, 1E16, 1E17, 1E18, 1E19, 1E20, 1E21, 1E22,
+    };
+    f64 result = (f64) mantissa;
+    result = exponent < 0 ? result / POWERS_OF_TEN[-exponent] : result * POWERS_OF_TEN[exponent];
+
+    *value = (f32) (negative ? -result : result);
+
+    return true;
+}
+
+// Like sscanf, these leave the value untouched if there is no number to parse
+bool scan_f32(Parser *parser, f32 *value)
+{
+    char token[64];
+    if (!next_token(parser, token, sizeof(token))) {
+        return false;
+    }
+
+    if (parse_decimal(token, value)) {
+        return true;
+    }
+
+    char *end;
+    f32 result = strtof(token, &end);
+    if (end == token) {
+        return false;
+    }
+
+    *value = result;
+
+    return true;
+}
+
+bool scan_u32(Parser *parser, u32 *value)
+{
+    char token[64];
+    if (!next_token(parser, token, sizeof(token))) {
+        return false;
+    }
+
+    char *end;
+    u32 result = (u32) strtoul(token, &end, 10);
+    if (end == token) {
+        return false;
+    }
+
+    *value = result;
+
+    return true;
+}
+
+#define SCAN_VECTOR3(parser, v) (scan_f32(parser, &(v).x) && scan_f32(parser, &(v).y) && scan_f32(parser, &(v).z))
+#define SCAN_QUATERNION(parser, q) (scan_f32(parser, &(q).x) && scan_f32(parser, &(q).y) && scan_f32(parser, &(q).z) && scan_f32(parser, &(q).w))
+
+// Keys are inserted in the order of their frames, a key for the same frame replaces the earlier one
+template <typename Key>
+void insert_key(Array<Key> *keys, Key key)
+{
+    u32 position = keys->size;
+    while (position > 0 && (*keys)[position - 1].frame >= key.frame) {
+        position--;
+    }
+
+    if (position < keys->size && (*keys)[position].frame == key.frame) {
+        (*keys)[position] = key;
+    } else {
+        array_insert(keys, key, position);
+    }
+}
+
+void parse_position_key(Parser *parser, Track *track)
+{
+    Position_Key key;
+    if (scan_f32(parser, &key.frame) && SCAN_VECTOR3(parser, key.position)) {
+        insert_key(&track->positions, key);
+    }
+}
+
+void parse_rotation_key(Parser *parser, Track *track)
+{
+    Rotation_Key key;
+    if (scan_f32(parser, &key.frame) && SCAN_QUATERNION(parser, key.rotation)) {
+        insert_key(&track->rotations, key);
+    }
+}
+
+Primitive parse_primitive(Parser *parser, Array<Track> *tracks)
 {
-    Primitive primitive;
+    Primitive primitive = {};
+
+    auto primitive_track = [&] () -> Track *
+    {
+        if (!primitive.track) {
+            array_push(tracks, {});
+            primitive.track = tracks->size;
+        }
+
+        return &(*tracks)[primitive.track - 1];
+    };
+
     while (parser->cursor < parser->length) {
         if (advance_if_starts_with(parser, "PLANE ")) {
             primitive.type = PRIMITIVE_PLANE;
@@ -142,12 +472,11 @@ Primitive parse_primitive(Parser *parser)
         } else if (advance_if_starts_with(parser, "POSITION ")) {
             SCAN_VECTOR3(parser, primitive.position);
         } else if (advance_if_starts_with(parser, "ROTATION ")) {
-            sscanf(current(parser), "%f %f %f %f",
-                &primitive.rotation.x,
-                &primitive.rotation.y,
-                &primitive.rotation.z,
-                &primitive.rotation.w
-            );
+            SCAN_QUATERNION(parser, primitive.rotation);
+        } else if (advance_if_starts_with(parser, "POSITION_KEY ")) {
+            parse_position_key(parser, primitive_track());
+        } else if (advance_if_starts_with(parser, "ROTATION_KEY ")) {
+            parse_rotation_key(parser, primitive_track());
         } else if (advance_if_starts_with(parser, "COLOR ")) {
             SCAN_VECTOR3(parser, primitive.color);
         } else if (advance_if_starts_with(parser, "METALLIC")) {
@@ -155,7 +484,7 @@ Primitive parse_primitive(Parser *parser)
         } else if (advance_if_starts_with(parser, "DIELECTRIC")) {
             primitive.surface_type = SURFACE_DIELECTRIC;
         } else if (advance_if_starts_with(parser, "IOR ")) {
-            sscanf(current(parser), "%f", &primitive.ior);
+            scan_f32(parser, &primitive.ior);
         } else if (advance_if_starts_with(parser, "EMISSION ")) {
             SCAN_VECTOR3(parser, primitive.emission);
         } else {
@@ -172,7 +501,7 @@ void parse(Parser *parser, Scene *scene)
 {
     while (parser->cursor < parser->length) {
         if (advance_if_starts_with(parser, "DIMENSIONS ")) {
-            sscanf(current(parser), "%d %d", &scene->width, &scene->height);
+            scan_u32(parser, &scene->width) && scan_u32(parser, &scene->height);
         } else if (advance_if_starts_with(parser, "BG_COLOR ")) {
             SCAN_VECTOR3(parser, scene->background_color);
         } else if (advance_if_starts_with(parser, "CAMERA_POSITION ")) {
@@ -183,15 +512,29 @@ void parse(Parser *parser, Scene *scene)
             SCAN_VECTOR3(parser, scene->camera.up);
         } else if (advance_if_starts_with(parser, "CAMERA_FORWARD ")) {
             SCAN_VECTOR3(parser, scene->camera.forward);
+        } else if (advance_if_starts_with(parser, "CAMERA_POSITION_KEY ")) {
+            parse_position_key(parser, &scene->camera_track);
+        } else if (advance_if_starts_with(parser, "CAMERA_ROTATION_KEY ")) {
+            parse_rotation_key(parser, &scene->camera_track);
         } else if (advance_if_starts_with(parser, "CAMERA_FOV_X ")) {
-            sscanf(current(parser), "%f", &scene->camera.fov_x_radians);
+            scan_f32(parser, &scene->camera.fov_x_radians);
         } else if (advance_if_starts_with(parser, "NEW_PRIMITIVE\n")) {
-            array_push(&scene->primitives, parse_primitive(parser));
+            array_push(&scene->primitives, parse_primitive(parser, &scene->tracks));
             continue;
         } else if (advance_if_starts_with(parser, "RAY_DEPTH ")) {
-            sscanf(current(parser), "%u", &scene->ray_depth);
+            scan_u32(parser, &scene->ray_depth);
         } else if (advance_if_starts_with(parser, "SAMPLES ")) {
-            sscanf(current(parser), "%u", &scene->samples);
+            scan_u32(parser, &scene->samples);
+        } else if (advance_if_starts_with(parser, "CAUSTIC_PHOTONS ")) {
+            scan_u32(parser, &scene->caustic_photons);
+        } else if (advance_if_starts_with(parser, "CAUSTIC_RADIUS ")) {
+            scan_f32(parser, &scene->caustic_radius);
+        } else if (advance_if_starts_with(parser, "RADIANCE_CACHE_VOXEL_SIZE ")) {
+            scan_f32(parser, &scene->cache_voxel_size);
+        } else if (advance_if_starts_with(parser, "RADIANCE_CACHE_MIN_SAMPLES ")) {
+            scan_u32(parser, &scene->cache_min_samples);
+        } else if (advance_if_starts_with(parser, "RADIANCE_CACHE_ENTRIES ")) {
+            scan_u32(parser, &scene->cache_entries);
         }
 
         skip_to_next_line(parser);
@@ -283,445 +626,534 @@ void write_bmp(const char *file_name, u32 width, u32 height, u8 *pixels)
 }
 #endif
 
-Intersection intersect_plane(Primitive *plane, Ray ray)
+// State of a path between two bounces
+struct Path
 {
-    Vector3 object_normal = plane->parameters;
+    Ray     ray;
+    Vector3 throughput;
+    Vector3 radiance;
+    u32     depth;
+    u32     pixel;    // Used by the batched renderer
+    f32     brdf_pdf; // Density of ray.direction if it was sampled from a diffuse BRDF, zero otherwise
+    bool    gathered; // A diffuse vertex gathered caustics from the photon map
+};
 
-    Intersection intersection = {
-        .t = -dot(ray.origin, object_normal) / dot(ray.direction, object_normal),
-        .normal = normalize(rotate(object_normal, plane->rotation)),
-    };
+// Power heuristic weight of a sample taken with density pdf against another
+// strategy that could have produced it with density other_pdf
+inline f32 mis_weight(f32 pdf, f32 other_pdf)
+{
+    return SQUARE(pdf) / (SQUARE(pdf) + SQUARE(other_pdf));
+}
 
-    if (dot(object_normal, ray.direction) > 0) {
-        intersection.normal = -intersection.normal;
-        intersection.inner = true;
-    }
+// Recording of the primitives and scene cells that paths touch, used by the
+// incremental renderer in watch mode (see incremental.cpp). Nothing is recorded
+// while touch_record is null.
+struct Touch_Record;
+thread_local Touch_Record *touch_record = nullptr;
 
-    return intersection;
-}
+void record_touch(u32 primitive_index);
+void record_segment(Ray ray, f32 t_max);
 
-Intersection intersect_ellipsoid(Primitive *ellipsoid, Ray ray)
-{
-    Vector3 semi_axes = ellipsoid->parameters;
+// Index of the primitive that blocked the last occlusion query on this thread.
+// Neighbouring shadow rays are often blocked by the same primitive, so it is
+// tested before the BVH is traversed.
+thread_local u32 last_occluder = U32_MAX;
 
-    f32 a = dot(ray.direction / semi_axes, ray.direction / semi_axes);
-    f32 b = 2.0f * dot(ray.origin / semi_axes, ray.direction / semi_axes);
-    f32 c = dot(ray.origin / semi_axes, ray.origin / semi_axes) - 1.0f;
+// Diffuse vertices of the path being traced on this thread, which train the
+// guide when the path is done. Null when the scene has no guide.
+thread_local Guide_Path *guide_path = nullptr;
 
-    f32 discriminant = b * b - 4.0f * a * c;
-    if (discriminant < 0) {
-        return {.t = -1};
-    }
+// Diffuse vertices of the path being traced on this thread, which train the
+// radiance cache when the path is done. Null when the scene has no cache.
+thread_local Cache_Path *cache_path = nullptr;
 
-    f32 t_min = (-b - sqrtf(discriminant)) / (2 * a);
-    f32 t_max = (-b + sqrtf(discriminant)) / (2 * a);
+// Samples for the next scatter of the path being traced on this thread, drawn
+// ahead by the batched renderer with the batched samplers (see wavefront.cpp).
+// Scatter draws its own while path_samples is null.
+struct Path_Samples
+{
+    u32     light_index;      // Of the sampled light for next-event estimation
+    Vector3 light_point;      // On that light, if drawn, where sample_light samples its whole surface
+    bool    light_point_drawn;
+    Vector3 bounce_direction; // Cosine weighted around the normal of the hit
+};
 
-    f32 t = -1;
-    f32 t_other = -1;
-    if (t_min > 0) {
-        t = t_min;
-        t_other = t_max;
-    } else if (t_max > 0) {
-        t = t_max;
-    } else {
-        return {.t = -1};
-    }
+thread_local Path_Samples *path_samples = nullptr;
 
-    Vector3 object_normal = (ray.origin + t * ray.direction) / semi_axes / semi_axes;
+// Work of the paths traced on this thread, counted only by the kernels
+// compiled with FEATURE_COSTS
+struct Path_Costs
+{
+    u64 primitive_tests; // Of a ray against one primitive, in lanes or on its own
+    u64 bounces;
+    u64 light_pdfs;
+};
 
-    Intersection intersection = {
-        .t = t,
-        .normal = normalize(rotate(object_normal, ellipsoid->rotation)),
-    };
+thread_local Path_Costs path_costs = {};
 
-    if (t_other > 0) {
-        intersection.t_other = t_other;
+#define ROUND_COLOR(f) (roundf((f) * 255.0f))
 
-        Vector3 object_normal_other = (ray.origin + t_other * ray.direction) / semi_axes / semi_axes;
-        intersection.normal_other = normalize(rotate(object_normal_other, ellipsoid->rotation));
-    }
+#if defined(__clang__)
+#define KERNELS_TARGET_BEGIN(features) _Pragma(STRINGIFY(clang attribute push(__attribute__((target(features))), apply_to = function)))
+#define KERNELS_TARGET_END             _Pragma("clang attribute pop")
+#else
+#define KERNELS_TARGET_BEGIN(features) _Pragma("GCC push_options") _Pragma(STRINGIFY(GCC target(features)))
+#define KERNELS_TARGET_END             _Pragma("GCC pop_options")
+#endif
 
-    if (dot(object_normal, ray.direction) > 0) {
-        intersection.normal = -intersection.normal;
-        intersection.inner = true;
-    }
+#define KERNELS_SSE42  0
+#define KERNELS_AVX2   1
+#define KERNELS_AVX512 2
 
-    return intersection;
+// The baseline, which the build targets
+namespace sse42 {
+#define KERNELS_ISA KERNELS_SSE42
+#include "kernels.cpp"
+#undef KERNELS_ISA
 }
 
-Intersection intersect_box(Primitive *box, Ray ray)
-{
-    Vector3 dimensions = box->parameters;
+KERNELS_TARGET_BEGIN("avx2,fma,bmi,bmi2,lzcnt,popcnt")
+namespace avx2 {
+#define KERNELS_ISA KERNELS_AVX2
+#include "kernels.cpp"
+#undef KERNELS_ISA
+}
+KERNELS_TARGET_END
 
-    Vector3 t1 = (-dimensions - ray.origin) / ray.direction;
-    Vector3 t2 = ( dimensions - ray.origin) / ray.direction;
+KERNELS_TARGET_BEGIN("avx2,fma,bmi,bmi2,lzcnt,popcnt,avx512f,avx512dq,avx512bw,avx512vl")
+namespace avx512 {
+#define KERNELS_ISA KERNELS_AVX512
+#include "kernels.cpp"
+#undef KERNELS_ISA
+}
+KERNELS_TARGET_END
 
-    Vector3 t_min = min(t1, t2);
-    Vector3 t_max = max(t1, t2);
+// Code outside of the render loop calls the baseline kernels directly
+using namespace sse42;
 
-    f32 interval_min = max(t_min);
-    f32 interval_max = min(t_max);
+#include "bvh.cpp"
 
-    if (interval_min > interval_max) {
-        return {.t = -1};
-    }
+void select_kernels(Scene *scene);
+void radiance_cache_init(Scene *scene);
+void radiance_cache_free(Scene *scene);
 
-    f32 t = -1.0f;
-    f32 t_other = -1.0f;
-    if (interval_min > 0) {
-        t = interval_min;
-        t_other = interval_max;
-    } else if (interval_max > 0) {
-        t = interval_max;
-    } else {
-        return {.t = -1};
-    }
+// Orders the lights first and builds the acceleration structure of a parsed
+// scene, and its radiance cache if it has one
+void prepare_scene(Scene *scene)
+{
+    // Sort the primitives by emission in descending order so that later we can
+    // effectively traverse all lights as they would be the first scene->num_lights
+    // elements of the scene->primitives array.
+    auto compare_primitives_by_emission = [] (const void *a, const void *b) -> int
+    {
+        const Primitive *p1 = (Primitive *) a;
+        const Primitive *p2 = (Primitive *) b;
 
-    Vector3 object_normal = (ray.origin + t * ray.direction) / dimensions;
-    u32 max_index = 0;
-    for (u32 i = 1; i < 3; i++) {
-        if (ABS(object_normal[i]) > ABS(object_normal[max_index])) {
-            max_index = i;
+        f32 diff = length_sq(p2->emission) - length_sq(p1->emission);
+        if (diff == 0) {
+            return 0;
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            return 1;
         }
-    }
-
-    object_normal[(max_index + 1) % 3] = 0.0f;
-    object_normal[(max_index + 2) % 3] = 0.0f;
-
-    Intersection intersection = {
-        .t = t,
-        .normal = normalize(rotate(object_normal, box->rotation)),
     };
+    qsort(scene->primitives.data, scene->primitives.size, sizeof(Primitive), compare_primitives_by_emission);
 
-    if (t_other > 0) {
-        intersection.t_other = t_other;
-
-        Vector3 object_normal_other = (ray.origin + t_other * ray.direction) / dimensions;
-        u32 max_index = 0;
-        for (u32 i = 1; i < 3; i++) {
-            if (ABS(object_normal_other[i]) > ABS(object_normal_other[max_index])) {
-                max_index = i;
-            }
+    // Any primitive that has a non-zero emission parameter is considered a light.
+    scene->num_lights = scene->primitives.size;
+    for (u32 i = 0; i < scene->primitives.size; i++) {
+        if (length_sq(scene->primitives[i].emission) == 0) {
+            scene->num_lights = i;
+            break;
         }
-
-        object_normal_other[(max_index + 1) % 3] = 0.0f;
-        object_normal_other[(max_index + 2) % 3] = 0.0f;
-
-        intersection.normal_other = normalize(rotate(object_normal_other, box->rotation));
     }
 
-    if (dot(ray.direction, object_normal) > 0) {
-        intersection.normal = -intersection.normal;
-        intersection.inner = true;
+    for (u32 i = 0; i < scene->num_lights; i++) {
+        if (scene->primitives[i].type != PRIMITIVE_PLANE) {
+            array_push(&scene->sampled_lights, i);
+        }
     }
 
-    return intersection;
+    build_acceleration_structure(scene);
+    select_kernels(scene);
+    radiance_cache_init(scene);
 }
 
-Intersection intersect_once(Primitive *primitive, Ray world_ray)
+void free_scene(Scene *scene)
 {
-    Quaternion inverse_rotation = conj(primitive->rotation);
-    Ray ray = {
-        .origin = rotate(world_ray.origin - primitive->position, inverse_rotation),
-        .direction = rotate(world_ray.direction, inverse_rotation),
-    };
-
-    Intersection current;
-    switch (primitive->type) {
-    case PRIMITIVE_PLANE:
-        current = intersect_plane(primitive, ray);
-        break;
-    case PRIMITIVE_ELLIPSOID:
-        current = intersect_ellipsoid(primitive, ray);
-        break;
-    case PRIMITIVE_BOX:
-        current = intersect_box(primitive, ray);
-        break;
+    array_free(&scene->primitives);
+    array_free(&scene->sampled_lights);
+    bvh8_free(&scene->bvh);
+
+    array_free(&scene->camera_track.positions);
+    array_free(&scene->camera_track.rotations);
+    ARRAY_ITERATE(scene->tracks) {
+        array_free(&it->positions);
+        array_free(&it->rotations);
     }
+    array_free(&scene->tracks);
 
-    return current;
+    radiance_cache_free(scene);
 }
 
-Intersection intersect(Array<Primitive> primitives, Ray world_ray, Primitive **closest, f32 t_max = INFINITY)
+u32 scene_features(Scene *scene)
 {
-    Intersection out = {.t = INFINITY};
-    *closest = nullptr;
+    u32 features = 0;
+    ARRAY_ITERATE(scene->primitives) {
+        features |= (1u << it->type) | (FEATURE_DIFFUSE << it->surface_type);
+    }
 
-    ARRAY_ITERATE(primitives) {
-        Intersection current = intersect_once(it, world_ray);
-        if (current.t > 0 && current.t < out.t && current.t < t_max) {
-            out = current;
-            *closest = it;
-        }
+    if (scene->sampled_lights.size > 0) {
+        features |= FEATURE_LIGHTS;
     }
 
-    return out;
+    return features;
 }
 
-Vector3 uniform_unit_sphere(Xoroshiro128 *xoroshiro)
+enum Instruction_Set
 {
-    f32 theta = 2.0f * PI * xoroshiro_next_f32(xoroshiro);
-    f32 z = 2.0f * xoroshiro_next_f32(xoroshiro) - 1.0f;
-    f32 h = sqrtf(1.0f - z * z);
+    ISA_SSE42,
+    ISA_AVX2,
+    ISA_AVX512,
+    ISA_COUNT,
+};
 
-    return {h * cosf(theta), h * sinf(theta), z};
-}
+const char *const INSTRUCTION_SET_NAMES[ISA_COUNT] = {"sse4.2", "avx2", "avx512"};
 
-Vector3 cosine_weighted(Xoroshiro128 *xoroshiro, Vector3 normal)
-{
-    Vector3 v;
-    do {
-        v = uniform_unit_sphere(xoroshiro);
-    } while (v == -normal);
+// The kernel tables of every instruction set, all in the same order
+const Scene_Kernels *const ISA_KERNELS[ISA_COUNT] = {sse42::SCENE_KERNELS, avx2::SCENE_KERNELS, avx512::SCENE_KERNELS};
+const Scene_Kernels *const ISA_COST_KERNELS[ISA_COUNT] = {&sse42::COST_KERNELS, &avx2::COST_KERNELS, &avx512::COST_KERNELS};
+const Sample_Kernels *const ISA_SAMPLE_KERNELS[ISA_COUNT] = {&sse42::SAMPLE_KERNELS, &avx2::SAMPLE_KERNELS, &avx512::SAMPLE_KERNELS};
 
-    return normalize(v + normal);
-}
+Instruction_Set instruction_set = ISA_SSE42; // Set by select_instruction_set
 
-f32 cosine_pdf(Vector3 w, Vector3 normal)
+// The instruction sets that both the processor and the OS support. The OS has
+// to save the vector registers on context switches, which XCR0 reports.
+u32 supported_instruction_sets()
 {
-    return MAX(0.0f, dot(w, normal) / PI);
-}
+    u32 registers[4];
+    os_cpuid(0, 0, registers);
+    u32 max_leaf = registers[0];
+
+    os_cpuid(1, 0, registers);
+    u32 ecx_1 = registers[2];
+    if (!(ecx_1 & (1 << 20)) || !(ecx_1 & (1 << 23))) { // SSE4.2 and POPCNT
+        return 0;
+    }
+    u32 supported = 1 << ISA_SSE42;
 
-Vector3 uniform_box(Xoroshiro128 *xoroshiro, Primitive *box)
-{
-    Vector3 dimensions = box->parameters;
+    // AVX, FMA and XGETBV
+    if ((ecx_1 & (1 << 28)) == 0 || (ecx_1 & (1 << 12)) == 0 || (ecx_1 & (1 << 27)) == 0 || max_leaf < 7) {
+        return supported;
+    }
 
-    Vector3 weights = {
-        4 * dimensions.y * dimensions.z,
-        4 * dimensions.x * dimensions.z,
-        4 * dimensions.x * dimensions.y
-    };
-    f32 w = weights.x + weights.y + weights.z;
+    u32 xcr0_low, xcr0_high;
+    __asm__ volatile ("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
 
-    f32 random_u = 2 * xoroshiro_next_f32(xoroshiro) - 1;
-    f32 random_v = 2 * xoroshiro_next_f32(xoroshiro) - 1;
+    os_cpuid(7, 0, registers);
+    u32 ebx_7 = registers[1];
 
-    f32 sign = 2.0f * xoroshiro_next_u32(xoroshiro, 1) - 1.0f;
+    os_cpuid(0x80000000, 0, registers);
+    bool lzcnt = false;
+    if (registers[0] >= 0x80000001) {
+        os_cpuid(0x80000001, 0, registers);
+        lzcnt = registers[2] & (1 << 5);
+    }
 
-    Vector3 point;
-    f32 random_number = w * xoroshiro_next_f32(xoroshiro);
-    if (random_number < weights.x) {
-        point = {sign, random_u, random_v};
-    } else if (random_number >= weights.x && random_number < weights.x + weights.y) {
-        point = {random_u, sign, random_v};
-    } else {
-        point = {random_u, random_v, sign};
+    u32 avx2_bits = (1 << 3) | (1 << 5) | (1 << 8); // BMI1, AVX2, BMI2
+    if ((xcr0_low & 0x6) != 0x6 || (ebx_7 & avx2_bits) != avx2_bits || !lzcnt) { // XMM and YMM state
+        return supported;
+    }
+    supported |= 1 << ISA_AVX2;
+
+    u32 avx512_bits = (1 << 16) | (1 << 17) | (1 << 30) | (1u << 31); // F, DQ, BW, VL
+    if ((xcr0_low & 0xE0) == 0xE0 && (ebx_7 & avx512_bits) == avx512_bits) { // Opmask and ZMM state
+        supported |= 1 << ISA_AVX512;
     }
 
-    return box->position + rotate(dimensions * point, box->rotation);
+    return supported;
 }
 
-f32 box_pdf(Primitive *box)
+// Finds the instruction set of the given name among the supported ones, or
+// without a name the default one: avx2 if supported and sse4.2 otherwise. The
+// avx512 kernels only run when requested, as they measure no faster than the
+// avx2 ones. Returns false if there is no such supported instruction set.
+bool find_instruction_set(const char *name, u32 supported, Instruction_Set *isa)
 {
-    Vector3 dimensions = box->parameters;
+    if (!name) {
+        *isa = (supported & (1 << ISA_AVX2)) ? ISA_AVX2 : ISA_SSE42;
+        return supported != 0;
+    }
 
-    return 1.0f / (8.0f * (dimensions.y * dimensions.z + dimensions.x * dimensions.z + dimensions.x * dimensions.y));
-}
+    u32 requested = 0;
+    while (requested < ISA_COUNT && strcmp(name, INSTRUCTION_SET_NAMES[requested]) != 0) {
+        requested++;
+    }
+    *isa = (Instruction_Set) requested;
 
-Vector3 nonuniform_ellipsoid(Xoroshiro128 *xoroshiro, Primitive *ellipsoid)
-{
-    return ellipsoid->position + rotate(uniform_unit_sphere(xoroshiro) * ellipsoid->parameters, ellipsoid->rotation);
+    return requested < ISA_COUNT && (supported & (1 << requested));
 }
 
-f32 ellipsoid_pdf(Vector3 p, Primitive *ellipsoid)
+// Chooses the kernels to run, see find_instruction_set. Returns false if the
+// request can not be met.
+bool select_instruction_set(const char *name)
 {
-    Vector3 r = ellipsoid->parameters;
-    Vector3 n = rotate(p - ellipsoid->position, conj(ellipsoid->rotation)) / r;
+    u32 supported = supported_instruction_sets();
+    if (!supported) {
+        printf("The processor does not support SSE4.2.\n");
+        return false;
+    }
 
-    return 1.0f / (4 * PI * sqrtf(n.x*n.x*r.y*r.y*r.z*r.z + r.x*r.x*n.y*n.y*r.z*r.z + r.x*r.x*r.y*r.y*n.z*n.z));
-}
+    Instruction_Set isa;
+    if (!find_instruction_set(name, supported, &isa)) {
+        if (isa == ISA_COUNT) {
+            printf("Unknown instruction set `%s`, expected sse4.2, avx2 or avx512.\n", name);
+        } else {
+            printf("The processor does not support %s.\n", name);
+        }
+        return false;
+    }
+    instruction_set = isa;
 
-f32 area_formulation_density(f32 distance, Vector3 direction, Vector3 normal)
-{
-    return distance * distance / ABS(dot(direction, normal));
+    // On stderr, as stdout carries the job protocol in server mode
+    fprintf(stderr, "Using the %s kernels.\n", INSTRUCTION_SET_NAMES[instruction_set]);
+
+    return true;
 }
 
-f32 light_pdf(Primitive *light, Ray ray)
+// Picks the kernels of the smallest feature set that covers the scene, for the
+// given instruction set
+void select_kernels(Scene *scene, Instruction_Set isa)
 {
-    Intersection intersection = intersect_once(light, ray);
-    f32 pdf = 0.0f;
-    switch (light->type) {
-    case PRIMITIVE_BOX:
-        if (intersection.t > 0) {
-            pdf += box_pdf(light) * area_formulation_density(intersection.t, ray.direction, intersection.normal);
-            if (intersection.t_other > 0) {
-                pdf += box_pdf(light) * area_formulation_density(intersection.t_other, ray.direction, intersection.normal_other);
-            }
+    u32 features = scene_features(scene);
+
+    const Scene_Kernels *table = ISA_KERNELS[isa];
+    const Scene_Kernels *best = &table[array_size(SCENE_KERNELS) - 1];
+    for (u32 i = 0; i < array_size(SCENE_KERNELS); i++) {
+        const Scene_Kernels *kernels = &table[i];
+        if ((kernels->features & features) == features && __builtin_popcount(kernels->features) < __builtin_popcount(best->features)) {
+            best = kernels;
         }
-        break;
-    case PRIMITIVE_ELLIPSOID:
-        if (intersection.t > 0) {
-            pdf += ellipsoid_pdf(ray.origin + intersection.t * ray.direction, light) * area_formulation_density(intersection.t, ray.direction, intersection.normal);
-            if (intersection.t_other > 0) {
-                pdf += ellipsoid_pdf(ray.origin + intersection.t_other * ray.direction, light) *
-                    area_formulation_density(intersection.t_other, ray.direction, intersection.normal_other);
-            }
-        }
-        break;
-    default:
-        break;
     }
 
-    return pdf;
+    scene->kernels = best;
+}
+
+void select_kernels(Scene *scene)
+{
+    select_kernels(scene, instruction_set);
 }
 
 Vector3 ray_trace(Scene *scene, Ray ray, u32 depth)
 {
-    if (depth > scene->ray_depth) {
-        return {};
-    }
+    ASSERT(scene->kernels);
+    return scene->kernels->ray_trace(scene, ray, depth);
+}
 
-    Primitive *closest = nullptr;
-    Intersection intersection = intersect(scene->primitives, ray, &closest);
+Ray camera_ray(Scene *scene, u32 x, u32 y)
+{
+    f32 tan_half_fov_x = tanf(scene->camera.fov_x_radians / 2);
+    f32 tan_half_fov_y = (scene->height * tan_half_fov_x) / scene->width;
 
-    if (!closest) {
-        return scene->background_color;
-    }
+    f32 offset_x = xoroshiro_next_f32(&scene->xoroshiro);
+    f32 offset_y = xoroshiro_next_f32(&scene->xoroshiro);
 
-    Vector3 intersection_point = ray.origin + intersection.t * ray.direction;
+    f32 normalized_x =  (2 * (x + offset_x) / scene->width  - 1) * tan_half_fov_x;
+    f32 normalized_y = -(2 * (y + offset_y) / scene->height - 1) * tan_half_fov_y;
+    Vector3 camera_direction = normalized_x * scene->camera.right + normalized_y * scene->camera.up + 1.0f * scene->camera.forward;
 
-    Xoroshiro128 *xoroshiro = &scene->xoroshiro;
-    switch (closest->surface_type) {
-    case SURFACE_DIFFUSE: {
-        Ray light_ray = {.origin = intersection_point + 1E-4 * intersection.normal};
-        // In the num_lights == 0 case (the only source is scene->background_color)
-        // use the cosine weighted distribution.
-        if (scene->num_lights == 0 || xoroshiro_next_u32(xoroshiro, 1)) {
-            light_ray.direction = cosine_weighted(xoroshiro, intersection.normal);
-        } else {
-choose_light_that_is_not_a_plane:
-            u32 light_index = xoroshiro_next_u32(xoroshiro, scene->num_lights - 1);
-            Primitive *chosen_light = &scene->primitives[light_index];
-
-            Vector3 light_surface_point;
-            switch (chosen_light->type) {
-            case PRIMITIVE_BOX:
-                light_surface_point = uniform_box(xoroshiro, chosen_light);
-                break;
-            case PRIMITIVE_ELLIPSOID:
-                light_surface_point = nonuniform_ellipsoid(xoroshiro, chosen_light);
-                break;
-            case PRIMITIVE_PLANE:
-                goto choose_light_that_is_not_a_plane;
-            }
+    return {
+        .origin = scene->camera.position,
+        .direction = normalize(camera_direction),
+    };
+}
 
-            light_ray.direction = normalize(light_surface_point - light_ray.origin);
-        }
+struct Heatmap;
+void heatmap_record(Heatmap *heatmap, u32 pixel, u64 cycles);
 
-        f32 pdf = 0.0f;
-        if (scene->num_lights == 0) {
-            pdf = cosine_pdf(light_ray.direction, intersection.normal);
-        } else {
-            pdf = cosine_pdf(light_ray.direction, intersection.normal) / 2;
-            for (u32 i = 0; i < scene->num_lights; i++) {
-                pdf += light_pdf(&scene->primitives[i], light_ray) / (2.0f * scene->num_lights);
-            }
-        }
+// With a heatmap, the scene has to run the cost kernels (see select_cost_kernels)
+void fill_pixels(Scene *scene, u8 *pixels, Heatmap *heatmap = nullptr)
+{
+    for (u32 y = 0; y < scene->height; y++) {
+        for (u32 x = 0; x < scene->width; x++) {
+            u64 start_cycles = heatmap ? __rdtsc() : 0;
 
-        // Ignore rays that are obstructed by the primitive itself.
-        // Diffuse BRDF guarantees that they do not affect the resulting color.
-        if (dot(light_ray.direction, intersection.normal) <= 0) {
-            return closest->emission;
-        }
+            Vector3 out_color = {};
+            for (u32 i = 0; i < scene->samples; i++) {
+                out_color += ray_trace(scene, camera_ray(scene, x, y), 1);
+            }
 
-        Vector3 light = ray_trace(scene, light_ray, depth + 1);
-
-        return closest->emission + dot(light_ray.direction, intersection.normal) * (closest->color / PI) * light / pdf;
-    } break;
-    case SURFACE_METALLIC: {
-        Ray reflected_ray = {
-            .origin = intersection_point + 1E-4 * intersection.normal,
-            .direction = reflect(-ray.direction, intersection.normal),
-        };
-        Vector3 light = ray_trace(scene, reflected_ray, depth + 1);
-
-        return closest->emission + light * closest->color;
-    } break;
-    case SURFACE_DIELECTRIC: {
-        Vector3 light = {};
-
-        Ray reflected_ray = {
-            .origin = intersection_point + 1E-4 * intersection.normal,
-            .direction = reflect(-ray.direction, intersection.normal),
-        };
-        Vector3 reflected_light = ray_trace(scene, reflected_ray, depth + 1);
-
-        f32 ior_quotient = intersection.inner ? closest->ior : (1 / closest->ior);
-        f32 cos_1 = dot(intersection.normal, -ray.direction);
-        f32 sin_2 = ior_quotient * sqrtf(1 - cos_1 * cos_1);
-        if (sin_2 <= 1) {
-            f32 reflection_coefficient = SQUARE((ior_quotient - 1) / (ior_quotient + 1));
-            f32 r = reflection_coefficient + (1 - reflection_coefficient) * powf(1 - cos_1, 5.0f);
-            f32 random_number_in_unit_inverval = xoroshiro_next_f32(xoroshiro);
-            if (random_number_in_unit_inverval < r) {
-                light = reflected_light;
-            } else {
-                f32 cos_2 = sqrtf(1 - sin_2 * sin_2);
-                Ray refracted_ray = {
-                    .origin = intersection_point - 1E-4 * intersection.normal,
-                    .direction = normalize(ior_quotient * ray.direction + (ior_quotient * cos_1 - cos_2) * intersection.normal),
-                };
-                Vector3 refracted_light = ray_trace(scene, refracted_ray, depth + 1);
-
-                if (!intersection.inner) {
-                    refracted_light *= closest->color;
-                }
-
-                light = refracted_light;
+            if (heatmap) {
+                heatmap_record(heatmap, x + y * scene->width, __rdtsc() - start_cycles);
             }
-        } else {
-            light = reflected_light;
-        }
 
-        return closest->emission + light;
-    } break;
+            out_color /= scene->samples;
+            out_color = aces_tonemap(out_color);
+
+            pixels[3 * (x + y * scene->width) + 0] = ROUND_COLOR(out_color.r);
+            pixels[3 * (x + y * scene->width) + 1] = ROUND_COLOR(out_color.g);
+            pixels[3 * (x + y * scene->width) + 2] = ROUND_COLOR(out_color.b);
+        }
     }
 }
 
-Vector3 aces_tonemap(Vector3 x)
+// Averages and tonemaps the sums of the given number of paths per pixel
+void resolve_pixels(Scene *scene, Vector3 *accumulation, u32 samples, u8 *pixels)
 {
-    const Vector3 A = {2.51f, 2.51f, 2.51f};
-    const Vector3 B = {0.03f, 0.03f, 0.03f};
-    const Vector3 C = {2.43f, 2.43f, 2.43f};
-    const Vector3 D = {0.59f, 0.59f, 0.59f};
-    const Vector3 E = {0.14f, 0.14f, 0.14f};
-
-    return pow(clamp((x * (A * x + B)) / (x * (C * x + D) + E), 0.0f, 1.0f), 1.0f / 2.2f);
+    ASSERT(scene->kernels);
+    scene->kernels->resolve_pixels(scene, accumulation, samples, pixels);
 }
 
-#define ROUND_COLOR(f) (roundf((f) * 255.0f))
-void fill_pixels(Scene *scene, u8 *pixels)
+#include "wavefront.cpp"
+#include "progressive.cpp"
+#include "profile.cpp"
+#include "threads.cpp"
+#include "photons.cpp"
+#include "radiance_cache.cpp"
+#include "guiding.cpp"
+#include "image.cpp"
+#include "heatmap.cpp"
+#include "budget.cpp"
+
+const u32 DEFAULT_SORT_BATCH_SIZE = 1 << 16;
+
+struct Options
 {
-    for (u32 y = 0; y < scene->height; y++) {
-        for (u32 x = 0; x < scene->width; x++) {
-            f32 tan_half_fov_x = tanf(scene->camera.fov_x_radians / 2);
-            f32 tan_half_fov_y = (scene->height * tan_half_fov_x) / scene->width;
+    const char *scene_path;
+    const char *output_path;
 
-            Vector3 out_color = {};
-            for (u32 i = 0; i < scene->samples; i++) {
-                f32 offset_x = xoroshiro_next_f32(&scene->xoroshiro);
-                f32 offset_y = xoroshiro_next_f32(&scene->xoroshiro);
+    u32 sort_batch_size; // Paths per batch when sorting secondary rays, zero renders paths one by one
+    bool watch;
 
-                f32 normalized_x =  (2 * (x + offset_x) / scene->width  - 1) * tan_half_fov_x;
-                f32 normalized_y = -(2 * (y + offset_y) / scene->height - 1) * tan_half_fov_y;
-                Vector3 camera_direction = normalized_x * scene->camera.right + normalized_y * scene->camera.up + 1.0f * scene->camera.forward;
+    bool        progressive;
+    const char *preview_name; // Shared memory that progressive passes are published to
 
-                Ray camera_ray = {
-                    .origin = scene->camera.position,
-                    .direction = normalize(camera_direction),
-                };
+    f64 time_budget; // Seconds from startup to the written output, zero renders scene->samples samples
 
-                out_color += ray_trace(scene, camera_ray, 1);
-            }
+    bool        server;
+    const char *socket_path; // Jobs are read from the standard input without one
+    u32         num_threads; // Zero uses one per processor
 
-            out_color /= scene->samples;
-            out_color = aces_tonemap(out_color);
+    bool animate;
+    u32  first_frame, last_frame;
 
-            pixels[3 * (x + y * scene->width) + 0] = ROUND_COLOR(out_color.r);
-            pixels[3 * (x + y * scene->width) + 1] = ROUND_COLOR(out_color.g);
-            pixels[3 * (x + y * scene->width) + 2] = ROUND_COLOR(out_color.b);
+    const char *instruction_set; // Of the kernels, avx2 by default where supported
+
+    bool counters;
+    bool guide;
+
+    const char *heatmap_name; // Of the heatmap files without extension, none without one
+
+    bool memory;
+    u64  memory_limit; // Bytes, zero for none
+};
+
+// ray [options] scene output       The output is PNG or QOI by its extension (.png, .qoi), PPM otherwise
+// ray --server [socket_path] [--threads n]
+//     --sort-rays [batch_size]  Trace paths in batches and sort secondary rays for coherence
+//     --watch                   Keep running and re-render the tiles affected by changes to the scene file
+//     --progressive             Render in passes of increasing resolution and samples, publishing each
+//                               pass into a shared memory framebuffer for live preview
+//     --preview-name name       Name of that shared memory, ray_preview by default (/dev/shm/ray_preview)
+//     --time-budget seconds     Take as many samples as fit before the deadline instead of SAMPLES
+//     --server [socket_path]    Render the jobs `scene output [priority]` given one per line on the standard
+//                               input, or on a local socket (not on Windows), keeping threads and parsed
+//                               scenes between jobs
+//     --frames first last       Render the frames of an animated scene, numbering the output files
+//                               (frame_###.ppm, or frame_0001.ppm for frame.ppm)
+//     --guide                   Learn where indirect light comes from over passes of doubling samples and
+//                               guide diffuse bounces towards it
+//     --threads n               Threads of the server, of animations, and of guided renders and renders with
+//                               caustic photons (CAUSTIC_PHOTONS in the scene), one per processor by default
+//     --isa name                Run the kernels compiled for sse4.2, avx2 or avx512 instead of the default
+//                               instruction set that the processor supports
+//     --counters                Report the time and the hardware counters of the parse, setup, render and
+//                               output phases, per path for the render (Linux perf events)
+//     --heatmap name            Write the cost of every pixel next to the image: TSC cycles, ray tests
+//                               against primitives, bounces and light densities evaluated, each as a false
+//                               colour name_<cost>.ppm and a raw name_<cost>.pfm (default render only)
+//     --memory                  Report the current and peak memory, the allocations and the system calls of
+//                               the parser, scene, acceleration structure, framebuffers, render and output
+//     --memory-limit megabytes  Stop with a report as soon as the memory would go over the limit
+bool parse_options(Options *options, int argc, char **argv)
+{
+    u32 num_positional = 0;
+    for (int i = 1; i < argc; i++) {
+        char *arg = argv[i];
+        if (strcmp(arg, "--sort-rays") == 0) {
+            options->sort_batch_size = DEFAULT_SORT_BATCH_SIZE;
+            if (i + 1 < argc && argv[i + 1][0] >= '1' && argv[i + 1][0] <= '9') {
+                options->sort_batch_size = (u32) atoi(argv[++i]);
+            }
+        } else if (strcmp(arg, "--watch") == 0) {
+            options->watch = true;
+        } else if (strcmp(arg, "--progressive") == 0) {
+            options->progressive = true;
+        } else if (strcmp(arg, "--preview-name") == 0 && i + 1 < argc) {
+            options->preview_name = argv[++i];
+        } else if (strcmp(arg, "--time-budget") == 0 && i + 1 < argc) {
+            options->time_budget = atof(argv[++i]);
+            if (!(options->time_budget > 0)) {
+                printf("Invalid time budget `%s`.", argv[i]);
+                return false;
+            }
+        } else if (strcmp(arg, "--server") == 0) {
+            options->server = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                options->socket_path = argv[++i];
+#ifdef _WIN32
+                printf("Local sockets are not supported on Windows, the server reads its jobs from the standard input.");
+                return false;
+#endif
+            }
+        } else if (strcmp(arg, "--frames") == 0 && i + 2 < argc) {
+            options->animate = true;
+            options->first_frame = (u32) atoi(argv[++i]);
+            options->last_frame  = (u32) atoi(argv[++i]);
+            if (options->last_frame < options->first_frame) {
+                printf("Invalid frame range %s to %s.", argv[i - 1], argv[i]);
+                return false;
+            }
+        } else if (strcmp(arg, "--threads") == 0 && i + 1 < argc) {
+            options->num_threads = (u32) atoi(argv[++i]);
+        } else if (strcmp(arg, "--isa") == 0 && i + 1 < argc) {
+            options->instruction_set = argv[++i];
+        } else if (strcmp(arg, "--counters") == 0) {
+            options->counters = true;
+        } else if (strcmp(arg, "--guide") == 0) {
+            options->guide = true;
+        } else if (strcmp(arg, "--heatmap") == 0 && i + 1 < argc) {
+            options->heatmap_name = argv[++i];
+        } else if (strcmp(arg, "--memory") == 0) {
+            options->memory = true;
+        } else if (strcmp(arg, "--memory-limit") == 0 && i + 1 < argc) {
+            f64 megabytes = atof(argv[++i]);
+            if (!(megabytes > 0)) {
+                printf("Invalid memory limit `%s`.", argv[i]);
+                return false;
+            }
+            options->memory_limit = (u64) (megabytes * 1E6);
+        } else if (arg[0] == '-' && arg[1] == '-') {
+            printf("Unknown option `%s`.", arg);
+            return false;
+        } else if (num_positional == 0) {
+            options->scene_path = arg;
+            num_positional++;
+        } else if (num_positional == 1) {
+            options->output_path = arg;
+            num_positional++;
+        } else {
+            num_positional++;
         }
     }
+
+    if (num_positional != (options->server ? 0 : 2)) {
+        printf("Invalid number of command line arguments.");
+        return false;
+    }
+
+    return true;
 }
 
 u64 poly31_hash(u8 *buffer, u32 length)
@@ -734,8 +1166,13 @@ u64 poly31_hash(u8 *buffer, u32 length)
     return hash;
 }
 
+#include "incremental.cpp"
+#include "server.cpp"
+#include "animation.cpp"
+
 PRIVATE_NAMESPACE_END
 
+#ifndef RAY_NO_MAIN
 extern "C"
 {
 
@@ -743,13 +1180,29 @@ int main(int argc, char **argv)
 {
     using namespace ray;
 
-    if (argc != 3) {
-        printf("Invalid number of command line arguments.");
+    u64 start = os_time_ns();
+
+    Options options = {.preview_name = DEFAULT_PREVIEW_NAME};
+    if (!parse_options(&options, argc, argv)) {
         return 1;
     }
 
+    if (!select_instruction_set(options.instruction_set)) {
+        return 1;
+    }
+
+    memory_init(options.memory, options.memory_limit);
+
+    if (options.server) {
+        return run_server(&options);
+    }
+
+    profile_init(options.counters);
+    profile_phase(PROFILE_PARSE);
+    memory_set_tag(MEMORY_PARSER);
+
     File file;
-    file.name = argv[1];
+    file.name = (char *) options.scene_path;
     if (!os_read_file(&file)) {
         return 1;
     }
@@ -763,38 +1216,27 @@ int main(int argc, char **argv)
 #endif
     xoroshiro_set_seed(&scene.xoroshiro, seed);
 
+    memory_set_tag(MEMORY_SCENE);
     Parser parser = {.buffer = (char *) file.data, .length = file.size};
     parse(&parser, &scene);
 
-    // Sort the primitives by emission in descending order so that later we can
-    // effectively traverse all lights as they would be the first scene.num_lights
-    // elements of the scene.primitives array.
-    auto compare_primitives_by_emission = [] (const void *a, const void *b) -> int
-    {
-        const Primitive *p1 = (Primitive *) a;
-        const Primitive *p2 = (Primitive *) b;
+    profile_phase(PROFILE_SETUP);
+    prepare_scene(&scene);
 
-        f32 diff = length_sq(p2->emission) - length_sq(p1->emission);
-        if (diff == 0) {
-            return 0;
-        } else if (diff < 0) {
-            return -1;
-        } else {
-            return 1;
-        }
-    };
-    qsort(scene.primitives.data, scene.primitives.size, sizeof(Primitive), compare_primitives_by_emission);
+    if (options.watch) {
+        return watch(&options, &scene, poly31_hash(file.data, file.size));
+    }
 
-    // Any primitive that has a non-zero emission parameter is considered a light.
-    scene.num_lights = scene.primitives.size;
-    for (u32 i = 0; i < scene.primitives.size; i++) {
-        if (length_sq(scene.primitives[i].emission) == 0) {
-            scene.num_lights = i;
-            break;
-        }
+    if (options.animate) {
+        profile_phase(PROFILE_RENDER);
+        memory_set_tag(MEMORY_RENDER);
+        int result = render_animation(&options, &scene, seed);
+        profile_report((u64) scene.width * scene.height * scene.samples * (options.last_frame - options.first_frame + 1));
+        memory_report();
+        return result;
     }
 
-    u8 *pixels = (u8 *) os_allocate(3 * scene.width * scene.height);
+    u8 *pixels = (u8 *) memory_allocate(MEMORY_FRAMEBUFFERS, 3 * scene.width * scene.height);
 
     Vector3 tonemapped_background_color = aces_tonemap(scene.background_color);
     for (u32 i = 0; i < 3 * scene.width * scene.height; i += 3) {
@@ -803,9 +1245,86 @@ int main(int argc, char **argv)
         pixels[i + 2] = ROUND_COLOR(tonemapped_background_color.b);
     }
 
-    fill_pixels(&scene, pixels);
+    // PNG compresses on a pool that is started before rendering, so a time
+    // budget covers the compression and not starting the threads
+    Thread_Pool output_pool;
+    bool png_output = has_extension(options.output_path, "png");
+    if (png_output) {
+        thread_pool_init(&output_pool, options.num_threads);
+    }
+
+    profile_phase(PROFILE_RENDER);
+    memory_set_tag(MEMORY_RENDER);
+
+    if (scene.caustic_photons && (options.time_budget > 0 || options.progressive || options.sort_batch_size)) {
+        printf("Caustic photons are only traced by the default and the guided renders.\n");
+    }
+
+    bool default_render = !(options.time_budget > 0 || options.progressive || options.sort_batch_size || options.guide || scene.caustic_photons);
+    if (options.heatmap_name && !default_render) {
+        printf("The heatmap is only recorded by the default render.\n");
+    }
+
+    Heatmap heatmap = {};
+
+    f64 effective_samples = 0;
+    if (options.time_budget > 0) {
+        effective_samples = render_budget(&scene, options.time_budget, png_output ? &output_pool : nullptr, options.output_path, pixels, start);
+    } else if (options.progressive) {
+        render_progressive(&scene, options.preview_name, pixels, start);
+    } else if (options.sort_batch_size) {
+        u64 accumulation_size = (u64) scene.width * scene.height * sizeof(Vector3);
+        Vector3 *accumulation = (Vector3 *) memory_allocate(MEMORY_FRAMEBUFFERS, accumulation_size);
+
+        Sorted_Renderer renderer;
+        sorted_renderer_init(&renderer, options.sort_batch_size);
+        fill_accumulation_sorted(&renderer, &scene, accumulation);
+        sorted_renderer_free(&renderer);
+
+        resolve_pixels(&scene, accumulation, scene.samples, pixels);
+        os_free(accumulation, accumulation_size);
+    } else if (options.guide || scene.caustic_photons) {
+        u64 accumulation_size = (u64) scene.width * scene.height * sizeof(Vector3);
+        Vector3 *accumulation = (Vector3 *) memory_allocate(MEMORY_FRAMEBUFFERS, accumulation_size);
+
+        Thread_Pool pool;
+        thread_pool_init(&pool, options.num_threads);
+        if (options.guide) {
+            render_guided(&pool, &scene, seed, accumulation);
+        } else {
+            render_caustics(&pool, &scene, seed, accumulation);
+        }
+        thread_pool_free(&pool);
+
+        resolve_pixels(&scene, accumulation, scene.samples, pixels);
+        os_free(accumulation, accumulation_size);
+    } else if (options.heatmap_name) {
+        heatmap_init(&heatmap, scene.width, scene.height);
+        select_cost_kernels(&scene);
+        fill_pixels(&scene, pixels, &heatmap);
+    } else {
+        fill_pixels(&scene, pixels);
+    }
+
+    profile_phase(PROFILE_OUTPUT);
+    memory_set_tag(MEMORY_OUTPUT);
+    write_image(png_output ? &output_pool : nullptr, options.output_path, scene.width, scene.height, pixels);
+    if (png_output) {
+        thread_pool_free(&output_pool);
+    }
+
+    if (options.heatmap_name && default_render) {
+        write_heatmap(&heatmap, options.heatmap_name);
+        heatmap_free(&heatmap);
+    }
+
+    if (options.time_budget > 0) {
+        printf("Rendered %.2f samples per pixel in %.3f s of %.3f s.\n", effective_samples, (os_time_ns() - start) / 1E9, options.time_budget);
+    }
 
-    write_ppm(argv[2], scene.width, scene.height, pixels);
+    f64 samples = options.time_budget > 0 ? effective_samples : scene.samples;
+    profile_report((u64) ((f64) scene.width * scene.height * samples));
+    memory_report();
 
 #ifdef _WIN32
     write_bmp("out.bmp", scene.width, scene.height, pixels);
@@ -815,4 +1334,4 @@ int main(int argc, char **argv)
 }
 
 }
-
+#endif
@@ -92,11 +92,17 @@ inline f32 skew(Vector2 u, Vector2 v)
     return u.x * v.y - u.y * v.x;
 }
 
+// Vectors are SSE registers. The fourth lane pads them to 16 bytes and is zero
+// after every operation, but not in a vector whose components were written
+// one by one, so structures holding vectors are compared by their fields.
+// Operations round like the scalar code would, except normalize(), which uses
+// the reciprocal square root estimate.
 union Vector3
 {
     struct
     {
         f32 x, y, z;
+        f32 pad;
     };
 
     struct
@@ -106,30 +112,57 @@ union Vector3
 
     f32 e[3];
 
+    __m128 m;
+
+    Vector3() = default;
+
+    FORCE_INLINE Vector3(f32 x, f32 y, f32 z) : m(_mm_setr_ps(x, y, z, 0.0f)) {}
+
+    FORCE_INLINE explicit Vector3(__m128 m) : m(m) {}
+
     inline f32 &operator[](u32 index)
     {
         return this->e[index];
     }
 };
 
+FORCE_INLINE Vector3 vector3(__m128 m)
+{
+    return Vector3(m);
+}
+
+// (a, a, a, 0)
+FORCE_INLINE __m128 splat3(f32 a)
+{
+    __m128 m = _mm_set_ss(a);
+
+    return _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 0, 0));
+}
+
+// Zeroes the fourth lane, which divisions fill with NaN
+FORCE_INLINE __m128 clear_pad(__m128 m)
+{
+    return _mm_blend_ps(m, _mm_setzero_ps(), 0x8);
+}
+
 inline bool operator==(Vector3 u, Vector3 v)
 {
-    return u.x == v.x && u.y == v.y && u.z == v.z;
+    return (_mm_movemask_ps(_mm_cmpeq_ps(u.m, v.m)) & 0x7) == 0x7;
 }
 
 inline bool operator!=(Vector3 u, Vector3 v)
 {
-    return u.x != v.x || u.y != v.y || u.z != v.z;
+    return (_mm_movemask_ps(_mm_cmpneq_ps(u.m, v.m)) & 0x7) != 0;
 }
 
 inline Vector3 operator-(Vector3 v)
 {
-    return {-v.x, -v.y, -v.z};
+    return vector3(_mm_xor_ps(v.m, _mm_setr_ps(-0.0f, -0.0f, -0.0f, 0.0f)));
 }
 
 inline Vector3 operator+(Vector3 u, Vector3 v)
 {
-    return {u.x + v.x, u.y + v.y, u.z + v.z};
+    return vector3(_mm_add_ps(u.m, v.m));
 }
 
 inline Vector3 &operator+=(Vector3 &u, Vector3 v)
@@ -141,7 +174,7 @@ inline Vector3 &operator+=(Vector3 &u, Vector3 v)
 
 inline Vector3 operator-(Vector3 u, Vector3 v)
 {
-    return {u.x - v.x, u.y - v.y, u.z - v.z};
+    return vector3(_mm_sub_ps(u.m, v.m));
 }
 
 inline Vector3 &operator-=(Vector3 &u, Vector3 v)
@@ -153,7 +186,7 @@ inline Vector3 &operator-=(Vector3 &u, Vector3 v)
 
 inline Vector3 operator*(Vector3 u, Vector3 v)
 {
-    return {u.x * v.x, u.y * v.y, u.z * v.z};
+    return vector3(_mm_mul_ps(u.m, v.m));
 }
 
 inline Vector3 &operator*=(Vector3 &u, Vector3 v)
@@ -165,7 +198,7 @@ inline Vector3 &operator*=(Vector3 &u, Vector3 v)
 
 inline Vector3 operator/(Vector3 u, Vector3 v)
 {
-    return {u.x / v.x, u.y / v.y, u.z / v.z};
+    return vector3(clear_pad(_mm_div_ps(u.m, v.m)));
 }
 
 inline Vector3 &operator/=(Vector3 &u, Vector3 v)
@@ -177,12 +210,12 @@ inline Vector3 &operator/=(Vector3 &u, Vector3 v)
 
 inline Vector3 operator*(f32 a, Vector3 v)
 {
-    return {a * v.x, a * v.y, a * v.z};
+    return vector3(_mm_mul_ps(splat3(a), v.m));
 }
 
 inline Vector3 operator*(Vector3 v, f32 a)
 {
-    return {a * v.x, a * v.y, a * v.z};
+    return vector3(_mm_mul_ps(splat3(a), v.m));
 }
 
 inline Vector3 &operator*=(Vector3 &v, f32 a)
@@ -194,7 +227,7 @@ inline Vector3 &operator*=(Vector3 &v, f32 a)
 
 inline Vector3 operator/(Vector3 v, f32 a)
 {
-    return {v.x / a, v.y / a, v.z / a};
+    return vector3(clear_pad(_mm_div_ps(v.m, _mm_set1_ps(a))));
 }
 
 inline Vector3 &operator/=(Vector3 &v, f32 a)
@@ -204,51 +237,91 @@ inline Vector3 &operator/=(Vector3 &v, f32 a)
     return v;
 }
 
+// Sums the lanes in the order of x + y + z
+FORCE_INLINE f32 sum3(__m128 m)
+{
+    __m128 sum = _mm_add_ss(m, _mm_movehdup_ps(m));
+
+    return _mm_cvtss_f32(_mm_add_ss(sum, _mm_movehl_ps(m, m)));
+}
+
+inline f32 dot(Vector3 u, Vector3 v)
+{
+    return sum3(_mm_mul_ps(u.m, v.m));
+}
+
 inline f32 length_sq(Vector3 v)
 {
-    return v.x * v.x + v.y * v.y + v.z * v.z;
+    return dot(v, v);
 }
 
 inline f32 length(Vector3 v)
 {
-    return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+    return sqrtf(dot(v, v));
 }
 
+// One Newton step refines the estimate to about 22 bits. Lengths below the
+// smallest normal float, which the estimate takes for zero, are divided by.
 inline Vector3 normalize(Vector3 v)
 {
-    return v / sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+    __m128 length_sq = _mm_set_ss(dot(v, v));
+    if (_mm_cvtss_f32(length_sq) < FLT_MIN) {
+        return v / sqrtf(_mm_cvtss_f32(length_sq));
+    }
+
+    __m128 estimate = _mm_rsqrt_ss(length_sq);
+    __m128 half_length_sq = _mm_mul_ss(_mm_set_ss(0.5f), length_sq);
+    __m128 correction = _mm_sub_ss(_mm_set_ss(1.5f), _mm_mul_ss(half_length_sq, _mm_mul_ss(estimate, estimate)));
+    __m128 inverse_length = _mm_mul_ss(estimate, correction);
+
+    return vector3(_mm_mul_ps(v.m, _mm_shuffle_ps(inverse_length, inverse_length, _MM_SHUFFLE(1, 0, 0, 0))));
 }
 
-inline f32 dot(Vector3 u, Vector3 v)
+// (y, z, x, w)
+FORCE_INLINE __m128 rotate_lanes(__m128 m)
 {
-    return u.x * v.x + u.y * v.y + u.z * v.z;
+    return _mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 0, 2, 1));
 }
 
+// The fourth lanes cancel, so u may be a quaternion whose vector part is used
 inline Vector3 cross(Vector3 u, Vector3 v)
 {
-    return {
-        u.y * v.z - u.z * v.y,
-        u.z * v.x - u.x * v.z,
-        u.x * v.y - u.y * v.x,
-    };
+    __m128 z_x_y = _mm_sub_ps(_mm_mul_ps(u.m, rotate_lanes(v.m)), _mm_mul_ps(rotate_lanes(u.m), v.m));
+
+    return vector3(rotate_lanes(z_x_y));
+}
+
+// All ones in the lane of the axis
+FORCE_INLINE __m128 axis_mask(u32 axis)
+{
+    return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_setr_epi32(0, 1, 2, 3), _mm_set1_epi32((s32) axis)));
+}
+
+// Writing a lane through [] and then reading the vector stalls the load until
+// the store retires, these stay in registers
+
+// v with the lanes of the other axes zeroed
+inline Vector3 keep_axis(Vector3 v, u32 axis)
+{
+    return vector3(_mm_and_ps(v.m, axis_mask(axis)));
+}
+
+// v with the lane of the axis replaced by a
+inline Vector3 set_axis(Vector3 v, u32 axis, f32 a)
+{
+    return vector3(_mm_blendv_ps(v.m, _mm_set1_ps(a), axis_mask(axis)));
 }
 
 inline Vector3 min(Vector3 u, Vector3 v)
 {
-    return {
-        MIN(u.x, v.x),
-        MIN(u.y, v.y),
-        MIN(u.z, v.z),
-    };
+    return vector3(_mm_min_ps(u.m, v.m));
 }
 
+// MAX keeps the first value when they are equal or either is NaN, and so does
+// _mm_max_ps the second
 inline Vector3 max(Vector3 u, Vector3 v)
 {
-    return {
-        MAX(u.x, v.x),
-        MAX(u.y, v.y),
-        MAX(u.z, v.z),
-    };
+    return vector3(_mm_max_ps(v.m, u.m));
 }
 
 inline Vector3 lerp(Vector3 a, Vector3 b, f32 t)
@@ -258,12 +331,16 @@ inline Vector3 lerp(Vector3 a, Vector3 b, f32 t)
 
 inline f32 min(Vector3 v)
 {
-    return MIN(MIN(v.x, v.y), v.z);
+    __m128 xy = _mm_min_ss(v.m, _mm_movehdup_ps(v.m));
+
+    return _mm_cvtss_f32(_mm_min_ss(xy, _mm_movehl_ps(v.m, v.m)));
 }
 
 inline f32 max(Vector3 v)
 {
-    return MAX(MAX(v.x, v.y), v.z);
+    __m128 xy = _mm_max_ss(_mm_movehdup_ps(v.m), v.m);
+
+    return _mm_cvtss_f32(_mm_max_ss(_mm_movehl_ps(v.m, v.m), xy));
 }
 
 inline Vector3 pow(Vector3 v, f32 a)
@@ -278,20 +355,12 @@ inline Vector3 pow(Vector3 v, Vector3 e)
 
 inline Vector3 clamp(Vector3 v, Vector3 min, Vector3 max)
 {
-    return {
-        CLAMP(v.x, min.x, max.x),
-        CLAMP(v.y, min.y, max.y),
-        CLAMP(v.z, min.z, max.z),
-    };
+    return vector3(_mm_max_ps(min.m, _mm_min_ps(v.m, max.m)));
 }
 
 inline Vector3 clamp(Vector3 v, f32 min, f32 max)
 {
-    return {
-        CLAMP(v.x, min, max),
-        CLAMP(v.y, min, max),
-        CLAMP(v.z, min, max),
-    };
+    return vector3(_mm_max_ps(splat3(min), _mm_min_ps(v.m, splat3(max))));
 }
 
 inline Vector3 reflect(Vector3 u, Vector3 v)
@@ -299,39 +368,109 @@ inline Vector3 reflect(Vector3 u, Vector3 v)
     return 2.0f * dot(u, v) * v - u;
 }
 
+// (x, y, z, w) in one register, w the scalar part
 union Quaternion
 {
-    struct
-    {
-        Vector3 v;
-        f32     s;
-    };
-
     struct
     {
         f32 x, y, z, w;
     };
+
+    __m128 m;
+
+    Quaternion() = default;
+
+    FORCE_INLINE Quaternion(f32 x, f32 y, f32 z, f32 w) : m(_mm_setr_ps(x, y, z, w)) {}
+
+    FORCE_INLINE explicit Quaternion(__m128 m) : m(m) {}
 };
 
+FORCE_INLINE Quaternion quaternion(__m128 m)
+{
+    return Quaternion(m);
+}
+
+// The vector part
+FORCE_INLINE Vector3 imaginary(Quaternion q)
+{
+    return vector3(clear_pad(q.m));
+}
+
+FORCE_INLINE __m128 splat4(__m128 m, u32 lane)
+{
+    switch (lane) {
+    case 0:  return _mm_shuffle_ps(m, m, _MM_SHUFFLE(0, 0, 0, 0));
+    case 1:  return _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1));
+    case 2:  return _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2));
+    default: return _mm_shuffle_ps(m, m, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+}
+
+// Every term of the Hamilton product is a lane of q times the lanes of r,
+// shuffled and with some signs flipped
 inline Quaternion operator*(Quaternion q, Quaternion r)
 {
-    return {q.w * r.v + r.w * q.v + cross(q.v, r.v), q.w * r.w - dot(q.v, r.v)};
+    __m128 x_term = _mm_mul_ps(splat4(q.m, 0), _mm_shuffle_ps(r.m, r.m, _MM_SHUFFLE(0, 1, 2, 3)));
+    __m128 y_term = _mm_mul_ps(splat4(q.m, 1), _mm_shuffle_ps(r.m, r.m, _MM_SHUFFLE(1, 0, 3, 2)));
+    __m128 z_term = _mm_mul_ps(splat4(q.m, 2), _mm_shuffle_ps(r.m, r.m, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    __m128 product = _mm_mul_ps(splat4(q.m, 3), r.m);
+    product = _mm_add_ps(product, _mm_xor_ps(x_term, _mm_setr_ps(0.0f, -0.0f, 0.0f, -0.0f)));
+    product = _mm_add_ps(product, _mm_xor_ps(y_term, _mm_setr_ps(0.0f, 0.0f, -0.0f, -0.0f)));
+    product = _mm_add_ps(product, _mm_xor_ps(z_term, _mm_setr_ps(-0.0f, 0.0f, 0.0f, -0.0f)));
+
+    return quaternion(product);
 }
 
 inline Quaternion make_rotation(Vector3 v, f32 radians)
 {
-    return {sinf(radians / 2.0f) * v, cosf(radians / 2.0f)};
+    __m128 axis = _mm_mul_ps(splat3(sinf(radians / 2.0f)), v.m);
+
+    return quaternion(_mm_blend_ps(axis, _mm_set1_ps(cosf(radians / 2.0f)), 0x8));
 }
 
 inline Quaternion conj(Quaternion q)
 {
-    return {-q.x, -q.y, -q.z, q.w};
+    return quaternion(_mm_xor_ps(q.m, _mm_setr_ps(-0.0f, -0.0f, -0.0f, 0.0f)));
 }
 
-inline Vector3 rotate(Vector3 v, Quaternion q)
+inline f32 dot(Quaternion a, Quaternion b)
 {
-    Vector3 t = 2.0f * cross(q.v, v);
+    __m128 m = _mm_mul_ps(a.m, b.m);
+    m = _mm_add_ps(m, _mm_movehl_ps(m, m));
 
-    return v + q.w * t + cross(q.v, t);
+    return _mm_cvtss_f32(_mm_add_ss(m, _mm_movehdup_ps(m)));
 }
 
+// Spherical linear interpolation along the shorter arc
+inline Quaternion slerp(Quaternion a, Quaternion b, f32 t)
+{
+    f32 cos_angle = dot(a, b);
+    if (cos_angle < 0) {
+        b = quaternion(_mm_xor_ps(b.m, _mm_set1_ps(-0.0f)));
+        cos_angle = -cos_angle;
+    }
+
+    // Nearly equal rotations are interpolated linearly, which avoids dividing by a tiny sine
+    f32 weight_a = 1 - t;
+    f32 weight_b = t;
+    if (cos_angle < 0.9995f) {
+        f32 angle = acosf(cos_angle);
+        weight_a = sinf((1 - t) * angle) / sinf(angle);
+        weight_b = sinf(t * angle) / sinf(angle);
+    }
+
+    Quaternion q = quaternion(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(weight_a), a.m), _mm_mul_ps(_mm_set1_ps(weight_b), b.m)));
+
+    return quaternion(_mm_div_ps(q.m, _mm_set1_ps(sqrtf(dot(q, q)))));
+}
+
+// v + 2w (u x v) + 2u x (u x v) for the vector part u and the scalar part w,
+// both cross products with the vector part in place
+inline Vector3 rotate(Vector3 v, Quaternion q)
+{
+    Vector3 u = vector3(q.m);
+    Vector3 t = 2.0f * cross(u, v);
+
+    return v + q.w * t + cross(u, t);
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+#include "basic.h"
+
+// Accounting of the pages that os_allocate, os_reallocate and the shared
+// memory maps hand out, by the subsystem that asked for them, enabled by
+// --memory and --memory-limit. Disabled, every hook returns after one test.
+//
+// A block is charged to the tag of the thread that allocates it, which the
+// main thread sets as it goes through the phases and workers leave at
+// MEMORY_RENDER. The tag and the size of every live block are kept in a table
+// by address, so a free is taken off the subsystem that allocated the block
+// whichever one frees it. Sizes are rounded up to pages, as mapped.
+
+enum Memory_Tag : u8
+{
+    MEMORY_PARSER,       // The scene file
+    MEMORY_SCENE,        // Primitives, lights and animation tracks
+    MEMORY_ACCEL,        // Acceleration structures and their refit state
+    MEMORY_FRAMEBUFFERS, // Accumulation buffers and pixels
+    MEMORY_RENDER,       // Working memory of renders: threads, paths, photon maps, guides, caches
+    MEMORY_OUTPUT,       // Image encoders
+
+    MEMORY_TAG_COUNT
+};
+
+const char *const MEMORY_TAG_NAMES[MEMORY_TAG_COUNT] = {"parser", "scene", "accel", "framebuffers", "render", "output"};
+
+struct Memory_Usage
+{
+    u64 current, peak; // Bytes
+    u64 allocations;   // Blocks allocated
+    u64 system_calls;  // Maps, remaps and unmaps
+};
+
+struct Memory_Block
+{
+    u64 address; // Zero while the entry is free
+    u64 size;
+    Memory_Tag tag;
+};
+
+struct Memory_Accounting
+{
+    bool enabled;
+    u64 limit; // Bytes, zero for none
+    u64 page_size;
+
+    u32 lock;
+    Memory_Block *blocks; // Open addressing with linear probing
+    u32 capacity;         // A power of two
+    u32 count;
+
+    Memory_Usage tags[MEMORY_TAG_COUNT];
+    u64 current, peak; // Of all tags together
+};
+
+Memory_Accounting memory_accounting = {};
+
+thread_local Memory_Tag memory_tag = MEMORY_RENDER;
+
+// Set while the table grows, so its own pages are not accounted
+thread_local bool memory_internal = false;
+
+const u32 MEMORY_INITIAL_BLOCKS = 1024;
+
+inline void memory_init(bool enabled, u64 limit)
+{
+    memory_accounting.enabled = enabled || limit > 0;
+    memory_accounting.limit = limit;
+    memory_accounting.page_size = os_page_size();
+}
+
+// Returns the tag before
+inline Memory_Tag memory_set_tag(Memory_Tag tag)
+{
+    Memory_Tag previous = memory_tag;
+    memory_tag = tag;
+
+    return previous;
+}
+
+inline void memory_lock()
+{
+    while (__atomic_exchange_n(&memory_accounting.lock, 1, __ATOMIC_ACQUIRE)) {
+        _mm_pause();
+    }
+}
+
+inline void memory_unlock()
+{
+    __atomic_store_n(&memory_accounting.lock, 0, __ATOMIC_RELEASE);
+}
+
+inline u32 memory_slot(u64 address, u32 capacity)
+{
+    return (u32) (((address >> 12) * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+}
+
+inline void memory_insert_block(Memory_Block block)
+{
+    Memory_Accounting *accounting = &memory_accounting;
+
+    if (2 * (accounting->count + 1) > accounting->capacity) {
+        Memory_Block *old_blocks = accounting->blocks;
+        u32 old_capacity = accounting->capacity;
+
+        memory_internal = true;
+        accounting->capacity = old_capacity ? 2 * old_capacity : MEMORY_INITIAL_BLOCKS;
+        accounting->blocks = (Memory_Block *) os_allocate((u64) accounting->capacity * sizeof(Memory_Block));
+        memory_internal = false;
+        ASSERT(accounting->blocks);
+
+        accounting->count = 0;
+        for (u32 i = 0; i < old_capacity; i++) {
+            if (old_blocks[i].address) {
+                memory_insert_block(old_blocks[i]);
+            }
+        }
+
+        memory_internal = true;
+        os_free(old_blocks, (u64) old_capacity * sizeof(Memory_Block));
+        memory_internal = false;
+    }
+
+    u32 slot = memory_slot(block.address, accounting->capacity);
+    while (accounting->blocks[slot].address) {
+        slot = (slot + 1) & (accounting->capacity - 1);
+    }
+    accounting->blocks[slot] = block;
+    accounting->count++;
+}
+
+// Takes the block out of the table, false if it is not there
+inline bool memory_remove_block(u64 address, Memory_Block *block)
+{
+    Memory_Accounting *accounting = &memory_accounting;
+    if (!accounting->capacity) {
+        return false;
+    }
+
+    u32 mask = accounting->capacity - 1;
+    u32 slot = memory_slot(address, accounting->capacity);
+    while (accounting->blocks[slot].address != address) {
+        if (!accounting->blocks[slot].address) {
+            return false;
+        }
+        slot = (slot + 1) & mask;
+    }
+    *block = accounting->blocks[slot];
+
+    // Moves back the entries after it that would no longer be found
+    u32 hole = slot;
+    for (u32 next = (slot + 1) & mask; accounting->blocks[next].address; next = (next + 1) & mask) {
+        u32 home = memory_slot(accounting->blocks[next].address, accounting->capacity);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            accounting->blocks[hole] = accounting->blocks[next];
+            hole = next;
+        }
+    }
+    accounting->blocks[hole].address = 0;
+    accounting->count--;
+
+    return true;
+}
+
+inline void memory_add(Memory_Tag tag, s64 bytes)
+{
+    Memory_Accounting *accounting = &memory_accounting;
+    Memory_Usage *usage = &accounting->tags[tag];
+
+    usage->current += bytes;
+    usage->peak = MAX(usage->peak, usage->current);
+    accounting->current += bytes;
+    accounting->peak = MAX(accounting->peak, accounting->current);
+}
+
+inline u64 memory_pages(u64 size)
+{
+    return ALIGN_POW2(size, memory_accounting.page_size);
+}
+
+inline void memory_report();
+
+// Before a map or a remap that grows a block by the given bytes: ends the
+// process if it would go over the limit
+inline void memory_check_limit(u64 growth)
+{
+    Memory_Accounting *accounting = &memory_accounting;
+    if (!accounting->limit || memory_internal) {
+        return;
+    }
+
+    u64 current = __atomic_load_n(&accounting->current, __ATOMIC_RELAXED);
+    if (current + memory_pages(growth) > accounting->limit) {
+        printf("Out of memory: %s asked for %.1f MB with %.1f MB in use, over the limit of %.1f MB.\n",
+            MEMORY_TAG_NAMES[memory_tag], memory_pages(growth) / 1E6, current / 1E6, accounting->limit / 1E6);
+        memory_report();
+        exit(1);
+    }
+}
+
+inline void memory_record_allocate(void *address, u64 size)
+{
+    if (!memory_accounting.enabled || memory_internal) {
+        return;
+    }
+
+    memory_lock();
+    Memory_Block block = {.address = (u64) address, .size = memory_pages(size), .tag = memory_tag};
+    memory_insert_block(block);
+    memory_add(block.tag, block.size);
+    memory_accounting.tags[block.tag].allocations++;
+    memory_accounting.tags[block.tag].system_calls++;
+    memory_unlock();
+}
+
+// The block keeps the tag it was allocated with
+inline void memory_record_reallocate(void *old_address, void *new_address, u64 new_size)
+{
+    if (!memory_accounting.enabled || memory_internal) {
+        return;
+    }
+
+    memory_lock();
+    Memory_Block block;
+    if (memory_remove_block((u64) old_address, &block)) {
+        memory_add(block.tag, -(s64) block.size);
+    } else {
+        block.tag = memory_tag;
+    }
+
+    block.address = (u64) new_address;
+    block.size = memory_pages(new_size);
+    memory_insert_block(block);
+    memory_add(block.tag, block.size);
+    memory_accounting.tags[block.tag].system_calls++;
+    memory_unlock();
+}
+
+// Blocks allocated before the accounting was enabled are not known and ignored
+inline void memory_record_free(void *address)
+{
+    if (!memory_accounting.enabled || memory_internal) {
+        return;
+    }
+
+    memory_lock();
+    Memory_Block block;
+    if (memory_remove_block((u64) address, &block)) {
+        memory_add(block.tag, -(s64) block.size);
+        memory_accounting.tags[block.tag].system_calls++;
+    }
+    memory_unlock();
+}
+
+// Allocates for the given subsystem rather than the one of the thread
+inline void *memory_allocate(Memory_Tag tag, u64 amount)
+{
+    Memory_Tag previous = memory_set_tag(tag);
+    void *address = os_allocate(amount);
+    memory_set_tag(previous);
+
+    return address;
+}
+
+inline void memory_report()
+{
+    Memory_Accounting *accounting = &memory_accounting;
+    if (!accounting->enabled) {
+        return;
+    }
+
+    memory_lock();
+    printf("%-14s %12s %12s %12s %12s\n", "memory", "current MB", "peak MB", "allocations", "system calls");
+    u64 allocations = 0;
+    u64 system_calls = 0;
+    for (u32 t = 0; t < MEMORY_TAG_COUNT; t++) {
+        Memory_Usage *usage = &accounting->tags[t];
+        printf("  %-12s %12.2f %12.2f %12llu %12llu\n", MEMORY_TAG_NAMES[t], usage->current / 1E6, usage->peak / 1E6,
+            (unsigned long long) usage->allocations, (unsigned long long) usage->system_calls);
+        allocations += usage->allocations;
+        system_calls += usage->system_calls;
+    }
+    printf("  %-12s %12.2f %12.2f %12llu %12llu\n", "total", accounting->current / 1E6, accounting->peak / 1E6,
+        (unsigned long long) allocations, (unsigned long long) system_calls);
+    memory_unlock();
+}
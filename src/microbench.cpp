@@ -0,0 +1,440 @@
+// Microbenchmarks of the inner kernels: intersection, math and random numbers.
+//
+// Usage: microbench [--cpu processor] [--hit-ratio ratio] [benchmark_name...]
+// Without names every benchmark runs.
+//
+// Every benchmark calls one function over a ring of random inputs that fits in
+// the L1 cache, on a thread pinned to one processor, the first one by default.
+// After a warmup that also sizes the repetitions to a few milliseconds, the
+// repetitions are timed one by one and the median per call is reported, with
+// the fastest repetition and the median absolute deviation as a spread. Cycles
+// are those of the time stamp counter, which runs at a fixed rate that is not
+// necessarily the clock of the core. The kernels are the baseline ones that
+// the build targets, except for the batched samplers, which run for every
+// instruction set the processor supports and report the time per sample.
+//
+// Intersection benchmarks run with rays that hit their primitive in 0%, 50%
+// and 100% of the calls, or only in the given ratio. Hits and misses are
+// shuffled, so the branches on them are as hard to predict as in a render.
+
+#define RAY_NO_BENCH_MAIN
+#include "bench.cpp"
+
+PRIVATE_NAMESPACE_BEGIN
+
+const u32 MICRO_INPUTS      = 128; // A power of two, see Intersection_Inputs
+const u32 MICRO_REPETITIONS = 31;
+const u64 MICRO_REPETITION_NS = 2000000;
+
+// Keeps the compiler from dropping the computation of the value
+template <typename T>
+FORCE_INLINE void keep(T const &value)
+{
+    asm volatile("" : : "m"(value) : "memory");
+}
+
+f64 median(f64 *values, u32 count)
+{
+    qsort(values, count, sizeof(f64), [] (const void *a, const void *b) {
+        f64 difference = *(f64 *) a - *(f64 *) b;
+        return difference < 0 ? -1 : (difference > 0 ? 1 : 0);
+    });
+
+    return values[count / 2];
+}
+
+// Times call(i) for i cycling over the inputs and prints the statistics per
+// call, or per operation for calls that do several
+template <typename F>
+void run_micro(const char *name, const char *variant, F call, u32 ops_per_call = 1)
+{
+    // Warmup, which doubles the calls per repetition until it takes long enough
+    u64 calls = MICRO_INPUTS;
+    for (;;) {
+        u64 start = os_time_ns();
+        for (u64 i = 0; i < calls; i++) {
+            call((u32) i & (MICRO_INPUTS - 1));
+        }
+
+        if (os_time_ns() - start >= MICRO_REPETITION_NS) {
+            break;
+        }
+        calls *= 2;
+    }
+
+    f64 ns[MICRO_REPETITIONS];
+    f64 cycles[MICRO_REPETITIONS];
+    for (u32 r = 0; r < MICRO_REPETITIONS; r++) {
+        u64 start = os_time_ns();
+        u64 start_cycles = __rdtsc();
+        for (u64 i = 0; i < calls; i++) {
+            call((u32) i & (MICRO_INPUTS - 1));
+        }
+        cycles[r] = (f64) (__rdtsc() - start_cycles) / (calls * ops_per_call);
+        ns[r]     = (f64) (os_time_ns() - start) / (calls * ops_per_call);
+    }
+
+    f64 median_ns     = median(ns, MICRO_REPETITIONS);
+    f64 median_cycles = median(cycles, MICRO_REPETITIONS);
+    f64 fastest_ns    = ns[0]; // Sorted by median
+
+    f64 deviations[MICRO_REPETITIONS];
+    for (u32 r = 0; r < MICRO_REPETITIONS; r++) {
+        deviations[r] = ABS(ns[r] - median_ns);
+    }
+    f64 deviation = median(deviations, MICRO_REPETITIONS);
+
+    printf("    %-20s %-9s %8.2f ns/op %8.2f cycles/op, fastest %8.2f ns/op, deviation %5.2f%%\n",
+        name, variant, median_ns, median_cycles, fastest_ns, 100.0 * deviation / median_ns);
+}
+
+Primitive random_primitive(Xoroshiro128 *xoroshiro, Primitive_Type type)
+{
+    Primitive primitive = {
+        .parameters = {
+            0.5f + 1.5f * xoroshiro_next_f32(xoroshiro),
+            0.5f + 1.5f * xoroshiro_next_f32(xoroshiro),
+            0.5f + 1.5f * xoroshiro_next_f32(xoroshiro),
+        },
+        .type     = type,
+        .position = 20 * Vector3{xoroshiro_next_f32(xoroshiro), xoroshiro_next_f32(xoroshiro), xoroshiro_next_f32(xoroshiro)} - Vector3{10, 10, 10},
+        .rotation = random_rotation(xoroshiro),
+        .emission = {4, 4, 4},
+    };
+
+    if (type == PRIMITIVE_PLANE) {
+        primitive.parameters = uniform_unit_sphere(xoroshiro);
+    }
+
+    return primitive;
+}
+
+// A ray in the space of the primitive that hits it, or that misses it, and
+// for other than planes also its bounding sphere
+Ray random_object_ray(Xoroshiro128 *xoroshiro, Primitive *primitive, bool hit)
+{
+    if (primitive->type == PRIMITIVE_PLANE) {
+        Vector3 normal = primitive->parameters;
+        Vector3 direction = uniform_unit_sphere(xoroshiro);
+        if ((dot(direction, normal) < 0) != hit) {
+            direction = -direction;
+        }
+
+        return {.origin = (1 + 9 * xoroshiro_next_f32(xoroshiro)) * normal, .direction = direction};
+    }
+
+    f32 radius = length(primitive->parameters);
+    Vector3 away = uniform_unit_sphere(xoroshiro);
+    Vector3 origin = (3 + 7 * xoroshiro_next_f32(xoroshiro)) * radius * away;
+
+    // A point inside of both a box and an ellipsoid, or one beside the bounding sphere
+    Vector3 target;
+    if (hit) {
+        target = 0.9f * cbrtf(xoroshiro_next_f32(xoroshiro)) * uniform_unit_sphere(xoroshiro) * primitive->parameters;
+    } else {
+        Vector3 side;
+        do {
+            side = cross(away, uniform_unit_sphere(xoroshiro));
+        } while (length_sq(side) < 1E-4f);
+        target = 1.5f * radius * normalize(side);
+    }
+
+    return {.origin = origin, .direction = normalize(target - origin)};
+}
+
+// Every input is a primitive and a ray
+struct Intersection_Inputs
+{
+    Primitive primitives[MICRO_INPUTS];
+    Ray       object_rays[MICRO_INPUTS];
+    Ray       world_rays[MICRO_INPUTS];
+};
+
+// The largest ring, which keeps the measured latencies those of the L1 cache
+static_assert(sizeof(Intersection_Inputs) <= 32 * 1024, "The intersection inputs must fit in a 32 KiB L1 data cache.");
+
+// Primitives of the types in turn, the hits spread randomly over the inputs
+void make_intersection_inputs(Intersection_Inputs *inputs, Primitive_Type *types, u32 num_types, f32 hit_ratio, u64 seed)
+{
+    Xoroshiro128 xoroshiro;
+    xoroshiro_set_seed(&xoroshiro, seed);
+
+    bool hits[MICRO_INPUTS];
+    u32 num_hits = (u32) (hit_ratio * MICRO_INPUTS + 0.5f);
+    for (u32 i = 0; i < MICRO_INPUTS; i++) {
+        hits[i] = i < num_hits;
+    }
+    for (u32 i = MICRO_INPUTS - 1; i > 0; i--) {
+        u32 j = xoroshiro_next_u32(&xoroshiro, i);
+        bool swap = hits[i];
+        hits[i] = hits[j];
+        hits[j] = swap;
+    }
+
+    for (u32 i = 0; i < MICRO_INPUTS; i++) {
+        inputs->primitives[i]  = random_primitive(&xoroshiro, types[i % num_types]);
+        inputs->object_rays[i] = random_object_ray(&xoroshiro, &inputs->primitives[i], hits[i]);
+        inputs->world_rays[i]  = {
+            .origin    = inputs->primitives[i].position + rotate(inputs->object_rays[i].origin, inputs->primitives[i].rotation),
+            .direction = rotate(inputs->object_rays[i].direction, inputs->primitives[i].rotation),
+        };
+    }
+}
+
+f32 micro_hit_ratio = -1; // Negative for all of MICRO_HIT_RATIOS
+const f32 MICRO_HIT_RATIOS[] = {0.0f, 0.5f, 1.0f};
+
+// Runs the intersection benchmark for every hit ratio
+template <typename F>
+void run_hit_ratios(const char *name, Primitive_Type *types, u32 num_types, F benchmark)
+{
+    Intersection_Inputs *inputs = (Intersection_Inputs *) os_allocate(sizeof(Intersection_Inputs));
+
+    u32 num_ratios = micro_hit_ratio < 0 ? array_size(MICRO_HIT_RATIOS) : 1;
+    for (u32 r = 0; r < num_ratios; r++) {
+        f32 ratio = micro_hit_ratio < 0 ? MICRO_HIT_RATIOS[r] : micro_hit_ratio;
+        make_intersection_inputs(inputs, types, num_types, ratio, 1);
+
+        char variant[32];
+        snprintf(variant, sizeof(variant), "%3.0f%% hit", 100.0f * ratio);
+        run_micro(name, variant, [&] (u32 i) {
+            benchmark(inputs, i);
+        });
+    }
+
+    os_free(inputs, sizeof(Intersection_Inputs));
+}
+
+void micro_intersect(u32 argc, char **argv)
+{
+    Primitive_Type plane     = PRIMITIVE_PLANE;
+    Primitive_Type ellipsoid = PRIMITIVE_ELLIPSOID;
+    Primitive_Type box       = PRIMITIVE_BOX;
+    Primitive_Type all[]     = {PRIMITIVE_PLANE, PRIMITIVE_ELLIPSOID, PRIMITIVE_BOX};
+
+    run_hit_ratios("intersect_plane", &plane, 1, [] (Intersection_Inputs *inputs, u32 i) {
+        keep(intersect_plane(&inputs->primitives[i], inputs->object_rays[i]));
+    });
+    run_hit_ratios("intersect_ellipsoid", &ellipsoid, 1, [] (Intersection_Inputs *inputs, u32 i) {
+        keep(intersect_ellipsoid(&inputs->primitives[i], inputs->object_rays[i]));
+    });
+    run_hit_ratios("intersect_box", &box, 1, [] (Intersection_Inputs *inputs, u32 i) {
+        keep(intersect_box(&inputs->primitives[i], inputs->object_rays[i]));
+    });
+
+    // The types alternate, as in a leaf of mixed primitives
+    run_hit_ratios("intersect_once", all, array_size(all), [] (Intersection_Inputs *inputs, u32 i) {
+        keep(intersect_once(&inputs->primitives[i], inputs->world_rays[i]));
+    });
+}
+
+void micro_math(u32 argc, char **argv)
+{
+    Xoroshiro128 xoroshiro;
+    xoroshiro_set_seed(&xoroshiro, 2);
+
+    Vector3 *vectors = (Vector3 *) os_allocate(MICRO_INPUTS * sizeof(Vector3));
+    Quaternion *rotations = (Quaternion *) os_allocate(MICRO_INPUTS * sizeof(Quaternion));
+    for (u32 i = 0; i < MICRO_INPUTS; i++) {
+        vectors[i] = (0.1f + 10 * xoroshiro_next_f32(&xoroshiro)) * uniform_unit_sphere(&xoroshiro);
+        rotations[i] = random_rotation(&xoroshiro);
+    }
+
+    run_micro("rotate", "", [&] (u32 i) {
+        keep(rotate(vectors[i], rotations[i]));
+    });
+    run_micro("normalize", "", [&] (u32 i) {
+        keep(normalize(vectors[i]));
+    });
+    run_micro("dot", "", [&] (u32 i) {
+        keep(dot(vectors[i], vectors[(i + 1) & (MICRO_INPUTS - 1)]));
+    });
+    run_micro("cross", "", [&] (u32 i) {
+        keep(cross(vectors[i], vectors[(i + 1) & (MICRO_INPUTS - 1)]));
+    });
+    run_micro("quaternion_product", "", [&] (u32 i) {
+        keep(rotations[i] * rotations[(i + 1) & (MICRO_INPUTS - 1)]);
+    });
+    run_micro("inverse_direction", "", [&] (u32 i) {
+        keep(inverse_direction(vectors[i]));
+    });
+
+    os_free(vectors, MICRO_INPUTS * sizeof(Vector3));
+    os_free(rotations, MICRO_INPUTS * sizeof(Quaternion));
+}
+
+void micro_random(u32 argc, char **argv)
+{
+    Xoroshiro128 xoroshiro;
+    xoroshiro_set_seed(&xoroshiro, 3);
+
+    // Bounds of all sizes, which change how often the rejection loop repeats
+    u32 *bounds = (u32 *) os_allocate(MICRO_INPUTS * sizeof(u32));
+    for (u32 i = 0; i < MICRO_INPUTS; i++) {
+        bounds[i] = (u32) (xoroshiro_next_u64(&xoroshiro) >> (32 + xoroshiro_next_u32(&xoroshiro, 31)));
+    }
+
+    run_micro("xoroshiro_next_f32", "", [&] (u32 i) {
+        keep(xoroshiro_next_f32(&xoroshiro));
+    });
+    run_micro("xoroshiro_next_u32", "", [&] (u32 i) {
+        keep(xoroshiro_next_u32(&xoroshiro, bounds[i]));
+    });
+
+    Sample_Randoms randoms;
+    run_micro("draw_sample_randoms", "", [&] (u32 i) {
+        draw_sample_randoms(&xoroshiro, &randoms);
+        keep(randoms);
+    }, SAMPLE_BATCH);
+
+    os_free(bounds, MICRO_INPUTS * sizeof(u32));
+}
+
+void micro_sampling(u32 argc, char **argv)
+{
+    Xoroshiro128 xoroshiro;
+    xoroshiro_set_seed(&xoroshiro, 4);
+
+    Vector3 *normals = (Vector3 *) os_allocate(MICRO_INPUTS * sizeof(Vector3));
+    Vector3 *colors  = (Vector3 *) os_allocate(MICRO_INPUTS * sizeof(Vector3));
+    for (u32 i = 0; i < MICRO_INPUTS; i++) {
+        normals[i] = uniform_unit_sphere(&xoroshiro);
+        colors[i]  = 4.0f * Vector3{xoroshiro_next_f32(&xoroshiro), xoroshiro_next_f32(&xoroshiro), xoroshiro_next_f32(&xoroshiro)};
+    }
+
+    run_micro("cosine_weighted", "", [&] (u32 i) {
+        keep(cosine_weighted(&xoroshiro, normals[i]));
+    });
+    run_micro("aces_tonemap", "", [&] (u32 i) {
+        keep(aces_tonemap(colors[i]));
+    });
+
+    Primitive_Type box = PRIMITIVE_BOX;
+    Primitive_Type lights[] = {PRIMITIVE_ELLIPSOID, PRIMITIVE_BOX};
+    Intersection_Inputs *inputs = (Intersection_Inputs *) os_allocate(sizeof(Intersection_Inputs));
+    make_intersection_inputs(inputs, &box, 1, 1.0f, 5);
+    run_micro("uniform_box", "", [&] (u32 i) {
+        keep(uniform_box(&xoroshiro, &inputs->primitives[i]));
+    });
+    make_intersection_inputs(inputs, &lights[0], 1, 1.0f, 5);
+    run_micro("nonuniform_ellipsoid", "", [&] (u32 i) {
+        keep(nonuniform_ellipsoid(&xoroshiro, &inputs->primitives[i]));
+    });
+    os_free(inputs, sizeof(Intersection_Inputs));
+
+    // Intersects the light before the density, like MIS of emission does
+    run_hit_ratios("light_pdf", lights, array_size(lights), [] (Intersection_Inputs *inputs, u32 i) {
+        keep(light_pdf(&inputs->primitives[i], inputs->world_rays[i]));
+    });
+
+    os_free(normals, MICRO_INPUTS * sizeof(Vector3));
+    os_free(colors,  MICRO_INPUTS * sizeof(Vector3));
+}
+
+// The batched samplers over random numbers drawn ahead, per sample
+void micro_batch(u32 argc, char **argv)
+{
+    const u32 BATCHES = MICRO_INPUTS / SAMPLE_BATCH;
+
+    Xoroshiro128 xoroshiro;
+    xoroshiro_set_seed(&xoroshiro, 6);
+
+    Sample_Randoms *randoms = (Sample_Randoms *) os_allocate(BATCHES * sizeof(Sample_Randoms));
+    Vector3_Batch  *normals = (Vector3_Batch *)  os_allocate(BATCHES * sizeof(Vector3_Batch));
+    for (u32 b = 0; b < BATCHES; b++) {
+        draw_sample_randoms(&xoroshiro, &randoms[b]);
+        for (u32 i = 0; i < SAMPLE_BATCH; i++) {
+            Vector3 normal = uniform_unit_sphere(&xoroshiro);
+            normals[b].x[i] = normal.x;
+            normals[b].y[i] = normal.y;
+            normals[b].z[i] = normal.z;
+        }
+    }
+
+    Primitive box       = random_primitive(&xoroshiro, PRIMITIVE_BOX);
+    Primitive ellipsoid = random_primitive(&xoroshiro, PRIMITIVE_ELLIPSOID);
+    Vector3_Batch samples;
+
+    u32 supported = supported_instruction_sets();
+    for (u32 isa = 0; isa < ISA_COUNT; isa++) {
+        if (!(supported & (1 << isa))) {
+            continue;
+        }
+
+        const Sample_Kernels *kernels = ISA_SAMPLE_KERNELS[isa];
+        run_micro("cosine_weighted", INSTRUCTION_SET_NAMES[isa], [&] (u32 i) {
+            kernels->cosine_weighted(&randoms[i % BATCHES], &normals[i % BATCHES], &samples);
+            keep(samples);
+        }, SAMPLE_BATCH);
+        run_micro("uniform_box", INSTRUCTION_SET_NAMES[isa], [&] (u32 i) {
+            kernels->uniform_box(&randoms[i % BATCHES], &box, &samples);
+            keep(samples);
+        }, SAMPLE_BATCH);
+        run_micro("nonuniform_ellipsoid", INSTRUCTION_SET_NAMES[isa], [&] (u32 i) {
+            kernels->nonuniform_ellipsoid(&randoms[i % BATCHES], &ellipsoid, &samples);
+            keep(samples);
+        }, SAMPLE_BATCH);
+    }
+
+    os_free(randoms, BATCHES * sizeof(Sample_Randoms));
+    os_free(normals, BATCHES * sizeof(Vector3_Batch));
+}
+
+Benchmark microbenchmarks[] = {
+    {"intersect", micro_intersect},
+    {"math",      micro_math},
+    {"random",    micro_random},
+    {"sampling",  micro_sampling},
+    {"batch",     micro_batch},
+};
+
+PRIVATE_NAMESPACE_END
+
+extern "C"
+{
+
+int main(int argc, char **argv)
+{
+    using namespace ray;
+
+    u32 processor = 0;
+    while (argc >= 3 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "--cpu") == 0) {
+            processor = (u32) atoi(argv[2]);
+        } else if (strcmp(argv[1], "--hit-ratio") == 0) {
+            micro_hit_ratio = CLAMP((f32) atof(argv[2]), 0.0f, 1.0f);
+        } else {
+            break;
+        }
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (!os_pin_thread(processor)) {
+        printf("Could not pin the thread to processor %u, timings may be noisy.\n", processor);
+    }
+
+    bool found = argc < 2;
+    for (u32 i = 0; i < array_size(microbenchmarks); i++) {
+        bool selected = argc < 2;
+        for (s32 a = 1; a < argc; a++) {
+            selected |= strcmp(argv[a], microbenchmarks[i].name) == 0;
+        }
+
+        if (selected) {
+            printf("== %s ==\n", microbenchmarks[i].name);
+            microbenchmarks[i].run(0, nullptr);
+            found = true;
+        }
+    }
+
+    if (!found) {
+        printf("Unknown benchmark `%s`.\n", argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
+
+}
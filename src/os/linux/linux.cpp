@@ -1,9 +1,16 @@
+#include <cpuid.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef DEVELOPER
@@ -21,6 +28,8 @@ void os_debug_break()
 
 void *os_allocate(u64 amount)
 {
+    memory_check_limit(amount);
+
     void *address =
         mmap(
             nullptr,
@@ -34,12 +43,15 @@ void *os_allocate(u64 amount)
     if (address == MAP_FAILED) {
         return nullptr;
     }
+    memory_record_allocate(address, amount);
 
     return address;
 }
 
 void *os_reallocate(void *start, u64 old_size, u64 new_size)
 {
+    memory_check_limit(new_size > old_size ? new_size - old_size : 0);
+
     void *address =
         mremap(
             start,    // Has to be page-aligned
@@ -51,12 +63,14 @@ void *os_reallocate(void *start, u64 old_size, u64 new_size)
     if (address == MAP_FAILED) {
         return nullptr;
     }
+    memory_record_reallocate(start, address, new_size);
 
     return address;
 }
 
 void os_free(void *address, u64 amount)
 {
+    memory_record_free(address);
     munmap(address, amount);
 }
 
@@ -65,6 +79,349 @@ u32 os_page_size()
     return sysconf(_SC_PAGE_SIZE);
 }
 
+u64 os_time_ns()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return (u64) time.tv_sec * 1000000000ull + time.tv_nsec;
+}
+
+void os_sleep_ms(u32 milliseconds)
+{
+    struct timespec duration = {
+        .tv_sec  = milliseconds / 1000,
+        .tv_nsec = (long) (milliseconds % 1000) * 1000000,
+    };
+
+    // Restart after interruptions by signals with the remaining time
+    while (nanosleep(&duration, &duration) == -1 && errno == EINTR) {}
+}
+
+void *os_map_shared_memory(const char *name, u64 size)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "/dev/shm/%s", name);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        debug_log("open(%s): %s", path, strerror(errno));
+
+        return nullptr;
+    }
+
+    defer {
+        close(fd);
+    };
+
+    if (ftruncate(fd, size) == -1) {
+        // Could not resize
+        return nullptr;
+    }
+
+    memory_check_limit(size);
+    void *address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        return nullptr;
+    }
+    memory_record_allocate(address, size);
+
+    return address;
+}
+
+void os_unmap_shared_memory(void *address, u64 size)
+{
+    memory_record_free(address);
+    munmap(address, size);
+}
+
+struct Os_Thread
+{
+    pthread_t thread;
+
+    Os_Thread_Function *function;
+    void *data;
+};
+
+struct Os_Mutex
+{
+    pthread_mutex_t mutex;
+};
+
+struct Os_Condition
+{
+    pthread_cond_t condition;
+};
+
+Os_Thread *os_start_thread(Os_Thread_Function *function, void *data)
+{
+    Os_Thread *thread = (Os_Thread *) os_allocate(sizeof(Os_Thread));
+    thread->function = function;
+    thread->data = data;
+
+    auto start = [] (void *argument) -> void *
+    {
+        Os_Thread *thread = (Os_Thread *) argument;
+        thread->function(thread->data);
+
+        return nullptr;
+    };
+
+    if (pthread_create(&thread->thread, nullptr, start, thread) != 0) {
+        os_free(thread, sizeof(Os_Thread));
+        return nullptr;
+    }
+
+    return thread;
+}
+
+void os_join_thread(Os_Thread *thread)
+{
+    pthread_join(thread->thread, nullptr);
+    os_free(thread, sizeof(Os_Thread));
+}
+
+u32 os_processor_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (u32) count : 1;
+}
+
+bool os_pin_thread(u32 processor)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(processor, &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void os_cpuid(u32 leaf, u32 subleaf, u32 *registers)
+{
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+}
+
+struct Os_Counters
+{
+    int fds[OS_COUNTER_COUNT]; // -1 for those that could not be opened
+};
+
+Os_Counters *os_open_counters()
+{
+    const u64 READ_MISS = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    struct
+    {
+        u32 type;
+        u64 config;
+    } events[OS_COUNTER_COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D  | READ_MISS},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL   | READ_MISS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | READ_MISS},
+    };
+
+    // Cycles and instructions share a group, so their ratio is measured over
+    // the same time. The other events need general-purpose counters, of which
+    // there may be too few for all of them at once with hyper-threading or the
+    // NMI watchdog, so each is opened on its own and the kernel multiplexes them.
+    const u32 GROUP_SIZE = 2;
+
+    Os_Counters *counters = (Os_Counters *) os_allocate(sizeof(Os_Counters));
+    int leader = -1;
+    bool any_open = false;
+    for (u32 i = 0; i < OS_COUNTER_COUNT; i++) {
+        struct perf_event_attr attributes = {};
+        attributes.size           = sizeof(attributes);
+        attributes.type           = events[i].type;
+        attributes.config         = events[i].config;
+        attributes.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv     = 1;
+
+        // The first counter of the group that opens leads it
+        int group = i < GROUP_SIZE ? leader : -1;
+        counters->fds[i] = (int) syscall(SYS_perf_event_open, &attributes, 0, -1, group, 0);
+        if (counters->fds[i] == -1) {
+            debug_log("perf_event_open(%u): %s", i, strerror(errno));
+            continue;
+        }
+
+        any_open = true;
+        if (i < GROUP_SIZE && leader == -1) {
+            leader = counters->fds[i];
+        }
+    }
+
+    if (!any_open) {
+        os_free(counters, sizeof(Os_Counters));
+        return nullptr;
+    }
+
+    return counters;
+}
+
+u32 os_read_counters(Os_Counters *counters, u64 *values)
+{
+    u32 available = 0;
+    for (u32 i = 0; i < OS_COUNTER_COUNT; i++) {
+        values[i] = 0;
+
+        // A counter that shared the hardware with others is scaled up to the
+        // whole time, one that never got onto it counted nothing
+        u64 value[3]; // Value, time enabled, time running
+        if (counters->fds[i] == -1 || read(counters->fds[i], value, sizeof(value)) != sizeof(value) || value[2] == 0) {
+            continue;
+        }
+
+        values[i] = value[2] < value[1] ? (u64) ((f64) value[0] * value[1] / value[2]) : value[0];
+        available |= 1u << i;
+    }
+
+    return available;
+}
+
+void os_close_counters(Os_Counters *counters)
+{
+    for (u32 i = 0; i < OS_COUNTER_COUNT; i++) {
+        if (counters->fds[i] != -1) {
+            close(counters->fds[i]);
+        }
+    }
+
+    os_free(counters, sizeof(Os_Counters));
+}
+
+Os_Mutex *os_create_mutex()
+{
+    Os_Mutex *mutex = (Os_Mutex *) os_allocate(sizeof(Os_Mutex));
+    pthread_mutex_init(&mutex->mutex, nullptr);
+
+    return mutex;
+}
+
+void os_destroy_mutex(Os_Mutex *mutex)
+{
+    pthread_mutex_destroy(&mutex->mutex);
+    os_free(mutex, sizeof(Os_Mutex));
+}
+
+void os_lock(Os_Mutex *mutex)
+{
+    pthread_mutex_lock(&mutex->mutex);
+}
+
+void os_unlock(Os_Mutex *mutex)
+{
+    pthread_mutex_unlock(&mutex->mutex);
+}
+
+Os_Condition *os_create_condition()
+{
+    Os_Condition *condition = (Os_Condition *) os_allocate(sizeof(Os_Condition));
+    pthread_cond_init(&condition->condition, nullptr);
+
+    return condition;
+}
+
+void os_destroy_condition(Os_Condition *condition)
+{
+    pthread_cond_destroy(&condition->condition);
+    os_free(condition, sizeof(Os_Condition));
+}
+
+void os_wait(Os_Condition *condition, Os_Mutex *mutex)
+{
+    pthread_cond_wait(&condition->condition, &mutex->mutex);
+}
+
+void os_wake_all(Os_Condition *condition)
+{
+    pthread_cond_broadcast(&condition->condition);
+}
+
+struct Os_Stream
+{
+    int fd;
+};
+
+Os_Stream *os_make_stream(int fd)
+{
+    Os_Stream *stream = (Os_Stream *) os_allocate(sizeof(Os_Stream));
+    stream->fd = fd;
+
+    return stream;
+}
+
+Os_Stream *os_standard_input()
+{
+    return os_make_stream(STDIN_FILENO);
+}
+
+Os_Stream *os_listen_local(const char *path)
+{
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        debug_log("Socket path `%s` is too long.", path);
+        return nullptr;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        debug_log("socket: %s", strerror(errno));
+        return nullptr;
+    }
+
+    // A socket file left behind by a previous server would make bind fail
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(fd, 16) == -1) {
+        debug_log("bind(%s): %s", path, strerror(errno));
+        close(fd);
+        return nullptr;
+    }
+
+    return os_make_stream(fd);
+}
+
+Os_Stream *os_accept(Os_Stream *listener)
+{
+    int fd;
+    do {
+        fd = accept(listener->fd, nullptr, nullptr);
+    } while (fd == -1 && errno == EINTR);
+
+    if (fd == -1) {
+        debug_log("accept: %s", strerror(errno));
+        return nullptr;
+    }
+
+    return os_make_stream(fd);
+}
+
+s64 os_read_stream(Os_Stream *stream, void *buffer, u64 size)
+{
+    ssize_t result;
+    do {
+        result = read(stream->fd, buffer, size);
+    } while (result == -1 && errno == EINTR);
+
+    return result;
+}
+
+void os_close_stream(Os_Stream *stream)
+{
+    if (stream->fd != STDIN_FILENO) {
+        close(stream->fd);
+    }
+
+    os_free(stream, sizeof(Os_Stream));
+}
+
 bool os_read_file(File *file)
 {
     int fd = open(file->name, O_RDONLY);
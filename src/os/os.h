@@ -10,6 +10,15 @@ void *os_reallocate(void *start, u64 old_size, u64 new_size);
 void os_free(void *address, u64 amount);
 u32 os_page_size();
 
+// Monotonic clock
+u64 os_time_ns();
+
+void os_sleep_ms(u32 milliseconds);
+
+// Memory that other processes can map by name, it lives in /dev/shm on Linux
+void *os_map_shared_memory(const char *name, u64 size);
+void os_unmap_shared_memory(void *address, u64 size);
+
 struct File
 {
     char *name; // This is one of the rare cases when we use null-terminated strings for convenience
@@ -17,6 +26,61 @@ struct File
     u32  size;
 };
 
+// Threads and synchronization
+struct Os_Thread;
+struct Os_Mutex;
+struct Os_Condition;
+
+typedef void Os_Thread_Function(void *data);
+
+Os_Thread *os_start_thread(Os_Thread_Function *function, void *data);
+void os_join_thread(Os_Thread *thread);
+u32  os_processor_count();
+bool os_pin_thread(u32 processor); // Keeps the calling thread on the processor
+
+// Runs CPUID with the leaf in eax and the subleaf in ecx, and writes eax, ebx, ecx and edx
+void os_cpuid(u32 leaf, u32 subleaf, u32 *registers);
+
+Os_Mutex *os_create_mutex();
+void os_destroy_mutex(Os_Mutex *mutex);
+void os_lock(Os_Mutex *mutex);
+void os_unlock(Os_Mutex *mutex);
+
+Os_Condition *os_create_condition();
+void os_destroy_condition(Os_Condition *condition);
+void os_wait(Os_Condition *condition, Os_Mutex *mutex); // The mutex has to be locked
+void os_wake_all(Os_Condition *condition);
+
+// Hardware performance counters of the calling thread, in user mode. They are
+// opened as one group so that they count over the same time, and not every
+// processor or system has all of them.
+enum Os_Counter
+{
+    OS_COUNTER_CYCLES,
+    OS_COUNTER_INSTRUCTIONS,
+    OS_COUNTER_L1D_MISSES,
+    OS_COUNTER_LLC_MISSES,
+    OS_COUNTER_BRANCH_MISSES,
+    OS_COUNTER_DTLB_MISSES,
+
+    OS_COUNTER_COUNT
+};
+
+struct Os_Counters;
+
+Os_Counters *os_open_counters(); // Null when none of them is available
+u32  os_read_counters(Os_Counters *counters, u64 *values); // Reads OS_COUNTER_COUNT values, returns the mask of the available ones
+void os_close_counters(Os_Counters *counters);
+
+// Byte streams: the standard input, and connections to a local (Unix domain) socket
+struct Os_Stream;
+
+Os_Stream *os_standard_input();
+Os_Stream *os_listen_local(const char *path);
+Os_Stream *os_accept(Os_Stream *listener); // Blocks until a client connects
+s64  os_read_stream(Os_Stream *stream, void *buffer, u64 size); // Zero at the end of the stream, negative on errors
+void os_close_stream(Os_Stream *stream);
+
 // File name has to be filled in
 bool os_read_file(File *file);
 bool os_write_file(File *file);
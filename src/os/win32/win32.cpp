@@ -40,28 +40,45 @@ void os_debug_vlog(const char *format, va_list args)
 
 void *os_allocate(u64 amount)
 {
-    return
+    memory_check_limit(amount);
+
+    void *address =
         VirtualAlloc(
             nullptr,
             amount,
             MEM_COMMIT | MEM_RESERVE,
             PAGE_READWRITE
         );
+
+    if (address) {
+        memory_record_allocate(address, amount);
+    }
+
+    return address;
 }
 
 void *os_reallocate(void *start, u64 old_size, u64 new_size)
 {
-    return
+    memory_check_limit(new_size > old_size ? new_size - old_size : 0);
+
+    void *address =
         VirtualAlloc(
             start,
             new_size,
             MEM_COMMIT | MEM_RESERVE,
             PAGE_READWRITE
         );
+
+    if (address) {
+        memory_record_reallocate(start, address, new_size);
+    }
+
+    return address;
 }
 
 void os_free(void *address, u64 amount)
 {
+    memory_record_free(address);
     VirtualFree(address, 0, MEM_RELEASE);
 }
 
@@ -73,6 +90,238 @@ u32 os_page_size()
     return info.dwPageSize;
 }
 
+u64 os_time_ns()
+{
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    // Split to avoid overflowing the multiplication
+    u64 seconds = counter.QuadPart / frequency.QuadPart;
+    u64 rest    = counter.QuadPart % frequency.QuadPart;
+
+    return seconds * 1000000000ull + rest * 1000000000ull / frequency.QuadPart;
+}
+
+void os_sleep_ms(u32 milliseconds)
+{
+    Sleep(milliseconds);
+}
+
+void *os_map_shared_memory(const char *name, u64 size)
+{
+    // The handle stays open, so that other processes can open the mapping by name
+    HANDLE mapping =
+        CreateFileMappingA(
+            INVALID_HANDLE_VALUE,
+            nullptr,
+            PAGE_READWRITE,
+            (DWORD) (size >> 32),
+            (DWORD) size,
+            name
+        );
+
+    if (!mapping) {
+        print_win32_error("CreateFileMapping");
+        return nullptr;
+    }
+
+    memory_check_limit(size);
+    void *address = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!address) {
+        print_win32_error("MapViewOfFile");
+    } else {
+        memory_record_allocate(address, size);
+    }
+
+    return address;
+}
+
+void os_unmap_shared_memory(void *address, u64 size)
+{
+    memory_record_free(address);
+    UnmapViewOfFile(address);
+}
+
+struct Os_Thread
+{
+    HANDLE handle;
+
+    Os_Thread_Function *function;
+    void *data;
+};
+
+struct Os_Mutex
+{
+    SRWLOCK lock;
+};
+
+struct Os_Condition
+{
+    CONDITION_VARIABLE condition;
+};
+
+Os_Thread *os_start_thread(Os_Thread_Function *function, void *data)
+{
+    Os_Thread *thread = (Os_Thread *) os_allocate(sizeof(Os_Thread));
+    thread->function = function;
+    thread->data = data;
+
+    auto start = [] (void *argument) -> DWORD
+    {
+        Os_Thread *thread = (Os_Thread *) argument;
+        thread->function(thread->data);
+
+        return 0;
+    };
+
+    thread->handle = CreateThread(nullptr, 0, start, thread, 0, nullptr);
+    if (!thread->handle) {
+        print_win32_error("CreateThread");
+        os_free(thread, sizeof(Os_Thread));
+        return nullptr;
+    }
+
+    return thread;
+}
+
+void os_join_thread(Os_Thread *thread)
+{
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    os_free(thread, sizeof(Os_Thread));
+}
+
+u32 os_processor_count()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return info.dwNumberOfProcessors;
+}
+
+bool os_pin_thread(u32 processor)
+{
+    if (!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << processor)) {
+        print_win32_error("SetThreadAffinityMask");
+        return false;
+    }
+
+    return true;
+}
+
+void os_cpuid(u32 leaf, u32 subleaf, u32 *registers)
+{
+    int values[4];
+    __cpuidex(values, (int) leaf, (int) subleaf);
+    memcpy(registers, values, sizeof(values));
+}
+
+// Counters would need a kernel driver on Windows
+Os_Counters *os_open_counters()
+{
+    return nullptr;
+}
+
+u32 os_read_counters(Os_Counters *counters, u64 *values)
+{
+    return 0;
+}
+
+void os_close_counters(Os_Counters *counters)
+{
+}
+
+Os_Mutex *os_create_mutex()
+{
+    Os_Mutex *mutex = (Os_Mutex *) os_allocate(sizeof(Os_Mutex));
+    InitializeSRWLock(&mutex->lock);
+
+    return mutex;
+}
+
+void os_destroy_mutex(Os_Mutex *mutex)
+{
+    os_free(mutex, sizeof(Os_Mutex));
+}
+
+void os_lock(Os_Mutex *mutex)
+{
+    AcquireSRWLockExclusive(&mutex->lock);
+}
+
+void os_unlock(Os_Mutex *mutex)
+{
+    ReleaseSRWLockExclusive(&mutex->lock);
+}
+
+Os_Condition *os_create_condition()
+{
+    Os_Condition *condition = (Os_Condition *) os_allocate(sizeof(Os_Condition));
+    InitializeConditionVariable(&condition->condition);
+
+    return condition;
+}
+
+void os_destroy_condition(Os_Condition *condition)
+{
+    os_free(condition, sizeof(Os_Condition));
+}
+
+void os_wait(Os_Condition *condition, Os_Mutex *mutex)
+{
+    SleepConditionVariableSRW(&condition->condition, &mutex->lock, INFINITE, 0);
+}
+
+void os_wake_all(Os_Condition *condition)
+{
+    WakeAllConditionVariable(&condition->condition);
+}
+
+struct Os_Stream
+{
+    HANDLE handle;
+};
+
+Os_Stream *os_standard_input()
+{
+    Os_Stream *stream = (Os_Stream *) os_allocate(sizeof(Os_Stream));
+    stream->handle = GetStdHandle(STD_INPUT_HANDLE);
+
+    return stream;
+}
+
+// Local sockets are not supported, the option parser rejects a socket path
+Os_Stream *os_listen_local(const char *path)
+{
+    return nullptr;
+}
+
+Os_Stream *os_accept(Os_Stream *listener)
+{
+    return nullptr;
+}
+
+s64 os_read_stream(Os_Stream *stream, void *buffer, u64 size)
+{
+    DWORD read;
+    if (ReadFile(stream->handle, buffer, (DWORD) size, &read, nullptr) == FALSE) {
+        // Reading a closed pipe fails instead of returning zero bytes
+        return GetLastError() == ERROR_BROKEN_PIPE ? 0 : -1;
+    }
+
+    return read;
+}
+
+void os_close_stream(Os_Stream *stream)
+{
+    os_free(stream, sizeof(Os_Stream));
+}
+
 bool os_read_file(File *file)
 {
     HANDLE handle =
@@ -0,0 +1,388 @@
+// Caustic photon pass, enabled by CAUSTIC_PHOTONS in the scene file.
+//
+// Light that glass and mirrors focus onto diffuse surfaces is found by paths
+// from the camera only when they happen to hit a light through the specular
+// surfaces, so caustics take enormous sample counts. Instead, every pass emits
+// photons from the sampled lights and follows them through specular surfaces
+// with the scatter kernel. Photons are stored where they first hit a diffuse
+// surface after at least one specular one, the others are dropped. Diffuse
+// vertices of paths then gather the stored photons within a radius (see
+// gather_photons in kernels.cpp), and do not count the emission that they see
+// through specular surfaces alone, which would count the same light twice.
+//
+// Photons that do not hit a specular surface first are wasted, so they are
+// only emitted towards the bounding spheres of the specular primitives, like
+// the projection maps of Jensen. Every direction within the cone of a sphere
+// from the emitting point is equally likely, which is a density of the number
+// of cones that contain it over their total solid angle. Scenes with many
+// specular primitives aim at one sphere around them all, and a specular plane
+// can be hit from anywhere, so with one photons leave in all directions.
+//
+// Photons are traced in chunks on the thread pool, every chunk with its own
+// random sequence and its own array, so the map does not depend on the number
+// of threads. The chunks are then counting sorted into the buckets of the
+// hash grid. The gather radius shrinks with every pass, as in "Progressive
+// Photon Mapping: A Probabilistic Approach" by Knaus and Zwicker, so the
+// average of the passes converges to the caustics that path tracing finds.
+
+const u32 PHOTON_CHUNK_SIZE      = 4096;
+const f32 CAUSTIC_RADIUS_ALPHA   = 2.0f / 3.0f; // Of the photons within the radius that every pass keeps
+const f32 CAUSTIC_DEFAULT_RADIUS = 0.002f;      // Of the diagonal of the scene bounds
+const u32 CAUSTIC_MAX_TARGETS    = 32;
+
+// Bounding sphere of specular primitives that photons are emitted towards
+struct Caustic_Target
+{
+    Vector3 center;
+    f32     radius;
+};
+
+struct Caustics
+{
+    Photon_Map map;
+    Array<Array<Photon>> chunks; // Photons stored by every chunk of a pass
+
+    Array<f32> light_cdf; // Of choosing scene->sampled_lights in proportion to their estimated power
+
+    Array<Caustic_Target> targets; // Empty without specular primitives, or with a specular plane
+    bool everywhere;               // Photons leave in all directions, for a specular plane
+
+    u32 num_passes;
+};
+
+// Exact for boxes, Thomsen's approximation for ellipsoids
+f32 light_area(Primitive *light)
+{
+    if (light->type == PRIMITIVE_BOX) {
+        return 1.0f / box_pdf(light);
+    }
+
+    const f32 P = 1.6075f;
+    f32 a = powf(light->parameters.x, P);
+    f32 b = powf(light->parameters.y, P);
+    f32 c = powf(light->parameters.z, P);
+
+    return 4.0f * PI * powf((a * b + a * c + b * c) / 3.0f, 1.0f / P);
+}
+
+// A point on the surface of the light and its outward normal. Returns the
+// density of the point per unit area.
+f32 sample_emitter(Xoroshiro128 *xoroshiro, Primitive *light, Vector3 *point, Vector3 *normal)
+{
+    if (light->type == PRIMITIVE_BOX) {
+        Vector3 dimensions = light->parameters;
+        f32 weights[3] = {dimensions.y * dimensions.z, dimensions.x * dimensions.z, dimensions.x * dimensions.y};
+
+        f32 r = (weights[0] + weights[1] + weights[2]) * xoroshiro_next_f32(xoroshiro);
+        u32 axis = r < weights[0] ? 0 : (r < weights[0] + weights[1] ? 1 : 2);
+        f32 sign = xoroshiro_next_u32(xoroshiro, 1) ? 1.0f : -1.0f;
+
+        Vector3 local = {
+            2 * xoroshiro_next_f32(xoroshiro) - 1,
+            2 * xoroshiro_next_f32(xoroshiro) - 1,
+            2 * xoroshiro_next_f32(xoroshiro) - 1,
+        };
+        local = set_axis(local, axis, sign);
+
+        Vector3 face_normal = set_axis({}, axis, sign);
+
+        *point  = light->position + rotate(dimensions * local, light->rotation);
+        *normal = rotate(face_normal, light->rotation);
+
+        return box_pdf(light);
+    }
+
+    Vector3 unit = uniform_unit_sphere(xoroshiro);
+    *point  = light->position + rotate(unit * light->parameters, light->rotation);
+    *normal = normalize(rotate(unit / light->parameters, light->rotation));
+
+    return ellipsoid_pdf(*point, light);
+}
+
+// A direction from the point within the cone of one of the targets, chosen by
+// their solid angles. Returns the density of the direction.
+f32 aim_photon(Xoroshiro128 *xoroshiro, Array<Caustic_Target> targets, Vector3 point, Vector3 *direction)
+{
+    // One minus the cosine of the cone of every target, two for the whole
+    // sphere of directions from within one
+    f32 one_minus_cos[CAUSTIC_MAX_TARGETS];
+    Vector3 axes[CAUSTIC_MAX_TARGETS];
+
+    f32 total = 0;
+    for (u32 i = 0; i < targets.size; i++) {
+        Vector3 to_center = targets[i].center - point;
+        f32 distance_sq = length_sq(to_center);
+        f32 radius_sq = SQUARE(targets[i].radius);
+
+        one_minus_cos[i] = 2.0f;
+        axes[i] = {};
+        if (distance_sq > radius_sq) {
+            f32 sin_sq = radius_sq / distance_sq;
+            one_minus_cos[i] = sin_sq / (1.0f + sqrtf(1.0f - sin_sq));
+            axes[i] = to_center / sqrtf(distance_sq);
+        }
+        total += one_minus_cos[i];
+    }
+
+    f32 r = total * xoroshiro_next_f32(xoroshiro);
+    u32 chosen = 0;
+    while (chosen + 1 < targets.size && r >= one_minus_cos[chosen]) {
+        r -= one_minus_cos[chosen];
+        chosen++;
+    }
+
+    *direction = one_minus_cos[chosen] < 2.0f ? uniform_cone(xoroshiro, axes[chosen], one_minus_cos[chosen]) : uniform_unit_sphere(xoroshiro);
+
+    // The chosen cone contains the direction even if rounding says otherwise
+    u32 num_containing = 1;
+    for (u32 i = 0; i < targets.size; i++) {
+        if (i != chosen && (one_minus_cos[i] >= 2.0f || 1.0f - dot(*direction, axes[i]) <= one_minus_cos[i])) {
+            num_containing++;
+        }
+    }
+
+    return num_containing / (2.0f * PI * total);
+}
+
+void caustics_init(Caustics *caustics, Scene *scene)
+{
+    *caustics = {};
+
+    f32 total = 0;
+    ARRAY_ITERATE(scene->sampled_lights) {
+        Primitive *light = &scene->primitives[*it];
+        total += luminance(light->emission) * light_area(light);
+        array_push(&caustics->light_cdf, total);
+    }
+
+    // Boxes are bounded by the sphere through their corners
+    ARRAY_ITERATE(scene->primitives) {
+        if (it->surface_type == SURFACE_DIFFUSE) {
+            continue;
+        }
+        if (it->type == PRIMITIVE_PLANE) {
+            caustics->everywhere = true;
+            break;
+        }
+
+        f32 radius = it->type == PRIMITIVE_BOX ? length(it->parameters) : max(it->parameters);
+        array_push(&caustics->targets, {it->position, radius});
+    }
+
+    if (caustics->everywhere) {
+        caustics->targets.size = 0;
+    } else if (caustics->targets.size > CAUSTIC_MAX_TARGETS) {
+        AABB bounds = {caustics->targets[0].center, caustics->targets[0].center};
+        ARRAY_ITERATE(caustics->targets) {
+            Vector3 extent = {it->radius, it->radius, it->radius};
+            bounds = merge(bounds, it->center - extent);
+            bounds = merge(bounds, it->center + extent);
+        }
+
+        caustics->targets.size = 1;
+        caustics->targets[0] = {0.5f * (bounds.min + bounds.max), 0.5f * length(bounds.max - bounds.min)};
+    }
+
+    u32 num_chunks = DIV_UP(scene->caustic_photons, PHOTON_CHUNK_SIZE);
+    for (u32 i = 0; i < num_chunks; i++) {
+        array_push(&caustics->chunks, {});
+    }
+
+    caustics->map.radius = scene->caustic_radius;
+    if (caustics->map.radius <= 0) {
+        caustics->map.radius = CAUSTIC_DEFAULT_RADIUS * length(scene->bvh.bounds.max - scene->bvh.bounds.min);
+    }
+}
+
+void caustics_free(Caustics *caustics)
+{
+    ARRAY_ITERATE(caustics->chunks) {
+        array_free(it);
+    }
+    array_free(&caustics->chunks);
+    array_free(&caustics->light_cdf);
+    array_free(&caustics->targets);
+    array_free(&caustics->map.photons);
+    array_free(&caustics->map.bucket_ends);
+}
+
+// Emits the photons of one chunk and keeps the ones that reach a diffuse
+// surface through specular ones
+void trace_photon_chunk(Caustics *caustics, Scene *scene, u64 seed, u32 chunk, Array<Photon> *photons)
+{
+    // Specular surfaces scatter with the random state of the scene
+    Scene chunk_scene = *scene;
+    xoroshiro_set_seed(&chunk_scene.xoroshiro, seed + chunk * 0x9E3779B97F4A7C15ull);
+    Xoroshiro128 *xoroshiro = &chunk_scene.xoroshiro;
+
+    Array<f32> cdf = caustics->light_cdf;
+    f32 total = cdf[cdf.size - 1];
+
+    photons->size = 0;
+    u32 count = MIN(PHOTON_CHUNK_SIZE, scene->caustic_photons - chunk * PHOTON_CHUNK_SIZE);
+    for (u32 i = 0; i < count; i++) {
+        // Binary search of the light, rounding may run past the last one
+        f32 r = total * xoroshiro_next_f32(xoroshiro);
+        u32 low = 0, high = cdf.size - 1;
+        while (low < high) {
+            u32 middle = (low + high) / 2;
+            if (r < cdf[middle]) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+
+        Primitive *light = &scene->primitives[scene->sampled_lights[low]];
+        f32 selection = (cdf[low] - (low > 0 ? cdf[low - 1] : 0.0f)) / total;
+
+        // Every photon carries the emission times the cosine over the
+        // densities of the light, the point and the direction
+        Vector3 point, normal;
+        f32 area_pdf = sample_emitter(xoroshiro, light, &point, &normal);
+
+        Vector3 direction;
+        f32 cosine, direction_pdf;
+        if (caustics->everywhere) {
+            direction = cosine_weighted(xoroshiro, normal);
+            cosine = dot(direction, normal);
+            direction_pdf = cosine / PI;
+        } else {
+            direction_pdf = aim_photon(xoroshiro, caustics->targets, point, &direction);
+            cosine = dot(direction, normal);
+        }
+
+        if (!(selection > 0 && area_pdf > 0 && direction_pdf > 0 && cosine > 0)) {
+            continue;
+        }
+
+        Path path = {
+            .ray = {
+                .origin = point + 1E-4 * normal,
+                .direction = direction,
+            },
+            .throughput = light->emission * (cosine / (selection * area_pdf * direction_pdf)),
+            .depth = 1,
+        };
+
+        bool specular = false;
+        while (path.depth <= scene->ray_depth) {
+            Primitive *closest = nullptr;
+            Intersection intersection = scene->kernels->intersect(&chunk_scene, path.ray, &closest, INFINITY);
+            if (!closest) {
+                break;
+            }
+
+            if (closest->surface_type == SURFACE_DIFFUSE) {
+                if (specular) {
+                    array_push(photons, {
+                        .position  = path.ray.origin + intersection.t * path.ray.direction,
+                        .direction = path.ray.direction,
+                        .power     = path.throughput,
+                    });
+                }
+                break;
+            }
+
+            specular = true;
+            scene->kernels->scatter(&chunk_scene, &path, intersection, closest);
+        }
+    }
+}
+
+// Counting sort of the photons of all chunks into the buckets of their cells
+void build_photon_map(Caustics *caustics)
+{
+    Photon_Map *map = &caustics->map;
+
+    u32 num_photons = 0;
+    ARRAY_ITERATE(caustics->chunks) {
+        num_photons += it->size;
+    }
+
+    u32 num_buckets = 1;
+    while (num_buckets < num_photons && num_buckets < (1u << 30)) {
+        num_buckets *= 2;
+    }
+    map->bucket_mask = num_buckets - 1;
+
+    array_resize(&map->bucket_ends, num_buckets);
+    memset(map->bucket_ends.data, 0, num_buckets * sizeof(u32));
+    array_resize(&map->photons, num_photons);
+
+    auto bucket_of = [map] (Photon *photon) {
+        Vector3 p = photon->position;
+        return photon_bucket(map, photon_cell(map, p.x), photon_cell(map, p.y), photon_cell(map, p.z));
+    };
+
+    ARRAY_ITERATE(caustics->chunks) {
+        for (u32 i = 0; i < it->size; i++) {
+            map->bucket_ends[bucket_of(&it->data[i])]++;
+        }
+    }
+
+    // The counts become the starts of the buckets, which end up at their ends
+    // as the photons are placed
+    u32 start = 0;
+    for (u32 i = 0; i < num_buckets; i++) {
+        u32 count = map->bucket_ends[i];
+        map->bucket_ends[i] = start;
+        start += count;
+    }
+
+    ARRAY_ITERATE(caustics->chunks) {
+        for (u32 i = 0; i < it->size; i++) {
+            map->photons[map->bucket_ends[bucket_of(&it->data[i])]++] = it->data[i];
+        }
+    }
+}
+
+// Traces the photons of the next pass into the map, with the radius shrunk
+// after every pass before
+void caustics_pass(Caustics *caustics, Thread_Pool *pool, Scene *scene, u64 seed)
+{
+    Photon_Map *map = &caustics->map;
+    if (caustics->num_passes > 0) {
+        f32 n = (f32) caustics->num_passes;
+        map->radius *= sqrtf((n + CAUSTIC_RADIUS_ALPHA) / (n + 1));
+    }
+    caustics->num_passes++;
+
+    map->cell_size = 2 * map->radius;
+    map->normalization = 1.0f / ((f32) scene->caustic_photons * PI * map->radius * map->radius);
+
+    if (caustics->light_cdf.size > 0 && (caustics->targets.size > 0 || caustics->everywhere)) {
+        parallel_for(pool, caustics->chunks.size, [&] (u32 chunk, u32 thread_index) {
+            trace_photon_chunk(caustics, scene, seed, chunk, &caustics->chunks[chunk]);
+        });
+    }
+
+    build_photon_map(caustics);
+}
+
+// Renders scene->samples paths per pixel into the accumulation buffer in
+// passes of one, each with a photon map of its own
+void render_caustics(Thread_Pool *pool, Scene *scene, u64 seed, Vector3 *accumulation)
+{
+    Caustics caustics;
+    caustics_init(&caustics, scene);
+
+    u64 num_pixels = (u64) scene->width * scene->height;
+    Vector3 *pass = (Vector3 *) memory_allocate(MEMORY_FRAMEBUFFERS, num_pixels * sizeof(Vector3));
+    memset(accumulation, 0, num_pixels * sizeof(Vector3));
+
+    Scene pass_scene = *scene;
+    pass_scene.samples = 1;
+    pass_scene.photon_map = &caustics.map;
+
+    for (u32 p = 0; p < scene->samples; p++) {
+        caustics_pass(&caustics, pool, scene, ~seed + p * 0xD1B54A32D192ED03ull);
+        render_parallel(pool, &pass_scene, seed + p * 0xD1B54A32D192ED03ull, pass);
+        for (u64 i = 0; i < num_pixels; i++) {
+            accumulation[i] += pass[i];
+        }
+    }
+
+    os_free(pass, num_pixels * sizeof(Vector3));
+    caustics_free(&caustics);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "math.h"
+
+// Caustic photon map (see photons.cpp): photons that reached a diffuse surface
+// from a light through specular surfaces alone, in a hash grid whose cells are
+// twice the gather radius wide. A gather then looks at the 2x2x2 cells around
+// the point at most.
+
+struct Photon
+{
+    Vector3 position;
+    Vector3 direction; // Of travel, into the surface
+    Vector3 power;     // Per emitted photon, see Photon_Map::normalization
+};
+
+struct Photon_Map
+{
+    Array<Photon> photons;  // Ordered by bucket
+    Array<u32> bucket_ends; // photons[bucket_ends[i - 1], bucket_ends[i]) hash to bucket i, the first from zero
+    u32 bucket_mask;        // Buckets minus one, a power of two minus one
+
+    f32 radius;
+    f32 cell_size;
+    f32 normalization; // One over the photons emitted times the area of the gather disk
+};
+
+// Cells are hashed by their integer coordinates (Teschner et al.)
+inline u32 photon_bucket(Photon_Map *map, s32 x, s32 y, s32 z)
+{
+    return (((u32) x * 73856093u) ^ ((u32) y * 19349663u) ^ ((u32) z * 83492791u)) & map->bucket_mask;
+}
+
+// Far away cells share the outermost ones, which only costs distance tests
+inline s32 photon_cell(Photon_Map *map, f32 coordinate)
+{
+    return (s32) CLAMP(floorf(coordinate / map->cell_size), -1E9f, 1E9f);
+}
@@ -0,0 +1,162 @@
+// Hardware counters per phase of a render, enabled by --counters.
+//
+// Every thread that renders opens its own counter group: the main thread and
+// the workers of thread pools as they start. At the start of every phase the
+// main thread reads all groups and adds what they counted since to the phase
+// before. Without counters, as on Windows or where perf_event_paranoid or a
+// virtual machine does not allow them, only the phase times are reported.
+
+enum Profile_Phase
+{
+    PROFILE_PARSE,
+    PROFILE_SETUP,
+    PROFILE_RENDER,
+    PROFILE_OUTPUT,
+
+    PROFILE_PHASE_COUNT
+};
+
+const char *PROFILE_PHASE_NAMES[PROFILE_PHASE_COUNT] = {"parse", "setup", "render", "output"};
+const char *PROFILE_COUNTER_NAMES[OS_COUNTER_COUNT] = {"cycles", "instructions", "L1D misses", "LLC misses", "branch misses", "dTLB misses"};
+
+const u32 PROFILE_MAX_THREADS = 256;
+
+struct Profile
+{
+    bool enabled;
+
+    Os_Counters *threads[PROFILE_MAX_THREADS];
+    u32 num_threads; // Taken atomically by the threads as they register
+    u32 available;   // Mask of the counters that every thread has
+
+    u64 last[PROFILE_MAX_THREADS][OS_COUNTER_COUNT]; // Values at the start of the current phase
+
+    u32 phase; // PROFILE_PHASE_COUNT before the first one
+    u64 phase_start;
+    u64 times[PROFILE_PHASE_COUNT];
+    u64 counts[PROFILE_PHASE_COUNT][OS_COUNTER_COUNT];
+};
+
+Profile profile = {.phase = PROFILE_PHASE_COUNT};
+
+// Opens the counters of the calling thread if profiling is enabled
+void profile_register_thread()
+{
+    if (!profile.enabled) {
+        return;
+    }
+
+    Os_Counters *counters = os_open_counters();
+    if (!counters) {
+        return;
+    }
+
+    u32 slot = __atomic_fetch_add(&profile.num_threads, 1, __ATOMIC_RELAXED);
+    if (slot >= PROFILE_MAX_THREADS) {
+        os_close_counters(counters);
+        return;
+    }
+
+    __atomic_store_n(&profile.threads[slot], counters, __ATOMIC_RELEASE);
+}
+
+void profile_init(bool enabled)
+{
+    profile.enabled = enabled;
+    profile.available = (1u << OS_COUNTER_COUNT) - 1;
+    profile_register_thread();
+}
+
+// Ends the current phase and starts the given one, PROFILE_PHASE_COUNT to only end it
+void profile_phase(u32 phase)
+{
+    if (!profile.enabled) {
+        return;
+    }
+
+    u64 now = os_time_ns();
+    if (profile.phase < PROFILE_PHASE_COUNT) {
+        profile.times[profile.phase] += now - profile.phase_start;
+    }
+
+    u32 num_threads = MIN(__atomic_load_n(&profile.num_threads, __ATOMIC_ACQUIRE), PROFILE_MAX_THREADS);
+    for (u32 t = 0; t < num_threads; t++) {
+        Os_Counters *counters = __atomic_load_n(&profile.threads[t], __ATOMIC_ACQUIRE);
+        if (!counters) {
+            continue;
+        }
+
+        u64 values[OS_COUNTER_COUNT];
+        profile.available &= os_read_counters(counters, values);
+        for (u32 c = 0; c < OS_COUNTER_COUNT; c++) {
+            if (profile.phase < PROFILE_PHASE_COUNT) {
+                profile.counts[profile.phase][c] += values[c] - profile.last[t][c];
+            }
+            profile.last[t][c] = values[c];
+        }
+    }
+
+    if (num_threads == 0) {
+        profile.available = 0;
+    }
+
+    profile.phase = phase;
+    profile.phase_start = os_time_ns();
+}
+
+// Prints the phases, and the counts of the render per path
+void profile_report(u64 num_paths)
+{
+    if (!profile.enabled) {
+        return;
+    }
+    profile_phase(PROFILE_PHASE_COUNT);
+
+    if (!profile.available) {
+        printf("Hardware counters are not available, phase times only.\n");
+    }
+
+    printf("%-8s %10s", "phase", "time");
+    for (u32 c = 0; c < OS_COUNTER_COUNT; c++) {
+        if (profile.available & (1u << c)) {
+            printf(" %14s", PROFILE_COUNTER_NAMES[c]);
+        }
+    }
+    if ((profile.available & 3) == 3) {
+        printf(" %6s", "IPC");
+    }
+    printf("\n");
+
+    for (u32 p = 0; p < PROFILE_PHASE_COUNT; p++) {
+        printf("%-8s %7.2f ms", PROFILE_PHASE_NAMES[p], profile.times[p] / 1E6);
+        for (u32 c = 0; c < OS_COUNTER_COUNT; c++) {
+            if (profile.available & (1u << c)) {
+                printf(" %14llu", (unsigned long long) profile.counts[p][c]);
+            }
+        }
+        if ((profile.available & 3) == 3) {
+            u64 cycles = profile.counts[p][OS_COUNTER_CYCLES];
+            printf(" %6.2f", cycles ? (f64) profile.counts[p][OS_COUNTER_INSTRUCTIONS] / cycles : 0.0);
+        }
+        printf("\n");
+    }
+
+    if (profile.available && num_paths > 0) {
+        printf("Render per path:");
+        const char *separator = " ";
+        for (u32 c = 0; c < OS_COUNTER_COUNT; c++) {
+            if (profile.available & (1u << c)) {
+                printf("%s%.2f %s", separator, (f64) profile.counts[PROFILE_RENDER][c] / num_paths, PROFILE_COUNTER_NAMES[c]);
+                separator = ", ";
+            }
+        }
+        printf(".\n");
+    }
+
+    for (u32 t = 0; t < MIN(profile.num_threads, PROFILE_MAX_THREADS); t++) {
+        if (profile.threads[t]) {
+            os_close_counters(profile.threads[t]);
+            profile.threads[t] = nullptr;
+        }
+    }
+}
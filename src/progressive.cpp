@@ -0,0 +1,157 @@
+// Progressive rendering with a live preview in shared memory.
+//
+// The first passes trace one sample per block of 4x4 and then 2x2 pixels, so
+// that a rough image is available almost immediately. Then the image is
+// refined at full resolution, doubling the total number of samples per pixel
+// with every pass until scene->samples is reached. After each pass the
+// tonemapped image is published into a named shared memory framebuffer that a
+// viewer can map and read in place.
+
+const u32 PREVIEW_MAGIC       = 0x50594152; // "RAYP"
+const u32 PREVIEW_START_SCALE = 4;          // Pixels per side of the blocks of the first pass
+
+const char *const DEFAULT_PREVIEW_NAME = "ray_preview";
+
+// Layout of the shared memory, the header is followed by the RGB8 pixels.
+//
+// The sequence number is a seqlock: it is odd while a frame is being written.
+// A reader waits for an even sequence number, reads the header and the pixels
+// in place, and then checks that the sequence number has not changed, retrying
+// otherwise.
+struct alignas(64) Preview_Header
+{
+    u32 magic;
+    u32 sequence;
+
+    u32 width, height;
+    u32 spp;   // Samples per pixel of the frame, zero until the first frame is published
+    u32 scale; // Pixels per side of the blocks that share one sample, one at full resolution
+    u32 pass;
+    u32 done;  // Set for the last frame
+};
+
+struct Preview
+{
+    Preview_Header *header;
+    u8             *pixels;
+    u64             size;
+};
+
+bool preview_open(Preview *preview, const char *name, u32 width, u32 height)
+{
+    preview->size = sizeof(Preview_Header) + 3 * width * height;
+
+    Memory_Tag tag = memory_set_tag(MEMORY_FRAMEBUFFERS);
+    u8 *memory = (u8 *) os_map_shared_memory(name, preview->size);
+    memory_set_tag(tag);
+    if (!memory) {
+        return false;
+    }
+
+    preview->header = (Preview_Header *) memory;
+    preview->pixels = memory + sizeof(Preview_Header);
+
+    // Restart the sequence at an even number in case a previous render left it odd
+    *preview->header = {
+        .magic  = PREVIEW_MAGIC,
+        .width  = width,
+        .height = height,
+    };
+
+    return true;
+}
+
+void preview_close(Preview *preview)
+{
+    os_unmap_shared_memory(preview->header, preview->size);
+}
+
+void preview_publish(Preview *preview, u8 *pixels, u32 spp, u32 scale, u32 pass, bool done)
+{
+    Preview_Header *header = preview->header;
+
+    // Readers must see the odd sequence number before any of the new data
+    __atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    header->spp   = spp;
+    header->scale = scale;
+    header->pass  = pass;
+    header->done  = done;
+    memcpy(preview->pixels, pixels, 3 * header->width * header->height);
+
+    __atomic_store_n(&header->sequence, header->sequence + 1, __ATOMIC_RELEASE);
+}
+
+// Traces one sample per block of scale x scale pixels and fills the blocks with it
+void render_reduced_pass(Scene *scene, u32 scale, u8 *pixels)
+{
+    for (u32 block_y = 0; block_y < scene->height; block_y += scale) {
+        for (u32 block_x = 0; block_x < scene->width; block_x += scale) {
+            u32 x = MIN(block_x + scale / 2, scene->width  - 1);
+            u32 y = MIN(block_y + scale / 2, scene->height - 1);
+
+            Vector3 out_color = aces_tonemap(ray_trace(scene, camera_ray(scene, x, y), 1));
+
+            for (u32 py = block_y; py < MIN(block_y + scale, scene->height); py++) {
+                for (u32 px = block_x; px < MIN(block_x + scale, scene->width); px++) {
+                    pixels[3 * (px + py * scene->width) + 0] = ROUND_COLOR(out_color.r);
+                    pixels[3 * (px + py * scene->width) + 1] = ROUND_COLOR(out_color.g);
+                    pixels[3 * (px + py * scene->width) + 2] = ROUND_COLOR(out_color.b);
+                }
+            }
+        }
+    }
+}
+
+// Renders scene->samples samples per pixel into pixels in passes, publishing
+// every pass into the shared memory preview. Times are reported relative to start.
+void render_progressive(Scene *scene, const char *preview_name, u8 *pixels, u64 start)
+{
+    Preview preview = {};
+    bool has_preview = preview_open(&preview, preview_name, scene->width, scene->height);
+    if (!has_preview) {
+        printf("Could not open the shared memory preview `%s`, rendering without it.\n", preview_name);
+    }
+
+    u64 accumulation_size = (u64) scene->width * scene->height * sizeof(Vector3);
+    Vector3 *accumulation = (Vector3 *) memory_allocate(MEMORY_FRAMEBUFFERS, accumulation_size);
+
+    u32 pass = 0;
+    auto finish_pass = [&] (u32 spp, u32 scale, bool done) {
+        if (has_preview) {
+            preview_publish(&preview, pixels, spp, scale, pass, done);
+        }
+
+        printf("Pass %u: %u spp at 1/%u resolution after %.3f s.\n", pass, spp, scale * scale, (os_time_ns() - start) / 1E9);
+        fflush(stdout);
+        pass++;
+    };
+
+    for (u32 scale = PREVIEW_START_SCALE; scale > 1; scale /= 2) {
+        render_reduced_pass(scene, scale, pixels);
+        finish_pass(1, scale, false);
+    }
+
+    u32 spp = 0;
+    while (spp < scene->samples) {
+        u32 pass_samples = MIN(MAX(spp, 1u), scene->samples - spp);
+
+        for (u32 y = 0; y < scene->height; y++) {
+            for (u32 x = 0; x < scene->width; x++) {
+                for (u32 i = 0; i < pass_samples; i++) {
+                    accumulation[x + y * scene->width] += ray_trace(scene, camera_ray(scene, x, y), 1);
+                }
+            }
+        }
+        spp += pass_samples;
+
+        resolve_pixels(scene, accumulation, spp, pixels);
+        finish_pass(spp, 1, spp == scene->samples);
+    }
+
+    os_free(accumulation, accumulation_size);
+    if (has_preview) {
+        preview_close(&preview);
+    }
+}
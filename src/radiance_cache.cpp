@@ -0,0 +1,62 @@
+// Radiance cache for diffuse bounces, enabled by RADIANCE_CACHE_VOXEL_SIZE in
+// the scene file.
+//
+// Paths of neighbouring pixels compute nearly the same indirect light at every
+// diffuse bounce. The cache averages the radiance that leaves diffuse surfaces
+// over voxels of the scene, separately for normals quantized to four steps per
+// axis, in the way of "Fast Path Space Filtering by Jittered Spatial Hashing"
+// by Binder et al. Past the first diffuse vertex of a path, a voxel that has
+// RADIANCE_CACHE_MIN_SAMPLES samples ends the path with their average, which
+// takes the next-event estimation and all bounces after it. Otherwise the
+// path goes on and adds the radiance that left the vertex to the voxel when
+// it is done (see cache_train in kernels.cpp).
+//
+// The cache is a hash table of RADIANCE_CACHE_ENTRIES entries that keys claim
+// with a compare-and-swap of their checksum, with linear probing, and that
+// samples are added to atomically. All threads share it without locks. The
+// radiance leaving diffuse surfaces does not depend on the camera, so the
+// cache lives as long as the scene, except in animations where primitives
+// move (see set_frame). The result is biased by the size of the voxels and
+// noisier with fewer samples per voxel, and with more than one thread it
+// depends on the order in which the voxels are filled.
+
+void radiance_cache_free(Scene *scene)
+{
+    Radiance_Cache *cache = scene->radiance_cache;
+    if (!cache) {
+        return;
+    }
+
+    os_free(cache->entries, (u64) (cache->mask + 1) * sizeof(Cache_Entry));
+    os_free(cache, sizeof(Radiance_Cache));
+    scene->radiance_cache = nullptr;
+}
+
+void radiance_cache_init(Scene *scene)
+{
+    radiance_cache_free(scene);
+    if (!(scene->cache_voxel_size > 0)) {
+        return;
+    }
+
+    u32 num_entries = 1;
+    while (num_entries < scene->cache_entries && num_entries < (1u << 30)) {
+        num_entries *= 2;
+    }
+
+    // Allocations are zeroed, which makes all entries free
+    Radiance_Cache *cache = (Radiance_Cache *) os_allocate(sizeof(Radiance_Cache));
+    *cache = {
+        .entries     = (Cache_Entry *) os_allocate((u64) num_entries * sizeof(Cache_Entry)),
+        .mask        = num_entries - 1,
+        .voxel_size  = scene->cache_voxel_size,
+        .min_samples = MAX(scene->cache_min_samples, 1u),
+    };
+
+    scene->radiance_cache = cache;
+}
+
+void radiance_cache_clear(Radiance_Cache *cache)
+{
+    memset(cache->entries, 0, (u64) (cache->mask + 1) * sizeof(Cache_Entry));
+}
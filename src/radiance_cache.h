@@ -0,0 +1,67 @@
+#pragma once
+
+#include "math.h"
+
+// Radiance cache (see radiance_cache.cpp): the radiance that leaves diffuse
+// surfaces, averaged over voxels of the scene and quantized normals, in a hash
+// table that all threads insert into and add to without locks.
+
+const u32 CACHE_MAX_VERTICES = 16; // Diffuse vertices per path that train the cache
+const u32 CACHE_MAX_PROBES   = 8;  // Entries tried after the one a key hashes to
+
+struct Cache_Entry
+{
+    u32 checksum; // Of the key, zero while the entry is free
+    u32 count;    // Samples summed
+    f32 sums[3];  // Of the radiance leaving the surface, per color channel
+};
+
+struct Radiance_Cache
+{
+    Cache_Entry *entries;
+    u32 mask; // Entries minus one, their number is a power of two
+
+    f32 voxel_size;
+    u32 min_samples; // Before an entry ends paths
+};
+
+// A diffuse vertex of a path that trains the entry of its voxel once the
+// radiance that reached the camera through it is known
+struct Cache_Vertex
+{
+    Cache_Entry *entry;
+    Vector3 throughput; // Of the path up to the vertex
+    Vector3 radiance;   // Of the path up to the vertex, with its emission
+};
+
+struct Cache_Path
+{
+    Cache_Vertex vertices[CACHE_MAX_VERTICES];
+    u32 num_vertices;
+    bool bounced; // Past the first diffuse vertex, where the cache may end the path
+};
+
+// Hash of the voxel and of the normal, quantized to four steps per axis
+inline u64 cache_key(Radiance_Cache *cache, Vector3 point, Vector3 normal)
+{
+    u64 key = 0;
+    for (u32 axis = 0; axis < 3; axis++) {
+        s32 cell = (s32) CLAMP(floorf(point[axis] / cache->voxel_size), -1E9f, 1E9f);
+        u32 step = (u32) CLAMP(2.0f * (normal[axis] + 1.0f), 0.0f, 3.0f);
+
+        key = (key ^ (u32) cell) * 0x9E3779B97F4A7C15ull;
+        key = (key ^ step) * 0xBF58476D1CE4E5B9ull;
+    }
+
+    return key ^ (key >> 31);
+}
+
+inline f32 atomic_load_f32(f32 *address)
+{
+    u32 bits = __atomic_load_n((u32 *) address, __ATOMIC_RELAXED);
+
+    f32 value;
+    memcpy(&value, &bits, sizeof(f32));
+
+    return value;
+}
@@ -0,0 +1,319 @@
+// Resident render server.
+//
+// Jobs are read as lines `scene_path output_path [priority]` from the standard
+// input, or from the clients of a local socket one after another, and are
+// rendered highest priority first, in arrival order for equal priorities.
+// Paths can not contain spaces. Every finished job is reported on a line of
+// the standard output.
+//
+// The thread pool and the framebuffers stay resident between jobs, and
+// prepared scenes are cached by the hash of the scene file, so rendering a
+// file again skips parsing, sorting and the acceleration structure build.
+
+const u32 SERVER_PATH_CAPACITY = 1024;
+const u32 SERVER_LINE_CAPACITY = 4096;
+const u32 SCENE_CACHE_CAPACITY = 64;
+
+struct Server_Job
+{
+    s32 priority;
+    char scene_path[SERVER_PATH_CAPACITY];
+    char output_path[SERVER_PATH_CAPACITY];
+};
+
+struct Cached_Scene
+{
+    u64   hash;
+    u32   file_size;
+    u64   last_used; // Job counter of the last use, the least recently used scene is evicted first
+    Scene scene;
+};
+
+struct Server
+{
+    Thread_Pool pool;
+
+    Os_Mutex     *mutex;
+    Os_Condition *job_ready;
+    Array<Server_Job> queue; // By descending priority, in arrival order for equal priorities
+    bool input_closed;
+
+    Array<Cached_Scene> cache;
+    u64 num_jobs;
+
+    // Reused by all jobs, grown when a job needs more
+    Vector3 *accumulation;
+    u8      *pixels;
+    u64      framebuffer_capacity; // In pixels
+};
+
+void server_push_job(Server *server, Server_Job *job)
+{
+    os_lock(server->mutex);
+
+    u32 position = server->queue.size;
+    while (position > 0 && server->queue[position - 1].priority < job->priority) {
+        position--;
+    }
+    array_insert(&server->queue, *job, position);
+
+    os_wake_all(server->job_ready);
+    os_unlock(server->mutex);
+}
+
+// Parses `scene_path output_path [priority]`
+bool parse_job(char *line, Server_Job *job)
+{
+    *job = {};
+
+    char *tokens[3] = {};
+    u32 num_tokens = 0;
+    for (char *c = line; *c;) {
+        while (*c == ' ' || *c == '\t' || *c == '\r') {
+            *c++ = '\0';
+        }
+
+        if (*c) {
+            if (num_tokens == array_size(tokens)) {
+                return false;
+            }
+
+            tokens[num_tokens++] = c;
+            while (*c && *c != ' ' && *c != '\t' && *c != '\r') {
+                c++;
+            }
+        }
+    }
+
+    if (num_tokens < 2 || strlen(tokens[0]) >= SERVER_PATH_CAPACITY || strlen(tokens[1]) >= SERVER_PATH_CAPACITY) {
+        return false;
+    }
+
+    strcpy(job->scene_path,  tokens[0]);
+    strcpy(job->output_path, tokens[1]);
+    if (num_tokens == 3) {
+        job->priority = atoi(tokens[2]);
+    }
+
+    return true;
+}
+
+// Reads jobs until the end of the stream
+void server_read_jobs(Server *server, Os_Stream *stream)
+{
+    char line[SERVER_LINE_CAPACITY];
+    u32 length = 0;
+    bool overlong = false;
+
+    for (;;) {
+        char buffer[SERVER_LINE_CAPACITY];
+        s64 read = os_read_stream(stream, buffer, sizeof(buffer));
+        if (read < 0) {
+            break;
+        }
+
+        // A last line without a newline is a job as well
+        if (read == 0 && length > 0) {
+            buffer[read++] = '\n';
+        }
+
+        if (read == 0) {
+            break;
+        }
+
+        for (s64 i = 0; i < read; i++) {
+            if (buffer[i] != '\n') {
+                if (length + 1 < sizeof(line)) {
+                    line[length++] = buffer[i];
+                } else {
+                    overlong = true;
+                }
+                continue;
+            }
+
+            line[length] = '\0';
+
+            Server_Job job;
+            if (overlong || !parse_job(line, &job)) {
+                if (length > 0) {
+                    printf("Invalid job `%s`, expected `scene_path output_path [priority]`.\n", line);
+                    fflush(stdout);
+                }
+            } else {
+                server_push_job(server, &job);
+            }
+
+            length = 0;
+            overlong = false;
+        }
+    }
+}
+
+struct Server_Input
+{
+    Server    *server;
+    Os_Stream *stream;   // Read to the end when there is no listener
+    Os_Stream *listener;
+};
+
+void server_input_thread(void *data)
+{
+    Server_Input *input = (Server_Input *) data;
+    Server *server = input->server;
+
+    if (input->listener) {
+        for (;;) {
+            Os_Stream *client = os_accept(input->listener);
+            if (client) {
+                server_read_jobs(server, client);
+                os_close_stream(client);
+            }
+        }
+    }
+
+    server_read_jobs(server, input->stream);
+
+    os_lock(server->mutex);
+    server->input_closed = true;
+    os_wake_all(server->job_ready);
+    os_unlock(server->mutex);
+}
+
+// Returns the prepared scene of the file, parsing it unless it is cached
+Scene *server_get_scene(Server *server, File *file, bool *cached)
+{
+    u64 hash = poly31_hash(file->data, file->size);
+
+    ARRAY_ITERATE(server->cache) {
+        if (it->hash == hash && it->file_size == file->size) {
+            it->last_used = server->num_jobs;
+            *cached = true;
+
+            return &it->scene;
+        }
+    }
+    *cached = false;
+
+    Cached_Scene *entry;
+    if (server->cache.size < SCENE_CACHE_CAPACITY) {
+        array_push(&server->cache, {});
+        entry = &server->cache[server->cache.size - 1];
+    } else {
+        entry = &server->cache[0];
+        ARRAY_ITERATE(server->cache) {
+            if (it->last_used < entry->last_used) {
+                entry = it;
+            }
+        }
+        free_scene(&entry->scene);
+    }
+
+    *entry = {
+        .hash      = hash,
+        .file_size = file->size,
+        .last_used = server->num_jobs,
+    };
+
+    Parser parser = {.buffer = (char *) file->data, .length = file->size};
+    parse(&parser, &entry->scene);
+    prepare_scene(&entry->scene);
+
+    return &entry->scene;
+}
+
+void server_run_job(Server *server, Server_Job *job)
+{
+    u64 start = os_time_ns();
+    server->num_jobs++;
+
+    memory_set_tag(MEMORY_PARSER);
+    File file = {.name = job->scene_path};
+    if (!os_read_file(&file)) {
+        printf("failed %s: could not read `%s`\n", job->output_path, job->scene_path);
+        fflush(stdout);
+        return;
+    }
+
+    bool cached;
+    memory_set_tag(MEMORY_SCENE);
+    Scene *scene = server_get_scene(server, &file, &cached);
+    memory_set_tag(MEMORY_RENDER);
+
+#ifdef DEVELOPER
+    u64 seed = poly31_hash(file.data, file.size);
+#else
+    u64 seed = time(nullptr) + server->num_jobs;
+#endif
+    os_free(file.data, file.size);
+
+    u64 num_pixels = (u64) scene->width * scene->height;
+    if (num_pixels > server->framebuffer_capacity) {
+        if (server->framebuffer_capacity > 0) {
+            os_free(server->accumulation, server->framebuffer_capacity * sizeof(Vector3));
+            os_free(server->pixels,       server->framebuffer_capacity * 3);
+        }
+
+        server->framebuffer_capacity = num_pixels;
+        server->accumulation = (Vector3 *) memory_allocate(MEMORY_FRAMEBUFFERS, num_pixels * sizeof(Vector3));
+        server->pixels       = (u8 *)      memory_allocate(MEMORY_FRAMEBUFFERS, num_pixels * 3);
+    }
+
+    render_parallel(&server->pool, scene, seed, server->accumulation);
+    resolve_pixels(scene, server->accumulation, scene->samples, server->pixels);
+    memory_set_tag(MEMORY_OUTPUT);
+    write_image(&server->pool, job->output_path, scene->width, scene->height, server->pixels);
+
+    printf("done %s %.3f s%s\n", job->output_path, (os_time_ns() - start) / 1E9, cached ? ", cached scene" : "");
+    fflush(stdout);
+}
+
+// Runs jobs until the standard input ends, or forever when listening on a socket
+int run_server(Options *options)
+{
+    Server server = {};
+    thread_pool_init(&server.pool, options->num_threads);
+    server.mutex     = os_create_mutex();
+    server.job_ready = os_create_condition();
+
+    Server_Input input = {.server = &server};
+    if (options->socket_path) {
+        input.listener = os_listen_local(options->socket_path);
+        if (!input.listener) {
+            printf("Could not listen on `%s`.\n", options->socket_path);
+            return 1;
+        }
+    } else {
+        input.stream = os_standard_input();
+    }
+
+    Os_Thread *input_thread = os_start_thread(server_input_thread, &input);
+    if (!input_thread) {
+        printf("Could not start the input thread.\n");
+        return 1;
+    }
+
+    for (;;) {
+        os_lock(server.mutex);
+        while (server.queue.size == 0 && !server.input_closed) {
+            os_wait(server.job_ready, server.mutex);
+        }
+
+        if (server.queue.size == 0) {
+            os_unlock(server.mutex);
+            break;
+        }
+
+        Server_Job job = array_delete(&server.queue, 0);
+        os_unlock(server.mutex);
+
+        server_run_job(&server, &job);
+    }
+
+    os_join_thread(input_thread);
+    os_close_stream(input.stream);
+
+    thread_pool_free(&server.pool);
+    memory_report();
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+// Thread pool for parallel loops, and parallel tiled rendering on top of it.
+//
+// The workers are started once and sleep between loops. The thread that runs
+// a loop takes part in it, so a pool of one thread runs everything inline.
+
+const u32 PARALLEL_TILE_SIZE = 32;
+
+typedef void Parallel_Function(void *data, u32 index, u32 thread_index);
+
+struct Thread_Pool
+{
+    u32         num_threads; // Including the thread that runs the loops
+    Os_Thread **workers;
+
+    Os_Mutex     *mutex;
+    Os_Condition *work_ready;
+    Os_Condition *work_done;
+
+    // The current loop, protected by the mutex except for next
+    Parallel_Function *function;
+    void *data;
+    u32   count;
+    u32   next; // Next index to run, taken atomically
+    u32   num_busy; // Workers that have not finished the loop
+    u64   generation;
+    bool  quit;
+};
+
+// Runs indices of the current loop until there are none left
+void thread_pool_run(Thread_Pool *pool, u32 thread_index)
+{
+    for (;;) {
+        u32 index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (index >= pool->count) {
+            break;
+        }
+
+        pool->function(pool->data, index, thread_index);
+    }
+}
+
+struct Thread_Pool_Worker
+{
+    Thread_Pool *pool;
+    u32 thread_index;
+};
+
+void thread_pool_worker(void *data)
+{
+    Thread_Pool_Worker worker = *(Thread_Pool_Worker *) data;
+    os_free(data, sizeof(Thread_Pool_Worker));
+
+    Thread_Pool *pool = worker.pool;
+    u64 generation = 0;
+
+    profile_register_thread();
+
+    os_lock(pool->mutex);
+    for (;;) {
+        while (pool->generation == generation && !pool->quit) {
+            os_wait(pool->work_ready, pool->mutex);
+        }
+
+        if (pool->quit) {
+            break;
+        }
+        generation = pool->generation;
+
+        os_unlock(pool->mutex);
+        thread_pool_run(pool, worker.thread_index);
+        os_lock(pool->mutex);
+
+        if (--pool->num_busy == 0) {
+            os_wake_all(pool->work_done);
+        }
+    }
+    os_unlock(pool->mutex);
+}
+
+// Zero threads uses one per processor
+void thread_pool_init(Thread_Pool *pool, u32 num_threads)
+{
+    if (num_threads == 0) {
+        num_threads = os_processor_count();
+    }
+
+    *pool = {.num_threads = num_threads};
+    pool->mutex      = os_create_mutex();
+    pool->work_ready = os_create_condition();
+    pool->work_done  = os_create_condition();
+
+    pool->workers = (Os_Thread **) os_allocate(num_threads * sizeof(Os_Thread *));
+    for (u32 i = 1; i < num_threads; i++) {
+        Thread_Pool_Worker *worker = (Thread_Pool_Worker *) os_allocate(sizeof(Thread_Pool_Worker));
+        *worker = {pool, i};
+
+        pool->workers[i] = os_start_thread(thread_pool_worker, worker);
+        ASSERT(pool->workers[i]);
+    }
+}
+
+void thread_pool_free(Thread_Pool *pool)
+{
+    os_lock(pool->mutex);
+    pool->quit = true;
+    os_wake_all(pool->work_ready);
+    os_unlock(pool->mutex);
+
+    for (u32 i = 1; i < pool->num_threads; i++) {
+        os_join_thread(pool->workers[i]);
+    }
+
+    os_free(pool->workers, pool->num_threads * sizeof(Os_Thread *));
+    os_destroy_condition(pool->work_ready);
+    os_destroy_condition(pool->work_done);
+    os_destroy_mutex(pool->mutex);
+}
+
+// Calls function(index, thread_index) for every index in [0, count) on the
+// threads of the pool and returns when all calls are done. Thread indices are
+// below pool->num_threads, so they can index per-thread data.
+template <typename F>
+void parallel_for(Thread_Pool *pool, u32 count, F function)
+{
+    auto call = [] (void *data, u32 index, u32 thread_index)
+    {
+        (*(F *) data)(index, thread_index);
+    };
+
+    os_lock(pool->mutex);
+    pool->function = call;
+    pool->data     = &function;
+    pool->count    = count;
+    pool->next     = 0;
+    pool->num_busy = pool->num_threads - 1;
+    pool->generation++;
+    os_wake_all(pool->work_ready);
+    os_unlock(pool->mutex);
+
+    thread_pool_run(pool, 0);
+
+    os_lock(pool->mutex);
+    while (pool->num_busy > 0) {
+        os_wait(pool->work_done, pool->mutex);
+    }
+    os_unlock(pool->mutex);
+}
+
+// Accumulates scene->samples paths per pixel into the accumulation buffer on
+// all threads of the pool. Every tile has its own random sequence derived from
+// the seed, so the result does not depend on the number of threads.
+void render_parallel(Thread_Pool *pool, Scene *scene, u64 seed, Vector3 *accumulation)
+{
+    u32 tiles_x = DIV_UP(scene->width,  PARALLEL_TILE_SIZE);
+    u32 tiles_y = DIV_UP(scene->height, PARALLEL_TILE_SIZE);
+
+    parallel_for(pool, tiles_x * tiles_y, [&] (u32 tile, u32 thread_index) {
+        // The scene is shared, only the random state is per tile
+        Scene tile_scene = *scene;
+        xoroshiro_set_seed(&tile_scene.xoroshiro, seed + tile * 0x9E3779B97F4A7C15ull);
+
+        u32 x_min = (tile % tiles_x) * PARALLEL_TILE_SIZE;
+        u32 y_min = (tile / tiles_x) * PARALLEL_TILE_SIZE;
+        u32 x_max = MIN(x_min + PARALLEL_TILE_SIZE, scene->width);
+        u32 y_max = MIN(y_min + PARALLEL_TILE_SIZE, scene->height);
+
+        for (u32 y = y_min; y < y_max; y++) {
+            for (u32 x = x_min; x < x_max; x++) {
+                Vector3 sum = {};
+                for (u32 i = 0; i < scene->samples; i++) {
+                    sum += ray_trace(&tile_scene, camera_ray(&tile_scene, x, y), 1);
+                }
+
+                accumulation[x + y * scene->width] = sum;
+            }
+        }
+    });
+}
@@ -0,0 +1,300 @@
+// Batched path tracing with coherence sorting of secondary rays.
+//
+// Paths are generated in batches of camera rays, and all active paths of a
+// batch advance one bounce at a time. Camera rays are already coherent, but
+// after the first bounce the paths are sorted by direction octant and by the
+// Morton code of their origin, so consecutive rays traverse similar parts of
+// the BVH and touch similar primitives. As the paths of a bounce are all
+// intersected before any is scattered, the bounce directions and light samples
+// of the bounce are drawn with the batched samplers, SAMPLE_BATCH at a time.
+
+const u32 SORT_MORTON_BITS = 9; // Per axis, leaving the top bits of a 30-bit key to the octant
+const u32 SORT_RADIX_BITS  = 10;
+const u32 SORT_KEY_BITS    = 3 * SORT_MORTON_BITS + 3;
+
+// Inserts two zero bits between the low 10 bits of x
+inline u32 morton_spread(u32 x)
+{
+    x &= 0x3FF;
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x <<  8)) & 0x0300F00F;
+    x = (x | (x <<  4)) & 0x030C30C3;
+    x = (x | (x <<  2)) & 0x09249249;
+
+    return x;
+}
+
+inline u32 ray_sort_key(Ray ray, Vector3 bounds_min, Vector3 scale)
+{
+    const f32 CELLS = (1 << SORT_MORTON_BITS) - 1;
+
+    Vector3 p = (ray.origin - bounds_min) * scale;
+    u32 x = (u32) CLAMP(p.x, 0.0f, CELLS);
+    u32 y = (u32) CLAMP(p.y, 0.0f, CELLS);
+    u32 z = (u32) CLAMP(p.z, 0.0f, CELLS);
+
+    u32 octant = (ray.direction.x < 0) | ((ray.direction.y < 0) << 1) | ((ray.direction.z < 0) << 2);
+
+    return (octant << (3 * SORT_MORTON_BITS)) | morton_spread(x) | (morton_spread(y) << 1) | (morton_spread(z) << 2);
+}
+
+// LSD radix sort of (key << 32 | index) values, returns the buffer holding the result
+u64 *radix_sort_keys(u64 *values, u64 *scratch, u32 count)
+{
+    const u32 BUCKETS = 1 << SORT_RADIX_BITS;
+
+    for (u32 shift = 32; shift < 32 + SORT_KEY_BITS; shift += SORT_RADIX_BITS) {
+        u32 offsets[BUCKETS] = {};
+        for (u32 i = 0; i < count; i++) {
+            offsets[(values[i] >> shift) & (BUCKETS - 1)]++;
+        }
+
+        u32 sum = 0;
+        for (u32 b = 0; b < BUCKETS; b++) {
+            u32 bucket_count = offsets[b];
+            offsets[b] = sum;
+            sum += bucket_count;
+        }
+
+        for (u32 i = 0; i < count; i++) {
+            scratch[offsets[(values[i] >> shift) & (BUCKETS - 1)]++] = values[i];
+        }
+
+        u64 *tmp = values;
+        values = scratch;
+        scratch = tmp;
+    }
+
+    return values;
+}
+
+struct Sorted_Renderer
+{
+    u32 batch_size;
+
+    Path *paths;
+    Path *sorted_paths;
+    u64  *keys;
+    u64  *key_scratch;
+
+    // Of every path of the bounce
+    Intersection *intersections;
+    Primitive   **closest;
+    Path_Samples *samples;
+    u32          *diffuse; // Indices of the paths that hit a diffuse surface
+
+    // Time spent sorting, for benchmarks
+    u64 sort_time_ns;
+};
+
+void sorted_renderer_init(Sorted_Renderer *renderer, u32 batch_size)
+{
+    *renderer = {.batch_size = batch_size};
+    renderer->paths        = (Path *) os_allocate(batch_size * sizeof(Path));
+    renderer->sorted_paths = (Path *) os_allocate(batch_size * sizeof(Path));
+    renderer->keys         = (u64 *)  os_allocate(batch_size * sizeof(u64));
+    renderer->key_scratch  = (u64 *)  os_allocate(batch_size * sizeof(u64));
+
+    renderer->intersections = (Intersection *) os_allocate(batch_size * sizeof(Intersection));
+    renderer->closest       = (Primitive **)   os_allocate(batch_size * sizeof(Primitive *));
+    renderer->samples       = (Path_Samples *) os_allocate(batch_size * sizeof(Path_Samples));
+    renderer->diffuse       = (u32 *)          os_allocate(batch_size * sizeof(u32));
+}
+
+void sorted_renderer_free(Sorted_Renderer *renderer)
+{
+    os_free(renderer->paths,        renderer->batch_size * sizeof(Path));
+    os_free(renderer->sorted_paths, renderer->batch_size * sizeof(Path));
+    os_free(renderer->keys,         renderer->batch_size * sizeof(u64));
+    os_free(renderer->key_scratch,  renderer->batch_size * sizeof(u64));
+
+    os_free(renderer->intersections, renderer->batch_size * sizeof(Intersection));
+    os_free(renderer->closest,       renderer->batch_size * sizeof(Primitive *));
+    os_free(renderer->samples,       renderer->batch_size * sizeof(Path_Samples));
+    os_free(renderer->diffuse,       renderer->batch_size * sizeof(u32));
+}
+
+void sort_paths(Sorted_Renderer *renderer, Scene *scene, u32 count)
+{
+    u64 start = os_time_ns();
+
+    // Origins outside of the bounded geometry (on planes) are clamped to the border cells
+    AABB bounds = scene->bvh.bounds;
+    Vector3 extent = bounds.max - bounds.min;
+    Vector3 scale = {};
+    for (u32 axis = 0; axis < 3; axis++) {
+        if (extent[axis] > 0) {
+            scale[axis] = ((1 << SORT_MORTON_BITS) - 1) / extent[axis];
+        }
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        renderer->keys[i] = ((u64) ray_sort_key(renderer->paths[i].ray, bounds.min, scale) << 32) | i;
+    }
+
+    u64 *sorted = radix_sort_keys(renderer->keys, renderer->key_scratch, count);
+    for (u32 i = 0; i < count; i++) {
+        renderer->sorted_paths[i] = renderer->paths[(u32) sorted[i]];
+    }
+
+    Path *tmp = renderer->paths;
+    renderer->paths = renderer->sorted_paths;
+    renderer->sorted_paths = tmp;
+
+    renderer->sort_time_ns += os_time_ns() - start;
+}
+
+// Draws the samples of the paths of the bounce that hit a diffuse surface:
+// bounce directions around their normals, and points on the surfaces of the
+// lights they sample, grouped by light so that a batch samples one light
+void draw_path_samples(Sorted_Renderer *renderer, Scene *scene, u32 count)
+{
+    const Sample_Kernels *kernels = ISA_SAMPLE_KERNELS[instruction_set];
+    Xoroshiro128 *xoroshiro = &scene->xoroshiro;
+
+    u32 num_diffuse = 0;
+    for (u32 i = 0; i < count; i++) {
+        if (renderer->closest[i] && renderer->closest[i]->surface_type == SURFACE_DIFFUSE) {
+            renderer->diffuse[num_diffuse++] = i;
+        }
+    }
+
+    Sample_Randoms randoms;
+    Vector3_Batch  normals, batch;
+    for (u32 first = 0; first < num_diffuse; first += SAMPLE_BATCH) {
+        u32 size = MIN(num_diffuse - first, SAMPLE_BATCH);
+
+        // Lanes past the end repeat the last normal
+        for (u32 j = 0; j < SAMPLE_BATCH; j++) {
+            Vector3 normal = renderer->intersections[renderer->diffuse[first + MIN(j, size - 1)]].normal;
+            normals.x[j] = normal.x;
+            normals.y[j] = normal.y;
+            normals.z[j] = normal.z;
+        }
+
+        draw_sample_randoms(xoroshiro, &randoms);
+        kernels->cosine_weighted(&randoms, &normals, &batch);
+        for (u32 j = 0; j < size; j++) {
+            renderer->samples[renderer->diffuse[first + j]].bounce_direction = {batch.x[j], batch.y[j], batch.z[j]};
+        }
+    }
+
+    u32 num_lights = scene->sampled_lights.size;
+    if (num_lights == 0) {
+        return;
+    }
+
+    // A light for every path that takes a next-event estimation, and a point
+    // on it only where sample_light samples the whole surface of the light.
+    // Cones and facing faces are sampled by scatter.
+    u32 num_surface = 0;
+    for (u32 j = 0; j < num_diffuse; j++) {
+        u32 i = renderer->diffuse[j];
+        Path *path = &renderer->paths[i];
+        Path_Samples *samples = &renderer->samples[i];
+        samples->light_point_drawn = false;
+
+        // Scatter counts the vertex before the estimation
+        if (path->depth + 1 > scene->ray_depth) {
+            continue;
+        }
+
+        samples->light_index = xoroshiro_next_u32(xoroshiro, num_lights - 1);
+
+        Intersection *intersection = &renderer->intersections[i];
+        Vector3 origin = path->ray.origin + intersection->t * path->ray.direction + 1E-4 * intersection->normal;
+        if (samples_light_surface(&scene->primitives[scene->sampled_lights[samples->light_index]], origin)) {
+            renderer->keys[num_surface++] = ((u64) samples->light_index << 32) | i;
+        }
+    }
+
+    u64 *sorted = radix_sort_keys(renderer->keys, renderer->key_scratch, num_surface);
+
+    for (u32 first = 0; first < num_surface;) {
+        u32 light_index = (u32) (sorted[first] >> 32);
+        Primitive *light = &scene->primitives[scene->sampled_lights[light_index]];
+
+        u32 size = 0;
+        while (size < SAMPLE_BATCH && first + size < num_surface && (u32) (sorted[first + size] >> 32) == light_index) {
+            size++;
+        }
+
+        draw_sample_randoms(xoroshiro, &randoms);
+        if (light->type == PRIMITIVE_BOX) {
+            kernels->uniform_box(&randoms, light, &batch);
+        } else {
+            kernels->nonuniform_ellipsoid(&randoms, light, &batch);
+        }
+
+        for (u32 j = 0; j < size; j++) {
+            Path_Samples *samples = &renderer->samples[(u32) sorted[first + j]];
+            samples->light_point = {batch.x[j], batch.y[j], batch.z[j]};
+            samples->light_point_drawn = true;
+        }
+
+        first += size;
+    }
+}
+
+// Accumulates scene->samples paths per pixel into the accumulation buffer
+void fill_accumulation_sorted(Sorted_Renderer *renderer, Scene *scene, Vector3 *accumulation)
+{
+    u64 total = (u64) scene->width * scene->height * scene->samples;
+    for (u64 first = 0; first < total; first += renderer->batch_size) {
+        u32 count = (u32) MIN(total - first, (u64) renderer->batch_size);
+
+        for (u32 i = 0; i < count; i++) {
+            u32 pixel = (u32) ((first + i) / scene->samples);
+            renderer->paths[i] = {
+                .ray = camera_ray(scene, pixel % scene->width, pixel / scene->width),
+                .throughput = {1, 1, 1},
+                .depth = 1,
+                .pixel = pixel,
+            };
+        }
+
+        for (u32 bounce = 0; count > 0; bounce++) {
+            if (bounce > 0) {
+                sort_paths(renderer, scene, count);
+            }
+
+            for (u32 i = 0; i < count; i++) {
+                Path *path = &renderer->paths[i];
+
+                renderer->closest[i] = nullptr;
+                if (path->depth <= scene->ray_depth) {
+                    renderer->intersections[i] = scene->kernels->intersect(scene, path->ray, &renderer->closest[i], INFINITY);
+                }
+            }
+
+            draw_path_samples(renderer, scene, count);
+
+            // Advance every path by one bounce and compact the ones that are still active
+            u32 active = 0;
+            for (u32 i = 0; i < count; i++) {
+                Path *path = &renderer->paths[i];
+
+                bool alive = path->depth <= scene->ray_depth;
+                if (alive) {
+                    Primitive *closest = renderer->closest[i];
+                    if (!closest) {
+                        path->radiance += path->throughput * scene->background_color;
+                        alive = false;
+                    } else {
+                        path_samples = &renderer->samples[i];
+                        alive = scene->kernels->scatter(scene, path, renderer->intersections[i], closest);
+                        path_samples = nullptr;
+                    }
+                }
+
+                if (alive) {
+                    renderer->paths[active++] = *path;
+                } else {
+                    accumulation[path->pixel] += path->radiance;
+                }
+            }
+
+            count = active;
+        }
+    }
+}